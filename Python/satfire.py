@@ -34,6 +34,11 @@ class SatfireDatabases:
         cur = self._db.cursor()
         cur.execute(f"ATTACH DATABASE '{clusters_path}' AS ff")
 
+        # Newer versions of connectfire keep a time series of every fire.
+        cur.execute(
+            "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'fire_time_series'")
+        self._has_rollup = cur.fetchone()[0] > 0
+
         cur.close()
 
         return
@@ -41,6 +46,9 @@ class SatfireDatabases:
     def total_fire_power_time_series(self, fire_id):
         '''Get a time series of fire power and maximum fire temperature.
 
+        If connectfire kept a time series for the fire, that is used and it covers the whole fire
+        this one was merged into. Otherwise it is put together from the clusters.
+
         Arguments:
             fire_id (int) - an id number from the fire_id column in the fires database.
 
@@ -48,6 +56,14 @@ class SatfireDatabases:
             A pandas.DataFrame.
         '''
 
+        ROLLUP_QUERY = """
+            SELECT start_time as st, SUM(power) as tp
+            FROM fire_time_series
+            WHERE root_id = IFNULL((SELECT root_id FROM fire_roots WHERE fire_id = ?), ?)
+            GROUP BY st
+            ORDER BY st ASC
+        """
+
         QUERY = """
             SELECT
                 ff.clusters.start_time as st, 
@@ -68,7 +84,12 @@ class SatfireDatabases:
             ORDER BY st ASC
         """
 
-        df = pd.read_sql_query(QUERY, self._db, params=(fire_id, ))
+        df = None
+        if self._has_rollup:
+            df = pd.read_sql_query(ROLLUP_QUERY, self._db, params=(fire_id, fire_id))
+
+        if df is None or df.empty:
+            df = pd.read_sql_query(QUERY, self._db, params=(fire_id, ))
 
         # Convert time stamps to time values.
         df['st'] = pd.to_datetime(df['st'], unit='s')
@@ -218,6 +239,52 @@ class SatfireDatabases:
         return f
 
 
+def load_columns(path, table, pixels=False):
+    '''Load the columns written by export_columns into a pandas.DataFrame.
+
+    Every partition in the table is memory mapped, so only the columns that are used are read from
+    disk, and they are joined into one data frame.
+
+    Arguments:
+        path (str) - the output directory given to export_columns.
+        table (str) - either 'clusters' or 'fires'.
+        pixels (bool) - load the pixels of the clusters or fires instead of the rows themselves.
+
+    Returns:
+        A pandas.DataFrame, with a column for the id of the cluster or fire for the pixels.
+    '''
+
+    table_dir = os.path.join(path, table)
+
+    frames = []
+    for partition in sorted(os.listdir(table_dir)):
+        if partition.endswith('.partial'):
+            continue
+
+        part_dir = os.path.join(table_dir, partition)
+        if pixels:
+            part_dir = os.path.join(part_dir, 'pixels')
+
+        columns = {}
+        for fname in sorted(os.listdir(part_dir)):
+            if fname.endswith('.npy'):
+                columns[fname[:-4]] = np.load(os.path.join(part_dir, fname), mmap_mode='r')
+
+        frames.append(pd.DataFrame(columns, copy=False))
+
+    df = pd.concat(frames, ignore_index=True)
+
+    for col in ('satellite', 'sector'):
+        if col in df:
+            df[col] = df[col].str.decode('ascii')
+
+    for col in ('start_time', 'end_time', 'first_observed', 'last_observed'):
+        if col in df:
+            df[col] = pd.to_datetime(df[col], unit='s', utc=True)
+
+    return df
+
+
 def _clean_data(df, gap=timedelta(minutes=15), min_valid_power=100):
     df2 = df
     df2['total power'] = df2['total power'].map(lambda x: np.NaN if x < min_valid_power else x, na_action='ignore')
@@ -0,0 +1,202 @@
+//! Synthetic fire detections shared by the benchmarks.
+//!
+//! Real FDC files are too large to check in, so the scenes are generated on a fixed grid shaped
+//! like a CONUS sector. The generator is deterministic so every run benchmarks the same data.
+#![allow(dead_code)]
+
+use chrono::{DateTime, Duration, NaiveDateTime, Utc};
+use satfire::{
+    bench_internals::{clusters_from_fire_points, FirePoint},
+    Cluster, ClusterDatabaseClusterRow, ClusterList, Coord, DataQualityFlagCode, Fire, Geo,
+    MaskCode, Pixel, PixelList, Satellite, Sector,
+};
+
+/// Width of the synthetic grid in pixels.
+const XLEN: isize = 2500;
+/// Height of the synthetic grid in pixels.
+const YLEN: isize = 1500;
+/// Size of a pixel in degrees.
+const PIXEL_SIZE: f64 = 0.02;
+
+/// The kinds of scenes the benchmarks are run on.
+#[derive(Debug, Clone, Copy)]
+pub enum Scene {
+    /// A few small fires scattered around.
+    QuietDay,
+    /// Dozens of large fires, like a bad day during fire season.
+    Outbreak,
+    /// Thousands of isolated detections, like the noise near the limb of the earth.
+    LimbNoise,
+}
+
+pub const SCENES: [Scene; 3] = [Scene::QuietDay, Scene::Outbreak, Scene::LimbNoise];
+
+impl Scene {
+    pub fn name(&self) -> &'static str {
+        match self {
+            Scene::QuietDay => "quiet_day",
+            Scene::Outbreak => "outbreak",
+            Scene::LimbNoise => "limb_noise",
+        }
+    }
+
+    /// Generate the fire points for one scan of this scene.
+    pub fn fire_points(&self) -> Vec<FirePoint> {
+        let mut rng = Lcg(0x5eed_f17e);
+        let mut points = vec![];
+
+        match self {
+            Scene::QuietDay => {
+                for _ in 0..40 {
+                    let (x, y) = (rng.below(XLEN), rng.below(YLEN));
+                    add_blob(&mut points, x, y, 1 + rng.below(2), 30.0);
+                }
+            }
+            Scene::Outbreak => {
+                for _ in 0..60 {
+                    let (x, y) = (rng.below(XLEN), rng.below(YLEN));
+                    add_blob(&mut points, x, y, 3 + rng.below(10), 45.0);
+                }
+            }
+            Scene::LimbNoise => {
+                for _ in 0..20_000 {
+                    // Along the top edge of the grid, the furthest from nadir.
+                    let (x, y) = (rng.below(XLEN), rng.below(YLEN / 10));
+                    points.push(fire_point(x, y, 75.0, rng.below(100) as f64));
+                }
+            }
+        }
+
+        points.sort_by_key(|fp| (fp.y, fp.x));
+        points.dedup_by_key(|fp| (fp.y, fp.x));
+        points
+    }
+
+    /// Generate the clusters for one scan of this scene.
+    pub fn clusters(&self) -> Vec<Cluster> {
+        clusters_from_fire_points(self.fire_points())
+    }
+
+    /// Generate a cluster list for one scan of this scene.
+    pub fn cluster_list(&self, start: DateTime<Utc>) -> ClusterList {
+        ClusterList::new(
+            Satellite::G17,
+            Sector::CONUS,
+            start,
+            start + Duration::minutes(5),
+            self.clusters(),
+        )
+    }
+
+    /// Generate the cluster rows for one scan of this scene, as connectfire reads them.
+    pub fn cluster_rows(&self, start: DateTime<Utc>) -> Vec<ClusterDatabaseClusterRow> {
+        self.clusters()
+            .into_iter()
+            .enumerate()
+            .map(|(rowid, cluster)| ClusterDatabaseClusterRow {
+                rowid: rowid as u64,
+                start,
+                end: start + Duration::minutes(5),
+                power: cluster.total_power(),
+                max_temperature: cluster.max_temperature(),
+                area: cluster.total_area(),
+                scan_angle: cluster.max_scan_angle(),
+                centroid: cluster.centroid(),
+                sector: Sector::CONUS,
+                sat: Satellite::G17,
+                pixels: cluster.pixels().clone(),
+            })
+            .collect()
+    }
+
+    /// Generate a fire for every cluster in one scan of this scene.
+    pub fn fires(&self, start: DateTime<Utc>) -> Vec<Fire> {
+        self.cluster_rows(start)
+            .into_iter()
+            .enumerate()
+            .map(|(id, row)| Fire::create_from_cluster(id as u64 + 1, row))
+            .collect()
+    }
+}
+
+/// A pixel list with `len` pixels in a square block.
+pub fn pixel_list(len: usize) -> PixelList {
+    let side = (len as f64).sqrt().ceil() as isize;
+
+    let mut pixels = PixelList::with_capacity(len);
+    for k in 0..len as isize {
+        pixels.push(fire_point(k % side, k / side, 10.0, 50.0).pixel);
+    }
+
+    pixels
+}
+
+/// The scan start time of the first synthetic scan.
+pub fn scan_start() -> DateTime<Utc> {
+    DateTime::<Utc>::from_utc(
+        NaiveDateTime::from_timestamp_opt(1_629_000_000, 0).unwrap(),
+        Utc,
+    )
+}
+
+/// Add a roughly round fire centered at (x, y).
+fn add_blob(points: &mut Vec<FirePoint>, x: isize, y: isize, radius: isize, scan_angle: f64) {
+    for dy in -radius..=radius {
+        for dx in -radius..=radius {
+            if dx * dx + dy * dy <= radius * radius {
+                let power = (radius * radius - dx * dx - dy * dy + 1) as f64 * 10.0;
+                points.push(fire_point(x + dx, y + dy, scan_angle, power));
+            }
+        }
+    }
+}
+
+fn fire_point(x: isize, y: isize, scan_angle: f64, power: f64) -> FirePoint {
+    let (x, y) = (x.clamp(0, XLEN - 1), y.clamp(0, YLEN - 1));
+
+    let top = 50.0 - y as f64 * PIXEL_SIZE;
+    let left = -125.0 + x as f64 * PIXEL_SIZE;
+    let (bottom, right) = (top - PIXEL_SIZE, left + PIXEL_SIZE);
+
+    FirePoint {
+        pixel: Pixel {
+            ul: Coord {
+                lat: top,
+                lon: left,
+            },
+            ll: Coord {
+                lat: bottom,
+                lon: left,
+            },
+            lr: Coord {
+                lat: bottom,
+                lon: right,
+            },
+            ur: Coord {
+                lat: top,
+                lon: right,
+            },
+            power,
+            area: 4.0e6,
+            temperature: 500.0 + power,
+            scan_angle,
+            mask_flag: MaskCode(10),
+            data_quality_flag: DataQualityFlagCode(0),
+        },
+        x,
+        y,
+    }
+}
+
+/// A tiny deterministic random number generator so the scenes are the same every run.
+struct Lcg(u64);
+
+impl Lcg {
+    fn below(&mut self, n: isize) -> isize {
+        self.0 = self
+            .0
+            .wrapping_mul(6_364_136_223_846_793_005)
+            .wrapping_add(1_442_695_040_888_963_407);
+        ((self.0 >> 33) % n as u64) as isize
+    }
+}
@@ -0,0 +1,120 @@
+//! Benchmarks for the hot paths in findfire, from a satellite file to rows in the database.
+//!
+//! The benchmarks that need a real Fire Detection Characteristics file only run if the path to
+//! one (a .nc or .zip file named like the NOAA Big Data archive) is given in the
+//! SATFIRE_BENCH_FDC_FILE environment variable.
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion};
+use satfire::{
+    bench_internals::{clusters_from_fire_points, SatFireImage},
+    ClusterDatabase, PixelList, Satellite, Sector,
+};
+use std::path::PathBuf;
+
+mod common;
+use common::{pixel_list, scan_start, SCENES};
+
+fn extract_fire_points(c: &mut Criterion) {
+    let path = match std::env::var_os("SATFIRE_BENCH_FDC_FILE") {
+        Some(path) => PathBuf::from(path),
+        None => {
+            eprintln!("SATFIRE_BENCH_FDC_FILE is not set, skipping extract_fire_points");
+            return;
+        }
+    };
+
+    let fname = path.file_name().unwrap().to_string_lossy().to_string();
+    let sat = Satellite::string_contains_satellite(&fname).expect("No satellite in file name");
+    let sector = Sector::string_contains_sector(&fname).expect("No sector in file name");
+
+    // The geolocation table is built by the first call and reused by the rest, like in findfire.
+    c.bench_function("extract_fire_points", |b| {
+        b.iter(|| {
+            let image = SatFireImage::open(&path).unwrap();
+            black_box(image.extract_fire_points(sat, sector).unwrap())
+        })
+    });
+}
+
+fn clusters_from_points(c: &mut Criterion) {
+    let mut group = c.benchmark_group("clusters_from_fire_points");
+
+    for scene in SCENES {
+        let points = scene.fire_points();
+        group.bench_with_input(
+            BenchmarkId::from_parameter(scene.name()),
+            &points,
+            |b, pts| {
+                b.iter_batched(
+                    || pts.clone(),
+                    |pts| black_box(clusters_from_fire_points(pts)),
+                    BatchSize::LargeInput,
+                )
+            },
+        );
+    }
+
+    group.finish();
+}
+
+fn pixel_list_binary_format(c: &mut Criterion) {
+    let mut group = c.benchmark_group("pixel_list");
+
+    // From a single pixel cluster up to the size where connectfire gives up on a fire.
+    for len in [1, 10, 100, 1_000] {
+        let pixels = pixel_list(len);
+        let bytes = pixels.binary_serialize();
+
+        group.bench_with_input(
+            BenchmarkId::new("binary_serialize", len),
+            &pixels,
+            |b, p| b.iter(|| black_box(p.binary_serialize())),
+        );
+
+        group.bench_with_input(
+            BenchmarkId::new("binary_deserialize", len),
+            &bytes,
+            |b, bs| b.iter(|| black_box(PixelList::binary_deserialize(&mut bs.as_slice()))),
+        );
+    }
+
+    group.finish();
+}
+
+fn add_clusters(c: &mut Criterion) {
+    let mut path = std::env::temp_dir();
+    path.push(format!("satfire_bench_{}.sqlite", std::process::id()));
+    let _ = std::fs::remove_file(&path);
+
+    ClusterDatabase::initialize(&path).unwrap();
+    let db = ClusterDatabase::connect(&path).unwrap();
+
+    let mut group = c.benchmark_group("add_clusters");
+    for scene in SCENES {
+        let mut start = scan_start();
+        group.bench_function(BenchmarkId::from_parameter(scene.name()), |b| {
+            let mut add = db.prepare_to_add_clusters().unwrap();
+            b.iter_batched(
+                || {
+                    start = start + chrono::Duration::minutes(5);
+                    scene.cluster_list(start)
+                },
+                |clist| add.add(clist).unwrap(),
+                BatchSize::LargeInput,
+            );
+            add.finish().unwrap();
+        });
+    }
+    group.finish();
+
+    drop(db);
+    let _ = std::fs::remove_file(&path);
+}
+
+criterion_group!(
+    benches,
+    extract_fire_points,
+    clusters_from_points,
+    pixel_list_binary_format,
+    add_clusters
+);
+criterion_main!(benches);
@@ -0,0 +1,101 @@
+//! Benchmarks for the hot paths in connectfire, matching clusters to fires and merging fires.
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion};
+use satfire::{bench_internals::Hilbert2DRTree, Fire, FireList, FireListView, Geo};
+
+mod common;
+use common::{scan_start, SCENES};
+
+fn rtree(c: &mut Criterion) {
+    let mut group = c.benchmark_group("hilbert_rtree");
+
+    for scene in SCENES {
+        let fires = scene.fires(scan_start());
+        let boxes: Vec<_> = fires.iter().map(|f| f.bounding_box()).collect();
+
+        group.bench_with_input(
+            BenchmarkId::new("build_for", scene.name()),
+            &fires,
+            |b, fires| b.iter(|| black_box(Hilbert2DRTree::build_for(fires, None))),
+        );
+
+        let tree = Hilbert2DRTree::build_for(&fires, None).unwrap();
+        group.bench_with_input(
+            BenchmarkId::new("indexes_overlapping", scene.name()),
+            &boxes,
+            |b, boxes| {
+                let mut buffer = Vec::with_capacity(16);
+                b.iter(|| {
+                    for bbox in boxes {
+                        buffer.clear();
+                        tree.indexes_overlapping(bbox, &mut buffer);
+                        black_box(&buffer);
+                    }
+                })
+            },
+        );
+    }
+
+    group.finish();
+}
+
+fn fire_list_view_update(c: &mut Criterion) {
+    let mut group = c.benchmark_group("fire_list_view_update");
+
+    for scene in SCENES {
+        let start = scan_start();
+        let next = start + chrono::Duration::minutes(5);
+
+        group.bench_function(BenchmarkId::from_parameter(scene.name()), |b| {
+            b.iter_batched(
+                || (FireList::from(scene.fires(start)), scene.cluster_rows(next)),
+                |(mut fires, rows)| {
+                    let mut view = FireListView::new(&mut fires).unwrap();
+                    for row in rows {
+                        black_box(view.update(row).unwrap());
+                    }
+                    fires
+                },
+                BatchSize::LargeInput,
+            )
+        });
+    }
+
+    group.finish();
+}
+
+fn merge_fires(c: &mut Criterion) {
+    let mut group = c.benchmark_group("merge_fires");
+
+    for scene in SCENES {
+        let start = scan_start();
+
+        // Every fire shows up twice under different ids, so every one of them gets merged.
+        let doubled = || {
+            let rows = scene.cluster_rows(start);
+            let fires: Vec<Fire> = rows
+                .iter()
+                .cloned()
+                .chain(rows.iter().cloned())
+                .enumerate()
+                .map(|(id, row)| Fire::create_from_cluster(id as u64 + 1, row))
+                .collect();
+            FireList::from(fires)
+        };
+
+        group.bench_function(BenchmarkId::from_parameter(scene.name()), |b| {
+            b.iter_batched(
+                || (doubled(), FireList::new()),
+                |(mut fires, mut merged_away)| {
+                    black_box(fires.merge_fires(&mut merged_away).unwrap());
+                    (fires, merged_away)
+                },
+                BatchSize::LargeInput,
+            )
+        });
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, rtree, fire_list_view_update, merge_fires);
+criterion_main!(benches);
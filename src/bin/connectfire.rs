@@ -3,14 +3,19 @@ use clap::Parser;
 use crossbeam_channel::{bounded, Receiver, Sender};
 use log::{error, info, warn};
 use satfire::{
-    BoundingBox, ClusterDatabase, Coord, Fire, FireList, FireListUpdateResult, FireListView,
-    FiresDatabase, SatFireResult, Satellite,
+    BoundingBox, ClusterDatabase, ClusterDatabaseClusterRow, Coord, Fire, FireAssociation,
+    FireList, FireListUpdateResult, FireListView, FiresDatabase, Geo, PipelineMetrics,
+    PixelScratchFile, SatFireResult, Satellite, StageMetrics,
 };
 use simple_logger::SimpleLogger;
 use std::{
     fmt::{self, Display},
+    io::Read,
     path::{Path, PathBuf},
-    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc,
+    },
     thread::{self, JoinHandle},
 };
 
@@ -70,6 +75,65 @@ struct ConnectFireOptions {
     #[clap(env = "FIRES_DB")]
     fires_store_file: PathBuf,
 
+    /// The number of threads each satellite uses to match clusters to fires.
+    ///
+    /// Each satellite is always processed on its own thread. With more than one matching thread,
+    /// all the clusters from a scan are compared to the fires in parallel, then the fires are
+    /// updated in a fixed order so the results don't depend on the number of threads. The default
+    /// is 1, which matches clusters to fires one at a time.
+    #[clap(short = 'j', long)]
+    #[clap(default_value_t = 1)]
+    match_threads: usize,
+
+    /// Split the area into a grid of this many tiles on each side and track fires in the tiles in
+    /// parallel.
+    ///
+    /// Each cluster belongs to the tile its centroid is in. Fires near the edges of a tile are
+    /// held back until the end of the run, then the fires from all the tiles are merged together
+    /// so fires that crossed an edge are reconnected. The default is 1, a single tile.
+    #[clap(short, long)]
+    #[clap(default_value_t = 1)]
+    tiles: usize,
+
+    /// A directory to save the state of each satellite in between runs.
+    ///
+    /// At the end of a run the ongoing fires and how far through the clusters each satellite got
+    /// are saved here. The next run picks up from there instead of loading the ongoing fires from
+    /// the fires database, which makes starting up much faster for frequent incremental runs. If
+    /// the fires database has been changed by a run that didn't use this directory, the saved
+    /// state is ignored.
+    #[clap(long)]
+    state_dir: Option<PathBuf>,
+
+    /// Page out the pixels of fires that have not been observed in this many hours.
+    ///
+    /// Only the bounding box and centroid of those fires are kept in memory, their pixels are
+    /// moved to a scratch file and read back in when a cluster shows up near the fire again. This
+    /// keeps the memory use down during long runs with a lot of ongoing fires. By default all the
+    /// pixels are kept in memory.
+    #[clap(long)]
+    page_out_after: Option<i64>,
+
+    /// The directory to put the scratch file for paged out fires in.
+    ///
+    /// The default is the system temporary directory.
+    #[clap(long)]
+    scratch_dir: Option<PathBuf>,
+
+    /// Log the throughput and timing of each stage of processing every this many seconds.
+    ///
+    /// For each satellite this reports the clusters read per second, how many scans are waiting
+    /// to be matched, and how long matching and merging take for each scan.
+    #[clap(long)]
+    metrics_interval: Option<u64>,
+
+    /// Also write the metrics to this file in the Prometheus text format.
+    ///
+    /// The file is replaced every time the metrics are reported, for the node exporter textfile
+    /// collector. If no interval is given, they are reported every minute.
+    #[clap(long)]
+    metrics_file: Option<PathBuf>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -140,6 +204,20 @@ impl Display for ConnectFireOptions {
             self.clusters_store_file.display()
         )?;
         writeln!(f, "  Fires Database: {}", self.fires_store_file.display())?;
+        writeln!(f, "   Match Threads: {}", self.match_threads)?;
+        writeln!(f, "           Tiles: {0} x {0}", self.tiles)?;
+        if let Some(ref state_dir) = self.state_dir {
+            writeln!(f, " State Directory: {}", state_dir.display())?;
+        }
+        if let Some(page_out_after) = self.page_out_after {
+            writeln!(f, "  Page Out After: {} hours", page_out_after)?;
+        }
+        if let Some(metrics_interval) = self.metrics_interval {
+            writeln!(f, "Metrics Interval: {} seconds", metrics_interval)?;
+        }
+        if let Some(ref metrics_file) = self.metrics_file {
+            writeln!(f, "    Metrics File: {}", metrics_file.display())?;
+        }
         writeln!(f, "\n")?; // yes, two blank lines.
 
         Ok(())
@@ -216,6 +294,24 @@ impl FireStats {
         }
     }
 
+    /// Combine the stats from another part of the same satellite, like a tile.
+    fn absorb(&mut self, other: FireStats) {
+        let max_active = self.max_active + other.max_active;
+
+        let fires: Vec<Fire> = [
+            other.longest_duration,
+            other.longest_pixel_list,
+            other.hottest,
+        ]
+        .into_iter()
+        .flatten()
+        .collect();
+        self.update(&FireList::from(fires));
+
+        self.max_active = max_active;
+        self.largest_pixels_list = self.largest_pixels_list.max(other.largest_pixels_list);
+    }
+
     fn update(&mut self, fires: &FireList) {
         // Return early if the list is empty. There's nothing to do.
         if fires.is_empty() {
@@ -245,12 +341,12 @@ impl FireStats {
                 fires_hottest = Some(fire);
             }
 
-            if fire.pixels().len() > fires_longest_pixel_list_size {
-                fires_longest_pixel_list_size = fire.pixels().len();
+            if fire.num_pixels() > fires_longest_pixel_list_size {
+                fires_longest_pixel_list_size = fire.num_pixels();
                 fires_longest_pixel_list = Some(fire);
             }
 
-            self.largest_pixels_list = self.largest_pixels_list.max(fire.pixels().len());
+            self.largest_pixels_list = self.largest_pixels_list.max(fire.num_pixels());
         }
 
         self.max_active = self.max_active.max(fires.len());
@@ -267,7 +363,7 @@ impl FireStats {
 
         if let Some(fires_longest) = fires_longest_pixel_list {
             if let Some(ref mut longest) = self.longest_pixel_list {
-                if fires_longest_pixel_list_size > longest.pixels().len() {
+                if fires_longest_pixel_list_size > longest.num_pixels() {
                     *longest = fires_longest.clone();
                 }
             } else {
@@ -299,13 +395,23 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
     end: Option<DateTime<Utc>>,
     kmz_path: P3,
     to_db_filler: Sender<DatabaseMessage>,
+    match_threads: usize,
+    tiles: usize,
+    paging: Option<Paging>,
+    metrics: TrackingMetrics,
+    state: Option<SatelliteState>,
+    save_state: bool,
     verbose: bool,
-) -> SatFireResult<()> {
-    let db = FiresDatabase::connect(fires_db_store.as_ref())?;
-
-    let mut current_fires = db.ongoing_fires(sat)?;
+) -> SatFireResult<Option<SatelliteState>> {
+    let (mut current_fires, resume_from) = match state {
+        Some(state) => (state.fires, Some(state.cursor)),
+        None => {
+            let db = FiresDatabase::connect(fires_db_store.as_ref())?;
+            (db.ongoing_fires(sat)?, db.last_observed(sat))
+        }
+    };
 
-    let start = match (start, db.last_observed(sat)) {
+    let start = match (start, resume_from) {
         (Some(start), None) => start,
         (None, Some(last_observed)) => last_observed,
         (Some(start), Some(last_observed)) => {
@@ -326,8 +432,6 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
     };
     let end = end.unwrap_or_else(|| Utc::now());
 
-    drop(db);
-
     if verbose {
         info!(target: sat.name(), "Using start time of {}", start);
         info!(target: sat.name(), "Using end time of {}", end);
@@ -335,14 +439,164 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
         info!(target: sat.name(), "Retrieved {} ongoing fires.", current_fires.len());
     }
 
+    let clusters_db_store = clusters_db_store.as_ref().to_owned();
+    let tiling = Tiling { area, n: tiles };
+
+    // The last scan may not be complete yet, so it's left for the next run. Every tile stops
+    // before the same scan, even the ones with no clusters in it.
+    let last_scan =
+        ClusterDatabase::connect(&clusters_db_store)?.last_scan_start(sat, start, end, area)?;
+
+    let TrackedFires {
+        mut current_fires,
+        mut new_fires,
+        mut old_fires,
+        border_fires: _,
+        current_time_step,
+        cursor,
+        num_absorbed,
+        mut stats,
+    } = if tiling.len() <= 1 {
+        track_fires(
+            current_fires,
+            &clusters_db_store,
+            sat,
+            area,
+            None,
+            start,
+            end,
+            last_scan,
+            &to_db_filler,
+            match_threads,
+            paging.as_ref(),
+            &metrics,
+            verbose,
+        )?
+    } else {
+        track_tiles(
+            current_fires,
+            &clusters_db_store,
+            sat,
+            tiling,
+            start,
+            end,
+            last_scan,
+            &to_db_filler,
+            match_threads,
+            paging.as_ref(),
+            &metrics,
+            verbose,
+        )?
+    };
+
+    let cursor = cursor.unwrap_or(start);
+
+    let num_merged = metrics
+        .merge
+        .time(|| current_fires.merge_fires(&mut old_fires))?;
+    metrics.merge.add_items(num_merged);
+    let num_old = current_fires.drain_stale_fires(&mut old_fires, current_time_step);
+    let num_new = current_fires.extend(&mut new_fires);
+
+    current_fires.save_kmz(Duration::days(1), kmz_path)?;
+
+    let largest_pixel_list_size = current_fires
+        .iter()
+        .map(|f| f.num_pixels())
+        .max()
+        .unwrap_or(0);
+
+    if verbose {
+        info!(target: sat.name(), "{:>23}, {:>8}, {:>6}, {:>4}, {:>4}, {:>6}, {:>6}",
+            current_time_step, num_absorbed, num_merged, num_old, num_new, current_fires.len(), 
+            largest_pixel_list_size);
+    }
+
+    let state = if save_state {
+        Some(SatelliteState {
+            sat,
+            cursor,
+            next_fire_id: 0,
+            run_id: 0,
+            fires: FireList::from(current_fires.iter().cloned().collect::<Vec<_>>()),
+        })
+    } else {
+        None
+    };
+
+    old_fires.extend(&mut current_fires);
+    stats.update(&old_fires);
+
+    assert!(current_fires.is_empty());
+    assert!(new_fires.is_empty());
+
+    to_db_filler
+        .send(DatabaseMessage::Fires(old_fires))
+        .map_err(|_| "Undable to send to_db_filler".to_owned())?;
+
+    if verbose {
+        info!(target: "stats", "{}", stats);
+    }
+
+    Ok(state)
+}
+
+/// The state of the fires at the end of [track_fires].
+struct TrackedFires {
+    current_fires: FireList,
+    new_fires: FireList,
+    /// Fires that are done but haven't been sent to the database yet.
+    old_fires: FireList,
+    /// Fires near the edges of a tile that are done, but may need to be merged with fires from
+    /// the neighboring tiles.
+    border_fires: FireList,
+    current_time_step: DateTime<Utc>,
+    /// Just after the last scan that was processed, if any were.
+    cursor: Option<DateTime<Utc>>,
+    num_absorbed: usize,
+    stats: FireStats,
+}
+
+/// Connect the clusters for a satellite in a time range to fires.
+///
+/// If `tile` is given, only clusters with a centroid in that tile are used. The clusters from
+/// `last_scan` on aren't used.
+fn track_fires(
+    mut current_fires: FireList,
+    clusters_db_store: &Path,
+    sat: Satellite,
+    area: BoundingBox,
+    tile: Option<(Tiling, usize)>,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    last_scan: Option<DateTime<Utc>>,
+    to_db_filler: &Sender<DatabaseMessage>,
+    match_threads: usize,
+    paging: Option<&Paging>,
+    metrics: &TrackingMetrics,
+    verbose: bool,
+) -> SatFireResult<TrackedFires> {
     let mut new_fires = FireList::new();
     let mut old_fires = FireList::new();
 
-    let db = ClusterDatabase::connect(clusters_db_store.as_ref())?;
     let mut stats = FireStats::new(sat);
 
-    let mut rows = db.query_clusters(Some(sat), None, start, end, area)?;
-    let rows = rows.rows()?;
+    // Fires near the edges of a tile that are done, but may need to be merged with fires from
+    // the neighboring tiles.
+    let mut border_fires = FireList::new();
+
+    let (to_matcher, from_reader) = bounded(CLUSTER_GROUPS_IN_FLIGHT);
+    let jh_reader = cluster_reader(
+        clusters_db_store.to_owned(),
+        sat,
+        area,
+        tile,
+        start,
+        end,
+        last_scan,
+        to_matcher,
+        Arc::clone(&metrics.read),
+    );
 
     let mut current_time_step: DateTime<Utc> = DateTime::from_utc(
         NaiveDate::from_ymd_opt(1970, 1, 1)
@@ -352,40 +606,32 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
     );
     let mut last_merge = current_time_step;
 
+    // Where the next run should start, just after the last scan that was processed.
+    let mut cursor = None;
+
     let mut num_absorbed = 0;
     let mut num_new = 0;
-    let current_group = vec![];
-    for (group_time, group) in rows
-        .map(|cluster| cluster.expect("Database error getting row."))
-        .scan(current_group, |group, cluster| {
-            let start = cluster.start;
-
-            if start != current_time_step {
-                let mut next_group = Vec::with_capacity(group.capacity());
-                std::mem::swap(&mut next_group, group);
-
-                let group_time = current_time_step;
-                current_time_step = start;
+    let mut num_merged = 0;
+    for (group_time, group) in from_reader.iter() {
+        current_time_step = group_time;
 
-                group.push(cluster);
-
-                Some(Some((group_time, next_group)))
-            } else {
-                group.push(cluster);
-                Some(None)
-            }
-        })
-        .filter_map(|val| val)
-    {
         if group_time - last_merge > Duration::hours(1) {
-            // Only merge once per hour to speed things up.
-            let num_merged = current_fires.merge_fires(&mut old_fires);
+            // Only drain and report once per hour to speed things up.
             let num_old = current_fires.drain_stale_fires(&mut old_fires, group_time);
             last_merge = group_time;
 
+            if let Some((tiling, tile_index)) = tile {
+                tiling.hold_border_fires(tile_index, &mut old_fires, &mut border_fires);
+            }
+
+            if let Some(paging) = paging {
+                current_fires
+                    .page_out_cold_fires(&paging.scratch, group_time - paging.cold_after)?;
+            }
+
             let largest_pixel_list_size = current_fires
                 .iter()
-                .map(|f| f.pixels().len())
+                .map(|f| f.num_pixels())
                 .max()
                 .unwrap_or(0);
 
@@ -397,6 +643,7 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
 
             num_absorbed = 0;
             num_new = 0;
+            num_merged = 0;
 
             to_db_filler
                 .send(DatabaseMessage::Fires(std::mem::take(&mut old_fires)))
@@ -410,12 +657,31 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
 
         num_new += current_fires.extend(&mut new_fires);
 
+        // Only the fires that grew or were added since the last time step are checked.
+        let step_merged = metrics
+            .merge
+            .time(|| current_fires.merge_fires(&mut old_fires))?;
+        metrics.merge.add_items(step_merged);
+        num_merged += step_merged;
+
         stats.update(&current_fires);
 
+        metrics.matching.add_items(group.len());
+        let now = std::time::Instant::now();
         if let Some(mut view) = FireListView::new(&mut current_fires) {
-            for cluster in group {
-                let clusterid = cluster.rowid;
-                let fireid = match view.update(cluster) {
+            let associations: Vec<_> = group.iter().map(FireAssociation::from).collect();
+            let results: Vec<_> = if match_threads > 1 {
+                view.update_all(group, match_threads)?
+            } else {
+                group
+                    .into_iter()
+                    .map(|cluster| view.update(cluster))
+                    .collect::<SatFireResult<_>>()?
+            };
+            metrics.matching.record(now.elapsed());
+
+            for (association, result) in associations.into_iter().zip(results) {
+                let fireid = match result {
                     FireListUpdateResult::NoMatch(cluster) => {
                         let fireid = NEXT_WILDFIRE_ID.fetch_add(1, Ordering::SeqCst);
                         new_fires.create_add_fire(fireid, cluster);
@@ -427,7 +693,7 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
                     }
                 };
 
-                match to_db_filler.send(DatabaseMessage::Association((fireid, clusterid))) {
+                match to_db_filler.send(DatabaseMessage::Association((fireid, association))) {
                     Ok(_) => {}
                     Err(err) => {
                         error!("Error sending Association message to database: {}", err);
@@ -437,11 +703,11 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
             }
         } else {
             for cluster in group {
-                let clusterid = cluster.rowid;
+                let association = FireAssociation::from(&cluster);
                 let fireid = NEXT_WILDFIRE_ID.fetch_add(1, Ordering::SeqCst);
                 new_fires.create_add_fire(fireid, cluster);
 
-                match to_db_filler.send(DatabaseMessage::Association((fireid, clusterid))) {
+                match to_db_filler.send(DatabaseMessage::Association((fireid, association))) {
                     Ok(_) => {}
                     Err(err) => {
                         error!("Error sending Association message to database: {}", err);
@@ -450,41 +716,403 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
                 }
             }
         }
+
+        cursor = Some(group_time + Duration::seconds(1));
     }
 
-    let num_merged = current_fires.merge_fires(&mut old_fires);
-    let num_old = current_fires.drain_stale_fires(&mut old_fires, current_time_step);
-    let num_new = current_fires.extend(&mut new_fires);
+    // The reader stops when the receiver is dropped, it has to be dropped before joining the
+    // reader if this quit early.
+    drop(from_reader);
+    jh_reader
+        .join()
+        .expect("Error joining the cluster reader thread.")?;
+
+    Ok(TrackedFires {
+        current_fires,
+        new_fires,
+        old_fires,
+        border_fires,
+        current_time_step,
+        cursor,
+        num_absorbed,
+        stats,
+    })
+}
 
-    current_fires.save_kmz(Duration::days(1), kmz_path)?;
+/// Track fires in each tile of an area in parallel, then combine the results.
+///
+/// The fires held back along the edges of the tiles are put back in the current fires, so the
+/// final merge for the satellite reconnects fires that crossed the edges.
+fn track_tiles(
+    current_fires: FireList,
+    clusters_db_store: &Path,
+    sat: Satellite,
+    tiling: Tiling,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    last_scan: Option<DateTime<Utc>>,
+    to_db_filler: &Sender<DatabaseMessage>,
+    match_threads: usize,
+    paging: Option<&Paging>,
+    metrics: &TrackingMetrics,
+    verbose: bool,
+) -> SatFireResult<TrackedFires> {
+    let mut tile_fires: Vec<Vec<Fire>> = (0..tiling.len()).map(|_| vec![]).collect();
+    for fire in current_fires.into_vec() {
+        tile_fires[tiling.tile_of(fire.centroid())].push(fire);
+    }
 
-    let largest_pixel_list_size = current_fires
-        .iter()
-        .map(|f| f.pixels().len())
-        .max()
-        .unwrap_or(0);
+    // Worker threads take the next tile from the queue when they finish one, so a few busy tiles
+    // don't hold up the rest.
+    let (to_workers, tile_queue) = crossbeam_channel::unbounded();
+    for (tile_index, fires) in tile_fires.into_iter().enumerate() {
+        to_workers
+            .send((tile_index, FireList::from(fires)))
+            .map_err(|_| "Unable to queue tiles")?;
+    }
+    drop(to_workers);
+
+    let num_workers = num_cpus::get().min(tiling.len()).max(1);
+
+    let results: Vec<SatFireResult<TrackedFires>> = thread::scope(|scope| {
+        let workers: Vec<_> = (0..num_workers)
+            .map(|_| {
+                let tile_queue = tile_queue.clone();
+                let to_db_filler = to_db_filler.clone();
+                scope.spawn(move || -> Vec<SatFireResult<TrackedFires>> {
+                    tile_queue
+                        .iter()
+                        .map(|(tile_index, fires)| {
+                            track_fires(
+                                fires,
+                                clusters_db_store,
+                                sat,
+                                tiling.bounding_box(tile_index),
+                                Some((tiling, tile_index)),
+                                start,
+                                end,
+                                last_scan,
+                                &to_db_filler,
+                                match_threads,
+                                paging,
+                                metrics,
+                                verbose,
+                            )
+                        })
+                        .collect()
+                })
+            })
+            .collect();
+
+        workers
+            .into_iter()
+            .flat_map(|worker| worker.join().expect("Error joining a tile thread."))
+            .collect()
+    });
+
+    let mut combined = TrackedFires {
+        current_fires: FireList::new(),
+        new_fires: FireList::new(),
+        old_fires: FireList::new(),
+        border_fires: FireList::new(),
+        current_time_step: start,
+        cursor: None,
+        num_absorbed: 0,
+        stats: FireStats::new(sat),
+    };
 
-    if verbose {
-        info!(target: sat.name(), "{:>23}, {:>8}, {:>6}, {:>4}, {:>4}, {:>6}, {:>6}",
-            current_time_step, num_absorbed, num_merged, num_old, num_new, current_fires.len(), 
-            largest_pixel_list_size);
+    for result in results {
+        let mut tile = result?;
+
+        combined.current_fires.extend(&mut tile.current_fires);
+        combined.current_fires.extend(&mut tile.border_fires);
+        // New fires near the edges need reconnecting too.
+        combined.current_fires.extend(&mut tile.new_fires);
+        combined.old_fires.extend(&mut tile.old_fires);
+        combined.current_time_step = combined.current_time_step.max(tile.current_time_step);
+        combined.cursor = match (combined.cursor, tile.cursor) {
+            (Some(a), Some(b)) => Some(a.max(b)),
+            (a, b) => a.or(b),
+        };
+        combined.num_absorbed += tile.num_absorbed;
+        combined.stats.absorb(tile.stats);
     }
 
-    old_fires.extend(&mut current_fires);
-    stats.update(&old_fires);
+    Ok(combined)
+}
 
-    assert!(current_fires.is_empty());
-    assert!(new_fires.is_empty());
+/// Where and when to page out the pixels of fires that haven't been observed in a while.
+#[derive(Debug, Clone)]
+struct Paging {
+    scratch: Arc<PixelScratchFile>,
+    cold_after: Duration,
+}
 
-    to_db_filler
-        .send(DatabaseMessage::Fires(old_fires))
-        .map_err(|_| "Undable to send to_db_filler".to_owned())?;
+/// The timed stages of tracking the fires for a satellite.
+#[derive(Debug, Clone)]
+struct TrackingMetrics {
+    /// Clusters read from the database, and the scans waiting to be matched.
+    read: Arc<StageMetrics>,
+    /// Matching the clusters from each scan to fires.
+    matching: Arc<StageMetrics>,
+    /// Merging fires that grew into each other after each scan.
+    merge: Arc<StageMetrics>,
+}
 
-    if verbose {
-        info!(target: "stats", "{}", stats);
+impl TrackingMetrics {
+    fn new(metrics: &PipelineMetrics, sat: Satellite) -> Self {
+        TrackingMetrics {
+            read: metrics.stage(&format!("{}/read", sat.name())),
+            matching: metrics.stage(&format!("{}/match", sat.name())),
+            merge: metrics.stage(&format!("{}/merge", sat.name())),
+        }
     }
+}
 
-    Ok(())
+/// Splits an area into a grid of equally sized tiles.
+#[derive(Debug, Clone, Copy)]
+struct Tiling {
+    area: BoundingBox,
+    /// The number of tiles on each side of the grid.
+    n: usize,
+}
+
+impl Tiling {
+    /// Fires that come within this distance of the edge of a neighboring tile, in degrees, are
+    /// held back for merging at the end.
+    const HALO: f64 = 0.25;
+
+    fn len(&self) -> usize {
+        self.n * self.n
+    }
+
+    fn tile_of(&self, coord: Coord) -> usize {
+        let n = self.n.max(1);
+        let cell = |value: f64, min: f64, max: f64| -> usize {
+            let cell = ((value - min) / (max - min) * n as f64).floor();
+            // Also handles NaN, which saturates to 0.
+            (cell.max(0.0) as usize).min(n - 1)
+        };
+
+        let row = cell(coord.lat, self.area.ll.lat, self.area.ur.lat);
+        let col = cell(coord.lon, self.area.ll.lon, self.area.ur.lon);
+
+        row * n + col
+    }
+
+    fn bounding_box(&self, tile_index: usize) -> BoundingBox {
+        let (row, col) = (tile_index / self.n, tile_index % self.n);
+        let height = (self.area.ur.lat - self.area.ll.lat) / self.n as f64;
+        let width = (self.area.ur.lon - self.area.ll.lon) / self.n as f64;
+
+        BoundingBox {
+            ll: Coord {
+                lat: self.area.ll.lat + height * row as f64,
+                lon: self.area.ll.lon + width * col as f64,
+            },
+            ur: Coord {
+                lat: self.area.ll.lat + height * (row + 1) as f64,
+                lon: self.area.ll.lon + width * (col + 1) as f64,
+            },
+        }
+    }
+
+    /// Move fires from `fires` that are near an edge shared with another tile into `border`.
+    ///
+    /// Fires that have been merged into another fire are already done, they stay in `fires`.
+    fn hold_border_fires(&self, tile_index: usize, fires: &mut FireList, border: &mut FireList) {
+        let (row, col) = (tile_index / self.n, tile_index % self.n);
+        let tile = self.bounding_box(tile_index);
+
+        // Shrink the tile by the halo on the sides that have a neighbor.
+        let halo = |has_neighbor: bool| if has_neighbor { Self::HALO } else { 0.0 };
+        let interior = BoundingBox {
+            ll: Coord {
+                lat: tile.ll.lat + halo(row > 0),
+                lon: tile.ll.lon + halo(col > 0),
+            },
+            ur: Coord {
+                lat: tile.ur.lat - halo(row + 1 < self.n),
+                lon: tile.ur.lon - halo(col + 1 < self.n),
+            },
+        };
+
+        let (near_edge, done): (Vec<Fire>, Vec<Fire>) = std::mem::take(fires)
+            .into_vec()
+            .into_iter()
+            .partition(|fire| {
+                let bbox = fire.bounding_box();
+                fire.merged_into() == 0
+                    && !(interior.contains_coord(bbox.ll, 0.0)
+                        && interior.contains_coord(bbox.ur, 0.0))
+            });
+
+        *fires = FireList::from(done);
+        border.extend(&mut FireList::from(near_edge));
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                              Saving the State Between Runs
+ *-----------------------------------------------------------------------------------------------*/
+/// The state of a satellite at the end of a run, so the next run can continue from there.
+struct SatelliteState {
+    sat: Satellite,
+    /// Start the next run with clusters from scans that started at or after this time.
+    cursor: DateTime<Utc>,
+    /// The next fire id at the end of the run that saved this.
+    next_fire_id: u64,
+    /// The run that saved this, it's out of date if any other run has started since.
+    run_id: u64,
+    fires: FireList,
+}
+
+impl SatelliteState {
+    const MAGIC: [u8; 8] = *b"SFSTATE2";
+
+    fn path(state_dir: &Path, sat: Satellite) -> PathBuf {
+        state_dir.join(format!("{}.connectfire", sat.name()))
+    }
+
+    /// Load the saved state for a satellite, if there is any.
+    fn load(state_dir: &Path, sat: Satellite) -> SatFireResult<Option<Self>> {
+        let bytes = match std::fs::read(Self::path(state_dir, sat)) {
+            Ok(bytes) => bytes,
+            Err(err) if err.kind() == std::io::ErrorKind::NotFound => return Ok(None),
+            Err(err) => return Err(err.into()),
+        };
+
+        let mut r = bytes.as_slice();
+
+        let mut magic: [u8; 8] = [0; 8];
+        r.read_exact(&mut magic)?;
+        if magic != Self::MAGIC {
+            return Err("Invalid state file".into());
+        }
+
+        let mut buf: [u8; 8] = [0; 8];
+        r.read_exact(&mut buf)?;
+        let cursor = NaiveDateTime::from_timestamp_opt(i64::from_le_bytes(buf), 0)
+            .map(|naive| DateTime::<Utc>::from_utc(naive, Utc))
+            .ok_or("Invalid time stamp")?;
+
+        r.read_exact(&mut buf)?;
+        let next_fire_id = u64::from_le_bytes(buf);
+
+        r.read_exact(&mut buf)?;
+        let run_id = u64::from_le_bytes(buf);
+
+        let fires = FireList::binary_deserialize(&mut r)?;
+        if fires.iter().any(|fire| fire.satellite() != sat) {
+            return Err("State file is for a different satellite".into());
+        }
+
+        Ok(Some(SatelliteState {
+            sat,
+            cursor,
+            next_fire_id,
+            run_id,
+            fires,
+        }))
+    }
+
+    /// Save the state, replacing any previously saved state for this satellite.
+    fn save(&self, state_dir: &Path) -> SatFireResult<()> {
+        let mut bytes = Vec::new();
+        bytes.extend_from_slice(&Self::MAGIC);
+        bytes.extend_from_slice(&self.cursor.timestamp().to_le_bytes());
+        bytes.extend_from_slice(&self.next_fire_id.to_le_bytes());
+        bytes.extend_from_slice(&self.run_id.to_le_bytes());
+        bytes.extend_from_slice(&self.fires.binary_serialize()?);
+
+        // Write to a temporary file first so an interrupted save doesn't leave a partial file.
+        let path = Self::path(state_dir, self.sat);
+        let tmp_path = path.with_extension("tmp");
+        std::fs::write(&tmp_path, bytes)?;
+        std::fs::rename(tmp_path, path)?;
+
+        Ok(())
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                         A thread for reading clusters from the database.
+ *-----------------------------------------------------------------------------------------------*/
+/// The number of scans the cluster reader can get ahead of the fire matching.
+const CLUSTER_GROUPS_IN_FLIGHT: usize = 64;
+
+/// All the clusters from one scan start time.
+type ClusterGroup = (DateTime<Utc>, Vec<ClusterDatabaseClusterRow>);
+
+/// Read and decode clusters from the database and group them by scan start time.
+///
+/// If `tile` is given, only the clusters with a centroid in that tile are sent.
+///
+/// This keeps the database reads and pixel decoding going while the clusters that were already
+/// read are matched to fires. The groups from `last_scan` on are never sent, that scan may not be
+/// complete yet, so the next run picks it up again.
+fn cluster_reader(
+    db_store: PathBuf,
+    sat: Satellite,
+    area: BoundingBox,
+    tile: Option<(Tiling, usize)>,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    last_scan: Option<DateTime<Utc>>,
+    to_matcher: Sender<ClusterGroup>,
+    metrics: Arc<StageMetrics>,
+) -> JoinHandle<SatFireResult<()>> {
+    thread::spawn(move || {
+        let db = ClusterDatabase::connect(db_store)?;
+
+        let mut rows = db.query_clusters(Some(sat), None, start, end, area)?;
+
+        let mut group_time = None;
+        let mut group = vec![];
+        for cluster in rows.rows()? {
+            let cluster = cluster?;
+
+            if last_scan.map(|last| cluster.start >= last).unwrap_or(true) {
+                break;
+            }
+
+            // Clusters on the edge between tiles are selected for both, but only belong to one.
+            if let Some((tiling, tile_index)) = tile {
+                if tiling.tile_of(cluster.centroid) != tile_index {
+                    continue;
+                }
+            }
+
+            if group_time != Some(cluster.start) {
+                let next_group = Vec::with_capacity(group.capacity());
+                let full_group = std::mem::replace(&mut group, next_group);
+
+                if let Some(group_time) = group_time {
+                    metrics.add_items(full_group.len());
+                    if to_matcher.send((group_time, full_group)).is_err() {
+                        // The matcher quit early.
+                        break;
+                    }
+                    metrics.queue_depth(to_matcher.len());
+                }
+
+                group_time = Some(cluster.start);
+            }
+
+            group.push(cluster);
+        }
+
+        // Every group before the last scan is complete.
+        if let Some(group_time) = group_time {
+            if !group.is_empty() {
+                metrics.add_items(group.len());
+                // If the matcher quit early, there's nothing to do about it.
+                let _ = to_matcher.send((group_time, group));
+            }
+        }
+
+        Ok(())
+    })
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -492,12 +1120,13 @@ fn process_rows_for_satellite<P1: AsRef<Path>, P2: AsRef<Path>, P3: AsRef<Path>>
  *-----------------------------------------------------------------------------------------------*/
 enum DatabaseMessage {
     Fires(FireList),
-    Association((u64, u64)),
+    Association((u64, FireAssociation)),
 }
 
 fn database_filler(
     db_store: PathBuf,
     messages: Receiver<DatabaseMessage>,
+    metrics: Arc<StageMetrics>,
 ) -> JoinHandle<SatFireResult<()>> {
     thread::spawn(move || {
         let db = FiresDatabase::connect(db_store)?;
@@ -505,9 +1134,12 @@ fn database_filler(
 
         for message in messages {
             match message {
-                DatabaseMessage::Fires(fires) => add_fire.add_fires(&fires)?,
-                DatabaseMessage::Association((fireid, clusterid)) => {
-                    add_fire.add_association(fireid, clusterid)
+                DatabaseMessage::Fires(fires) => {
+                    metrics.add_items(fires.len());
+                    metrics.time(|| add_fire.add_fires(&fires))?
+                }
+                DatabaseMessage::Association((fireid, association)) => {
+                    add_fire.add_association(fireid, association)
                 }
             }
         }
@@ -536,6 +1168,9 @@ fn handle_shutdown_signal(_signal: libc::c_int) {
 /*-------------------------------------------------------------------------------------------------
  *                                             Main
  *-----------------------------------------------------------------------------------------------*/
+/// How often to report the metrics if a metrics file is given without an interval.
+const DEFAULT_METRICS_INTERVAL: std::time::Duration = std::time::Duration::from_secs(60);
+
 fn main() -> SatFireResult<()> {
     register_signal_handlers();
 
@@ -545,14 +1180,67 @@ fn main() -> SatFireResult<()> {
 
     FiresDatabase::initialize(&opts.fires_store_file)?;
     let fires_db = FiresDatabase::connect(&opts.fires_store_file)?;
-    let next_id = fires_db.next_wildfire_id()?;
-    NEXT_WILDFIRE_ID.store(next_id, Ordering::SeqCst);
+    let mut next_id = fires_db.next_wildfire_id()?;
+    let last_run = fires_db.last_run()?;
+    let run_id = fires_db.start_run()?;
     drop(fires_db);
 
+    let mut states: Vec<Option<SatelliteState>> = Vec::with_capacity(Satellite::iter().count());
+    for sat in Satellite::iter() {
+        let state = match opts.state_dir {
+            Some(ref state_dir) => match SatelliteState::load(state_dir, sat) {
+                // Any other run since this was saved may have changed the fires.
+                Ok(Some(state)) if state.run_id == last_run => Some(state),
+                Ok(Some(_)) => {
+                    warn!(target: sat.name(), "Saved state is out of date, ignoring it.");
+                    None
+                }
+                Ok(None) => None,
+                Err(err) => {
+                    warn!(target: sat.name(), "Unable to load saved state: {}", err);
+                    None
+                }
+            },
+            None => None,
+        };
+
+        states.push(state);
+    }
+
+    // Fires too short to be saved in the database can still be in the saved state.
+    next_id = states
+        .iter()
+        .flatten()
+        .map(|state| state.next_fire_id)
+        .fold(next_id, u64::max);
+    NEXT_WILDFIRE_ID.store(next_id, Ordering::SeqCst);
+
     if opts.verbose {
         info!(target: "startup", "Next fire ID {}", next_id);
     }
 
+    let paging = match opts.page_out_after {
+        Some(hours) => {
+            let scratch_dir = opts.scratch_dir.clone().unwrap_or_else(std::env::temp_dir);
+            Some(Paging {
+                scratch: PixelScratchFile::create_in(&scratch_dir)?,
+                cold_after: Duration::hours(hours),
+            })
+        }
+        None => None,
+    };
+
+    let metrics = PipelineMetrics::new("connectfire");
+    let metrics_interval = match (opts.metrics_interval, &opts.metrics_file) {
+        (Some(secs), _) => Some(std::time::Duration::from_secs(secs.max(1))),
+        (None, Some(_)) => Some(DEFAULT_METRICS_INTERVAL),
+        (None, None) => None,
+    };
+    let reporter = match metrics_interval {
+        Some(interval) => Some(metrics.start_reporting(interval, opts.metrics_file.clone())?),
+        None => None,
+    };
+
     let (send_to_db_filler, from_processing) = bounded(1024);
 
     let mut jh_processing = Vec::with_capacity(Satellite::iter().count());
@@ -562,13 +1250,16 @@ fn main() -> SatFireResult<()> {
             "scan start time", "Absorbed", "Merged", "Old", "New", "Active", "Most Pixels");
     }
 
-    for sat in Satellite::iter() {
+    for (sat, state) in Satellite::iter().zip(states) {
         let mut kmz_path = opts.clusters_store_file.clone();
         kmz_path.set_file_name(sat.name());
         kmz_path.set_extension("kmz");
         let clusters_store_file = opts.clusters_store_file.clone();
         let fires_store_file = opts.fires_store_file.clone();
         let send_to_db_filler = send_to_db_filler.clone();
+        let save_state = opts.state_dir.is_some();
+        let paging = paging.clone();
+        let metrics = TrackingMetrics::new(&metrics, sat);
 
         let jh = std::thread::spawn(move || {
             process_rows_for_satellite(
@@ -580,6 +1271,12 @@ fn main() -> SatFireResult<()> {
                 opts.end,
                 kmz_path,
                 send_to_db_filler,
+                opts.match_threads,
+                opts.tiles,
+                paging,
+                metrics,
+                state,
+                save_state,
                 opts.verbose,
             )
         });
@@ -588,14 +1285,33 @@ fn main() -> SatFireResult<()> {
     }
     drop(send_to_db_filler);
 
-    let jh_db_filler = database_filler(opts.fires_store_file, from_processing);
+    let jh_db_filler = database_filler(
+        opts.fires_store_file,
+        from_processing,
+        metrics.stage("store"),
+    );
 
     jh_db_filler
         .join()
         .expect("Error joining the database filler thread.")?;
 
+    let mut states = Vec::with_capacity(jh_processing.len());
     for jh in jh_processing {
-        jh.join().expect("Error joining a processing thread.")?;
+        states.push(jh.join().expect("Error joining a processing thread.")?);
+    }
+
+    // Make the final report.
+    drop(reporter);
+
+    // Only save the states once all the fires are in the database.
+    if let Some(ref state_dir) = opts.state_dir {
+        let next_fire_id = NEXT_WILDFIRE_ID.load(Ordering::SeqCst);
+
+        for mut state in states.into_iter().flatten() {
+            state.next_fire_id = next_fire_id;
+            state.run_id = run_id;
+            state.save(state_dir)?;
+        }
     }
 
     Ok(())
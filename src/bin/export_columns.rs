@@ -0,0 +1,375 @@
+//! Documentation for the binary is with the definition of `ExportColumnsOptionsInit` below.
+
+use chrono::{DateTime, Datelike, NaiveDate, NaiveDateTime, Utc};
+use clap::Parser;
+use log::{info, LevelFilter};
+use satfire::{
+    BoundingBox, ClusterColumns, ClusterDatabase, Coord, FireColumns, FiresDatabase, SatFireResult,
+    Satellite,
+};
+use simple_logger::SimpleLogger;
+use std::{
+    path::{Path, PathBuf},
+    sync::atomic::{AtomicUsize, Ordering},
+};
+use strum::IntoEnumIterator;
+
+/*-------------------------------------------------------------------------------------------------
+ *                               Parse Command Line Arguments
+ *-----------------------------------------------------------------------------------------------*/
+///
+/// Export clusters and fires as columns of NumPy arrays for analysis in Python.
+///
+/// Each column is written to its own .npy file, with a directory for each month of data from each
+/// satellite under "clusters" and "fires" in the output directory. The pixels are flattened into
+/// a child table in the "pixels" directory of each month, with the id of the cluster or fire each
+/// one belongs to. The months are written in parallel, and exporting a month again replaces it.
+/// Since each month is replaced as a whole, the start and end are widened to whole months.
+///
+/// Load the columns with `load_columns` in satfire.py, or `numpy.load` with `mmap_mode="r"`.
+///
+#[derive(Debug, Parser)]
+#[clap(bin_name = "export_columns")]
+#[clap(author, version, about)]
+struct ExportColumnsOptionsInit {
+    /// The path to the cluster database file, the clusters are exported if this is given.
+    ///
+    /// If this is not specified, then the program will check for it in the "CLUSTER_DB"
+    /// environment variable.
+    #[clap(short, long)]
+    #[clap(env = "CLUSTER_DB")]
+    clusters_store_file: Option<PathBuf>,
+
+    /// The path to the fires database file, the fires are exported if this is given.
+    ///
+    /// If this is not specified, then the program will check for it in the "FIRES_DB"
+    /// environment variable.
+    #[clap(short, long)]
+    #[clap(env = "FIRES_DB")]
+    fires_store_file: Option<PathBuf>,
+
+    /// The directory to write the columns to.
+    output_dir: PathBuf,
+
+    /// The start time (UTC) for the export in the format YYYY-MM-DD-HH
+    ///
+    /// This is moved back to the start of its month.
+    #[clap(parse(try_from_str=parse_datetime))]
+    start: DateTime<Utc>,
+
+    /// The end time (UTC) for the export in the format YYYY-MM-DD-HH
+    ///
+    /// This is moved forward to the start of the next month, unless it already is the start of a
+    /// month.
+    #[clap(parse(try_from_str=parse_datetime))]
+    end: DateTime<Utc>,
+
+    /// Verbose output
+    #[clap(short, long)]
+    verbose: bool,
+}
+
+/// Parse a command line datetime
+fn parse_datetime(dt_str: &str) -> SatFireResult<DateTime<Utc>> {
+    const TIME_FORMAT: &str = "%Y-%m-%d-%H:%M:%S";
+    let t_str = format!("{}:00:00", dt_str);
+
+    let naive = NaiveDateTime::parse_from_str(&t_str, TIME_FORMAT)?;
+    Ok(DateTime::from_utc(naive, Utc))
+}
+
+#[derive(Debug)]
+struct ExportColumnsOptionsChecked {
+    /// The path to the cluster database file.
+    clusters_store_file: Option<PathBuf>,
+
+    /// The path to the fires database file.
+    fires_store_file: Option<PathBuf>,
+
+    /// The directory to write to.
+    output_dir: PathBuf,
+
+    /// The start time.
+    start: DateTime<Utc>,
+
+    /// The end time.
+    end: DateTime<Utc>,
+
+    /// Verbose output
+    verbose: bool,
+}
+
+/// Get the command line arguments and check them.
+///
+/// If there is missing data, try to fill it in with environment variables.
+fn parse_args() -> SatFireResult<ExportColumnsOptionsChecked> {
+    let ExportColumnsOptionsInit {
+        clusters_store_file,
+        fires_store_file,
+        output_dir,
+        start,
+        end,
+        verbose,
+    } = ExportColumnsOptionsInit::parse();
+
+    if clusters_store_file.is_none() && fires_store_file.is_none() {
+        return Err("At least one of the cluster or fires databases must be specified.".into());
+    }
+
+    if start >= end {
+        return Err(format!("The start ({}) must be before the end ({}).", start, end).into());
+    }
+
+    // Exporting part of a month would replace the parts of it that were exported before.
+    let start = start_of_month(start);
+    let end = match start_of_month(end) {
+        month if month == end => end,
+        month => next_month(month),
+    };
+
+    Ok(ExportColumnsOptionsChecked {
+        clusters_store_file,
+        fires_store_file,
+        output_dir,
+        start,
+        end,
+        verbose,
+    })
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                            Main
+ *-----------------------------------------------------------------------------------------------*/
+fn main() -> SatFireResult<()> {
+    SimpleLogger::new().with_level(LevelFilter::Info).init()?;
+
+    let opts = parse_args()?;
+
+    if opts.verbose {
+        info!(target: "startup", "{:#?}", opts);
+    }
+
+    let partitions = partitions(opts.start, opts.end);
+
+    if let Some(ref path) = opts.clusters_store_file {
+        let dir = opts.output_dir.join("clusters");
+        let (rows, pixels) = export_in_parallel(&partitions, |partition| {
+            export_clusters(path, &dir, partition, &opts)
+        })?;
+        info!(target: "summary", "Exported {} clusters with {} pixels", rows, pixels);
+    }
+
+    if let Some(ref path) = opts.fires_store_file {
+        let dir = opts.output_dir.join("fires");
+        let (rows, pixels) = export_in_parallel(&partitions, |partition| {
+            export_fires(path, &dir, partition, &opts)
+        })?;
+        info!(target: "summary", "Exported {} fires with {} pixels", rows, pixels);
+    }
+
+    Ok(())
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                          Partitions
+ *-----------------------------------------------------------------------------------------------*/
+/// A month of data from one satellite, or the part of it in the time range being exported.
+#[derive(Debug, Clone, Copy)]
+struct Partition {
+    sat: Satellite,
+    /// The first day of the month, for naming the partition.
+    month: NaiveDate,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+}
+
+impl Partition {
+    fn dir(&self, table_dir: &Path) -> PathBuf {
+        table_dir.join(format!(
+            "{}_{}",
+            self.sat.name(),
+            self.month.format("%Y-%m")
+        ))
+    }
+
+    /// Check if a row that started at `t` goes in this partition.
+    fn contains(&self, t: DateTime<Utc>) -> bool {
+        t >= self.start && t < self.end
+    }
+}
+
+/// Get the start of the month a time is in.
+fn start_of_month(t: DateTime<Utc>) -> DateTime<Utc> {
+    let month = NaiveDate::from_ymd_opt(t.year(), t.month(), 1).unwrap();
+    DateTime::<Utc>::from_utc(month.and_hms_opt(0, 0, 0).unwrap(), Utc)
+}
+
+/// Get the start of the month after the one a time is in.
+fn next_month(t: DateTime<Utc>) -> DateTime<Utc> {
+    let next = if t.month() == 12 {
+        NaiveDate::from_ymd_opt(t.year() + 1, 1, 1)
+    } else {
+        NaiveDate::from_ymd_opt(t.year(), t.month() + 1, 1)
+    }
+    .unwrap();
+
+    DateTime::<Utc>::from_utc(next.and_hms_opt(0, 0, 0).unwrap(), Utc)
+}
+
+/// Split a time range into months for every satellite.
+fn partitions(start: DateTime<Utc>, end: DateTime<Utc>) -> Vec<Partition> {
+    let mut months = vec![];
+    let mut month_start = start_of_month(start);
+
+    loop {
+        let next_start = next_month(month_start);
+        months.push((month_start.date_naive(), next_start));
+
+        if next_start >= end {
+            break;
+        }
+        month_start = next_start;
+    }
+
+    let mut partitions = vec![];
+    for sat in Satellite::iter() {
+        let mut month_start = start;
+        for &(month, next_start) in &months {
+            partitions.push(Partition {
+                sat,
+                month,
+                start: month_start,
+                end: next_start.min(end),
+            });
+            month_start = next_start;
+        }
+    }
+
+    partitions
+}
+
+/// Export each partition on a pool of threads, returns the total rows and pixels exported.
+fn export_in_parallel<F>(partitions: &[Partition], export: F) -> SatFireResult<(usize, usize)>
+where
+    F: Fn(&Partition) -> SatFireResult<(usize, usize)> + Sync,
+{
+    let num_threads = num_cpus::get().min(partitions.len()).max(1);
+    let next_partition = &AtomicUsize::new(0);
+    let export = &export;
+
+    std::thread::scope(|s| {
+        let handles: Vec<_> = (0..num_threads)
+            .map(|_| {
+                s.spawn(move || -> SatFireResult<(usize, usize)> {
+                    let mut totals = (0, 0);
+                    loop {
+                        let i = next_partition.fetch_add(1, Ordering::Relaxed);
+                        if i >= partitions.len() {
+                            return Ok(totals);
+                        }
+
+                        let (rows, pixels) = export(&partitions[i])?;
+                        totals = (totals.0 + rows, totals.1 + pixels);
+                    }
+                })
+            })
+            .collect();
+
+        let mut totals = (0, 0);
+        for handle in handles {
+            let (rows, pixels) = handle.join().map_err(|_| "export thread panicked")??;
+            totals = (totals.0 + rows, totals.1 + pixels);
+        }
+
+        Ok(totals)
+    })
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                            Export
+ *-----------------------------------------------------------------------------------------------*/
+/// The whole globe, partitions are only split by time.
+const GLOBE: BoundingBox = BoundingBox {
+    ll: Coord {
+        lat: -90.0,
+        lon: -180.0,
+    },
+    ur: Coord {
+        lat: 90.0,
+        lon: 180.0,
+    },
+};
+
+fn export_clusters(
+    db_path: &Path,
+    table_dir: &Path,
+    partition: &Partition,
+    opts: &ExportColumnsOptionsChecked,
+) -> SatFireResult<(usize, usize)> {
+    let db = ClusterDatabase::connect(db_path)?;
+
+    // A scan that starts in this partition may end in the next one.
+    let query_end = partition.end + chrono::Duration::hours(1);
+
+    let mut columns = ClusterColumns::create(partition.dir(table_dir))?;
+
+    let mut query =
+        db.query_clusters(Some(partition.sat), None, partition.start, query_end, GLOBE)?;
+    for row in query.rows()? {
+        let row = row?;
+        if !partition.contains(row.start) {
+            break;
+        }
+
+        columns.push(&row)?;
+    }
+
+    let (rows, pixels) = columns.finish()?;
+    if opts.verbose && rows > 0 {
+        info!(
+            target: "clusters",
+            "{} {} - {} clusters, {} pixels",
+            partition.sat.name(),
+            partition.month.format("%Y-%m"),
+            rows,
+            pixels
+        );
+    }
+
+    Ok((rows, pixels))
+}
+
+fn export_fires(
+    db_path: &Path,
+    table_dir: &Path,
+    partition: &Partition,
+    opts: &ExportColumnsOptionsChecked,
+) -> SatFireResult<(usize, usize)> {
+    let db = FiresDatabase::connect(db_path)?;
+
+    let mut columns = FireColumns::create(partition.dir(table_dir))?;
+
+    // Every fire overlapping the partition is selected, so a fire is only exported with the
+    // partition it started in. Fires that started before the export aren't in any of them.
+    let mut query = db.query_fires(Some(partition.sat), partition.start, partition.end, GLOBE)?;
+    for fire in query.rows()? {
+        let fire = fire?;
+        if partition.contains(fire.first_observed()) {
+            columns.push(&fire)?;
+        }
+    }
+
+    let (rows, pixels) = columns.finish()?;
+    if opts.verbose && rows > 0 {
+        info!(
+            target: "fires",
+            "{} {} - {} fires, {} pixels",
+            partition.sat.name(),
+            partition.month.format("%Y-%m"),
+            rows,
+            pixels
+        );
+    }
+
+    Ok((rows, pixels))
+}
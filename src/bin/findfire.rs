@@ -2,21 +2,35 @@
 
 use chrono::{DateTime, Datelike, Timelike, Utc};
 use clap::Parser;
-use crossbeam_channel::{bounded, Receiver, Sender};
+use crossbeam_channel::{bounded, Receiver, RecvTimeoutError, Sender};
 use log::{debug, info, warn};
 use satfire::{
-    BoundingBox, Cluster, ClusterDatabase, ClusterList, Coord, Geo, KmlWriter, KmzFile,
-    SatFireResult, Satellite, Sector,
+    BoundingBox, Cluster, ClusterDatabase, ClusterDatabaseProcessedFiles, ClusterList,
+    ClusterListBuffers, ClusterListWorker, Coord, DirectoryWatcher, Geo, KmlWriter, KmzFile,
+    PipelineMetrics, PrefetchBudget, PrefetchedFile, SatFireResult, Satellite, Sector,
+    StageMetrics, WatchEvent,
 };
 use simple_logger::SimpleLogger;
 use std::{
     collections::HashMap,
+    ffi::OsString,
     fmt::{self, Display, Formatter},
     path::{Path, PathBuf},
+    process::{Child, Command},
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
     thread::JoinHandle,
+    time::{Duration, Instant, SystemTime},
 };
 use strum::IntoEnumIterator;
 
+/*-------------------------------------------------------------------------------------------------
+ *                                        Global State
+ *-----------------------------------------------------------------------------------------------*/
+static SHUT_DOWN: AtomicBool = AtomicBool::new(false);
+
 /*-------------------------------------------------------------------------------------------------
  *                               Parse Command Line Arguments
  *-----------------------------------------------------------------------------------------------*/
@@ -73,6 +87,103 @@ struct FindFireOptionsInit {
     #[clap(short, long)]
     new_only: bool,
 
+    /// Cache the pixel geolocation tables on disk.
+    ///
+    /// The tables are stored in the same directory as the cluster database and reused on later
+    /// runs, which avoids recalculating the latitude and longitude of every pixel corner.
+    #[clap(short, long)]
+    geolocation_cache: bool,
+
+    /// The number of threads to use for loading and analyzing files.
+    ///
+    /// If this is not specified, one thread per CPU is used.
+    #[clap(short = 't', long)]
+    loader_threads: Option<usize>,
+
+    /// The number of threads to use for walking the data directory.
+    ///
+    /// The directories a couple of levels down, one for each satellite and sector in the usual
+    /// layout, are walked at the same time. This helps most on network storage, where listing
+    /// each directory is a round trip to the server.
+    #[clap(long, default_value_t = 4)]
+    walker_threads: usize,
+
+    /// The number of threads reading files ahead of the loaders.
+    ///
+    /// Files are read into the page cache in the order they will be loaded, so on network storage
+    /// the loaders don't have to wait for them. Set this to 0 to turn it off.
+    #[clap(long, default_value_t = 4)]
+    prefetch_threads: usize,
+
+    /// The most data to read ahead of the loaders, in megabytes.
+    ///
+    /// This should be well under the free memory, or the files will be pushed out of the page
+    /// cache before they are loaded.
+    #[clap(long, default_value_t = 512)]
+    prefetch_mb: u64,
+
+    /// Load files in this process instead of in worker processes.
+    ///
+    /// The NetCDF library is not thread safe, so in this mode the loader threads spend most of
+    /// their time waiting on each other. By default each loader thread hands the files off to its
+    /// own worker process so decoding scales with the number of loader threads.
+    #[clap(long)]
+    in_process: bool,
+
+    /// Group many files into each database transaction.
+    ///
+    /// This is meant for loading a large archive. It also puts the database in write ahead
+    /// logging mode and relaxes how often it syncs to disk, so a crash could lose the most recent
+    /// files. They will be processed again on the next run.
+    #[clap(short, long)]
+    bulk_load: bool,
+
+    /// Drop the database indexes while loading and rebuild them at the end.
+    ///
+    /// This speeds up loading into a new or nearly empty database, but checking whether a file
+    /// has already been processed is slow until the indexes are rebuilt.
+    #[clap(long)]
+    defer_indexes: bool,
+
+    /// Log the throughput and timing of each stage of processing every this many seconds.
+    ///
+    /// For each stage this reports the files or clusters per second, how long each file took to
+    /// decode or each transaction took to commit, and how full the channel to the next stage is.
+    #[clap(long)]
+    metrics_interval: Option<u64>,
+
+    /// Also write the metrics to this file in the Prometheus text format.
+    ///
+    /// The file is replaced every time the metrics are reported, for the node exporter textfile
+    /// collector. If no interval is given, they are reported every minute.
+    #[clap(long)]
+    metrics_file: Option<PathBuf>,
+
+    /// Keep running and process new files as they arrive in the data directory.
+    ///
+    /// After the files already in the data directory are processed, the directories are watched
+    /// for new files, which are loaded and added to the database as soon as they are written. The
+    /// loaders, database connection, and geolocation tables stay ready in between. Directories
+    /// more than three levels below the data directory, like the day and hour directories in the
+    /// usual SATELLITE/SECTOR/YEAR/DAY/HOUR layout, are only watched if they were modified in the
+    /// last week. Stop it with SIGINT or SIGTERM, the files already found are finished first.
+    #[clap(short, long)]
+    watch: bool,
+
+    /// Also take the paths of new files, one per line, from this named pipe or file.
+    ///
+    /// This implies --watch. It is for programs that already know when a file arrives, like an
+    /// LDM pqact entry, so the files don't need to be in the data directory.
+    #[clap(long)]
+    paths_from: Option<PathBuf>,
+
+    /// A shell command to run after new clusters are committed in watch mode.
+    ///
+    /// For example, an incremental connectfire run with --state-dir. The command is run once
+    /// the loaders have caught up, and not again until the last run of it has finished.
+    #[clap(long)]
+    after_insert: Option<String>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -92,6 +203,45 @@ struct FindFireOptionsChecked {
     /// Only look for data newer than the most recent in the database.
     new_only: bool,
 
+    /// The directory to cache the pixel geolocation tables in, if any.
+    geolocation_cache: Option<PathBuf>,
+
+    /// The number of threads to use for loading and analyzing files.
+    loader_threads: usize,
+
+    /// The number of threads to use for walking the data directory.
+    walker_threads: usize,
+
+    /// The number of threads reading files ahead of the loaders.
+    prefetch_threads: usize,
+
+    /// The most data to read ahead of the loaders, in bytes.
+    prefetch_bytes: u64,
+
+    /// Load files in this process instead of in worker processes.
+    in_process: bool,
+
+    /// Group many files into each database transaction.
+    bulk_load: bool,
+
+    /// Drop the database indexes while loading and rebuild them at the end.
+    defer_indexes: bool,
+
+    /// How often to report the metrics, if at all.
+    metrics_interval: Option<Duration>,
+
+    /// A file to write the metrics to in the Prometheus text format.
+    metrics_file: Option<PathBuf>,
+
+    /// Keep running and process new files as they arrive.
+    watch: bool,
+
+    /// Also take the paths of new files from this named pipe or file.
+    paths_from: Option<PathBuf>,
+
+    /// A shell command to run after new clusters are committed in watch mode.
+    after_insert: Option<String>,
+
     /// Verbose output
     verbose: bool,
 }
@@ -105,6 +255,19 @@ fn parse_args() -> SatFireResult<FindFireOptionsChecked> {
         kmz_file,
         data_dir,
         new_only,
+        geolocation_cache,
+        loader_threads,
+        walker_threads,
+        prefetch_threads,
+        prefetch_mb,
+        in_process,
+        bulk_load,
+        defer_indexes,
+        metrics_interval,
+        metrics_file,
+        watch,
+        paths_from,
+        after_insert,
         verbose,
     } = FindFireOptionsInit::parse();
 
@@ -117,11 +280,48 @@ fn parse_args() -> SatFireResult<FindFireOptionsChecked> {
         }
     };
 
+    let geolocation_cache = if geolocation_cache {
+        match cluster_store_file.parent() {
+            Some(dir) if !dir.as_os_str().is_empty() => Some(dir.to_path_buf()),
+            _ => Some(PathBuf::from(".")),
+        }
+    } else {
+        None
+    };
+
+    let loader_threads = loader_threads.unwrap_or_else(num_cpus::get).max(1);
+    let walker_threads = walker_threads.max(1);
+    let prefetch_bytes = prefetch_mb * 1024 * 1024;
+
+    let metrics_interval = match (metrics_interval, &metrics_file) {
+        (Some(secs), _) => Some(Duration::from_secs(secs.max(1))),
+        (None, Some(_)) => Some(DEFAULT_METRICS_INTERVAL),
+        (None, None) => None,
+    };
+
+    let watch = watch || paths_from.is_some();
+    if after_insert.is_some() && !watch {
+        return Err("--after-insert only works with --watch".into());
+    }
+
     Ok(FindFireOptionsChecked {
         cluster_store_file,
         kmz_file,
         data_dir,
         new_only,
+        geolocation_cache,
+        loader_threads,
+        walker_threads,
+        prefetch_threads,
+        prefetch_bytes,
+        in_process,
+        bulk_load,
+        defer_indexes,
+        metrics_interval,
+        metrics_file,
+        watch,
+        paths_from,
+        after_insert,
         verbose,
     })
 }
@@ -129,64 +329,192 @@ fn parse_args() -> SatFireResult<FindFireOptionsChecked> {
 /*-------------------------------------------------------------------------------------------------
  *                                            Main
  *-----------------------------------------------------------------------------------------------*/
-const NUM_LOADER_THREADS: u8 = 4;
+/// Command line argument used to start this program as a decode worker for the loader threads.
+///
+/// This is not part of the public interface, it is only passed to child processes started by
+/// findfire itself. The optional second argument is the geolocation cache directory.
+const DECODE_WORKER_ARG: &str = "--decode-worker";
+
+/// Maximum number of files to group into a single database transaction during a bulk load.
+const BULK_LOAD_MAX_FILES: usize = 500;
+
+/// Maximum time to keep a database transaction open during a bulk load.
+const BULK_LOAD_MAX_TIME: Duration = Duration::from_secs(60);
+
+/// How often to report the metrics if a metrics file is given without an interval.
+const DEFAULT_METRICS_INTERVAL: Duration = Duration::from_secs(60);
+
+/// How often to check for a shutdown signal while watching for new files.
+const WATCH_POLL_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Directories deep in the data directory modified longer ago than this aren't watched.
+const WATCH_RECENT: Duration = Duration::from_secs(7 * 24 * 60 * 60);
+
+/// How often to stop watching the directories that haven't been modified recently.
+const WATCH_PRUNE_INTERVAL: Duration = Duration::from_secs(60 * 60);
+
+/// Directories at most this deep in the data directory are always watched.
+const WATCH_MAX_ALWAYS_DEPTH: usize = 3;
+
+/// The directories this deep in the data directory, SATELLITE/SECTOR in the usual layout, are
+/// walked in parallel.
+const PARALLEL_WALK_DEPTH: usize = 2;
 
 fn main() -> SatFireResult<()> {
+    let mut args = std::env::args_os().skip(1);
+    if args
+        .next()
+        .map(|arg| arg == DECODE_WORKER_ARG)
+        .unwrap_or(false)
+    {
+        if let Some(cache_dir) = args.next() {
+            satfire::set_geolocation_cache_directory(cache_dir)?;
+        }
+
+        return satfire::run_cluster_list_worker();
+    }
+
     SimpleLogger::new().init()?;
 
     let opts = parse_args()?;
 
+    if opts.watch {
+        register_signal_handlers();
+    }
+
     if opts.verbose {
         info!(target: "startup", "{:#?}", opts);
     }
 
     ClusterDatabase::initialize(&opts.cluster_store_file)?;
 
+    let most_recent = scan_start_limits(&opts.cluster_store_file, opts.new_only, opts.verbose)?;
+
+    // Load this before deferring the indexes, it needs them to be fast. The directory filter only
+    // skips whole hours, so the set needs the files from the start of the hour on, or the files
+    // earlier in the same hour would be loaded again.
+    let processed = ClusterDatabase::connect(&opts.cluster_store_file)?.processed_files(
+        most_recent.iter().flat_map(|(&sat, sectors)| {
+            sectors
+                .iter()
+                .map(move |(&sector, &start)| (sat, sector, start_of_hour(start)))
+        }),
+    )?;
+
+    if opts.verbose {
+        info!(target: "startup", "{} files already processed", processed.len());
+    }
+
+    if opts.defer_indexes {
+        ClusterDatabase::connect(&opts.cluster_store_file)?.defer_indexes()?;
+    }
+
+    if let Some(ref cache_dir) = opts.geolocation_cache {
+        satfire::set_geolocation_cache_directory(cache_dir)?;
+    }
+
+    let metrics = PipelineMetrics::new("findfire");
+    let reporter = match opts.metrics_interval {
+        Some(interval) => Some(metrics.start_reporting(interval, opts.metrics_file.clone())?),
+        None => None,
+    };
+
     let (to_present_filter, from_dir_walker) = bounded(512);
-    let (to_loader, from_present_filter) = bounded(512);
+    let (to_prefetcher, from_present_filter) = bounded(512);
+    let (to_loader, from_prefetcher) = bounded(512);
     let (to_db_writer, from_loader) = bounded(512);
 
     let data_dir = &opts.data_dir;
-    let store_file = &opts.cluster_store_file;
     let verbose = opts.verbose;
-    let only_new = opts.new_only;
 
-    let walk_dir = dir_walker(data_dir, store_file, to_present_filter, only_new, verbose)?;
-    let filter_present = filter_already_processed(store_file, from_dir_walker, to_loader, verbose)?;
-    let loader = loader_threads(from_present_filter, to_db_writer, verbose)?;
+    let watch = match opts.watch {
+        true => Some(opts.paths_from.clone()),
+        false => None,
+    };
+    let walk_dir = dir_walker(
+        data_dir,
+        most_recent,
+        opts.walker_threads,
+        watch,
+        to_present_filter,
+        metrics.stage("walk"),
+        verbose,
+    )?;
+    let filter_present = filter_already_processed(
+        &opts.cluster_store_file,
+        processed,
+        from_dir_walker,
+        to_prefetcher,
+        metrics.stage("filter"),
+        verbose,
+    )?;
+    let prefetch = prefetch_threads(
+        from_present_filter,
+        to_loader,
+        opts.prefetch_threads,
+        PrefetchBudget::new(opts.prefetch_bytes),
+        metrics.stage("prefetch"),
+    )?;
+    let loader = loader_threads(
+        from_prefetcher,
+        to_db_writer,
+        &opts,
+        metrics.stage("decode"),
+        verbose,
+    )?;
     let db_filler = db_filler_thread(
         &opts.cluster_store_file,
         from_loader,
         &opts.kmz_file,
+        opts.bulk_load,
+        opts.watch,
+        opts.after_insert.clone().map(AfterInsertHook::new),
+        &metrics,
         opts.verbose,
     )?;
 
+    // Join from the end of the pipeline back. If the loaders quit early, the prefetch threads can
+    // be left waiting on budget that is never freed, and everything before them waiting on full
+    // channels, so their errors have to be seen first.
     db_filler.join().expect("Error joining db filler thread")?;
-    walk_dir.join().expect("Error joining dir walker thread")?;
-
-    for jh in filter_present {
-        jh.join().expect("Error joining filter thread")?;
-    }
 
     for jh in loader {
         jh.join().expect("Error joining loader thread")?;
     }
 
+    for jh in prefetch {
+        jh.join().expect("Error joining prefetch thread")?;
+    }
+
+    filter_present
+        .join()
+        .expect("Error joining filter thread")?;
+
+    walk_dir.join().expect("Error joining dir walker thread")?;
+
+    // Make the final report.
+    drop(reporter);
+
+    if opts.defer_indexes {
+        if opts.verbose {
+            info!(target: "shutdown", "Rebuilding database indexes.");
+        }
+
+        ClusterDatabase::connect(&opts.cluster_store_file)?.create_deferred_indexes()?;
+    }
+
     Ok(())
 }
 
 /*-------------------------------------------------------------------------------------------------
  *                           Threads - Functions that start threads
  *-----------------------------------------------------------------------------------------------*/
-fn dir_walker<P: AsRef<Path>>(
-    data_dir: P,
+/// Find the earliest scan start time to look for files for each satellite and sector.
+fn scan_start_limits<P: AsRef<Path>>(
     store_file: P,
-    to_db_present_filter: Sender<PathBuf>,
     only_new: bool,
     verbose: bool,
-) -> SatFireResult<JoinHandle<SatFireResult<()>>> {
-    let data_dir = data_dir.as_ref().to_path_buf();
-
+) -> SatFireResult<HashMap<Satellite, HashMap<Sector, DateTime<Utc>>>> {
     // Get the most recent version in the database if necessary
     let mut most_recent = HashMap::new();
     if only_new {
@@ -214,25 +542,71 @@ fn dir_walker<P: AsRef<Path>>(
         }
     }
 
-    let standard_dir_filter = create_standard_dir_filter(most_recent, verbose);
+    Ok(most_recent)
+}
+
+/// Round a time down to the start of its hour.
+fn start_of_hour(t: DateTime<Utc>) -> DateTime<Utc> {
+    t.with_nanosecond(0)
+        .and_then(|t| t.with_second(0))
+        .and_then(|t| t.with_minute(0))
+        .unwrap_or(t)
+}
+
+/// Walk the data directory and send the files on to be processed.
+///
+/// If `watch` is given, afterwards keep watching the directories for new files, and reading paths
+/// from the pipe in `watch` if there is one, until shut down.
+fn dir_walker<P: AsRef<Path>>(
+    data_dir: P,
+    most_recent: HashMap<Satellite, HashMap<Sector, DateTime<Utc>>>,
+    walker_threads: usize,
+    watch: Option<Option<PathBuf>>,
+    to_db_present_filter: Sender<PathBuf>,
+    metrics: Arc<StageMetrics>,
+    verbose: bool,
+) -> SatFireResult<JoinHandle<SatFireResult<()>>> {
+    let data_dir = data_dir.as_ref().to_path_buf();
 
     let jh = std::thread::Builder::new()
         .name("findfire-walker".to_owned())
         .spawn(move || {
-            for entry in walkdir::WalkDir::new(data_dir)
-                .into_iter()
-                .filter_entry(standard_dir_filter)
-                // Skip errors silently
-                .filter_map(|res| res.ok())
-                // Only process directories and "*.nc" and "*.zip" files
-                .filter(|e| {
-                    // Pass if it is a directory, or it has the right extension
-                    e.file_type().is_dir()
-                        || e.path().extension().map(|ex| ex == "nc").unwrap_or(false)
-                        || e.path().extension().map(|ex| ex == "zip").unwrap_or(false)
-                })
-            {
-                to_db_present_filter.send(entry.into_path())?;
+            // Watch the directories before they are walked, so files that land during the walk
+            // aren't missed. Files found both ways are only processed once.
+            let mut watcher = match watch {
+                Some(ref paths_from) => {
+                    let mut watcher = DirectoryWatcher::new()?;
+                    if let Some(paths_from) = paths_from {
+                        watcher.read_paths_from(paths_from)?;
+                    }
+                    Some(watcher)
+                }
+                None => None,
+            };
+
+            walk_data_dir_in_parallel(
+                &data_dir,
+                &most_recent,
+                walker_threads,
+                watcher.as_mut(),
+                &to_db_present_filter,
+                &metrics,
+                verbose,
+            )?;
+
+            if let Some(mut watcher) = watcher {
+                if verbose {
+                    info!(target: "watch", "watching {} directories", watcher.len());
+                }
+
+                watch_for_new_files(
+                    &data_dir,
+                    &most_recent,
+                    &mut watcher,
+                    &to_db_present_filter,
+                    &metrics,
+                    verbose,
+                )?;
             }
 
             Ok(())
@@ -241,68 +615,372 @@ fn dir_walker<P: AsRef<Path>>(
     Ok(jh)
 }
 
+/// Walk the data directory on several threads.
+///
+/// The top of the tree is walked first, then the directories [PARALLEL_WALK_DEPTH] levels down
+/// are each walked by one of the threads.
+fn walk_data_dir_in_parallel(
+    data_dir: &Path,
+    most_recent: &HashMap<Satellite, HashMap<Sector, DateTime<Utc>>>,
+    walker_threads: usize,
+    watcher: Option<&mut DirectoryWatcher>,
+    to_db_present_filter: &Sender<PathBuf>,
+    metrics: &StageMetrics,
+    verbose: bool,
+) -> SatFireResult<()> {
+    let watcher = watcher.map(Mutex::new);
+
+    let subtrees = walk_data_dir(
+        data_dir,
+        0,
+        PARALLEL_WALK_DEPTH,
+        create_standard_dir_filter(most_recent.clone(), verbose),
+        watcher.as_ref(),
+        to_db_present_filter,
+        metrics,
+    )?;
+
+    let next_subtree = AtomicUsize::new(0);
+    std::thread::scope(|s| -> SatFireResult<()> {
+        let handles: Vec<_> = (0..walker_threads.min(subtrees.len()))
+            .map(|_| {
+                s.spawn(|| -> SatFireResult<()> {
+                    loop {
+                        let i = next_subtree.fetch_add(1, Ordering::Relaxed);
+                        if i >= subtrees.len() || SHUT_DOWN.load(Ordering::SeqCst) {
+                            return Ok(());
+                        }
+
+                        walk_data_dir(
+                            &subtrees[i],
+                            PARALLEL_WALK_DEPTH,
+                            usize::MAX,
+                            create_standard_dir_filter(most_recent.clone(), verbose),
+                            watcher.as_ref(),
+                            to_db_present_filter,
+                            metrics,
+                        )?;
+                    }
+                })
+            })
+            .collect();
+
+        for handle in handles {
+            handle.join().expect("Error joining walker thread")?;
+        }
+
+        Ok(())
+    })
+}
+
+/// Walk a directory tree and send the "*.nc" and "*.zip" files on, and the directories.
+///
+/// The files in each directory are sent in order by name, which is also the order of their scan
+/// start times. `base_depth` is how deep `dir` is in the data directory. Below the top of the data
+/// directory, `dir` itself isn't sent because it was found by the walk of the directory above it.
+///
+/// Directories `max_depth` below `dir` aren't walked, they are returned instead. If a watcher is
+/// given, the directories are watched as they are walked.
+fn walk_data_dir<F: FnMut(&walkdir::DirEntry) -> bool>(
+    dir: &Path,
+    base_depth: usize,
+    max_depth: usize,
+    dir_filter: F,
+    watcher: Option<&Mutex<&mut DirectoryWatcher>>,
+    to_db_present_filter: &Sender<PathBuf>,
+    metrics: &StageMetrics,
+) -> SatFireResult<Vec<PathBuf>> {
+    let mut not_walked = vec![];
+
+    for entry in walkdir::WalkDir::new(dir)
+        .min_depth(if base_depth > 0 { 1 } else { 0 })
+        .max_depth(max_depth)
+        .sort_by_file_name()
+        .into_iter()
+        .filter_entry(dir_filter)
+        // Skip errors silently
+        .filter_map(|res| res.ok())
+        // Pass if it is a directory, or it has the right extension
+        .filter(|e| e.file_type().is_dir() || is_data_file(e.path()))
+    {
+        if SHUT_DOWN.load(Ordering::SeqCst) {
+            break;
+        }
+
+        if entry.file_type().is_dir() {
+            if let Some(watcher) = watcher {
+                if should_watch(&entry, base_depth) {
+                    if let Err(err) = watcher.lock().unwrap().watch(entry.path()) {
+                        warn!(target: "watch", "{}", err);
+                    }
+                }
+            }
+
+            if entry.depth() == max_depth {
+                not_walked.push(entry.path().to_path_buf());
+            }
+        }
+
+        to_db_present_filter.send(entry.into_path())?;
+        metrics.add_items(1);
+        metrics.queue_depth(to_db_present_filter.len());
+    }
+
+    Ok(not_walked)
+}
+
+/// Send the new files found by the watcher on until shut down.
+fn watch_for_new_files(
+    data_dir: &Path,
+    most_recent: &HashMap<Satellite, HashMap<Sector, DateTime<Utc>>>,
+    watcher: &mut DirectoryWatcher,
+    to_db_present_filter: &Sender<PathBuf>,
+    metrics: &StageMetrics,
+    verbose: bool,
+) -> SatFireResult<()> {
+    let mut events = vec![];
+    let mut last_pruned = Instant::now();
+
+    while !SHUT_DOWN.load(Ordering::SeqCst) {
+        watcher.wait(WATCH_POLL_INTERVAL, &mut events)?;
+
+        if last_pruned.elapsed() >= WATCH_PRUNE_INTERVAL {
+            let removed = watcher.retain(|dir| should_keep_watching(data_dir, dir))?;
+            if verbose {
+                info!(target: "watch", "stopped watching {} directories, watching {}", removed, watcher.len());
+            }
+            last_pruned = Instant::now();
+        }
+
+        for event in events.drain(..) {
+            match event {
+                WatchEvent::File(path) => {
+                    if is_data_file(&path) {
+                        to_db_present_filter.send(path)?;
+                        metrics.add_items(1);
+                        metrics.queue_depth(to_db_present_filter.len());
+                    }
+                }
+                WatchEvent::Directory(dir) => {
+                    if verbose {
+                        info!(target: "watch", "new directory {}", dir.display());
+                    }
+
+                    // Files may have landed in it before it was watched.
+                    walk_data_dir(
+                        &dir,
+                        0,
+                        usize::MAX,
+                        |_| true,
+                        Some(&Mutex::new(&mut *watcher)),
+                        to_db_present_filter,
+                        metrics,
+                    )?;
+                }
+                WatchEvent::Overflow => {
+                    warn!(target: "watch", "missed some new files, walking {} again", data_dir.display());
+
+                    let standard_dir_filter =
+                        create_standard_dir_filter(most_recent.clone(), false);
+                    walk_data_dir(
+                        data_dir,
+                        0,
+                        usize::MAX,
+                        standard_dir_filter,
+                        Some(&Mutex::new(&mut *watcher)),
+                        to_db_present_filter,
+                        metrics,
+                    )?;
+                }
+            }
+        }
+    }
+
+    info!(target: "watch", "Shutting down.");
+
+    Ok(())
+}
+
+/// Only the "*.nc" and "*.zip" files are processed.
+fn is_data_file(path: &Path) -> bool {
+    path.extension()
+        .map(|ex| ex == "nc" || ex == "zip")
+        .unwrap_or(false)
+}
+
+/// Watch the top levels of the data directory, and the directories below that still get files.
+fn should_watch(entry: &walkdir::DirEntry, base_depth: usize) -> bool {
+    if base_depth + entry.depth() <= WATCH_MAX_ALWAYS_DEPTH {
+        return true;
+    }
+
+    entry
+        .metadata()
+        .map(|md| recently_modified(&md))
+        .unwrap_or(true)
+}
+
+/// Like [should_watch], for a directory that is already watched.
+fn should_keep_watching(data_dir: &Path, dir: &Path) -> bool {
+    let depth = dir
+        .strip_prefix(data_dir)
+        .map(|rel| rel.components().count())
+        .unwrap_or(0);
+    if depth <= WATCH_MAX_ALWAYS_DEPTH {
+        return true;
+    }
+
+    // If it's gone, the watcher finds out on its own.
+    std::fs::metadata(dir)
+        .map(|md| recently_modified(&md))
+        .unwrap_or(true)
+}
+
+fn recently_modified(md: &std::fs::Metadata) -> bool {
+    md.modified()
+        .ok()
+        .and_then(|modified| SystemTime::now().duration_since(modified).ok())
+        .map(|age| age < WATCH_RECENT)
+        // Modified in the future, or we can't tell.
+        .unwrap_or(true)
+}
+
+/// Skip files that are already in the database.
+///
+/// Most files are checked against the set loaded at start up. Files it can't answer for, like
+/// older files from `--paths-from`, are checked against the database itself.
 fn filter_already_processed<P: AsRef<Path>>(
     store_file: P,
+    mut processed: ClusterDatabaseProcessedFiles,
     from_dir_walker: Receiver<PathBuf>,
-    to_loader: Sender<PathBuf>,
+    to_prefetcher: Sender<PathBuf>,
+    metrics: Arc<StageMetrics>,
     verbose: bool,
-) -> SatFireResult<Vec<JoinHandle<SatFireResult<()>>>> {
+) -> SatFireResult<JoinHandle<SatFireResult<()>>> {
     let store_file = store_file.as_ref().to_path_buf();
 
-    let mut handles = Vec::with_capacity(num_cpus::get());
+    let jh = std::thread::Builder::new()
+        .name("findifre-filter".to_owned())
+        .spawn(move || {
+            let db = ClusterDatabase::connect(store_file)?;
+            let mut present = db.prepare_to_query_clusters_present()?;
+
+            for path in from_dir_walker {
+                if let Some((sat, sector, start, end)) = path.file_name().and_then(|fname| {
+                    satfire::parse_satellite_description_from_file_name(&fname.to_string_lossy())
+                }) {
+                    let in_db = !processed.covers(sat, sector, start, end)
+                        && present.present(sat, sector, start, end)?;
+
+                    // Remember it too, in watch mode the same file can be found more than once.
+                    if !in_db && processed.insert(sat, sector, start, end) {
+                        if verbose {
+                            info!(target: "filter", "processing {} {} {}", sat, sector, start);
+                            debug!(target: "filter", "processing {} {} {} - {}", sat, sector, start, path.display());
+                        }
+
+                        to_prefetcher.send(path)?;
+                        metrics.add_items(1);
+                        metrics.queue_depth(to_prefetcher.len());
+                    } else if verbose {
+                        info!(target: "filter", "already in db: {}", path.display());
+                    }
+                }
+            }
+            Ok(())
+        })?;
+
+    Ok(jh)
+}
 
-    for _ in 0..num_cpus::get() {
-        let to_loader_clone = to_loader.clone();
-        let from_dir_walker_clone = from_dir_walker.clone();
-        let store_file_clone = store_file.clone();
+/// Read the files into the page cache before they get to the loaders.
+///
+/// With no prefetch threads, a single thread passes the files on without reading them.
+fn prefetch_threads(
+    from_db_present_filter: Receiver<PathBuf>,
+    to_loader: Sender<PrefetchedFile>,
+    num_threads: usize,
+    budget: Arc<PrefetchBudget>,
+    metrics: Arc<StageMetrics>,
+) -> SatFireResult<Vec<JoinHandle<SatFireResult<()>>>> {
+    let read_ahead = num_threads > 0;
+
+    let mut jhs = Vec::with_capacity(num_threads.max(1));
+    for _ in 0..num_threads.max(1) {
+        let from_db_present = from_db_present_filter.clone();
+        let to_loader = to_loader.clone();
+        let budget = Arc::clone(&budget);
+        let metrics = Arc::clone(&metrics);
 
         let jh = std::thread::Builder::new()
-            .name("findifre-filter".to_owned())
+            .name("findfire-prefetch".to_owned())
             .spawn(move || {
-                let db = ClusterDatabase::connect(store_file_clone)?;
-                let mut is_present = db.prepare_to_query_clusters_present()?;
-
-                for path in from_dir_walker_clone {
-                    if let Some((sat, sector, start, end)) = path.file_name().and_then(|fname| {
-                        satfire::parse_satellite_description_from_file_name(&fname.to_string_lossy())
-                    }) {
-                        if !is_present.present(sat, sector, start, end)? {
-                            if verbose {
-                                info!(target: "filter", "processing {} {} {}", sat, sector, start);
-                                debug!(target: "filter", "processing {} {} {} - {}", sat, sector, start, path.display());
-                            }
+                let mut buffer = vec![];
 
-                            to_loader_clone.send(path)?;
-                        } else if verbose {
-                            info!(target: "filter", "already in db: {}", path.display());
-                        }
-                    }
+                for path in from_db_present {
+                    let now = Instant::now();
+                    let file = if read_ahead {
+                        PrefetchedFile::read_ahead(path, &budget, &mut buffer)
+                    } else {
+                        PrefetchedFile::not_read(path, &budget)
+                    };
+                    metrics.record(now.elapsed());
+
+                    to_loader.send(file)?;
+                    metrics.add_items(1);
+                    metrics.queue_depth(to_loader.len());
                 }
+
                 Ok(())
             })?;
 
-        handles.push(jh);
+        jhs.push(jh);
     }
 
-    Ok(handles)
+    Ok(jhs)
 }
 
 fn loader_threads(
-    from_db_present_filter: Receiver<PathBuf>,
+    from_db_present_filter: Receiver<PrefetchedFile>,
     to_db_writer: Sender<ClusterList>,
+    opts: &FindFireOptionsChecked,
+    metrics: Arc<StageMetrics>,
     verbose: bool,
 ) -> SatFireResult<Vec<JoinHandle<SatFireResult<()>>>> {
-    let mut jhs = Vec::with_capacity(NUM_LOADER_THREADS as usize);
+    let mut jhs = Vec::with_capacity(opts.loader_threads);
+
+    let mut worker_args: Vec<OsString> = vec![DECODE_WORKER_ARG.into()];
+    if let Some(ref cache_dir) = opts.geolocation_cache {
+        worker_args.push(cache_dir.clone().into_os_string());
+    }
 
-    for _ in 0..NUM_LOADER_THREADS {
+    for _ in 0..opts.loader_threads {
         let from_db_present = from_db_present_filter.clone();
         let to_db_writer = to_db_writer.clone();
+        let metrics = Arc::clone(&metrics);
+
+        let mut worker = if opts.in_process {
+            None
+        } else {
+            Some(ClusterListWorker::spawn(&worker_args)?)
+        };
 
         let jh = std::thread::Builder::new()
             .name("findfire-load".to_owned())
             .spawn(move || {
-                for path in from_db_present {
-                    let mut clist = match ClusterList::from_file(&path) {
+                let mut buffers = ClusterListBuffers::default();
+
+                for file in from_db_present {
+                    let path = file.path();
+
+                    let now = Instant::now();
+                    let clist = match worker {
+                        Some(ref mut worker) => worker.load(path),
+                        None => ClusterList::from_file_with_buffers(path, &mut buffers),
+                    };
+                    metrics.record(now.elapsed());
+
+                    let mut clist = match clist {
                         Ok(clist) => clist,
                         Err(err) => {
                             if verbose {
@@ -313,9 +991,14 @@ fn loader_threads(
                         }
                     };
 
+                    // It's been loaded, so make room for the next file to be read ahead.
+                    drop(file);
+
                     clist.filter(is_cluster_a_keeper);
+                    metrics.add_items(clist.len());
 
                     to_db_writer.send(clist)?;
+                    metrics.queue_depth(to_db_writer.len());
                 }
 
                 Ok(())
@@ -331,10 +1014,16 @@ fn db_filler_thread<P: AsRef<Path>>(
     store_file: P,
     from_loader: Receiver<ClusterList>,
     kmz_path: P,
+    bulk_load: bool,
+    watch: bool,
+    mut after_insert: Option<AfterInsertHook>,
+    metrics: &PipelineMetrics,
     verbose: bool,
 ) -> SatFireResult<JoinHandle<SatFireResult<()>>> {
     let store_file = store_file.as_ref().to_path_buf();
     let kmz_path = kmz_path.as_ref().to_path_buf();
+    let insert_metrics = metrics.stage("insert");
+    let commit_metrics = metrics.stage("commit");
 
     let jh = std::thread::Builder::new()
         .name("findfire-dbase".to_owned())
@@ -351,17 +1040,51 @@ fn db_filler_thread<P: AsRef<Path>>(
             };
 
             let db = ClusterDatabase::connect(store_file)?;
-            let mut add_stmt = db.prepare_to_add_clusters()?;
+            let mut add_stmt = if bulk_load {
+                db.prepare_to_bulk_add_clusters(BULK_LOAD_MAX_FILES, BULK_LOAD_MAX_TIME)?
+            } else {
+                db.prepare_to_add_clusters()?
+            };
+            add_stmt.record_commits_in(commit_metrics);
 
             let mut cluster_stats: Option<ClusterStats> = None;
             let mut cluster_list_stats: Option<ClusterListStats> = None;
 
-            for mut cluster_list in from_loader {
-                cluster_list.filter_box(bb);
-                ClusterStats::update(&mut cluster_stats, &cluster_list);
-                ClusterListStats::update(&mut cluster_list_stats, &cluster_list);
-                add_stmt.add(cluster_list)?;
+            // Whether there are clusters the after insert hook hasn't been run for.
+            let mut pending = false;
+
+            loop {
+                match from_loader.recv_timeout(AfterInsertHook::RETRY_INTERVAL) {
+                    Ok(mut cluster_list) => {
+                        cluster_list.filter_box(bb);
+                        ClusterStats::update(&mut cluster_stats, &cluster_list);
+                        ClusterListStats::update(&mut cluster_list_stats, &cluster_list);
+                        insert_metrics.add_items(cluster_list.len());
+                        insert_metrics.time(|| add_stmt.add(cluster_list))?;
+                        pending = true;
+                    }
+                    Err(RecvTimeoutError::Timeout) => {
+                        // When watching, nothing else may come for a long time, so commit what
+                        // has arrived instead of waiting to fill the transaction.
+                        if watch {
+                            add_stmt.flush()?;
+                        } else {
+                            add_stmt.flush_if_due()?;
+                        }
+                    }
+                    Err(RecvTimeoutError::Disconnected) => break,
+                }
+
+                // Wait for the loaders to catch up so a burst of files only runs it once.
+                if let Some(ref mut hook) = after_insert {
+                    if pending && from_loader.is_empty() && !hook.is_running()? {
+                        add_stmt.flush()?;
+                        hook.start()?;
+                        pending = false;
+                    }
+                }
             }
+            add_stmt.finish()?;
 
             if let (Some(ref cluster_stats), Some(ref cluster_list_stats)) =
                 (cluster_stats, cluster_list_stats)
@@ -379,6 +1102,63 @@ fn db_filler_thread<P: AsRef<Path>>(
     Ok(jh)
 }
 
+/// A command run after new clusters are committed to the database.
+#[derive(Debug)]
+struct AfterInsertHook {
+    command: String,
+    running: Option<Child>,
+}
+
+impl AfterInsertHook {
+    /// How often to check if the last run of the command finished when there are new clusters.
+    const RETRY_INTERVAL: Duration = Duration::from_secs(1);
+
+    fn new(command: String) -> Self {
+        AfterInsertHook {
+            command,
+            running: None,
+        }
+    }
+
+    fn is_running(&mut self) -> SatFireResult<bool> {
+        if let Some(ref mut child) = self.running {
+            match child.try_wait()? {
+                None => return Ok(true),
+                Some(status) if !status.success() => {
+                    warn!(target: "after-insert", "'{}' failed: {}", self.command, status);
+                }
+                Some(_) => {}
+            }
+
+            self.running = None;
+        }
+
+        Ok(false)
+    }
+
+    fn start(&mut self) -> SatFireResult<()> {
+        let child = Command::new("sh").arg("-c").arg(&self.command).spawn()?;
+        self.running = Some(child);
+        Ok(())
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                       Signal Handlers
+ *-----------------------------------------------------------------------------------------------*/
+fn register_signal_handlers() {
+    unsafe {
+        libc::signal(libc::SIGTERM, handle_shutdown_signal as usize);
+        libc::signal(libc::SIGINT, handle_shutdown_signal as usize);
+    }
+}
+
+fn handle_shutdown_signal(_signal: libc::c_int) {
+    register_signal_handlers();
+
+    SHUT_DOWN.store(true, Ordering::SeqCst);
+}
+
 /*-------------------------------------------------------------------------------------------------
  *                             Cluster and Image Statistics
  *-----------------------------------------------------------------------------------------------*/
@@ -695,10 +1475,11 @@ fn create_standard_dir_filter(
      */
 
     move |entry| -> bool {
-        if entry.path().is_file() {
+        // The file type comes from the directory listing, checking the path would stat it.
+        if entry.file_type().is_file() {
             // We're only concerned with trimming directories - at this point.
             true
-        } else if entry.path().is_dir() {
+        } else if entry.file_type().is_dir() {
             // Let's trim directories we KNOW have data that is too old
             let path = entry.path().to_string_lossy();
 
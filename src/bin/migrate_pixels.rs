@@ -0,0 +1,129 @@
+//! Documentation for the binary is with the definition of `MigratePixelsOptionsInit` below.
+
+use clap::Parser;
+use log::{info, LevelFilter};
+use satfire::{ClusterDatabase, FiresDatabase, SatFireResult};
+use simple_logger::SimpleLogger;
+use std::path::PathBuf;
+
+/*-------------------------------------------------------------------------------------------------
+ *                               Parse Command Line Arguments
+ *-----------------------------------------------------------------------------------------------*/
+///
+/// Upgrade the pixel data in the cluster and fire databases to the current binary format.
+///
+/// Older versions of findfire and connectfire stored pixels in a larger binary format. The
+/// current programs can still read that, but the newer format is about half the size and much
+/// faster to load. This program rewrites every row that is still in an old format, so it is safe
+/// to run more than once or to stop and restart.
+///
+/// SQLite does not give the space freed up by the smaller format back to the file system, so run
+/// VACUUM on the databases afterwards to shrink the files.
+///
+/// This can also add the optional spatial indexes to the databases, which make queries over small
+/// areas much faster. Once a database has a spatial index, findfire and connectfire keep it up to
+/// date.
+///
+#[derive(Debug, Parser)]
+#[clap(bin_name = "migrate_pixels")]
+#[clap(author, version, about)]
+struct MigratePixelsOptionsInit {
+    /// The path to the cluster database file.
+    ///
+    /// If this is not specified, then the program will check for it in the "CLUSTER_DB"
+    /// environment variable.
+    #[clap(short, long)]
+    #[clap(env = "CLUSTER_DB")]
+    clusters_store_file: Option<PathBuf>,
+
+    /// The path to the database file with the fires and associations.
+    ///
+    /// If this is not specified, then the program will check for it in the "FIRES_DB"
+    /// environment variable.
+    #[clap(short, long)]
+    #[clap(env = "FIRES_DB")]
+    fires_store_file: Option<PathBuf>,
+
+    /// Also create the spatial indexes, or add any missing rows to them if they already exist.
+    #[clap(short, long)]
+    spatial_index: bool,
+
+    /// Verbose output
+    #[clap(short, long)]
+    verbose: bool,
+}
+
+#[derive(Debug)]
+struct MigratePixelsOptionsChecked {
+    /// The path to the cluster database file.
+    clusters_store_file: Option<PathBuf>,
+
+    /// The path to the fires database file.
+    fires_store_file: Option<PathBuf>,
+
+    /// Create the spatial indexes.
+    spatial_index: bool,
+
+    /// Verbose output
+    verbose: bool,
+}
+
+/// Get the command line arguments and check them.
+///
+/// If there is missing data, try to fill it in with environment variables.
+fn parse_args() -> SatFireResult<MigratePixelsOptionsChecked> {
+    let MigratePixelsOptionsInit {
+        clusters_store_file,
+        fires_store_file,
+        spatial_index,
+        verbose,
+    } = MigratePixelsOptionsInit::parse();
+
+    if clusters_store_file.is_none() && fires_store_file.is_none() {
+        return Err("At least one of the cluster or fires databases must be specified.".into());
+    }
+
+    Ok(MigratePixelsOptionsChecked {
+        clusters_store_file,
+        fires_store_file,
+        spatial_index,
+        verbose,
+    })
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                            Main
+ *-----------------------------------------------------------------------------------------------*/
+fn main() -> SatFireResult<()> {
+    SimpleLogger::new().with_level(LevelFilter::Info).init()?;
+
+    let opts = parse_args()?;
+
+    if opts.verbose {
+        info!(target: "startup", "{:#?}", opts);
+    }
+
+    if let Some(ref path) = opts.clusters_store_file {
+        let db = ClusterDatabase::connect(path)?;
+        let num_upgraded = db.upgrade_pixel_format()?;
+        info!(target: "summary", "Upgraded {} clusters in {}", num_upgraded, path.display());
+
+        if opts.spatial_index {
+            let num_indexed = db.create_spatial_index()?;
+            info!(target: "summary", "Indexed {} clusters in {}", num_indexed, path.display());
+        }
+    }
+
+    if let Some(ref path) = opts.fires_store_file {
+        let db = FiresDatabase::connect(path)?;
+        let num_upgraded = db.upgrade_pixel_format()?;
+        info!(target: "summary", "Upgraded {} fires in {}", num_upgraded, path.display());
+
+        if opts.spatial_index {
+            let num_indexed = db.create_spatial_index()?;
+            info!(target: "summary", "Indexed {} fires in {}", num_indexed, path.display());
+        }
+    }
+
+    Ok(())
+}
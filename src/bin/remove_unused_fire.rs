@@ -1,14 +1,18 @@
 //! Documentation for the binary is with the definition of `RemoveUnusedOptionsInit` below.
 
+use chrono::{DateTime, NaiveDateTime, Utc};
 use clap::Parser;
 use crossbeam_channel::{bounded, Receiver, Sender};
 use log::{debug, info, trace, warn, LevelFilter};
-use satfire::{ClusterDatabase, SatFireResult, Satellite, Sector};
+use rustc_hash::FxHashMap as HashMap;
+use satfire::{ClusterDatabase, ClusterDatabaseProcessedFiles, SatFireResult, Satellite, Sector};
 use simple_logger::SimpleLogger;
 use std::{
     path::{Path, PathBuf},
     thread::JoinHandle,
+    time::{Duration, Instant},
 };
+use strum::IntoEnumIterator;
 
 /*-------------------------------------------------------------------------------------------------
  *                               Parse Command Line Arguments
@@ -16,6 +20,10 @@ use std::{
 ///
 /// Search for files with that had no clusters analyzed, and remove them.
 ///
+/// The files that had no clusters are loaded from the database once at the start, so checking a
+/// file doesn't need a query. Without --execute this only reports how many files and bytes could
+/// be removed for each satellite and sector.
+///
 #[derive(Debug, Parser)]
 #[clap(bin_name = "remove_unused_fire")]
 #[clap(author, version, about)]
@@ -40,6 +48,16 @@ struct RemoveUnusedOptionsInit {
     #[clap(short, long)]
     execute: bool,
 
+    /// The number of threads deleting files.
+    #[clap(short, long, default_value_t = 4)]
+    jobs: usize,
+
+    /// Limit the total number of files deleted per second.
+    ///
+    /// Use this to leave some I/O for other programs, like findfire, using the same disks.
+    #[clap(long)]
+    max_deletes_per_second: Option<u32>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -58,6 +76,12 @@ struct RemoveUnusedOptionsChecked {
 
     /// Default to a dry run, but if execute, then actually delete the files.
     execute: bool,
+
+    /// The number of threads deleting files.
+    jobs: usize,
+
+    /// Limit the total number of files deleted per second.
+    max_deletes_per_second: Option<u32>,
 }
 
 /// Get the command line arguments and check them.
@@ -68,14 +92,26 @@ fn parse_args() -> SatFireResult<RemoveUnusedOptionsChecked> {
         cluster_store_file,
         data_dir,
         execute,
+        jobs,
+        max_deletes_per_second,
         verbose,
     } = RemoveUnusedOptionsInit::parse();
 
+    if jobs == 0 {
+        return Err("At least 1 job is required.".into());
+    }
+
+    if max_deletes_per_second == Some(0) {
+        return Err("The maximum deletes per second must be more than 0.".into());
+    }
+
     Ok(RemoveUnusedOptionsChecked {
         cluster_store_file,
         data_dir,
         verbose,
         execute,
+        jobs,
+        max_deletes_per_second,
     })
 }
 
@@ -94,33 +130,43 @@ fn main() -> SatFireResult<()> {
 
     ClusterDatabase::initialize(&opts.cluster_store_file)?;
 
+    let since_forever =
+        DateTime::<Utc>::from_utc(NaiveDateTime::from_timestamp_opt(0, 0).unwrap(), Utc);
+    let no_cluster = ClusterDatabase::connect(&opts.cluster_store_file)?.no_cluster_files(
+        Satellite::iter()
+            .flat_map(|sat| Sector::iter().map(move |sector| (sat, sector, since_forever))),
+    )?;
+
+    if opts.verbose {
+        info!(target: "startup", "{} files with no clusters", no_cluster.len());
+    }
+
     let (to_no_fire_filter, from_dir_walker) = bounded(128);
-    let (to_deleter, from_no_fire_filter) = bounded(128);
+    let (to_deleter, from_no_fire_filter) = bounded(opts.jobs * 2);
 
     let data_dir = &opts.data_dir;
-    let store_file = &opts.cluster_store_file;
     let verbose = opts.verbose;
     let execute = opts.execute;
 
     let walk_dir = dir_walker(data_dir, to_no_fire_filter)?;
-    let no_fire = filter_no_fire(store_file, from_dir_walker, to_deleter, verbose)?;
-    let deleter = deleter_thread(from_no_fire_filter, execute, verbose)?;
+    let no_fire = filter_no_fire(no_cluster, from_dir_walker, to_deleter, verbose)?;
+    let deleters = deleter_threads(
+        from_no_fire_filter,
+        opts.jobs,
+        opts.max_deletes_per_second,
+        execute,
+        verbose,
+    )?;
 
     walk_dir.join().expect("Error joining dir walker thread")?;
+    no_fire.join().expect("Error joining filter thread")?;
 
-    for jh in no_fire {
-        jh.join().expect("Error joining filter thread")?;
+    let mut reclaimed = Reclaimed::default();
+    for jh in deleters {
+        reclaimed.merge(jh.join().expect("Error joining deleter thread")?);
     }
 
-    let num_deleted = deleter.join().expect("Error joining deleter thread")?;
-
-    if verbose {
-        if execute {
-            info!(target: "summary", "Deleted {} files.", num_deleted);
-        } else {
-            info!(target: "summary", "Can delete {} files.", num_deleted);
-        }
-    }
+    reclaimed.log_summary(execute);
 
     Ok(())
 }
@@ -159,43 +205,113 @@ fn dir_walker<P: AsRef<Path>>(
     Ok(jh)
 }
 
-fn filter_no_fire<P: AsRef<Path>>(
-    store_file: P,
+/// A batch of files to delete, with the satellite and sector of each for the summary.
+type DeleteBatch = Vec<(Satellite, Sector, PathBuf)>;
+
+fn filter_no_fire(
+    no_cluster: ClusterDatabaseProcessedFiles,
     from_dir_walker: Receiver<PathBuf>,
-    to_deleter: Sender<PathBuf>,
+    to_deleter: Sender<DeleteBatch>,
+    verbose: bool,
+) -> SatFireResult<JoinHandle<SatFireResult<()>>> {
+    /// Deleting in batches keeps the channel to the deleters from becoming the bottleneck.
+    const BATCH_SIZE: usize = 256;
+
+    let jh = std::thread::Builder::new()
+        .name("no-fire-filter".to_owned())
+        .spawn(move || {
+            let mut batch = Vec::with_capacity(BATCH_SIZE);
+
+            for path in from_dir_walker {
+                if let Some((sat, sector, start, end)) = path.file_name().and_then(|fname| {
+                    satfire::parse_satellite_description_from_file_name(&fname.to_string_lossy())
+                }) {
+                    if no_cluster.contains(sat, sector, start, end) {
+                        if verbose {
+                            debug!(target: "filter", "can remove: {} {} {} - {}", sat, sector, start, path.display());
+                        }
+
+                        batch.push((sat, sector, path));
+                        if batch.len() >= BATCH_SIZE {
+                            to_deleter.send(std::mem::replace(&mut batch, Vec::with_capacity(BATCH_SIZE)))?;
+                        }
+                    } else if verbose {
+                        trace!(target: "filter", "contains data or not processed: {}", path.display());
+                    }
+                }
+            }
+
+            if !batch.is_empty() {
+                to_deleter.send(batch)?;
+            }
+
+            Ok(())
+        })?;
+
+    Ok(jh)
+}
+
+fn deleter_threads(
+    from_no_fire_filter: Receiver<DeleteBatch>,
+    jobs: usize,
+    max_deletes_per_second: Option<u32>,
+    execute: bool,
     verbose: bool,
-) -> SatFireResult<Vec<JoinHandle<SatFireResult<()>>>> {
-    let store_file = store_file.as_ref().to_path_buf();
+) -> SatFireResult<Vec<JoinHandle<SatFireResult<Reclaimed>>>> {
+    // Each thread gets an equal share of the limit. There's no need to throttle a dry run, it
+    // doesn't write anything.
+    let min_time_per_file = max_deletes_per_second
+        .filter(|_| execute)
+        .map(|max| Duration::from_secs_f64(jobs as f64 / max as f64));
 
-    let mut handles = Vec::with_capacity(num_cpus::get());
+    let mut handles = Vec::with_capacity(jobs);
 
-    for _ in 0..num_cpus::get() {
-        let to_deleter_clone = to_deleter.clone();
-        let from_dir_walker_clone = from_dir_walker.clone();
-        let store_file_clone = store_file.clone();
+    for _ in 0..jobs {
+        let from_no_fire_filter = from_no_fire_filter.clone();
 
         let jh = std::thread::Builder::new()
-            .name("no-fire-filter".to_owned())
+            .name("no-fire-del".to_owned())
             .spawn(move || {
-                let db = ClusterDatabase::connect(store_file_clone)?;
-                let mut no_fire = db.prepare_to_query_clusters_present()?;
-
-                for path in from_dir_walker_clone {
-                    if let Some((sat, sector, start, end)) = path.file_name().and_then(|fname| {
-                        satfire::parse_satellite_description_from_file_name(&fname.to_string_lossy())
-                    }) {
-                        if no_fire.present_no_fire(sat, sector, start, end)? {
-                            if verbose {
-                                debug!(target: "filter", "can remove: {} {} {} - {}", sat, sector, start, path.display());
+                let mut reclaimed = Reclaimed::default();
+
+                // Deletes are spread out evenly, a burst would be the spike the limit is there
+                // to prevent.
+                let mut next_delete = Instant::now();
+
+                for batch in from_no_fire_filter {
+                    for (sat, sector, path) in batch {
+                        if verbose {
+                            info!(target: "delete", "Removing {}", path.display());
+                        }
+
+                        let size = match std::fs::metadata(&path) {
+                            Ok(md) => md.len(),
+                            Err(e) => {
+                                warn!(target: "delete", "Error reading {} :: {}", path.display(), e);
+                                continue;
                             }
+                        };
+
+                        if let Some(min_time_per_file) = min_time_per_file {
+                            let now = Instant::now();
+                            if now < next_delete {
+                                std::thread::sleep(next_delete - now);
+                            }
+                            next_delete = next_delete.max(now) + min_time_per_file;
+                        }
 
-                            to_deleter_clone.send(path)?;
-                        } else if verbose {
-                            trace!(target: "filter", "contains data or not processed: {}", path.display());
+                        if execute {
+                            if let Err(e) = std::fs::remove_file(&path) {
+                                warn!(target: "delete", "Error deleting {} :: {}", path.display(), e);
+                                continue;
+                            }
                         }
+
+                        reclaimed.add(sat, sector, size);
                     }
                 }
-                Ok(())
+
+                Ok(reclaimed)
             })?;
 
         handles.push(jh);
@@ -204,37 +320,62 @@ fn filter_no_fire<P: AsRef<Path>>(
     Ok(handles)
 }
 
-fn deleter_thread(
-    from_no_fire_filter: Receiver<PathBuf>,
-    execute: bool,
-    verbose: bool,
-) -> SatFireResult<JoinHandle<SatFireResult<u64>>> {
-    let jh = std::thread::Builder::new()
-        .name("no-fire-del".to_owned())
-        .spawn(move || {
-            let mut count: u64 = 0;
+/*-------------------------------------------------------------------------------------------------
+ *                                    Keep track of the space
+ *-----------------------------------------------------------------------------------------------*/
+/// The number of files and bytes removed, or that could be, for each satellite and sector.
+#[derive(Debug, Default)]
+struct Reclaimed {
+    by_source: HashMap<(Satellite, Sector), (u64, u64)>,
+}
 
-            for path in from_no_fire_filter {
-                if verbose {
-                    info!(target: "delete", "Removing {}", path.display());
-                }
+impl Reclaimed {
+    fn add(&mut self, sat: Satellite, sector: Sector, bytes: u64) {
+        let (files, total_bytes) = self.by_source.entry((sat, sector)).or_default();
+        *files += 1;
+        *total_bytes += bytes;
+    }
 
-                count += 1;
+    fn merge(&mut self, other: Reclaimed) {
+        for (key, (files, bytes)) in other.by_source {
+            let (total_files, total_bytes) = self.by_source.entry(key).or_default();
+            *total_files += files;
+            *total_bytes += bytes;
+        }
+    }
 
-                if execute {
-                    match std::fs::remove_file(&path) {
-                        Ok(_) => {}
-                        Err(e) => {
-                            warn!(target: "delete", "Error deleting {} :: {}", path.display(), e)
-                        }
-                    }
-                }
-            }
+    fn log_summary(&self, execute: bool) {
+        let action = if execute { "Deleted" } else { "Can delete" };
 
-            Ok(count)
-        })?;
+        let mut sources: Vec<_> = self.by_source.iter().collect();
+        sources.sort_by_key(|((sat, sector), _)| (sat.name(), sector.name()));
 
-    Ok(jh)
+        let (mut total_files, mut total_bytes) = (0, 0);
+        for ((sat, sector), &(files, bytes)) in sources {
+            info!(target: "summary", "{} {} {} files, {} from {}", action, files, format_bytes(bytes), sat.name(), sector.name());
+            total_files += files;
+            total_bytes += bytes;
+        }
+
+        info!(target: "summary", "{} {} files, {} total.", action, total_files, format_bytes(total_bytes));
+    }
+}
+
+fn format_bytes(bytes: u64) -> String {
+    const UNITS: [&str; 5] = ["B", "KiB", "MiB", "GiB", "TiB"];
+
+    let mut value = bytes as f64;
+    let mut unit = 0;
+    while value >= 1024.0 && unit < UNITS.len() - 1 {
+        value /= 1024.0;
+        unit += 1;
+    }
+
+    if unit == 0 {
+        format!("{} {}", bytes, UNITS[0])
+    } else {
+        format!("{:.1} {}", value, UNITS[unit])
+    }
 }
 
 /*-------------------------------------------------------------------------------------------------
@@ -249,7 +390,7 @@ fn create_standard_path_filter() -> impl FnMut(&walkdir::DirEntry) -> bool {
      */
 
     move |entry| -> bool {
-        if entry.path().is_file() {
+        if entry.file_type().is_file() {
             // Keep files with the proper extension.
             let keep = entry
                 .path()
@@ -264,7 +405,7 @@ fn create_standard_path_filter() -> impl FnMut(&walkdir::DirEntry) -> bool {
 
             //debug!(target: "path filter", "keep: {} path: {}", keep, entry.path().display());
             keep
-        } else if entry.path().is_dir() {
+        } else if entry.file_type().is_dir() {
             // Let's trim directories we KNOW have data that is too old
             let path = entry.path().to_string_lossy();
 
@@ -2,13 +2,15 @@ use chrono::{DateTime, NaiveDateTime, Utc};
 use clap::Parser;
 use log::info;
 use satfire::{
-    BoundingBox, ClusterDatabase, ClusterDatabaseClusterRow, Coord, KmlWriter, KmzFile,
-    SatFireResult, Satellite, Sector,
+    write_chunked_kmz, write_kml_in_parallel, BoundingBox, ClusterDatabase,
+    ClusterDatabaseClusterRow, ClusterDatabaseClusterSummary, Coord, KmlChunk, KmlDetail,
+    KmlWriter, KmzFile, SatFireResult, Satellite, Sector,
 };
 use simple_logger::SimpleLogger;
 use std::{
-    fmt::{self, Display},
+    fmt::{self, Display, Write},
     path::PathBuf,
+    sync::atomic::{AtomicBool, Ordering},
 };
 use strum::IntoEnumIterator;
 
@@ -52,6 +54,26 @@ struct ShowClustersOptionsInit {
     #[clap(default_value_t=BoundingBox{ll:Coord{lat: 44.0, lon: -116.5}, ur:Coord{lat: 49.5, lon: -104.0}})]
     bbox: BoundingBox,
 
+    /// How much detail to show for each cluster, pixels, outlines, or centroids.
+    ///
+    /// Outlines and centroids are read without the pixels, so they are much faster for large
+    /// exports. Outlines need a spatial index in the database, see migrate_pixels, without one the
+    /// centroids are shown instead.
+    #[clap(short, long)]
+    #[clap(default_value = "pixels")]
+    detail: KmlDetail,
+
+    /// Split the output into a document for every this many hours.
+    ///
+    /// The documents are linked from the root document in the KMZ file and only loaded by Google
+    /// Earth when they are in the time range and area shown, so very large exports can be opened.
+    #[clap(long)]
+    chunk_hours: Option<i64>,
+
+    /// Split the output into a document for every area this many degrees on a side.
+    #[clap(long)]
+    chunk_degrees: Option<f64>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -132,6 +154,21 @@ struct ShowClustersOptionsChecked {
 
     /// Bounding Box
     bbox: BoundingBox,
+
+    /// How much detail to show for each cluster.
+    detail: KmlDetail,
+
+    /// The number of hours in each chunk of the output, if it is chunked by time.
+    chunk_hours: Option<i64>,
+
+    /// The size of each chunk of the output in degrees, if it is chunked by area.
+    chunk_degrees: Option<f64>,
+}
+
+impl ShowClustersOptionsChecked {
+    fn is_chunked(&self) -> bool {
+        self.chunk_hours.is_some() || self.chunk_degrees.is_some()
+    }
 }
 
 impl Display for ShowClustersOptionsChecked {
@@ -146,6 +183,13 @@ impl Display for ShowClustersOptionsChecked {
             "Bounding Box: ({:.6}, {:.6}) <---> ({:.6}, {:.6})",
             self.bbox.ll.lat, self.bbox.ll.lon, self.bbox.ur.lat, self.bbox.ur.lon
         )?;
+        writeln!(f, "      Detail: {}", self.detail.name())?;
+        if let Some(hours) = self.chunk_hours {
+            writeln!(f, " Chunk Hours: {}", hours)?;
+        }
+        if let Some(degrees) = self.chunk_degrees {
+            writeln!(f, "Chunk Degrees: {}", degrees)?;
+        }
         writeln!(f, "\n")?; // yes, two blank lines.
 
         Ok(())
@@ -162,9 +206,18 @@ fn parse_args() -> SatFireResult<ShowClustersOptionsChecked> {
         start,
         end,
         bbox,
+        detail,
+        chunk_hours,
+        chunk_degrees,
         verbose,
     } = ShowClustersOptionsInit::parse();
 
+    if chunk_hours.map(|h| h <= 0).unwrap_or(false)
+        || chunk_degrees.map(|d| !(d > 0.0)).unwrap_or(false)
+    {
+        return Err("The chunk size must be greater than zero.".into());
+    }
+
     let kmz_file = match kmz_file {
         Some(v) => v,
         None => {
@@ -180,6 +233,9 @@ fn parse_args() -> SatFireResult<ShowClustersOptionsChecked> {
         start,
         end,
         bbox,
+        detail,
+        chunk_hours,
+        chunk_degrees,
         verbose,
     };
 
@@ -198,44 +254,173 @@ fn main() -> SatFireResult<()> {
 
     let opts = parse_args()?;
 
-    let db = ClusterDatabase::connect(&opts.cluster_store_file)?;
-    let mut kfile = KmzFile::new(&opts.kmz_file)?;
+    if !opts.is_chunked() {
+        let db = ClusterDatabase::connect(&opts.cluster_store_file)?;
+        let mut kfile = KmzFile::new(&opts.kmz_file)?;
+
+        return write_clusters(
+            &mut kfile, &db, &opts, opts.start, opts.end, opts.bbox, true,
+        );
+    }
+
+    let chunks = KmlChunk::split(
+        opts.start,
+        opts.end,
+        opts.bbox,
+        opts.chunk_hours,
+        opts.chunk_degrees,
+    );
+
+    if opts.verbose {
+        info!("Writing {} chunks.", chunks.len());
+    }
+
+    // The chunks are written in parallel, so each one is written on a single thread.
+    write_chunked_kmz(&opts.kmz_file, &chunks, |chunk, kml| {
+        let db = ClusterDatabase::connect(&opts.cluster_store_file)?;
+        let area = chunk.region.unwrap_or(opts.bbox);
+
+        write_clusters(kml, &db, &opts, chunk.start, chunk.end, area, false)
+    })
+}
+
+/// Only warn once about outlines without a spatial index.
+static WARNED_NO_OUTLINES: AtomicBool = AtomicBool::new(false);
+
+/// Write the clusters with a scan start from `start` up to, but not including `end`, unless `end`
+/// is the end of the whole export.
+fn write_clusters<K: KmlWriter>(
+    kml: &mut K,
+    db: &ClusterDatabase,
+    opts: &ShowClustersOptionsChecked,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    area: BoundingBox,
+    parallel: bool,
+) -> SatFireResult<()> {
+    // A scan that starts in this time range may end after it.
+    let query_end = if end < opts.end {
+        (end + chrono::Duration::hours(1)).min(opts.end)
+    } else {
+        end
+    };
+    let in_range = |scan_start: DateTime<Utc>| scan_start < end || end >= opts.end;
+
+    if opts.detail != KmlDetail::Pixels {
+        kml.start_style(Some("cluster"))?;
+        kml.create_icon_style(
+            Some("http://maps.google.com/mapfiles/kml/shapes/firedept.png"),
+            0.5,
+        )?;
+        kml.create_poly_style(Some("880000FF"), true, true)?;
+        kml.finish_style()?;
+    }
 
     for sat in Satellite::iter() {
-        kfile.start_folder(Some(sat.name()), None, false)?;
+        kml.start_folder(Some(sat.name()), None, false)?;
 
         for sector in Sector::iter() {
-            kfile.start_folder(Some(sector.name()), None, false)?;
-
-            let mut query =
-                db.query_clusters(Some(sat), Some(sector), opts.start, opts.end, opts.bbox)?;
-
-            for row_res in query.rows()? {
-                let ClusterDatabaseClusterRow {
-                    start, end, pixels, ..
-                } = match row_res {
-                    Ok(row) => row,
-                    Err(err) => {
-                        if opts.verbose {
-                            info!("Error reading cluster from database: {}", err);
-                        }
-                        continue;
+            kml.start_folder(Some(sector.name()), None, false)?;
+
+            if opts.detail == KmlDetail::Pixels {
+                let mut query =
+                    db.query_clusters(Some(sat), Some(sector), start, query_end, area)?;
+                let rows = query
+                    .rows()?
+                    .filter_map(|row_res| log_error(row_res, opts.verbose))
+                    .take_while(|row| in_range(row.start));
+
+                if parallel {
+                    // Formatting the pixels is most of the work, so spread it out over several
+                    // threads.
+                    write_kml_in_parallel(kml, rows, |row, buf| write_cluster_pixels(row, buf))?;
+                } else {
+                    for row in rows {
+                        write_cluster_pixels(&row, kml)?;
                     }
-                };
+                }
+            } else {
+                let mut query =
+                    db.query_cluster_summaries(Some(sat), Some(sector), start, query_end, area)?;
+                let rows = query
+                    .rows()?
+                    .filter_map(|row_res| log_error(row_res, opts.verbose))
+                    .take_while(|row| in_range(row.start));
+
+                let mut description = String::new();
+                for row in rows {
+                    write_cluster_summary(&row, opts.detail, &mut description, kml)?;
+                }
+            }
 
-                kfile.start_folder(Some("Folder"), None, false)?;
+            kml.finish_folder()?;
+        }
 
-                kfile.timespan(start, end)?;
-                pixels.kml_write(&mut kfile);
+        kml.finish_folder()?;
+    }
 
-                kfile.finish_folder()?;
-            }
+    Ok(())
+}
 
-            kfile.finish_folder()?;
+fn log_error<T>(row_res: SatFireResult<T>, verbose: bool) -> Option<T> {
+    match row_res {
+        Ok(row) => Some(row),
+        Err(err) => {
+            if verbose {
+                info!("Error reading cluster from database: {}", err);
+            }
+            None
         }
+    }
+}
+
+fn write_cluster_pixels<K: KmlWriter>(
+    row: &ClusterDatabaseClusterRow,
+    kml: &mut K,
+) -> SatFireResult<()> {
+    let ClusterDatabaseClusterRow {
+        start, end, pixels, ..
+    } = row;
+
+    kml.start_folder(Some("Folder"), None, false)?;
 
-        kfile.finish_folder()?;
+    kml.timespan(*start, *end)?;
+    pixels.kml_write(kml);
+
+    kml.finish_folder()
+}
+
+fn write_cluster_summary<K: KmlWriter>(
+    row: &ClusterDatabaseClusterSummary,
+    detail: KmlDetail,
+    description: &mut String,
+    kml: &mut K,
+) -> SatFireResult<()> {
+    description.clear();
+    write!(
+        description,
+        concat!(
+            "Power: {:.0} MW<br/>",
+            "Area: {:.0} m^2<br/>",
+            "Max Temperature: {:.0} K<br/>",
+            "Max Scan Angle: {:.2}&deg;<br/>",
+        ),
+        row.power, row.area, row.max_temperature, row.scan_angle,
+    )?;
+
+    kml.start_placemark(None, Some(description), Some("#cluster"))?;
+    kml.timespan(row.start, row.end)?;
+
+    match (detail, row.bbox) {
+        (KmlDetail::Outlines, Some(ref bbox)) => kml.create_outline(bbox)?,
+        (KmlDetail::Outlines, None) => {
+            if !WARNED_NO_OUTLINES.swap(true, Ordering::Relaxed) {
+                info!("No spatial index in the database, showing centroids instead of outlines.");
+            }
+            kml.create_point(row.centroid.lat, row.centroid.lon, 0.0)?;
+        }
+        _ => kml.create_point(row.centroid.lat, row.centroid.lon, 0.0)?,
     }
 
-    Ok(())
+    kml.finish_placemark()
 }
@@ -2,12 +2,14 @@ use chrono::{DateTime, Duration, NaiveDateTime, Utc};
 use clap::Parser;
 use log::info;
 use satfire::{
-    BoundingBox, Coord, FiresDatabase, Geo, KmlWriter, KmzFile, SatFireResult, Satellite,
+    write_chunked_kmz, BoundingBox, Coord, Fire, FiresDatabase, FiresDatabaseFireSummary, Geo,
+    KmlChunk, KmlDetail, KmlWriter, KmzFile, SatFireResult, Satellite,
 };
 use simple_logger::SimpleLogger;
 use std::{
     fmt::{self, Display},
     path::PathBuf,
+    sync::atomic::{AtomicBool, Ordering},
 };
 use strum::IntoEnumIterator;
 
@@ -56,6 +58,26 @@ struct ShowFiresOptionsInit {
     #[clap(default_value_t = 0)]
     minimum_days: i64,
 
+    /// How much detail to show for each fire, pixels, outlines, or centroids.
+    ///
+    /// Outlines and centroids are read without the pixels, so they are much faster for large
+    /// exports. Outlines need a spatial index in the database, see migrate_pixels, without one the
+    /// centroids are shown instead.
+    #[clap(short, long)]
+    #[clap(default_value = "pixels")]
+    detail: KmlDetail,
+
+    /// Split the output into a document for every this many hours, by when each fire started.
+    ///
+    /// The documents are linked from the root document in the KMZ file and only loaded by Google
+    /// Earth when they are in the time range and area shown, so very large exports can be opened.
+    #[clap(long)]
+    chunk_hours: Option<i64>,
+
+    /// Split the output into a document for every area this many degrees on a side.
+    #[clap(long)]
+    chunk_degrees: Option<f64>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -139,6 +161,21 @@ struct ShowFiresOptionsChecked {
 
     /// Bounding Box
     bbox: BoundingBox,
+
+    /// How much detail to show for each fire.
+    detail: KmlDetail,
+
+    /// The number of hours in each chunk of the output, if it is chunked by time.
+    chunk_hours: Option<i64>,
+
+    /// The size of each chunk of the output in degrees, if it is chunked by area.
+    chunk_degrees: Option<f64>,
+}
+
+impl ShowFiresOptionsChecked {
+    fn is_chunked(&self) -> bool {
+        self.chunk_hours.is_some() || self.chunk_degrees.is_some()
+    }
 }
 
 impl Display for ShowFiresOptionsChecked {
@@ -154,6 +191,13 @@ impl Display for ShowFiresOptionsChecked {
             "    Bounding Box: ({:.6}, {:.6}) <---> ({:.6}, {:.6})",
             self.bbox.ll.lat, self.bbox.ll.lon, self.bbox.ur.lat, self.bbox.ur.lon
         )?;
+        writeln!(f, "          Detail: {}", self.detail.name())?;
+        if let Some(hours) = self.chunk_hours {
+            writeln!(f, "     Chunk Hours: {}", hours)?;
+        }
+        if let Some(degrees) = self.chunk_degrees {
+            writeln!(f, "   Chunk Degrees: {}", degrees)?;
+        }
         writeln!(f, "\n")?; // yes, two blank lines.
 
         Ok(())
@@ -171,9 +215,18 @@ fn parse_args() -> SatFireResult<ShowFiresOptionsChecked> {
         end,
         minimum_days,
         bbox,
+        detail,
+        chunk_hours,
+        chunk_degrees,
         verbose,
     } = ShowFiresOptionsInit::parse();
 
+    if chunk_hours.map(|h| h <= 0).unwrap_or(false)
+        || chunk_degrees.map(|d| !(d > 0.0)).unwrap_or(false)
+    {
+        return Err("The chunk size must be greater than zero.".into());
+    }
+
     let kmz_file = match kmz_file {
         Some(v) => v,
         None => {
@@ -190,6 +243,9 @@ fn parse_args() -> SatFireResult<ShowFiresOptionsChecked> {
         end,
         minimum_days: Duration::days(minimum_days),
         bbox,
+        detail,
+        chunk_hours,
+        chunk_degrees,
         verbose,
     };
 
@@ -208,83 +264,215 @@ fn main() -> SatFireResult<()> {
 
     let opts = parse_args()?;
 
-    let db = FiresDatabase::connect(&opts.fires_store_file)?;
-    let mut kfile = KmzFile::new(&opts.kmz_file)?;
+    if !opts.is_chunked() {
+        let db = FiresDatabase::connect(&opts.fires_store_file)?;
+        let mut kfile = KmzFile::new(&opts.kmz_file)?;
+
+        return write_fires(&mut kfile, &db, &opts, opts.start, opts.end, opts.bbox);
+    }
+
+    let chunks = KmlChunk::split(
+        opts.start,
+        opts.end,
+        opts.bbox,
+        opts.chunk_hours,
+        opts.chunk_degrees,
+    );
+
+    if opts.verbose {
+        info!("Writing {} chunks.", chunks.len());
+    }
+
+    write_chunked_kmz(&opts.kmz_file, &chunks, |chunk, kml| {
+        let db = FiresDatabase::connect(&opts.fires_store_file)?;
+        let area = chunk.region.unwrap_or(opts.bbox);
 
-    kfile.start_style(Some("fire"))?;
-    kfile.create_icon_style(
+        write_fires(kml, &db, &opts, chunk.start, chunk.end, area)
+    })
+}
+
+/// Only warn once about outlines without a spatial index.
+static WARNED_NO_OUTLINES: AtomicBool = AtomicBool::new(false);
+
+/// Write the fires that started from `start` up to, but not including `end`, or were already
+/// burning at the start of the export if `start` is the start of the export.
+fn write_fires<K: KmlWriter>(
+    kml: &mut K,
+    db: &FiresDatabase,
+    opts: &ShowFiresOptionsChecked,
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    area: BoundingBox,
+) -> SatFireResult<()> {
+    // Every fire overlapping the time range is selected, so a fire in several chunks is only
+    // written in the one it started in.
+    let in_range = |first_observed: DateTime<Utc>| {
+        let first_observed = first_observed.max(opts.start);
+        first_observed >= start && (first_observed < end || end >= opts.end)
+    };
+
+    kml.start_style(Some("fire"))?;
+    kml.create_icon_style(
         Some("http://maps.google.com/mapfiles/kml/shapes/firedept.png"),
         0.5,
     )?;
-    kfile.finish_style()?;
+    kml.create_poly_style(Some("880000FF"), true, true)?;
+    kml.finish_style()?;
 
-    let mut name = String::new();
-    let mut description = String::new();
-    let mut duration_buf = String::new();
+    let mut buffers = Buffers::default();
 
     for sat in Satellite::iter() {
-        kfile.start_folder(Some(sat.name()), None, false)?;
-
-        let mut query = db.query_fires(Some(sat), opts.start, opts.end, opts.bbox)?;
-
-        for fire_res in query.rows()? {
-            match fire_res {
-                Ok(fire) => {
-                    if fire.duration() < opts.minimum_days {
-                        continue;
-                    }
-
-                    let pixels = fire.pixels();
-                    let Coord { lat, lon } = fire.centroid();
-
-                    name.clear();
-                    write!(&mut name as &mut dyn std::fmt::Write, "{}", fire.id())?;
-
-                    kfile.start_folder(Some(&name), None, false)?;
-
-                    kfile.timespan(fire.first_observed(), fire.last_observed())?;
-
-                    fire.format_duration(&mut duration_buf);
-                    description.clear();
-
-                    write!(
-                        &mut description as &mut dyn std::fmt::Write,
-                        concat!(
-                            "ID: {}<br/>",
-                            "First Observed: {}<br/>",
-                            "Last Observed: {}<br/>",
-                            "Duration: {}<br/>",
-                            "Max Power: {:.0} MW<br/>",
-                            "Max Temperature: {:.0}K<br/>",
-                            "Num Pixels: {}<br/>",
-                        ),
-                        fire.id(),
-                        fire.first_observed(),
-                        fire.last_observed(),
-                        &duration_buf,
-                        fire.max_power(),
-                        fire.max_temperature(),
-                        fire.pixels().len(),
-                    )?;
-
-                    kfile.start_placemark(Some(&name), Some(&description), Some("#fire"))?;
-                    kfile.create_point(lat, lon, 0.0)?;
-                    kfile.finish_placemark()?;
-
-                    pixels.kml_write(&mut kfile);
-
-                    kfile.finish_folder()?;
+        kml.start_folder(Some(sat.name()), None, false)?;
+
+        if opts.detail == KmlDetail::Pixels {
+            let mut query = db.query_fires(Some(sat), start, end, area)?;
+
+            for fire in query.rows()?.filter_map(|res| log_error(res, opts.verbose)) {
+                if fire.duration() >= opts.minimum_days && in_range(fire.first_observed()) {
+                    write_fire_pixels(&fire, &mut buffers, kml)?;
                 }
-                Err(err) => {
-                    if opts.verbose {
-                        info!("Error reading fire from database: {}", err);
-                    }
+            }
+        } else {
+            let mut query = db.query_fire_summaries(Some(sat), start, end, area)?;
+
+            for fire in query.rows()?.filter_map(|res| log_error(res, opts.verbose)) {
+                if fire.duration() >= opts.minimum_days && in_range(fire.first_observed) {
+                    write_fire_summary(&fire, opts.detail, &mut buffers, kml)?;
                 }
             }
         }
 
-        kfile.finish_folder()?;
+        kml.finish_folder()?;
     }
 
     Ok(())
 }
+
+fn log_error<T>(res: SatFireResult<T>, verbose: bool) -> Option<T> {
+    match res {
+        Ok(fire) => Some(fire),
+        Err(err) => {
+            if verbose {
+                info!("Error reading fire from database: {}", err);
+            }
+            None
+        }
+    }
+}
+
+/// Strings reused for each fire.
+#[derive(Default)]
+struct Buffers {
+    name: String,
+    description: String,
+    duration: String,
+}
+
+impl Buffers {
+    fn describe(
+        &mut self,
+        id: u64,
+        first_observed: DateTime<Utc>,
+        last_observed: DateTime<Utc>,
+        max_power: f64,
+        max_temperature: f64,
+        num_pixels: usize,
+    ) -> SatFireResult<()> {
+        self.name.clear();
+        write!(&mut self.name as &mut dyn std::fmt::Write, "{}", id)?;
+
+        self.description.clear();
+        write!(
+            &mut self.description as &mut dyn std::fmt::Write,
+            concat!(
+                "ID: {}<br/>",
+                "First Observed: {}<br/>",
+                "Last Observed: {}<br/>",
+                "Duration: {}<br/>",
+                "Max Power: {:.0} MW<br/>",
+                "Max Temperature: {:.0}K<br/>",
+                "Num Pixels: {}<br/>",
+            ),
+            id,
+            first_observed,
+            last_observed,
+            &self.duration,
+            max_power,
+            max_temperature,
+            num_pixels,
+        )?;
+
+        Ok(())
+    }
+}
+
+fn write_fire_pixels<K: KmlWriter>(
+    fire: &Fire,
+    buffers: &mut Buffers,
+    kml: &mut K,
+) -> SatFireResult<()> {
+    let Coord { lat, lon } = fire.centroid();
+
+    fire.format_duration(&mut buffers.duration);
+    buffers.describe(
+        fire.id(),
+        fire.first_observed(),
+        fire.last_observed(),
+        fire.max_power(),
+        fire.max_temperature(),
+        fire.pixels().len(),
+    )?;
+
+    kml.start_folder(Some(&buffers.name), None, false)?;
+
+    kml.timespan(fire.first_observed(), fire.last_observed())?;
+
+    kml.start_placemark(
+        Some(&buffers.name),
+        Some(&buffers.description),
+        Some("#fire"),
+    )?;
+    kml.create_point(lat, lon, 0.0)?;
+    kml.finish_placemark()?;
+
+    fire.pixels().kml_write(kml);
+
+    kml.finish_folder()
+}
+
+fn write_fire_summary<K: KmlWriter>(
+    fire: &FiresDatabaseFireSummary,
+    detail: KmlDetail,
+    buffers: &mut Buffers,
+    kml: &mut K,
+) -> SatFireResult<()> {
+    fire.format_duration(&mut buffers.duration);
+    buffers.describe(
+        fire.id,
+        fire.first_observed,
+        fire.last_observed,
+        fire.max_power,
+        fire.max_temperature,
+        fire.num_pixels,
+    )?;
+
+    kml.start_placemark(
+        Some(&buffers.name),
+        Some(&buffers.description),
+        Some("#fire"),
+    )?;
+    kml.timespan(fire.first_observed, fire.last_observed)?;
+
+    match (detail, fire.bbox) {
+        (KmlDetail::Outlines, Some(ref bbox)) => kml.create_outline(bbox)?,
+        (KmlDetail::Outlines, None) => {
+            if !WARNED_NO_OUTLINES.swap(true, Ordering::Relaxed) {
+                info!("No spatial index in the database, showing centroids instead of outlines.");
+            }
+            kml.create_point(fire.centroid.lat, fire.centroid.lon, 0.0)?;
+        }
+        _ => kml.create_point(fire.centroid.lat, fire.centroid.lon, 0.0)?,
+    }
+
+    kml.finish_placemark()
+}
@@ -1,10 +1,15 @@
+use chrono::{DateTime, Utc};
 use clap::Parser;
 use log::info;
-use satfire::{Coord, Geo, JointFiresClusterDatabases, KmlWriter, KmzFile, SatFireResult};
+use satfire::{
+    write_chunked_kmz, ClusterDatabaseClusterRow, Coord, FiresDatabase, Geo,
+    JointFiresClusterDatabases, KmlChunk, KmlDetail, KmlWriter, KmzFile, PixelList, SatFireResult,
+};
 use simple_logger::SimpleLogger;
 use std::{
     fmt::{self, Display, Write},
-    path::PathBuf,
+    io::{BufWriter, Write as _},
+    path::{Path, PathBuf},
 };
 
 /*-------------------------------------------------------------------------------------------------
@@ -39,6 +44,25 @@ struct SingleFireOptions {
     #[clap(env = "FIRES_DB")]
     fires_store_file: PathBuf,
 
+    /// Also write the time series of the fire's power, area, and temperature to this CSV file.
+    ///
+    /// This comes from the rollup connectfire keeps for every fire, so it is fast even for large
+    /// fires with a lot of mergers. It covers the whole fire this one was merged into, if any.
+    #[clap(short, long)]
+    time_series: Option<PathBuf>,
+
+    /// How much detail to show for each hour of the fire, pixels, outlines, or centroids.
+    #[clap(short, long)]
+    #[clap(default_value = "pixels")]
+    detail: KmlDetail,
+
+    /// Split the output into a document for every this many hours.
+    ///
+    /// The documents are linked from the root document in the KMZ file and only loaded by Google
+    /// Earth when they are in the time range shown, so very long lived fires can be opened.
+    #[clap(long)]
+    chunk_hours: Option<i64>,
+
     /// Verbose output
     #[clap(short, long)]
     verbose: bool,
@@ -53,6 +77,13 @@ impl Display for SingleFireOptions {
             self.clusters_store_file.display()
         )?;
         writeln!(f, "  Fires Database: {}", self.fires_store_file.display())?;
+        if let Some(ref time_series) = self.time_series {
+            writeln!(f, "     Time Series: {}", time_series.display())?;
+        }
+        writeln!(f, "          Detail: {}", self.detail.name())?;
+        if let Some(hours) = self.chunk_hours {
+            writeln!(f, "     Chunk Hours: {}", hours)?;
+        }
         writeln!(f, "\n")?; // yes, two blank lines.
 
         Ok(())
@@ -65,6 +96,10 @@ impl Display for SingleFireOptions {
 fn parse_args() -> SatFireResult<SingleFireOptions> {
     let opts = SingleFireOptions::parse();
 
+    if opts.chunk_hours.map(|h| h <= 0).unwrap_or(false) {
+        return Err("The chunk size must be greater than zero.".into());
+    }
+
     if opts.verbose {
         info!(target:"startup", "{}", opts);
     }
@@ -80,81 +115,189 @@ fn main() -> SatFireResult<()> {
 
     let opts = parse_args()?;
 
+    if let Some(ref time_series) = opts.time_series {
+        save_time_series(&opts.fires_store_file, opts.fire_id, time_series)?;
+    }
+
     let dbs =
         JointFiresClusterDatabases::connect(&opts.clusters_store_file, &opts.fires_store_file)?;
 
     let mut query = dbs.single_fire_query()?;
 
+    let hours = hours_of_fire(query.run(opts.fire_id)?.filter_map(Result::ok));
+
     //
     // Output the KMZ
     //
-    let mut kfile = KmzFile::new(&opts.kmz_file)?;
-
-    kfile.start_style(Some("fire"))?;
-    kfile.create_icon_style(None, 0.0)?;
-    kfile.finish_style()?;
-
-    let mut description = String::new();
-    let mut hour_of_data = Vec::new();
-    let mut current_hour_ts = 0;
-
-    for group in query
-        .run(opts.fire_id)?
-        .filter_map(Result::ok)
-        .filter_map(|cluster| {
-            // Works because satellite times are all after 1970
-            let mut cluster_hour_ts = cluster.start.timestamp();
-            cluster_hour_ts -= cluster_hour_ts % 3_600;
-
-            if current_hour_ts != cluster_hour_ts {
-                let mut to_ret = Vec::with_capacity(hour_of_data.len());
-                std::mem::swap(&mut to_ret, &mut hour_of_data);
-
-                hour_of_data.push(cluster);
-                current_hour_ts = cluster_hour_ts;
-                Some(to_ret)
-            } else {
-                hour_of_data.push(cluster);
-                None
-            }
-        })
-    {
-        if !group.is_empty() {
-            let start = group[0].start;
-            let end = group.iter().last().map(|c| c.end).unwrap_or(start);
-
-            let mut max_power: f64 = -f64::INFINITY;
-            let mut max_temp: f64 = -f64::INFINITY;
-            let mut pixels = satfire::PixelList::new();
-
-            for cluster in group {
-                pixels.max_merge(&cluster.pixels);
-                max_power = max_power.max(cluster.power);
-                max_temp = max_temp.max(cluster.max_temperature);
+    let hours_per_chunk = match opts.chunk_hours {
+        Some(hours_per_chunk) => hours_per_chunk,
+        None => {
+            let mut kfile = KmzFile::new(&opts.kmz_file)?;
+            write_style(&mut kfile)?;
+
+            let mut description = String::new();
+            for hour in hours {
+                write_hour(&hour, opts.detail, &mut description, &mut kfile)?;
             }
 
-            description.clear();
-            let _ = write!(
-                &mut description,
-                concat!(
-                    "<h3>Cluster Power: {:.0}MW</h3>",
-                    "<h3>Max Temperature: {:.2}&deg;K</h3>",
-                ),
-                max_power, max_temp,
-            );
-
-            let Coord { lat, lon } = pixels.centroid();
-
-            kfile.start_folder(None, None, false)?;
-            kfile.timespan(start, end)?;
-
-            kfile.start_placemark(None, Some(&description), Some("#fire"))?;
-            kfile.create_point(lat, lon, 0.0)?;
-            kfile.finish_placemark()?;
-            pixels.kml_write(&mut kfile);
-            kfile.finish_folder()?;
+            return Ok(());
+        }
+    };
+
+    let hours: Vec<HourOfFire> = hours.collect();
+    let (first, last) = match (hours.first(), hours.last()) {
+        (Some(first), Some(last)) => (first.start, last.end),
+        _ => return Err(format!("No clusters found for fire {}", opts.fire_id).into()),
+    };
+
+    // A single fire is small enough to show at any zoom, so the chunks are only split by time.
+    let area = hours[0].pixels.bounding_box();
+    let mut chunks = KmlChunk::split(first, last, area, Some(hours_per_chunk), None);
+    for chunk in &mut chunks {
+        chunk.region = None;
+    }
+    let hours = &hours;
+
+    write_chunked_kmz(&opts.kmz_file, &chunks, |chunk, kml| {
+        write_style(kml)?;
+
+        // The last chunk also gets anything that started right at the end.
+        let start = hours.partition_point(|hour| hour.start < chunk.start);
+        let end = if chunk.end >= last {
+            hours.len()
+        } else {
+            hours.partition_point(|hour| hour.start < chunk.end)
+        };
+
+        let mut description = String::new();
+        for hour in &hours[start..end] {
+            write_hour(hour, opts.detail, &mut description, kml)?;
+        }
+
+        Ok(())
+    })
+}
+
+/// The clusters from an hour of a fire, merged together.
+struct HourOfFire {
+    start: DateTime<Utc>,
+    end: DateTime<Utc>,
+    max_power: f64,
+    max_temperature: f64,
+    pixels: PixelList,
+}
+
+/// Merge the clusters of a fire, in order of scan start, into hours.
+fn hours_of_fire<I>(clusters: I) -> impl Iterator<Item = HourOfFire>
+where
+    I: Iterator<Item = ClusterDatabaseClusterRow>,
+{
+    let mut clusters = clusters.peekable();
+
+    std::iter::from_fn(move || {
+        let first = clusters.next()?;
+
+        // Works because satellite times are all after 1970
+        let hour_ts = |cluster: &ClusterDatabaseClusterRow| {
+            let ts = cluster.start.timestamp();
+            ts - ts % 3_600
+        };
+        let current_hour_ts = hour_ts(&first);
+
+        let mut hour = HourOfFire {
+            start: first.start,
+            end: first.end,
+            max_power: first.power,
+            max_temperature: first.max_temperature,
+            pixels: first.pixels,
+        };
+
+        while let Some(cluster) = clusters.next_if(|c| hour_ts(c) == current_hour_ts) {
+            hour.pixels.max_merge(&cluster.pixels);
+            hour.end = cluster.end;
+            hour.max_power = hour.max_power.max(cluster.power);
+            hour.max_temperature = hour.max_temperature.max(cluster.max_temperature);
+        }
+
+        Some(hour)
+    })
+}
+
+fn write_style<K: KmlWriter>(kml: &mut K) -> SatFireResult<()> {
+    kml.start_style(Some("fire"))?;
+    kml.create_icon_style(None, 0.0)?;
+    kml.create_poly_style(Some("880000FF"), true, true)?;
+    kml.finish_style()
+}
+
+fn write_hour<K: KmlWriter>(
+    hour: &HourOfFire,
+    detail: KmlDetail,
+    description: &mut String,
+    kml: &mut K,
+) -> SatFireResult<()> {
+    description.clear();
+    let _ = write!(
+        description,
+        concat!(
+            "<h3>Cluster Power: {:.0}MW</h3>",
+            "<h3>Max Temperature: {:.2}&deg;K</h3>",
+        ),
+        hour.max_power, hour.max_temperature,
+    );
+
+    let Coord { lat, lon } = hour.pixels.centroid();
+
+    kml.start_folder(None, None, false)?;
+    kml.timespan(hour.start, hour.end)?;
+
+    kml.start_placemark(None, Some(description), Some("#fire"))?;
+    kml.create_point(lat, lon, 0.0)?;
+    kml.finish_placemark()?;
+
+    match detail {
+        KmlDetail::Pixels => hour.pixels.kml_write(kml),
+        KmlDetail::Outlines => {
+            kml.start_placemark(None, None, Some("#fire"))?;
+            kml.create_outline(&hour.pixels.bounding_box())?;
+            kml.finish_placemark()?;
         }
+        KmlDetail::Centroids => {}
+    }
+
+    kml.finish_folder()
+}
+
+/// Save the time series of a fire from the fires database to a CSV file.
+fn save_time_series(fires_store_file: &Path, fire_id: u64, path: &Path) -> SatFireResult<()> {
+    let rows = FiresDatabase::connect(fires_store_file)?.fire_time_series(fire_id)?;
+
+    if rows.is_empty() {
+        info!(target: "time-series", "No time series for fire {}, was it added by an older connectfire?", fire_id);
     }
 
+    let mut out = BufWriter::new(std::fs::File::create(path)?);
+    writeln!(
+        out,
+        "root_id,sector,scan_start,scan_end,power_mw,area_m2,max_temperature_k,num_clusters"
+    )?;
+
+    for row in rows {
+        writeln!(
+            out,
+            "{},{},{},{},{:.1},{:.0},{:.1},{}",
+            row.root_id,
+            row.sector.name(),
+            row.start.format("%Y-%m-%dT%H:%M:%SZ"),
+            row.end.format("%Y-%m-%dT%H:%M:%SZ"),
+            row.power,
+            row.area,
+            row.max_temperature,
+            row.num_clusters
+        )?;
+    }
+
+    out.flush()?;
+
     Ok(())
 }
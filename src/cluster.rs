@@ -1,13 +1,21 @@
 use crate::{
     end_time_from_file_name,
-    firesatimage::{FirePoint, SatFireImage},
+    firesatimage::{FirePoint, FirePointBuffers, SatFireImage},
     geo::{BoundingBox, Coord, Geo},
     pixel::PixelList,
     satellite::{Satellite, Sector},
     start_time_from_file_name, SatFireResult,
 };
-use chrono::{DateTime, Utc};
-use std::path::Path;
+use chrono::{DateTime, NaiveDateTime, Utc};
+use rustc_hash::FxHashMap as HashMap;
+use std::{
+    io::{Read, Write},
+    path::Path,
+};
+use strum::IntoEnumIterator;
+
+mod worker;
+pub use worker::{run_cluster_list_worker, ClusterListWorker};
 
 /** Represents a spatially contiguous cluster of [Pixel](crate::Pixel) objects.
  *
@@ -93,6 +101,14 @@ impl Cluster {
         &self.pixels
     }
 
+    /// Create an empty Cluster with room for a number of pixels.
+    fn with_capacity(num_pixels: usize) -> Self {
+        Cluster {
+            pixels: PixelList::with_capacity(num_pixels),
+            ..Cluster::default()
+        }
+    }
+
     /// Add a fire point to this Cluster.
     fn add_fire_point(&mut self, fire_point: FirePoint) {
         let FirePoint { pixel, .. } = fire_point;
@@ -142,6 +158,23 @@ pub struct ClusterList {
 }
 
 impl ClusterList {
+    /// Create a new ClusterList from clusters that were already found.
+    pub fn new(
+        satellite: Satellite,
+        sector: Sector,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        clusters: Vec<Cluster>,
+    ) -> Self {
+        ClusterList {
+            satellite,
+            sector,
+            start,
+            end,
+            clusters,
+        }
+    }
+
     /// Get the name of the satellite.
     pub fn satellite(&self) -> Satellite {
         self.satellite
@@ -210,11 +243,105 @@ impl ClusterList {
             .fold(0.0, |acc, cluster| acc + cluster.power)
     }
 
+    /// Serialize this ClusterList into an array of bytes.
+    ///
+    /// This is used to pass a ClusterList between processes, it is not meant for long term
+    /// storage.
+    pub fn binary_serialize(&self) -> Vec<u8> {
+        let mut output = Vec::new();
+        self.binary_serialize_into(&mut output);
+        output
+    }
+
+    /// Append the binary format from [ClusterList::binary_serialize] to a buffer.
+    pub fn binary_serialize_into(&self, output: &mut Vec<u8>) {
+        // Ignore write errors since we're writing to a Vec<u8>
+        let sat_idx = Satellite::iter().position(|s| s == self.satellite).unwrap() as u8;
+        let sector_idx = Sector::iter().position(|s| s == self.sector).unwrap() as u8;
+
+        let _ = output.write_all(&[sat_idx, sector_idx]);
+        let _ = output.write_all(&self.start.timestamp().to_le_bytes());
+        let _ = output.write_all(&self.end.timestamp().to_le_bytes());
+        let _ = output.write_all(&self.clusters.len().to_le_bytes());
+
+        for cluster in &self.clusters {
+            let _ = output.write_all(&cluster.power.to_le_bytes());
+            let _ = output.write_all(&cluster.area.to_le_bytes());
+            let _ = output.write_all(&cluster.max_temp.to_le_bytes());
+            let _ = output.write_all(&cluster.max_scan_angle.to_le_bytes());
+            cluster.pixels.binary_serialize_into(output);
+        }
+    }
+
+    /// Deserialize an array of bytes created by [ClusterList::binary_serialize].
+    pub fn binary_deserialize<R: Read>(r: &mut R) -> SatFireResult<Self> {
+        let mut buf: [u8; 2] = [0; 2];
+        r.read_exact(&mut buf)?;
+
+        let satellite = Satellite::iter()
+            .nth(buf[0] as usize)
+            .ok_or_else(|| "Invalid satellite".to_string())?;
+        let sector = Sector::iter()
+            .nth(buf[1] as usize)
+            .ok_or_else(|| "Invalid sector".to_string())?;
+
+        let mut buf: [u8; 8] = [0; 8];
+        let mut read_time = || -> SatFireResult<DateTime<Utc>> {
+            r.read_exact(&mut buf)?;
+            let naive = NaiveDateTime::from_timestamp_opt(i64::from_le_bytes(buf), 0)
+                .ok_or_else(|| "Invalid time stamp".to_string())?;
+            Ok(DateTime::<Utc>::from_utc(naive, Utc))
+        };
+
+        let start = read_time()?;
+        let end = read_time()?;
+
+        let mut buf: [u8; std::mem::size_of::<usize>()] = [0; std::mem::size_of::<usize>()];
+        r.read_exact(&mut buf)?;
+        let num_clusters = usize::from_le_bytes(buf);
+
+        let mut clusters = Vec::with_capacity(num_clusters);
+        let mut buf: [u8; 8] = [0; 8];
+        for _ in 0..num_clusters {
+            let mut read_f64 = || -> SatFireResult<f64> {
+                r.read_exact(&mut buf)?;
+                Ok(f64::from_le_bytes(buf))
+            };
+
+            let power = read_f64()?;
+            let area = read_f64()?;
+            let max_temp = read_f64()?;
+            let max_scan_angle = read_f64()?;
+            let pixels = PixelList::binary_deserialize(r);
+
+            clusters.push(Cluster::new(power, area, max_temp, max_scan_angle, pixels));
+        }
+
+        Ok(ClusterList {
+            satellite,
+            sector,
+            start,
+            end,
+            clusters,
+        })
+    }
+
     /// Analyze a file and return a ClusterList.
     ///
     /// The metadata is gleaned from the file name, so this program relies on the current naming
     /// conventions of the NOAA big data program.
     pub fn from_file<P: AsRef<Path>>(full_path: P) -> SatFireResult<ClusterList> {
+        Self::from_file_with_buffers(full_path, &mut ClusterListBuffers::default())
+    }
+
+    /// The same as [ClusterList::from_file], but with working space that is kept between files.
+    ///
+    /// A thread loading many files should keep one [ClusterListBuffers] and pass it to every call,
+    /// so it isn't allocating and freeing the same large buffers for each file.
+    pub fn from_file_with_buffers<P: AsRef<Path>>(
+        full_path: P,
+        buffers: &mut ClusterListBuffers,
+    ) -> SatFireResult<ClusterList> {
         let path: &Path = full_path.as_ref();
         let fname = path
             .file_name()
@@ -231,8 +358,8 @@ impl ClusterList {
         let end = end_time_from_file_name(&fname).ok_or_else(|| "No end time".to_string())?;
 
         let fdata = SatFireImage::open(path)?;
-        let points = fdata.extract_fire_points()?;
-        let clusters: Vec<Cluster> = clusters_from_fire_points(points);
+        fdata.extract_fire_points_into(satellite, sector, &mut buffers.fire_points)?;
+        let clusters = buffers.clusters.clusters_from(&buffers.fire_points.points);
 
         Ok(ClusterList {
             satellite,
@@ -244,53 +371,264 @@ impl ClusterList {
     }
 }
 
-fn clusters_from_fire_points(mut points: Vec<FirePoint>) -> Vec<Cluster> {
-    let mut clusters: Vec<Cluster> = vec![];
-    let mut cluster_points: Vec<FirePoint> = Vec::with_capacity(20);
+/// Working space for [ClusterList::from_file_with_buffers].
+#[derive(Debug, Default)]
+pub struct ClusterListBuffers {
+    fire_points: FirePointBuffers,
+    clusters: ClusterBuffers,
+}
 
-    for i in 0..points.len() {
-        let fp = unsafe { points.get_unchecked_mut(i) };
+/// Group fire points into clusters of 8-connected pixels.
+///
+/// This is a union-find over the grid locations of the points, so it runs in (nearly) linear time
+/// in the number of points. The clusters are ordered by their first point in `points`, and the
+/// pixels in each cluster keep their order from `points`.
+pub fn clusters_from_fire_points(points: Vec<FirePoint>) -> Vec<Cluster> {
+    ClusterBuffers::default().clusters_from(&points)
+}
 
-        if fp.x == isize::MIN && fp.y == isize::MIN {
-            continue;
+/// Working space for [clusters_from_fire_points].
+#[derive(Debug, Default)]
+struct ClusterBuffers {
+    locations: HashMap<(isize, isize), usize>,
+    sets: DisjointSet,
+    /// The cluster each root of `sets` belongs to, `usize::MAX` if it doesn't have one yet.
+    cluster_for_root: Vec<usize>,
+    /// The cluster each point belongs to.
+    cluster_for_point: Vec<usize>,
+    /// The number of points in each cluster.
+    sizes: Vec<usize>,
+}
+
+impl ClusterBuffers {
+    fn clusters_from(&mut self, points: &[FirePoint]) -> Vec<Cluster> {
+        self.locations.clear();
+        self.locations.extend(
+            points
+                .iter()
+                .enumerate()
+                .map(|(idx, fp)| ((fp.x, fp.y), idx)),
+        );
+
+        self.sets.reset(points.len());
+        for (idx, fp) in points.iter().enumerate() {
+            // Only look at half the neighbors, the other half will look back at this point.
+            for (dx, dy) in [(-1, 0), (-1, -1), (0, -1), (1, -1)] {
+                if let Some(&other) = self.locations.get(&(fp.x + dx, fp.y + dy)) {
+                    self.sets.union(idx, other);
+                }
+            }
         }
 
-        cluster_points.push(*fp);
+        // Number the clusters and count their pixels first, so each cluster's pixels are
+        // allocated once at the right size.
+        self.cluster_for_root.clear();
+        self.cluster_for_root.resize(points.len(), usize::MAX);
+        self.cluster_for_point.clear();
+        self.sizes.clear();
+        for idx in 0..points.len() {
+            let root = self.sets.find(idx);
+            if self.cluster_for_root[root] == usize::MAX {
+                self.cluster_for_root[root] = self.sizes.len();
+                self.sizes.push(0);
+            }
 
-        fp.x = isize::MIN;
-        fp.y = isize::MIN;
+            let cluster_idx = self.cluster_for_root[root];
+            self.sizes[cluster_idx] += 1;
+            self.cluster_for_point.push(cluster_idx);
+        }
 
-        for j in (i + 1)..points.len() {
-            let candidate = unsafe { points.get_unchecked_mut(j) };
+        let mut clusters: Vec<Cluster> = self
+            .sizes
+            .iter()
+            .map(|&size| Cluster::with_capacity(size))
+            .collect();
 
-            if candidate.x == isize::MIN && candidate.y == isize::MIN {
-                continue;
-            }
+        for (fp, &cluster_idx) in points.iter().zip(&self.cluster_for_point) {
+            clusters[cluster_idx].add_fire_point(*fp);
+        }
 
-            let mut adjacent = false;
-            for cluster_point in &cluster_points {
-                let dx = (cluster_point.x - candidate.x).abs();
-                let dy = (cluster_point.y - candidate.y).abs();
+        clusters
+    }
+}
 
-                if dx <= 1 && dy <= 1 {
-                    adjacent = true;
-                    break;
-                }
-            }
+/// A union-find structure over the indexes 0..n.
+#[derive(Debug, Default)]
+pub(crate) struct DisjointSet {
+    parents: Vec<usize>,
+    ranks: Vec<u8>,
+}
+
+impl DisjointSet {
+    pub(crate) fn new(n: usize) -> Self {
+        DisjointSet {
+            parents: (0..n).collect(),
+            ranks: vec![0; n],
+        }
+    }
+
+    /// Start over with every index in its own set, keeping the memory.
+    pub(crate) fn reset(&mut self, n: usize) {
+        self.parents.clear();
+        self.parents.extend(0..n);
+        self.ranks.clear();
+        self.ranks.resize(n, 0);
+    }
+
+    pub(crate) fn find(&mut self, mut idx: usize) -> usize {
+        while self.parents[idx] != idx {
+            // Path halving
+            self.parents[idx] = self.parents[self.parents[idx]];
+            idx = self.parents[idx];
+        }
+
+        idx
+    }
 
-            if adjacent {
-                cluster_points.push(*candidate);
-                candidate.x = isize::MIN;
-                candidate.y = isize::MIN;
+    pub(crate) fn union(&mut self, a: usize, b: usize) {
+        let (a, b) = (self.find(a), self.find(b));
+        if a == b {
+            return;
+        }
+
+        match self.ranks[a].cmp(&self.ranks[b]) {
+            std::cmp::Ordering::Less => self.parents[a] = b,
+            std::cmp::Ordering::Greater => self.parents[b] = a,
+            std::cmp::Ordering::Equal => {
+                self.parents[b] = a;
+                self.ranks[a] += 1;
             }
         }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::{
+        pixel::Pixel,
+        satellite::{DataQualityFlagCode, MaskCode},
+    };
+
+    fn test_pixel(power: f64) -> Pixel {
+        Pixel {
+            ul: Coord {
+                lat: 45.0,
+                lon: -120.0,
+            },
+            ll: Coord {
+                lat: 44.0,
+                lon: -120.0,
+            },
+            lr: Coord {
+                lat: 44.0,
+                lon: -119.0,
+            },
+            ur: Coord {
+                lat: 45.0,
+                lon: -119.0,
+            },
+            power,
+            area: 2.5,
+            temperature: 350.0,
+            scan_angle: 6.0,
+            mask_flag: MaskCode(10),
+            data_quality_flag: DataQualityFlagCode(0),
+        }
+    }
+
+    #[test]
+    fn test_clusters_from_fire_points() {
+        // Two clusters, the first is U shaped so it can't be found in a single forward sweep.
+        //
+        //   X . X . .
+        //   X X X . X
+        //   . . . . X
+        let locations = [(0, 0), (2, 0), (0, 1), (1, 1), (2, 1), (4, 1), (4, 2)];
 
-        let mut curr_clust = Cluster::default();
-        cluster_points
-            .drain(..)
-            .for_each(|cp| curr_clust.add_fire_point(cp));
-        clusters.push(curr_clust);
+        let points: Vec<FirePoint> = locations
+            .iter()
+            .enumerate()
+            .map(|(idx, &(x, y))| FirePoint {
+                pixel: test_pixel(idx as f64),
+                x,
+                y,
+            })
+            .collect();
+
+        let clusters = clusters_from_fire_points(points);
+        assert_eq!(clusters.len(), 2);
+
+        let powers = |cluster: &Cluster| -> Vec<f64> {
+            cluster.pixels().pixels().iter().map(|p| p.power).collect()
+        };
+
+        assert_eq!(powers(&clusters[0]), vec![0.0, 1.0, 2.0, 3.0, 4.0]);
+        assert_eq!(powers(&clusters[1]), vec![5.0, 6.0]);
+        assert_eq!(clusters[0].total_power(), 10.0);
+        assert_eq!(clusters[1].total_power(), 11.0);
+    }
+
+    #[test]
+    fn test_reused_cluster_buffers() {
+        let points = |locations: &[(isize, isize)]| -> Vec<FirePoint> {
+            locations
+                .iter()
+                .map(|&(x, y)| FirePoint {
+                    pixel: test_pixel(1.0),
+                    x,
+                    y,
+                })
+                .collect()
+        };
+
+        let big = points(&[(0, 0), (1, 0), (5, 5), (6, 6), (9, 0), (9, 1), (9, 2)]);
+        let small = points(&[(3, 3), (3, 4)]);
+
+        let mut buffers = ClusterBuffers::default();
+        let sizes = |clusters: Vec<Cluster>| -> Vec<usize> {
+            clusters.iter().map(|c| c.pixel_count()).collect()
+        };
+
+        assert_eq!(sizes(buffers.clusters_from(&big)), vec![2, 2, 3]);
+        assert_eq!(sizes(buffers.clusters_from(&small)), vec![2]);
+        assert_eq!(sizes(buffers.clusters_from(&[])), Vec::<usize>::new());
+        assert_eq!(sizes(buffers.clusters_from(&big)), vec![2, 2, 3]);
     }
 
-    clusters
+    #[test]
+    fn test_binary_round_trip() {
+        let fname = "OR_ABI-L2-FDCC-M6_G17_s20212451201177_e20212451203550_c20212451204136.nc";
+
+        let pixel = test_pixel(1.5);
+
+        let mut pixels = PixelList::new();
+        pixels.push(pixel);
+        pixels.push(pixel);
+
+        let clist = ClusterList {
+            satellite: Satellite::G17,
+            sector: Sector::CONUS,
+            start: start_time_from_file_name(fname).unwrap(),
+            end: end_time_from_file_name(fname).unwrap(),
+            clusters: vec![Cluster::new(3.0, 5.0, 350.0, 6.0, pixels)],
+        };
+
+        let buf = clist.binary_serialize();
+        let clist2 = ClusterList::binary_deserialize(&mut buf.as_slice()).unwrap();
+
+        assert_eq!(clist.satellite(), clist2.satellite());
+        assert_eq!(clist.sector(), clist2.sector());
+        assert_eq!(clist.scan_start(), clist2.scan_start());
+        assert_eq!(clist.scan_end(), clist2.scan_end());
+        assert_eq!(clist2.len(), 1);
+
+        let (c1, c2) = (&clist.clusters()[0], &clist2.clusters()[0]);
+        assert_eq!(c1.total_power(), c2.total_power());
+        assert_eq!(c1.total_area(), c2.total_area());
+        assert_eq!(c1.max_temperature(), c2.max_temperature());
+        assert_eq!(c1.max_scan_angle(), c2.max_scan_angle());
+        assert_eq!(c2.pixel_count(), 2);
+        assert!(c1.pixels().pixels()[0].approx_equal(&c2.pixels().pixels()[0], 1.0e-12));
+    }
 }
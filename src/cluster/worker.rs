@@ -0,0 +1,189 @@
+//! Decode satellite files into [ClusterList]s in a separate process.
+//!
+//! The NetCDF library is not thread safe, so every call into it in this process is serialized on a
+//! global lock. Loading files on several threads of one process doesn't help much because they
+//! spend almost all their time waiting on each other. Each worker process has its own copy of the
+//! NetCDF library, so running several of them scales with the number of cores.
+//!
+//! The protocol between the parent and the worker is very simple. The parent writes a length
+//! prefixed path to the worker's standard input, and the worker replies on standard output with a
+//! status byte, followed by a length prefixed payload. The payload is either a serialized
+//! [ClusterList] or an error message.
+
+use super::{ClusterList, ClusterListBuffers};
+use crate::SatFireResult;
+use simple_logger::SimpleLogger;
+use std::{
+    ffi::{OsStr, OsString},
+    fs::File,
+    io::{BufReader, BufWriter, Read, Write},
+    os::unix::{ffi::OsStrExt, io::FromRawFd},
+    path::Path,
+    process::{Child, ChildStdin, ChildStdout, Command, Stdio},
+};
+
+const STATUS_OK: u8 = 0;
+const STATUS_ERR: u8 = 1;
+
+/// A handle to a worker process that loads [ClusterList]s from files.
+///
+/// The worker process is the current executable started with the provided arguments. The program
+/// must check for those arguments at startup and call [run_cluster_list_worker] when it sees them.
+#[derive(Debug)]
+pub struct ClusterListWorker {
+    args: Vec<OsString>,
+    child: Child,
+    /// This is only `None` while the worker is being shut down.
+    to_worker: Option<BufWriter<ChildStdin>>,
+    from_worker: BufReader<ChildStdout>,
+}
+
+impl ClusterListWorker {
+    /// Start a new worker process.
+    pub fn spawn<I, S>(args: I) -> SatFireResult<Self>
+    where
+        I: IntoIterator<Item = S>,
+        S: AsRef<OsStr>,
+    {
+        let args: Vec<OsString> = args.into_iter().map(|a| a.as_ref().to_owned()).collect();
+
+        let mut child = Command::new(std::env::current_exe()?)
+            .args(&args)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .stderr(Stdio::inherit())
+            .spawn()?;
+
+        let to_worker = Some(BufWriter::new(
+            child.stdin.take().ok_or("No stdin for worker")?,
+        ));
+        let from_worker = BufReader::new(child.stdout.take().ok_or("No stdout for worker")?);
+
+        Ok(ClusterListWorker {
+            args,
+            child,
+            to_worker,
+            from_worker,
+        })
+    }
+
+    /// Analyze a file and return a ClusterList, the same as [ClusterList::from_file].
+    ///
+    /// If the worker process died, for instance because of a corrupt file, it is restarted before
+    /// the error is returned so the worker can be used for the next file.
+    pub fn load<P: AsRef<Path>>(&mut self, path: P) -> SatFireResult<ClusterList> {
+        match self.request(path.as_ref()) {
+            Ok(result) => result,
+            Err(err) => {
+                let _ = self.child.kill();
+                *self = Self::spawn(&self.args)?;
+                Err(format!("worker process failed: {}", err).into())
+            }
+        }
+    }
+
+    /// Send a request to the worker, the outer result is for communication errors.
+    fn request(&mut self, path: &Path) -> SatFireResult<SatFireResult<ClusterList>> {
+        let to_worker = self.to_worker.as_mut().ok_or("Worker shut down")?;
+        write_message(to_worker, path.as_os_str().as_bytes())?;
+        to_worker.flush()?;
+
+        let mut status: [u8; 1] = [0];
+        self.from_worker.read_exact(&mut status)?;
+        let payload = read_message(&mut self.from_worker)?;
+
+        match status[0] {
+            STATUS_OK => Ok(ClusterList::binary_deserialize(&mut payload.as_slice())),
+            STATUS_ERR => Ok(Err(String::from_utf8_lossy(&payload).into_owned().into())),
+            _ => Err("Invalid status from worker".into()),
+        }
+    }
+}
+
+impl Drop for ClusterListWorker {
+    fn drop(&mut self) {
+        // Closing standard input tells the worker there is nothing left to do.
+        drop(self.to_worker.take());
+        let _ = self.child.wait();
+    }
+}
+
+/// Run the worker side of a [ClusterListWorker].
+///
+/// This reads paths from standard input until it is closed, and replies on standard output.
+///
+/// SIGINT and SIGTERM are ignored. They also reach the workers when the parent is stopped from a
+/// terminal or by a service manager, and the parent finishes the files in flight before it closes
+/// standard input to stop them.
+///
+/// This sets up the logger, so warnings from loading files show up on standard error like the
+/// parent's do.
+pub fn run_cluster_list_worker() -> SatFireResult<()> {
+    unsafe {
+        libc::signal(libc::SIGINT, libc::SIG_IGN);
+        libc::signal(libc::SIGTERM, libc::SIG_IGN);
+    }
+
+    // The logger prints to standard output, so keep the replies on a copy of it and send anything
+    // else printed there to standard error instead.
+    let replies = unsafe {
+        let fd = libc::dup(libc::STDOUT_FILENO);
+        if fd < 0 || libc::dup2(libc::STDERR_FILENO, libc::STDOUT_FILENO) < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+        File::from_raw_fd(fd)
+    };
+
+    SimpleLogger::new().init()?;
+
+    let stdin = std::io::stdin();
+    let mut input = BufReader::new(stdin.lock());
+    let mut output = BufWriter::new(replies);
+
+    // Keep the working space and the reply buffer between files.
+    let mut buffers = ClusterListBuffers::default();
+    let mut reply = vec![];
+
+    loop {
+        let path = match read_message(&mut input) {
+            Ok(path) => path,
+            Err(err) if err.kind() == std::io::ErrorKind::UnexpectedEof => break,
+            Err(err) => return Err(err.into()),
+        };
+
+        let path = Path::new(OsStr::from_bytes(&path));
+
+        match ClusterList::from_file_with_buffers(path, &mut buffers) {
+            Ok(clist) => {
+                reply.clear();
+                clist.binary_serialize_into(&mut reply);
+
+                output.write_all(&[STATUS_OK])?;
+                write_message(&mut output, &reply)?;
+            }
+            Err(err) => {
+                output.write_all(&[STATUS_ERR])?;
+                write_message(&mut output, err.to_string().as_bytes())?;
+            }
+        }
+
+        output.flush()?;
+    }
+
+    Ok(())
+}
+
+fn write_message<W: Write>(w: &mut W, msg: &[u8]) -> std::io::Result<()> {
+    w.write_all(&(msg.len() as u64).to_le_bytes())?;
+    w.write_all(msg)
+}
+
+fn read_message<R: Read>(r: &mut R) -> std::io::Result<Vec<u8>> {
+    let mut buf: [u8; 8] = [0; 8];
+    r.read_exact(&mut buf)?;
+
+    let mut msg = vec![0; u64::from_le_bytes(buf) as usize];
+    r.read_exact(&mut msg)?;
+
+    Ok(msg)
+}
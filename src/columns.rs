@@ -0,0 +1,440 @@
+//! Write clusters and fires as columns of NumPy arrays for analysis in Python.
+//!
+//! Each column is a `.npy` file in a partition directory, and the pixels of each cluster or fire
+//! are flattened into a child table in the `pixels` directory of the partition with the id of the
+//! row they belong to. The format is simple enough to write without pulling in another large
+//! dependency, and `numpy.load(path, mmap_mode="r")` reads a column straight from the page cache
+//! without parsing or copying anything.
+//!
+//! A partition is written to a temporary directory and renamed when it is complete, so a reader
+//! never sees part of one.
+
+use crate::{
+    database::ClusterDatabaseClusterRow, fire::Fire, pixel::PixelList, Geo, SatFireResult,
+};
+use std::{
+    fs::File,
+    io::{BufWriter, Seek, SeekFrom, Write},
+    marker::PhantomData,
+    path::{Path, PathBuf},
+};
+
+/// The size of the header of every column file, the shape of the array is filled in when the
+/// column is finished so space is left for any length.
+const NPY_HEADER_SIZE: usize = 128;
+
+/// A type that can be stored in a column.
+pub trait NpyValue: Copy {
+    /// The NumPy type description, like `<f8`.
+    fn descr() -> String;
+
+    fn write_le<W: Write>(&self, out: &mut W) -> std::io::Result<()>;
+}
+
+macro_rules! npy_number {
+    ($type:ty, $descr:expr) => {
+        impl NpyValue for $type {
+            fn descr() -> String {
+                $descr.to_string()
+            }
+
+            fn write_le<W: Write>(&self, out: &mut W) -> std::io::Result<()> {
+                out.write_all(&self.to_le_bytes())
+            }
+        }
+    };
+}
+
+npy_number!(i16, "<i2");
+npy_number!(i64, "<i8");
+npy_number!(f32, "<f4");
+npy_number!(f64, "<f8");
+
+/// Fixed width byte strings, shorter strings are padded with nul bytes.
+impl<const N: usize> NpyValue for [u8; N] {
+    fn descr() -> String {
+        format!("|S{}", N)
+    }
+
+    fn write_le<W: Write>(&self, out: &mut W) -> std::io::Result<()> {
+        out.write_all(self)
+    }
+}
+
+/// Make a fixed width byte string, longer strings are cut off.
+fn fixed<const N: usize>(s: &str) -> [u8; N] {
+    let mut bytes = [0u8; N];
+    let len = s.len().min(N);
+    bytes[..len].copy_from_slice(&s.as_bytes()[..len]);
+    bytes
+}
+
+/// A single column of values in a `.npy` file.
+pub struct NpyColumn<T> {
+    out: BufWriter<File>,
+    len: usize,
+    values: PhantomData<T>,
+}
+
+impl<T: NpyValue> NpyColumn<T> {
+    pub fn create<P: AsRef<Path>>(path: P) -> SatFireResult<Self> {
+        let mut out = BufWriter::new(File::create(path.as_ref())?);
+        out.write_all(&npy_header(&T::descr(), 0))?;
+
+        Ok(NpyColumn {
+            out,
+            len: 0,
+            values: PhantomData,
+        })
+    }
+
+    pub fn push(&mut self, value: T) -> SatFireResult<()> {
+        value.write_le(&mut self.out)?;
+        self.len += 1;
+        Ok(())
+    }
+
+    /// Fill in the length of the column and close the file.
+    pub fn finish(mut self) -> SatFireResult<usize> {
+        self.out.seek(SeekFrom::Start(0))?;
+        self.out.write_all(&npy_header(&T::descr(), self.len))?;
+        self.out.flush()?;
+        Ok(self.len)
+    }
+}
+
+/// Create a version 1.0 `.npy` header for a one dimensional array.
+fn npy_header(descr: &str, len: usize) -> [u8; NPY_HEADER_SIZE] {
+    const MAGIC: &[u8] = b"\x93NUMPY\x01\x00";
+    const PREFIX_SIZE: usize = 10;
+
+    let mut header = [b' '; NPY_HEADER_SIZE];
+    header[..MAGIC.len()].copy_from_slice(MAGIC);
+    header[8..PREFIX_SIZE].copy_from_slice(&((NPY_HEADER_SIZE - PREFIX_SIZE) as u16).to_le_bytes());
+
+    let dict = format!(
+        "{{'descr': '{}', 'fortran_order': False, 'shape': ({},), }}",
+        descr, len
+    );
+    debug_assert!(PREFIX_SIZE + dict.len() < NPY_HEADER_SIZE);
+    header[PREFIX_SIZE..(PREFIX_SIZE + dict.len())].copy_from_slice(dict.as_bytes());
+    header[NPY_HEADER_SIZE - 1] = b'\n';
+
+    header
+}
+
+/// The pixels of the clusters or fires in a partition.
+struct PixelColumns {
+    parent_id: NpyColumn<i64>,
+    corners: [NpyColumn<f32>; 8],
+    power: NpyColumn<f32>,
+    area: NpyColumn<f32>,
+    temperature: NpyColumn<f32>,
+    scan_angle: NpyColumn<f32>,
+    mask_flag: NpyColumn<i16>,
+    data_quality_flag: NpyColumn<i16>,
+}
+
+impl PixelColumns {
+    /// The corners, in the order they are stored.
+    const CORNERS: [&'static str; 8] = [
+        "ul_lat", "ul_lon", "ll_lat", "ll_lon", "lr_lat", "lr_lon", "ur_lat", "ur_lon",
+    ];
+
+    fn create(dir: &Path, parent_id: &str) -> SatFireResult<Self> {
+        let dir = dir.join("pixels");
+        std::fs::create_dir_all(&dir)?;
+
+        let column = |name: &str| dir.join(name).with_extension("npy");
+
+        let mut corners = vec![];
+        for name in Self::CORNERS {
+            corners.push(NpyColumn::create(column(name))?);
+        }
+
+        Ok(PixelColumns {
+            parent_id: NpyColumn::create(column(parent_id))?,
+            corners: corners
+                .try_into()
+                .map_err(|_| "wrong number of corner columns")?,
+            power: NpyColumn::create(column("power"))?,
+            area: NpyColumn::create(column("area"))?,
+            temperature: NpyColumn::create(column("temperature"))?,
+            scan_angle: NpyColumn::create(column("scan_angle"))?,
+            mask_flag: NpyColumn::create(column("mask_flag"))?,
+            data_quality_flag: NpyColumn::create(column("data_quality_flag"))?,
+        })
+    }
+
+    fn push(&mut self, parent_id: i64, pixels: &PixelList) -> SatFireResult<()> {
+        for pixel in pixels.pixels() {
+            self.parent_id.push(parent_id)?;
+
+            let corners = [
+                pixel.ul.lat,
+                pixel.ul.lon,
+                pixel.ll.lat,
+                pixel.ll.lon,
+                pixel.lr.lat,
+                pixel.lr.lon,
+                pixel.ur.lat,
+                pixel.ur.lon,
+            ];
+            for (column, value) in self.corners.iter_mut().zip(corners) {
+                column.push(value as f32)?;
+            }
+
+            self.power.push(pixel.power as f32)?;
+            self.area.push(pixel.area as f32)?;
+            self.temperature.push(pixel.temperature as f32)?;
+            self.scan_angle.push(pixel.scan_angle as f32)?;
+            self.mask_flag.push(pixel.mask_flag.0)?;
+            self.data_quality_flag.push(pixel.data_quality_flag.0)?;
+        }
+
+        Ok(())
+    }
+
+    fn finish(self) -> SatFireResult<usize> {
+        let len = self.parent_id.finish()?;
+        for column in self.corners {
+            column.finish()?;
+        }
+        self.power.finish()?;
+        self.area.finish()?;
+        self.temperature.finish()?;
+        self.scan_angle.finish()?;
+        self.mask_flag.finish()?;
+        self.data_quality_flag.finish()?;
+
+        Ok(len)
+    }
+}
+
+/// A partition directory that is being written.
+struct Partition {
+    tmp_dir: PathBuf,
+    dir: PathBuf,
+}
+
+impl Partition {
+    fn create(dir: &Path) -> SatFireResult<Self> {
+        let mut tmp_name = dir.file_name().ok_or("invalid partition name")?.to_owned();
+        tmp_name.push(".partial");
+        let tmp_dir = dir.with_file_name(tmp_name);
+
+        if tmp_dir.exists() {
+            std::fs::remove_dir_all(&tmp_dir)?;
+        }
+        std::fs::create_dir_all(&tmp_dir)?;
+
+        Ok(Partition {
+            tmp_dir,
+            dir: dir.to_path_buf(),
+        })
+    }
+
+    fn column(&self, name: &str) -> PathBuf {
+        self.tmp_dir.join(name).with_extension("npy")
+    }
+
+    /// Replace any old copy of the partition with the new one, or remove it if it's empty.
+    fn finish(self, len: usize) -> SatFireResult<()> {
+        if self.dir.exists() {
+            std::fs::remove_dir_all(&self.dir)?;
+        }
+
+        if len > 0 {
+            std::fs::rename(&self.tmp_dir, &self.dir)?;
+        } else {
+            std::fs::remove_dir_all(&self.tmp_dir)?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Writes the clusters in a partition as columns.
+pub struct ClusterColumns {
+    partition: Partition,
+    cluster_id: NpyColumn<i64>,
+    satellite: NpyColumn<[u8; 3]>,
+    sector: NpyColumn<[u8; 5]>,
+    start_time: NpyColumn<i64>,
+    end_time: NpyColumn<i64>,
+    lat: NpyColumn<f64>,
+    lon: NpyColumn<f64>,
+    power: NpyColumn<f64>,
+    max_temperature: NpyColumn<f64>,
+    area: NpyColumn<f64>,
+    max_scan_angle: NpyColumn<f64>,
+    pixels: PixelColumns,
+}
+
+impl ClusterColumns {
+    /// Start writing the partition in `dir`, any old copy is replaced when it is finished.
+    pub fn create<P: AsRef<Path>>(dir: P) -> SatFireResult<Self> {
+        let partition = Partition::create(dir.as_ref())?;
+
+        Ok(ClusterColumns {
+            cluster_id: NpyColumn::create(partition.column("cluster_id"))?,
+            satellite: NpyColumn::create(partition.column("satellite"))?,
+            sector: NpyColumn::create(partition.column("sector"))?,
+            start_time: NpyColumn::create(partition.column("start_time"))?,
+            end_time: NpyColumn::create(partition.column("end_time"))?,
+            lat: NpyColumn::create(partition.column("lat"))?,
+            lon: NpyColumn::create(partition.column("lon"))?,
+            power: NpyColumn::create(partition.column("power"))?,
+            max_temperature: NpyColumn::create(partition.column("max_temperature"))?,
+            area: NpyColumn::create(partition.column("area"))?,
+            max_scan_angle: NpyColumn::create(partition.column("max_scan_angle"))?,
+            pixels: PixelColumns::create(&partition.tmp_dir, "cluster_id")?,
+            partition,
+        })
+    }
+
+    pub fn push(&mut self, row: &ClusterDatabaseClusterRow) -> SatFireResult<()> {
+        let id = row.rowid as i64;
+
+        self.cluster_id.push(id)?;
+        self.satellite.push(fixed(row.sat.name()))?;
+        self.sector.push(fixed(row.sector.name()))?;
+        self.start_time.push(row.start.timestamp())?;
+        self.end_time.push(row.end.timestamp())?;
+        self.lat.push(row.centroid.lat)?;
+        self.lon.push(row.centroid.lon)?;
+        self.power.push(row.power)?;
+        self.max_temperature.push(row.max_temperature)?;
+        self.area.push(row.area)?;
+        self.max_scan_angle.push(row.scan_angle)?;
+
+        self.pixels.push(id, &row.pixels)
+    }
+
+    /// Finish writing the partition, returns the number of clusters and pixels written.
+    pub fn finish(self) -> SatFireResult<(usize, usize)> {
+        let len = self.cluster_id.finish()?;
+        self.satellite.finish()?;
+        self.sector.finish()?;
+        self.start_time.finish()?;
+        self.end_time.finish()?;
+        self.lat.finish()?;
+        self.lon.finish()?;
+        self.power.finish()?;
+        self.max_temperature.finish()?;
+        self.area.finish()?;
+        self.max_scan_angle.finish()?;
+        let num_pixels = self.pixels.finish()?;
+
+        self.partition.finish(len)?;
+
+        Ok((len, num_pixels))
+    }
+}
+
+/// Writes the fires in a partition as columns.
+pub struct FireColumns {
+    partition: Partition,
+    fire_id: NpyColumn<i64>,
+    merged_into: NpyColumn<i64>,
+    satellite: NpyColumn<[u8; 3]>,
+    first_observed: NpyColumn<i64>,
+    last_observed: NpyColumn<i64>,
+    lat: NpyColumn<f64>,
+    lon: NpyColumn<f64>,
+    max_power: NpyColumn<f64>,
+    max_temperature: NpyColumn<f64>,
+    pixels: PixelColumns,
+}
+
+impl FireColumns {
+    /// Start writing the partition in `dir`, any old copy is replaced when it is finished.
+    pub fn create<P: AsRef<Path>>(dir: P) -> SatFireResult<Self> {
+        let partition = Partition::create(dir.as_ref())?;
+
+        Ok(FireColumns {
+            fire_id: NpyColumn::create(partition.column("fire_id"))?,
+            merged_into: NpyColumn::create(partition.column("merged_into"))?,
+            satellite: NpyColumn::create(partition.column("satellite"))?,
+            first_observed: NpyColumn::create(partition.column("first_observed"))?,
+            last_observed: NpyColumn::create(partition.column("last_observed"))?,
+            lat: NpyColumn::create(partition.column("lat"))?,
+            lon: NpyColumn::create(partition.column("lon"))?,
+            max_power: NpyColumn::create(partition.column("max_power"))?,
+            max_temperature: NpyColumn::create(partition.column("max_temperature"))?,
+            pixels: PixelColumns::create(&partition.tmp_dir, "fire_id")?,
+            partition,
+        })
+    }
+
+    pub fn push(&mut self, fire: &Fire) -> SatFireResult<()> {
+        let id = fire.id() as i64;
+        let centroid = fire.centroid();
+
+        self.fire_id.push(id)?;
+        self.merged_into.push(fire.merged_into() as i64)?;
+        self.satellite.push(fixed(fire.satellite().name()))?;
+        self.first_observed
+            .push(fire.first_observed().timestamp())?;
+        self.last_observed.push(fire.last_observed().timestamp())?;
+        self.lat.push(centroid.lat)?;
+        self.lon.push(centroid.lon)?;
+        self.max_power.push(fire.max_power())?;
+        self.max_temperature.push(fire.max_temperature())?;
+
+        self.pixels.push(id, fire.try_pixels()?)
+    }
+
+    /// Finish writing the partition, returns the number of fires and pixels written.
+    pub fn finish(self) -> SatFireResult<(usize, usize)> {
+        let len = self.fire_id.finish()?;
+        self.merged_into.finish()?;
+        self.satellite.finish()?;
+        self.first_observed.finish()?;
+        self.last_observed.finish()?;
+        self.lat.finish()?;
+        self.lon.finish()?;
+        self.max_power.finish()?;
+        self.max_temperature.finish()?;
+        let num_pixels = self.pixels.finish()?;
+
+        self.partition.finish(len)?;
+
+        Ok((len, num_pixels))
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_npy_column() {
+        let path = std::env::temp_dir().join(format!("satfire-npy-{}.npy", std::process::id()));
+
+        let mut column = NpyColumn::<f64>::create(&path).unwrap();
+        for value in [1.5, -2.0, 1.0e10] {
+            column.push(value).unwrap();
+        }
+        assert_eq!(column.finish().unwrap(), 3);
+
+        let bytes = std::fs::read(&path).unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        assert_eq!(&bytes[..8], b"\x93NUMPY\x01\x00");
+        let header_len = u16::from_le_bytes([bytes[8], bytes[9]]) as usize;
+        assert_eq!((10 + header_len) % 64, 0);
+
+        let header = std::str::from_utf8(&bytes[10..(10 + header_len)]).unwrap();
+        assert!(header.starts_with("{'descr': '<f8', 'fortran_order': False, 'shape': (3,), }"));
+        assert!(header.ends_with(" \n"));
+
+        let data = &bytes[(10 + header_len)..];
+        assert_eq!(data.len(), 3 * 8);
+        assert_eq!(data[8..16], (-2.0f64).to_le_bytes());
+
+        assert_eq!(<[u8; 5]>::descr(), "|S5");
+        assert_eq!(fixed::<5>("FDCC"), *b"FDCC\0");
+        assert_eq!(fixed::<3>("G17"), *b"G17");
+    }
+}
@@ -2,6 +2,7 @@ use crate::{
     cluster::ClusterList,
     fire::{Fire, FireList},
     geo::{BoundingBox, Coord, Geo},
+    metrics::StageMetrics,
     pixel::PixelList,
     satellite::{Satellite, Sector},
     SatFireResult,
@@ -9,33 +10,129 @@ use crate::{
 use chrono::{DateTime, Duration, NaiveDateTime, Utc};
 use log::{info, warn};
 use rusqlite::{Connection, OpenFlags, ToSql};
-use rustc_hash::FxHashMap as HashMap;
-use std::path::Path;
+use rustc_hash::{FxHashMap as HashMap, FxHashSet as HashSet};
+use std::{marker::PhantomData, path::Path, sync::Arc};
+use strum::IntoEnumIterator;
+
+mod shards;
+use shards::{ShardKey, ShardSet};
 
 /// Represents a connection to the database where ALL the information related to fires is stored.
+///
+/// The database is either a single file, or a directory with one file per satellite per month.
+/// See the [shards] module for more about the directory layout.
 pub struct ClusterDatabase {
-    conn: Connection,
+    storage: Storage,
+}
+
+enum Storage {
+    File(Connection),
+    Sharded(ShardSet),
 }
 
+/// Drop the indexes on a clusters table for a bulk load.
+const DEFER_INDEXES_QUERY: &str = "
+    CREATE TABLE IF NOT EXISTS bulk_load_in_progress (started INTEGER NOT NULL);
+    INSERT INTO bulk_load_in_progress (started) VALUES (strftime('%s', 'now'));
+    DROP INDEX IF EXISTS no_cluster_dups;
+    DROP INDEX IF EXISTS file_processed;";
+
+/// The columns read by [query_row_to_cluster_row].
+const CLUSTER_ROW_COLUMNS: &str = "
+    clusters.rowid,
+    satellite,
+    sector,
+    start_time,
+    end_time,
+    power,
+    max_temperature,
+    area,
+    max_scan_angle,
+    lat,
+    lon,
+    pixels";
+
+/// The columns read by [query_row_to_cluster_summary] from a database without a spatial index.
+const CLUSTER_SUMMARY_COLUMNS: &str = "
+    clusters.rowid,
+    satellite,
+    sector,
+    start_time,
+    end_time,
+    power,
+    max_temperature,
+    area,
+    max_scan_angle,
+    lat,
+    lon,
+    NULL, NULL, NULL, NULL";
+
+/// The columns read by [query_row_to_cluster_summary] when joined with the spatial index.
+const CLUSTER_SUMMARY_INDEXED_COLUMNS: &str = "
+    clusters.rowid,
+    satellite,
+    sector,
+    start_time,
+    end_time,
+    power,
+    max_temperature,
+    area,
+    max_scan_angle,
+    lat,
+    lon,
+    clusters_rtree.min_lat,
+    clusters_rtree.max_lat,
+    clusters_rtree.min_lon,
+    clusters_rtree.max_lon";
+
 impl ClusterDatabase {
     /// Initialize a database.
     ///
     /// Initialize a database to make sure it exists and is set up properly. This should be run in
     /// the main thread before any other threads open a connection to the database to ensure
     /// consistency.
+    ///
+    /// If a bulk load with deferred indexes was interrupted, this also finishes it by building the
+    /// indexes.
     pub fn initialize<P: AsRef<Path>>(path: P) -> SatFireResult<()> {
         let path = path.as_ref();
 
-        let _conn = Self::open_database_to_write(path)?;
+        if ShardSet::is_sharded(path) {
+            // Only a bulk load defers the indexes, so without its marker there is nothing to
+            // check and the shards don't need to be opened.
+            let shards = ShardSet::new(path);
+            if shards.bulk_load_in_progress() {
+                warn!(target: "database", "Finishing an interrupted bulk load, rebuilding indexes.");
+                Self::create_deferred_shard_indexes(&shards)?;
+            }
+
+            return Ok(());
+        }
+
+        let conn = Self::open_database_to_write(path)?;
+
+        if Self::indexes_deferred(&conn)? {
+            warn!(target: "database", "Finishing an interrupted bulk load, rebuilding indexes.");
+            Self::create_deferred_indexes_in(&conn)?;
+        }
+
         Ok(())
     }
 
     /// Open a connection to the database to store clusters, wildfires, and associations.
+    ///
+    /// If `path` is an existing directory, the database is sharded by satellite and month and the
+    /// shards are opened as they are needed.
     pub fn connect<P: AsRef<Path>>(path: P) -> SatFireResult<Self> {
         let path = path.as_ref();
 
-        let conn = Self::open_database_to_write(path)?;
-        Ok(ClusterDatabase { conn })
+        let storage = if ShardSet::is_sharded(path) {
+            Storage::Sharded(ShardSet::new(path))
+        } else {
+            Storage::File(Self::open_database_to_write(path)?)
+        };
+
+        Ok(ClusterDatabase { storage })
     }
 
     fn open_database_to_write(path: &Path) -> SatFireResult<Connection> {
@@ -51,17 +148,160 @@ impl ClusterDatabase {
         const QUERY: &str = include_str!("database/create_cluster_db.sql");
         conn.execute_batch(QUERY)?;
 
+        // Needed so INSERT OR REPLACE keeps the optional spatial index up to date.
+        conn.pragma_update(None, "recursive_triggers", true)?;
+
+        if !Self::indexes_deferred(&conn)? {
+            const INDEX_QUERY: &str = include_str!("database/create_cluster_db_indexes.sql");
+            conn.execute_batch(INDEX_QUERY)?;
+        }
+
         Ok(conn)
     }
 
+    /// Check if the indexes have been dropped for a bulk load.
+    fn indexes_deferred(conn: &Connection) -> SatFireResult<bool> {
+        table_exists(conn, "bulk_load_in_progress")
+    }
+
+    /// Create the optional spatial index of cluster bounding boxes.
+    ///
+    /// Once it exists, the index is kept up to date as clusters are added and
+    /// [ClusterDatabase::query_clusters] uses it to find clusters in an area without scanning
+    /// every cluster in the time range. Any clusters already in the database are added to the
+    /// index, so this can take a while on a large database. It is safe to run more than once.
+    ///
+    /// Returns the number of clusters that were added to the index.
+    pub fn create_spatial_index(&self) -> SatFireResult<usize> {
+        match self.storage {
+            Storage::File(ref conn) => Self::create_spatial_index_in(conn),
+            Storage::Sharded(ref shards) => Ok(shards
+                .for_each(&shards.keys()?, |_, conn| {
+                    Self::create_spatial_index_in(conn)
+                })?
+                .into_iter()
+                .sum()),
+        }
+    }
+
+    fn create_spatial_index_in(conn: &Connection) -> SatFireResult<usize> {
+        const QUERY: &str = include_str!("database/create_cluster_db_rtree.sql");
+        const ADD_QUERY: &str = include_str!("database/add_cluster_rtree.sql");
+
+        conn.execute_batch(QUERY)?;
+        fill_spatial_index(conn, "clusters", "cluster_id", "clusters_rtree", ADD_QUERY)
+    }
+
+    /// Drop the indexes on the clusters table until [ClusterDatabase::create_deferred_indexes] is
+    /// called.
+    ///
+    /// Inserting into a large table is much faster without the indexes to maintain, but queries
+    /// for whether a file has already been processed are much slower. This is meant for loading a
+    /// large archive into a new or nearly empty database.
+    ///
+    /// While the indexes are deferred no other connection will recreate them. If the load is
+    /// interrupted, the next call to [ClusterDatabase::initialize] rebuilds them.
+    pub fn defer_indexes(&self) -> SatFireResult<()> {
+        match self.storage {
+            Storage::File(ref conn) => conn.execute_batch(DEFER_INDEXES_QUERY)?,
+            Storage::Sharded(ref shards) => {
+                // Shards created during the load check for this and defer their indexes too.
+                shards.start_bulk_load()?;
+                shards.for_each(&shards.keys()?, |_, conn| {
+                    Ok(conn.execute_batch(DEFER_INDEXES_QUERY)?)
+                })?;
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Rebuild the indexes dropped by [ClusterDatabase::defer_indexes].
+    ///
+    /// Duplicate clusters can't be replaced without the indexes, so they are removed first and the
+    /// most recently added copy is kept.
+    pub fn create_deferred_indexes(&self) -> SatFireResult<()> {
+        match self.storage {
+            Storage::File(ref conn) => Self::create_deferred_indexes_in(conn),
+            Storage::Sharded(ref shards) => Self::create_deferred_shard_indexes(shards),
+        }
+    }
+
+    /// The marker is removed last, so if this is interrupted the next run finishes it.
+    fn create_deferred_shard_indexes(shards: &ShardSet) -> SatFireResult<()> {
+        shards.for_each(&shards.keys()?, |_, conn| {
+            if Self::indexes_deferred(conn)? {
+                Self::create_deferred_indexes_in(conn)?;
+            }
+            Ok(())
+        })?;
+
+        shards.finish_bulk_load()
+    }
+
+    fn create_deferred_indexes_in(conn: &Connection) -> SatFireResult<()> {
+        const DEDUP_QUERY: &str = include_str!("database/remove_duplicate_clusters.sql");
+        const INDEX_QUERY: &str = include_str!("database/create_cluster_db_indexes.sql");
+
+        conn.execute("BEGIN TRANSACTION", [])?;
+        conn.execute_batch(DEDUP_QUERY)?;
+        conn.execute_batch(INDEX_QUERY)?;
+        conn.execute_batch("DROP TABLE IF EXISTS bulk_load_in_progress;")?;
+        conn.execute("COMMIT", [])?;
+
+        Ok(())
+    }
+
+    /// Rewrite any pixel BLOBs stored in an older binary format in the current format.
+    ///
+    /// Returns the number of clusters that were rewritten.
+    pub fn upgrade_pixel_format(&self) -> SatFireResult<usize> {
+        match self.storage {
+            Storage::File(ref conn) => upgrade_pixel_blobs(conn, "clusters", "cluster_id"),
+            Storage::Sharded(ref shards) => Ok(shards
+                .for_each(&shards.keys()?, |_, conn| {
+                    upgrade_pixel_blobs(conn, "clusters", "cluster_id")
+                })?
+                .into_iter()
+                .sum()),
+        }
+    }
+
     /// Find the latest valid time in the database so you can safely skip anything older.
     pub fn newest_scan_start(
         &self,
         satellite: Satellite,
         sector: Sector,
+    ) -> SatFireResult<DateTime<Utc>> {
+        match self.storage {
+            Storage::File(ref conn) => Self::newest_scan_start_in(conn, satellite, sector),
+            Storage::Sharded(ref shards) => {
+                // Almost always the newest month has data for the sector, so check one shard at a
+                // time instead of opening all of them.
+                for key in shards.keys()?.into_iter().rev() {
+                    if key.satellite() != Some(satellite) {
+                        continue;
+                    }
+
+                    if let Some(conn) = shards.open_existing(key)? {
+                        if let Ok(newest) = Self::newest_scan_start_in(&conn, satellite, sector) {
+                            return Ok(newest);
+                        }
+                    }
+                }
+
+                Err(format!("No data for {} {}", satellite, sector).into())
+            }
+        }
+    }
+
+    fn newest_scan_start_in(
+        conn: &Connection,
+        satellite: Satellite,
+        sector: Sector,
     ) -> SatFireResult<DateTime<Utc>> {
         const QUERY: &str = include_str!("database/query_newest_cluster.sql");
-        let mut stmt = self.conn.prepare(QUERY)?;
+        let mut stmt = conn.prepare(QUERY)?;
 
         let res: DateTime<Utc> = stmt.query_row(
             [
@@ -81,38 +321,221 @@ impl ClusterDatabase {
         Ok(res)
     }
 
+    /// Find the start of the last scan with clusters in an area and time range.
+    ///
+    /// This selects from the same clusters as [ClusterDatabase::query_clusters] with the same
+    /// arguments, so it is the time of the last group of rows from that query.
+    pub fn last_scan_start(
+        &self,
+        sat: Satellite,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+    ) -> SatFireResult<Option<DateTime<Utc>>> {
+        let query = format!(
+            r#"SELECT MAX(start_time)
+               FROM clusters
+               WHERE
+                 satellite = '{}' AND
+                 start_time >= {} AND
+                 end_time <= {} AND
+                 lat >= {} AND lat <= {} AND
+                 lon >= {} AND lon <= {}"#,
+            sat.name(),
+            start.timestamp(),
+            end.timestamp(),
+            area.ll.lat,
+            area.ur.lat,
+            area.ll.lon,
+            area.ur.lon,
+        );
+
+        let last_in = |conn: &Connection| -> SatFireResult<Option<i64>> {
+            Ok(conn.query_row(&query, [], |row| row.get(0))?)
+        };
+
+        let last = match self.storage {
+            Storage::File(ref conn) => last_in(conn)?,
+            Storage::Sharded(ref shards) => {
+                // The newest shard with any clusters in the range has the last one.
+                let mut last = None;
+                for key in shards.keys_for(Some(sat), start, end)?.into_iter().rev() {
+                    if let Some(conn) = shards.open_existing(key)? {
+                        last = last_in(&conn)?;
+                        if last.is_some() {
+                            break;
+                        }
+                    }
+                }
+                last
+            }
+        };
+
+        Ok(last
+            .and_then(|timestamp| chrono::NaiveDateTime::from_timestamp_opt(timestamp, 0))
+            .map(|naive| DateTime::<Utc>::from_utc(naive, Utc)))
+    }
+
     /// Prepare to add cluster rows to the database.
     pub fn prepare_to_add_clusters(&self) -> SatFireResult<ClusterDatabaseAddCluster> {
-        const ADD_CLUSTER_QUERY: &str = include_str!("database/add_cluster.sql");
-        const ADD_NO_FIRE_QUERY: &str = include_str!("database/add_no_cluster.sql");
-
-        let add_cluster_stmt = self.conn.prepare(ADD_CLUSTER_QUERY)?;
-        let add_no_fire_stmt = self.conn.prepare(ADD_NO_FIRE_QUERY)?;
+        let file_has_rtree = match self.storage {
+            Storage::File(ref conn) => table_exists(conn, "clusters_rtree")?,
+            Storage::Sharded(_) => false,
+        };
 
         Ok(ClusterDatabaseAddCluster {
-            add_cluster_stmt,
-            add_no_fire_stmt,
-            conn: &self.conn,
+            db: self,
+            file_has_rtree,
+            shards: HashMap::default(),
+            bulk: false,
+            batch: TransactionBatch::new(1, std::time::Duration::ZERO),
+            commits: None,
         })
     }
 
+    /// Prepare to add a large number of cluster rows to the database.
+    ///
+    /// This switches the database to write ahead logging, relaxes syncing to disk, and increases
+    /// the page cache for this connection. Instead of one transaction per [ClusterList], each
+    /// transaction is committed after `max_files` lists have been added or after it has been open
+    /// for `max_time`, whichever comes first. Call [ClusterDatabaseAddCluster::finish] when done to
+    /// commit any remaining lists.
+    pub fn prepare_to_bulk_add_clusters(
+        &self,
+        max_files: usize,
+        max_time: std::time::Duration,
+    ) -> SatFireResult<ClusterDatabaseAddCluster> {
+        if let Storage::File(ref conn) = self.storage {
+            configure_bulk_load(conn)?;
+        }
+
+        let mut add = self.prepare_to_add_clusters()?;
+        add.bulk = true;
+        add.batch = TransactionBatch::new(max_files.max(1), max_time);
+
+        Ok(add)
+    }
+
     /// Prepare to query the database if data from a satellite image is already in the database.
     pub fn prepare_to_query_clusters_present(
         &self,
     ) -> SatFireResult<ClusterDatabaseQueryClusterPresent> {
-        const QUERY_CLUSTER: &str = include_str!("database/query_num_clusters_present.sql");
-        const QUERY_NO_FIRE: &str = include_str!("database/query_no_clusters.sql");
-
-        let clusters_stmt = self.conn.prepare(QUERY_CLUSTER)?;
-        let no_fire_stmt = self.conn.prepare(QUERY_NO_FIRE)?;
-
         Ok(ClusterDatabaseQueryClusterPresent {
-            clusters_stmt,
-            no_fire_stmt,
+            db: self,
+            shards: HashMap::default(),
         })
     }
 
+    /// Load the set of all files that have already been processed into memory.
+    ///
+    /// Only files from the given satellites and sectors with a scan start at or after the given
+    /// time are loaded. Checking this set is much faster than querying the database for every
+    /// file, see [ClusterDatabase::prepare_to_query_clusters_present].
+    pub fn processed_files<I>(&self, windows: I) -> SatFireResult<ClusterDatabaseProcessedFiles>
+    where
+        I: IntoIterator<Item = (Satellite, Sector, DateTime<Utc>)>,
+    {
+        const QUERY: &str = include_str!("database/query_processed_files.sql");
+        self.load_file_keys(QUERY, windows.into_iter().collect())
+    }
+
+    /// Load the set of files that were processed and had no clusters into memory.
+    ///
+    /// This is like [ClusterDatabase::processed_files], but only the files that had nothing in
+    /// them are in the set, so they are the ones that are safe to remove from an archive.
+    pub fn no_cluster_files<I>(&self, windows: I) -> SatFireResult<ClusterDatabaseProcessedFiles>
+    where
+        I: IntoIterator<Item = (Satellite, Sector, DateTime<Utc>)>,
+    {
+        const QUERY: &str = include_str!("database/query_no_cluster_files.sql");
+        self.load_file_keys(QUERY, windows.into_iter().collect())
+    }
+
+    /// Run a query for the start and end times of files in each window, and collect the keys.
+    fn load_file_keys(
+        &self,
+        query: &str,
+        windows: Vec<(Satellite, Sector, DateTime<Utc>)>,
+    ) -> SatFireResult<ClusterDatabaseProcessedFiles> {
+        let mut processed = ClusterDatabaseProcessedFiles {
+            keys: HashSet::default(),
+            windows: windows
+                .iter()
+                .map(|&(sat, sector, since)| ((sat, sector), since.timestamp()))
+                .collect(),
+        };
+
+        match self.storage {
+            Storage::File(ref conn) => {
+                Self::load_file_keys_in(conn, query, &windows, &mut processed)?
+            }
+            Storage::Sharded(ref shards) => {
+                let keys: Vec<_> = shards
+                    .keys()?
+                    .into_iter()
+                    .filter(|key| {
+                        windows.iter().any(|&(sat, _, since)| {
+                            key.satellite() == Some(sat) && key.end() > since
+                        })
+                    })
+                    .collect();
+
+                let shard_sets = shards.for_each(&keys, |key, conn| {
+                    let windows: Vec<_> = windows
+                        .iter()
+                        .filter(|&&(sat, _, _)| key.satellite() == Some(sat))
+                        .cloned()
+                        .collect();
+
+                    let mut in_shard = ClusterDatabaseProcessedFiles {
+                        keys: HashSet::default(),
+                        windows: HashMap::default(),
+                    };
+                    Self::load_file_keys_in(conn, query, &windows, &mut in_shard)?;
+                    Ok(in_shard)
+                })?;
+
+                for in_shard in shard_sets {
+                    processed.keys.extend(in_shard.keys);
+                }
+            }
+        }
+
+        Ok(processed)
+    }
+
+    fn load_file_keys_in(
+        conn: &Connection,
+        query: &str,
+        windows: &[(Satellite, Sector, DateTime<Utc>)],
+        processed: &mut ClusterDatabaseProcessedFiles,
+    ) -> SatFireResult<()> {
+        let mut stmt = conn.prepare(query)?;
+
+        for &(sat, sector, since) in windows {
+            let mut rows = stmt.query([
+                &sat.name() as &dyn ToSql,
+                &sector.name(),
+                &since.timestamp(),
+            ])?;
+
+            while let Some(row) = rows.next()? {
+                let start: i64 = row.get(0)?;
+                let end: i64 = row.get(1)?;
+
+                if let Some(key) = ClusterDatabaseProcessedFiles::key(sat, sector, start, end) {
+                    processed.keys.insert(key);
+                }
+            }
+        }
+
+        Ok(())
+    }
+
     /// Query clusters from the database.
+    ///
+    /// For a sharded database, only the shards for the satellite and months in the time range
+    /// are read, each on its own thread.
     pub fn query_clusters(
         &self,
         sat: Option<Satellite>,
@@ -121,6 +544,33 @@ impl ClusterDatabase {
         end: DateTime<Utc>,
         area: BoundingBox,
     ) -> SatFireResult<ClusterDatabaseQueryClusters<'_>> {
+        self.query_cluster_rows(sat, sect, start, end, area)
+    }
+
+    /// Query summaries of clusters from the database, without reading their pixels.
+    ///
+    /// This selects the same clusters as [ClusterDatabase::query_clusters], but it is much faster
+    /// for large exports. The bounding boxes of the clusters are only available from a database
+    /// with a spatial index.
+    pub fn query_cluster_summaries(
+        &self,
+        sat: Option<Satellite>,
+        sect: Option<Sector>,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+    ) -> SatFireResult<ClusterDatabaseQueryClusters<'_, ClusterDatabaseClusterSummary>> {
+        self.query_cluster_rows(sat, sect, start, end, area)
+    }
+
+    fn query_cluster_rows<T: ClusterQueryRow>(
+        &self,
+        sat: Option<Satellite>,
+        sect: Option<Sector>,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+    ) -> SatFireResult<ClusterDatabaseQueryClusters<'_, T>> {
         let sat_select = if let Some(sat) = sat {
             format!("AND satellite = '{}'", sat.name())
         } else {
@@ -133,76 +583,328 @@ impl ClusterDatabase {
             String::new()
         };
 
-        let query = &format!(
-            r#"SELECT
-                 rowid,
-                 satellite,
-                 sector,
-                 start_time,
-                 end_time,
-                 power,
-                 max_temperature,
-                 area,
-                 max_scan_angle,
-                 lat,
-                 lon,
-                 pixels
-               FROM clusters
+        let build_query = |use_rtree: bool| -> String {
+            let (from, spatial_select) = if use_rtree {
+                (
+                    "clusters_rtree CROSS JOIN clusters
+                   ON clusters.cluster_id = clusters_rtree.cluster_id",
+                    spatial_index_select("clusters_rtree", &area),
+                )
+            } else {
+                ("clusters", String::new())
+            };
+
+            format!(
+                r#"SELECT {}
+               FROM {}
                WHERE
                  start_time >= {} AND
                  end_time <= {} AND
                  lat >= {} AND lat <= {} AND
-                 lon >= {} AND lon <= {} {} {}
+                 lon >= {} AND lon <= {} {} {} {}
                ORDER BY start_time ASC"#,
-            start.timestamp(),
-            end.timestamp(),
-            area.ll.lat,
-            area.ur.lat,
-            area.ll.lon,
-            area.ur.lon,
-            sat_select,
-            sector_select
-        );
+                if use_rtree {
+                    T::INDEXED_COLUMNS
+                } else {
+                    T::COLUMNS
+                },
+                from,
+                start.timestamp(),
+                end.timestamp(),
+                area.ll.lat,
+                area.ur.lat,
+                area.ll.lon,
+                area.ur.lon,
+                spatial_select,
+                sat_select,
+                sector_select
+            )
+        };
 
-        let stmt = self.conn.prepare(query)?;
+        // Rows that read something from the spatial index join it even when it wouldn't filter
+        // anything out.
+        let want_rtree = T::NEEDS_INDEX || !covers_globe(&area);
 
-        Ok(ClusterDatabaseQueryClusters { stmt })
+        let query = match self.storage {
+            Storage::File(ref conn) => {
+                let use_rtree = want_rtree && table_exists(conn, "clusters_rtree")?;
+                QueryClusters::File(conn.prepare(&build_query(use_rtree))?)
+            }
+            // Each shard may or may not have a spatial index, so the reader for each shard picks
+            // the query to use.
+            Storage::Sharded(ref shards) => QueryClusters::Sharded {
+                shards,
+                keys: shards.keys_for(sat, start, end)?,
+                query: build_query(false),
+                indexed_query: if want_rtree {
+                    Some(build_query(true))
+                } else {
+                    None
+                },
+            },
+        };
+
+        Ok(ClusterDatabaseQueryClusters {
+            query,
+            rows: PhantomData,
+        })
     }
 }
 
+/// Change the settings of a connection for faster bulk loads.
+fn configure_bulk_load(conn: &Connection) -> SatFireResult<()> {
+    conn.pragma_update_and_check(None, "journal_mode", "WAL", |_| Ok(()))?;
+    conn.pragma_update(None, "synchronous", "NORMAL")?;
+    // Negative values are in KiB, so this is 256 MiB.
+    conn.pragma_update(None, "cache_size", -262_144)?;
+
+    Ok(())
+}
+
 pub struct ClusterDatabaseAddCluster<'a> {
-    add_cluster_stmt: rusqlite::Statement<'a>,
-    add_no_fire_stmt: rusqlite::Statement<'a>,
-    conn: &'a Connection,
+    db: &'a ClusterDatabase,
+    /// Only used for single file databases.
+    file_has_rtree: bool,
+    /// The shards written to since the last flush, and whether each has a spatial index.
+    shards: HashMap<ShardKey, (Connection, bool)>,
+    bulk: bool,
+    batch: TransactionBatch,
+    /// Where to record how long each commit takes, if anywhere.
+    commits: Option<Arc<StageMetrics>>,
+}
+
+/// Keeps track of when to commit a transaction that spans several files.
+#[derive(Debug)]
+struct TransactionBatch {
+    max_files: usize,
+    max_time: std::time::Duration,
+    num_files: usize,
+    started: Option<std::time::Instant>,
+}
+
+impl TransactionBatch {
+    fn new(max_files: usize, max_time: std::time::Duration) -> Self {
+        TransactionBatch {
+            max_files,
+            max_time,
+            num_files: 0,
+            started: None,
+        }
+    }
+
+    fn is_full(&self) -> bool {
+        self.num_files >= self.max_files
+            || self
+                .started
+                .map(|started| started.elapsed() >= self.max_time)
+                .unwrap_or(false)
+    }
 }
 
 impl<'a> ClusterDatabaseAddCluster<'a> {
+    /// Don't keep more shards than this open between transactions.
+    const MAX_OPEN_SHARDS: usize = 8;
+
     /// Adds an entire ClusterList to the database.
+    ///
+    /// If this fails, everything added since the last commit is rolled back, so no file is ever
+    /// left partly in the database.
     pub fn add(&mut self, clist: ClusterList) -> SatFireResult<()> {
+        let res = self.try_add(clist);
+        if res.is_err() {
+            self.rollback();
+        }
+
+        res
+    }
+
+    fn try_add(&mut self, clist: ClusterList) -> SatFireResult<()> {
+        if self.batch.started.is_none() {
+            self.batch.started = Some(std::time::Instant::now());
+        }
+
+        let (conn, has_rtree) = self.connection(clist.satellite(), clist.scan_start())?;
+        if conn.is_autocommit() {
+            conn.execute("BEGIN TRANSACTION", [])?;
+        }
+
         if clist.is_empty() {
-            self.add_no_fire(clist)
+            Self::add_no_fire(conn, clist)?;
         } else {
-            self.add_clusters(clist)
+            Self::add_clusters(conn, has_rtree, clist)?;
+        }
+
+        self.batch.num_files += 1;
+        if self.batch.is_full() {
+            self.flush()?;
         }
+
+        Ok(())
     }
 
-    fn add_clusters(&mut self, clist: ClusterList) -> SatFireResult<()> {
-        self.conn.execute("BEGIN TRANSACTION", [])?;
+    /// Record how long each commit takes in `commits`, the items are the number of files in each.
+    pub fn record_commits_in(&mut self, commits: Arc<StageMetrics>) {
+        self.commits = Some(commits);
+    }
+
+    /// Commit everything that has been added and finish adding to the database.
+    ///
+    /// Dropping this without finishing rolls back the ClusterLists that weren't committed yet.
+    pub fn finish(mut self) -> SatFireResult<()> {
+        self.flush()
+    }
+
+    /// Commit the ClusterLists that have been added if the transaction is full or has been open
+    /// for too long.
+    ///
+    /// This is only checked when a list is added, so call this while waiting for more lists to
+    /// commit the last ones of a burst on time.
+    pub fn flush_if_due(&mut self) -> SatFireResult<()> {
+        if self.batch.started.is_some() && self.batch.is_full() {
+            self.flush()?;
+        }
+
+        Ok(())
+    }
+
+    /// Commit any ClusterLists that have been added but not committed yet.
+    ///
+    /// If the commit fails, everything that wasn't committed is rolled back. For a sharded
+    /// database each shard commits on its own, so the error names the shards that were committed
+    /// before the failure, their files are in the database.
+    pub fn flush(&mut self) -> SatFireResult<()> {
+        let res = self.commit();
+        if res.is_err() {
+            self.rollback();
+        }
+
+        res
+    }
+
+    fn commit(&mut self) -> SatFireResult<()> {
+        if self.batch.started.take().is_some() {
+            let now = std::time::Instant::now();
+
+            match self.db.storage {
+                Storage::File(ref conn) => {
+                    if !conn.is_autocommit() {
+                        conn.execute("COMMIT", [])?;
+                    }
+                }
+                Storage::Sharded(_) => {
+                    let mut committed = vec![];
+                    for (key, (conn, _)) in self.shards.iter() {
+                        if conn.is_autocommit() {
+                            continue;
+                        }
+
+                        if let Err(err) = conn.execute("COMMIT", []) {
+                            let name = |key: &ShardKey| key.file_name().unwrap_or_default();
+                            let committed: Vec<_> = committed.iter().map(name).collect();
+
+                            return Err(format!(
+                                "Error committing {} ({}), already committed: [{}]",
+                                name(key),
+                                err,
+                                committed.join(", ")
+                            )
+                            .into());
+                        }
+                        committed.push(*key);
+                    }
+                }
+            }
+
+            if let Some(ref commits) = self.commits {
+                commits.record(now.elapsed());
+                commits.add_items(self.batch.num_files);
+            }
+        }
+        self.batch.num_files = 0;
+
+        if self.shards.len() > Self::MAX_OPEN_SHARDS {
+            self.shards.clear();
+        }
+
+        Ok(())
+    }
+
+    /// Roll back any ClusterLists that have been added but not committed yet.
+    fn rollback(&mut self) {
+        let conns: Vec<&Connection> = match self.db.storage {
+            Storage::File(ref conn) => vec![conn],
+            Storage::Sharded(_) => self.shards.values().map(|(conn, _)| conn).collect(),
+        };
+
+        for conn in conns {
+            if !conn.is_autocommit() {
+                if let Err(err) = conn.execute("ROLLBACK", []) {
+                    warn!(target: "database", "Error rolling back clusters: {}", err);
+                }
+            }
+        }
+
+        self.batch.started = None;
+        self.batch.num_files = 0;
+    }
+
+    /// Get the connection to add data from this satellite and scan start time to.
+    fn connection(
+        &mut self,
+        sat: Satellite,
+        scan_start: DateTime<Utc>,
+    ) -> SatFireResult<(&Connection, bool)> {
+        match self.db.storage {
+            Storage::File(ref conn) => Ok((conn, self.file_has_rtree)),
+            Storage::Sharded(ref shards) => {
+                let key = ShardKey::for_time(sat, scan_start);
+
+                if !self.shards.contains_key(&key) {
+                    let conn = shards.connect(key)?;
+                    if self.bulk {
+                        configure_bulk_load(&conn)?;
+                    }
+                    let has_rtree = table_exists(&conn, "clusters_rtree")?;
+
+                    self.shards.insert(key, (conn, has_rtree));
+                }
+
+                let (conn, has_rtree) = &self.shards[&key];
+                Ok((conn, *has_rtree))
+            }
+        }
+    }
+
+    fn add_clusters(conn: &Connection, has_rtree: bool, clist: ClusterList) -> SatFireResult<()> {
+        const ADD_CLUSTER_QUERY: &str = include_str!("database/add_cluster.sql");
+        const ADD_RTREE_QUERY: &str = include_str!("database/add_cluster_rtree.sql");
+
+        let mut add_cluster_stmt = conn.prepare_cached(ADD_CLUSTER_QUERY)?;
+        let mut add_rtree_stmt = if has_rtree {
+            Some(conn.prepare_cached(ADD_RTREE_QUERY)?)
+        } else {
+            None
+        };
 
         let satellite = clist.satellite();
         let sector = clist.sector();
         let scan_start = clist.scan_start().timestamp();
         let scan_end = clist.scan_end().timestamp();
 
-        for cluster in clist.take_clusters().into_iter() {
+        // One buffer is reused for the pixels of every cluster.
+        let mut pixels = vec![];
+
+        for cluster in clist.clusters() {
             let Coord { lat, lon } = cluster.centroid();
-            let pixels = cluster.pixels().binary_serialize();
+            pixels.clear();
+            cluster.pixels().binary_serialize_into(&mut pixels);
             let power = cluster.total_power();
             let maxt = cluster.max_temperature();
             let area = cluster.total_area();
             let angle = cluster.max_scan_angle();
+            let bbox = cluster.pixels().bounding_box();
 
-            self.add_cluster_stmt.execute([
+            add_cluster_stmt.execute([
                 &satellite.name() as &dyn ToSql,
                 &sector.name(),
                 &scan_start,
@@ -215,20 +917,24 @@ impl<'a> ClusterDatabaseAddCluster<'a> {
                 &angle,
                 &pixels,
             ])?;
-        }
 
-        self.conn.execute("COMMIT", [])?;
+            if let Some(ref mut add_rtree_stmt) = add_rtree_stmt {
+                add_spatial_index_row(add_rtree_stmt, conn.last_insert_rowid(), &bbox)?;
+            }
+        }
 
         Ok(())
     }
 
-    fn add_no_fire(&mut self, clist: ClusterList) -> SatFireResult<()> {
+    fn add_no_fire(conn: &Connection, clist: ClusterList) -> SatFireResult<()> {
+        const ADD_NO_FIRE_QUERY: &str = include_str!("database/add_no_cluster.sql");
+
         let satellite = clist.satellite();
         let sector = clist.sector();
         let scan_start = clist.scan_start().timestamp();
         let scan_end = clist.scan_end().timestamp();
 
-        self.add_no_fire_stmt.execute([
+        conn.prepare_cached(ADD_NO_FIRE_QUERY)?.execute([
             &satellite.name() as &dyn ToSql,
             &sector.name(),
             &scan_start,
@@ -239,12 +945,24 @@ impl<'a> ClusterDatabaseAddCluster<'a> {
     }
 }
 
+impl<'a> Drop for ClusterDatabaseAddCluster<'a> {
+    fn drop(&mut self) {
+        // Only reached without finishing on an error path, nothing can be reported as processed
+        // unless it was committed on purpose.
+        self.rollback();
+    }
+}
+
 pub struct ClusterDatabaseQueryClusterPresent<'a> {
-    clusters_stmt: rusqlite::Statement<'a>,
-    no_fire_stmt: rusqlite::Statement<'a>,
+    db: &'a ClusterDatabase,
+    /// Connections to the shards checked so far, `None` for shards that don't exist.
+    shards: HashMap<ShardKey, Option<Connection>>,
 }
 
 impl<'a> ClusterDatabaseQueryClusterPresent<'a> {
+    /// Don't keep more shards than this open at a time.
+    const MAX_OPEN_SHARDS: usize = 16;
+
     /// Check to see if an entry for these values already exists in the database.
     pub fn present(
         &mut self,
@@ -253,33 +971,27 @@ impl<'a> ClusterDatabaseQueryClusterPresent<'a> {
         start: DateTime<Utc>,
         end: DateTime<Utc>,
     ) -> SatFireResult<bool> {
-        let start = start.timestamp();
-        let end = end.timestamp();
+        const QUERY_CLUSTER: &str = include_str!("database/query_num_clusters_present.sql");
+
+        let conn = match self.connection(satellite, start)? {
+            Some(conn) => conn,
+            None => return Ok(false),
+        };
 
-        let num_clusters: i64 = self.clusters_stmt.query_row(
+        let num_clusters: i64 = conn.prepare_cached(QUERY_CLUSTER)?.query_row(
             [
                 &satellite.name() as &dyn ToSql,
                 &sector.name(),
-                &start,
-                &end,
+                &start.timestamp(),
+                &end.timestamp(),
             ],
             |row| row.get(0),
         )?;
 
         if num_clusters <= 0 {
-            let no_fire: i64 = self.no_fire_stmt.query_row(
-                [
-                    &satellite.name() as &dyn ToSql,
-                    &sector.name(),
-                    &start,
-                    &end,
-                ],
-                |row| row.get(0),
-            )?;
-
             // This satellite, sector, start, end time group was processessed and there were no
             // clusters found, so it is present in the database, just with no clusters.
-            Ok(no_fire > 0)
+            self.present_no_fire(satellite, sector, start, end)
         } else {
             // There was more than 0 clusters in the database, so YES, this satellite, sector,
             // start, and end time group was processessed.
@@ -294,15 +1006,19 @@ impl<'a> ClusterDatabaseQueryClusterPresent<'a> {
         start: DateTime<Utc>,
         end: DateTime<Utc>,
     ) -> SatFireResult<bool> {
-        let start = start.timestamp();
-        let end = end.timestamp();
+        const QUERY_NO_FIRE: &str = include_str!("database/query_no_clusters.sql");
 
-        let no_fire: i64 = self.no_fire_stmt.query_row(
+        let conn = match self.connection(satellite, start)? {
+            Some(conn) => conn,
+            None => return Ok(false),
+        };
+
+        let no_fire: i64 = conn.prepare_cached(QUERY_NO_FIRE)?.query_row(
             [
                 &satellite.name() as &dyn ToSql,
                 &sector.name(),
-                &start,
-                &end,
+                &start.timestamp(),
+                &end.timestamp(),
             ],
             |row| row.get(0),
         )?;
@@ -311,18 +1027,154 @@ impl<'a> ClusterDatabaseQueryClusterPresent<'a> {
         // clusters found, so it is present in the database, just with no clusters.
         Ok(no_fire > 0)
     }
+
+    /// Get the connection that would hold data from this satellite and scan start time.
+    fn connection(
+        &mut self,
+        sat: Satellite,
+        scan_start: DateTime<Utc>,
+    ) -> SatFireResult<Option<&Connection>> {
+        match self.db.storage {
+            Storage::File(ref conn) => Ok(Some(conn)),
+            Storage::Sharded(ref shards) => {
+                let key = ShardKey::for_time(sat, scan_start);
+
+                if !self.shards.contains_key(&key) {
+                    if self.shards.len() >= Self::MAX_OPEN_SHARDS {
+                        self.shards.clear();
+                    }
+                    self.shards.insert(key, shards.open_existing(key)?);
+                }
+
+                Ok(self.shards[&key].as_ref())
+            }
+        }
+    }
 }
 
-pub struct ClusterDatabaseQueryClusters<'a> {
-    stmt: rusqlite::Statement<'a>,
+/// A set of files, as loaded by [ClusterDatabase::processed_files] or
+/// [ClusterDatabase::no_cluster_files].
+///
+/// This doesn't hold on to a database connection, so it can be shared between threads. It only
+/// knows about the files in the windows it was loaded with, see
+/// [ClusterDatabaseProcessedFiles::covers].
+#[derive(Debug, Clone)]
+pub struct ClusterDatabaseProcessedFiles {
+    keys: HashSet<u64>,
+    /// The earliest scan start loaded for each satellite and sector.
+    windows: HashMap<(Satellite, Sector), i64>,
 }
 
-impl<'a> ClusterDatabaseQueryClusters<'a> {
-    /// Get an iterator over the rows
-    pub fn rows(
+impl ClusterDatabaseProcessedFiles {
+    /// Check to see if the set can answer for a file.
+    ///
+    /// If this is `false` the file is from before the window that was loaded for its satellite and
+    /// sector, or can't be stored in the set, so not being in the set doesn't mean it wasn't
+    /// processed. Check the database instead.
+    pub fn covers(
+        &self,
+        satellite: Satellite,
+        sector: Sector,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+    ) -> bool {
+        let start = start.timestamp();
+
+        Self::key(satellite, sector, start, end.timestamp()).is_some()
+            && self
+                .windows
+                .get(&(satellite, sector))
+                .map(|&since| since <= start)
+                .unwrap_or(false)
+    }
+
+    /// Check to see if a file has been processed.
+    pub fn contains(
+        &self,
+        satellite: Satellite,
+        sector: Sector,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+    ) -> bool {
+        Self::key(satellite, sector, start.timestamp(), end.timestamp())
+            .map(|key| self.keys.contains(&key))
+            .unwrap_or(false)
+    }
+
+    /// Add a file to the set, returns `true` if it wasn't already in it.
+    pub fn insert(
         &mut self,
-    ) -> SatFireResult<impl Iterator<Item = SatFireResult<ClusterDatabaseClusterRow>> + '_> {
-        Ok(self.stmt.query_and_then([], query_row_to_cluster_row)?)
+        satellite: Satellite,
+        sector: Sector,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+    ) -> bool {
+        match Self::key(satellite, sector, start.timestamp(), end.timestamp()) {
+            Some(key) => self.keys.insert(key),
+            // It can't be remembered, so it is always new.
+            None => true,
+        }
+    }
+
+    /// Get the number of files in the set.
+    pub fn len(&self) -> usize {
+        self.keys.len()
+    }
+
+    /// Check if the set is empty.
+    pub fn is_empty(&self) -> bool {
+        self.keys.is_empty()
+    }
+
+    /// Pack a file description into a single u64.
+    ///
+    /// The start time takes the upper 32 bits, the scan duration in seconds the next 16, and the
+    /// satellite and sector a byte each. Returns `None` for anything that doesn't fit, which just
+    /// means that file will be processed again.
+    fn key(satellite: Satellite, sector: Sector, start: i64, end: i64) -> Option<u64> {
+        let start = u32::try_from(start).ok()? as u64;
+        let duration = u16::try_from(end - start as i64).ok()? as u64;
+        let sat = Satellite::iter().position(|s| s == satellite)? as u64;
+        let sector = Sector::iter().position(|s| s == sector)? as u64;
+
+        Some(start << 32 | duration << 16 | sat << 8 | sector)
+    }
+}
+
+pub struct ClusterDatabaseQueryClusters<'a, T = ClusterDatabaseClusterRow> {
+    query: QueryClusters<'a>,
+    rows: PhantomData<T>,
+}
+
+enum QueryClusters<'a> {
+    File(rusqlite::Statement<'a>),
+    Sharded {
+        shards: &'a ShardSet,
+        keys: Vec<ShardKey>,
+        query: String,
+        /// The query using the spatial index, for shards that have one.
+        indexed_query: Option<String>,
+    },
+}
+
+impl<'a, T: ClusterQueryRow> ClusterDatabaseQueryClusters<'a, T> {
+    /// Get an iterator over the rows
+    pub fn rows(&mut self) -> SatFireResult<Box<dyn Iterator<Item = SatFireResult<T>> + '_>> {
+        match self.query {
+            QueryClusters::File(ref mut stmt) => {
+                Ok(Box::new(stmt.query_and_then([], T::from_query_row)?))
+            }
+            QueryClusters::Sharded {
+                shards,
+                ref keys,
+                ref query,
+                ref indexed_query,
+            } => Ok(Box::new(shards.merged_rows::<T>(
+                keys.clone(),
+                query.clone(),
+                indexed_query.clone(),
+            ))),
+        }
     }
 }
 
@@ -344,6 +1196,106 @@ pub struct ClusterDatabaseClusterRow {
 
 impl ClusterDatabaseClusterRow {}
 
+/// The data about a cluster retrieved from the database, without its pixels.
+#[derive(Debug, Clone)]
+pub struct ClusterDatabaseClusterSummary {
+    pub rowid: u64,
+    pub start: DateTime<Utc>,
+    pub end: DateTime<Utc>,
+    pub power: f64,
+    pub max_temperature: f64,
+    pub area: f64,
+    pub scan_angle: f64,
+    pub centroid: Coord,
+    pub sector: Sector,
+    pub sat: Satellite,
+    /// The bounding box of the pixels, only available from a database with a spatial index.
+    pub bbox: Option<BoundingBox>,
+}
+
+/// A type that can be read from the rows of a query on the clusters table.
+pub trait ClusterQueryRow: Sized + Send + 'static {
+    /// The columns to select.
+    const COLUMNS: &'static str;
+    /// The columns to select when the query is joined with the spatial index.
+    const INDEXED_COLUMNS: &'static str;
+    /// Whether to join the spatial index whenever there is one, even if it doesn't filter anything.
+    const NEEDS_INDEX: bool;
+
+    fn from_query_row(row: &rusqlite::Row) -> SatFireResult<Self>;
+
+    /// The scan start time, rows from different shards are merged in this order.
+    fn scan_start(&self) -> DateTime<Utc>;
+}
+
+impl ClusterQueryRow for ClusterDatabaseClusterRow {
+    const COLUMNS: &'static str = CLUSTER_ROW_COLUMNS;
+    const INDEXED_COLUMNS: &'static str = CLUSTER_ROW_COLUMNS;
+    const NEEDS_INDEX: bool = false;
+
+    fn from_query_row(row: &rusqlite::Row) -> SatFireResult<Self> {
+        query_row_to_cluster_row(row)
+    }
+
+    fn scan_start(&self) -> DateTime<Utc> {
+        self.start
+    }
+}
+
+impl ClusterQueryRow for ClusterDatabaseClusterSummary {
+    const COLUMNS: &'static str = CLUSTER_SUMMARY_COLUMNS;
+    const INDEXED_COLUMNS: &'static str = CLUSTER_SUMMARY_INDEXED_COLUMNS;
+    const NEEDS_INDEX: bool = true;
+
+    fn from_query_row(row: &rusqlite::Row) -> SatFireResult<Self> {
+        query_row_to_cluster_summary(row)
+    }
+
+    fn scan_start(&self) -> DateTime<Utc> {
+        self.start
+    }
+}
+
+/// A cluster that was assigned to a fire, with the totals that go into the fire's time series.
+#[derive(Debug, Clone, Copy)]
+pub struct FireAssociation {
+    pub cluster_id: u64,
+    pub sector: Sector,
+    pub start: DateTime<Utc>,
+    pub end: DateTime<Utc>,
+    pub power: f64,
+    pub area: f64,
+    pub max_temperature: f64,
+}
+
+impl From<&ClusterDatabaseClusterRow> for FireAssociation {
+    fn from(row: &ClusterDatabaseClusterRow) -> Self {
+        FireAssociation {
+            cluster_id: row.rowid,
+            sector: row.sector,
+            start: row.start,
+            end: row.end,
+            power: row.power,
+            area: row.area,
+            max_temperature: row.max_temperature,
+        }
+    }
+}
+
+/// The totals of all the clusters in a single scan of a fire, including the fires merged into it.
+#[derive(Debug, Clone)]
+pub struct FireTimeSeriesRow {
+    /// The fire all the others were merged into.
+    pub root_id: u64,
+    pub sector: Sector,
+    pub start: DateTime<Utc>,
+    pub end: DateTime<Utc>,
+    pub power: f64,
+    pub area: f64,
+    pub max_temperature: f64,
+    pub num_clusters: u32,
+}
+
 /// Represents a connection to the database where ALL the information related to fires is stored.
 pub struct FiresDatabase {
     conn: Connection,
@@ -383,9 +1335,34 @@ impl FiresDatabase {
         const QUERY: &str = include_str!("database/create_fire_db.sql");
         conn.execute_batch(QUERY)?;
 
+        // Needed so INSERT OR REPLACE keeps the optional spatial index up to date.
+        conn.pragma_update(None, "recursive_triggers", true)?;
+
         Ok(conn)
     }
 
+    /// Create the optional spatial index of fire bounding boxes.
+    ///
+    /// Once it exists, the index is kept up to date as fires are added and
+    /// [FiresDatabase::query_fires] uses it to find fires in an area. Any fires already in the
+    /// database are added to the index. It is safe to run more than once.
+    ///
+    /// Returns the number of fires that were added to the index.
+    pub fn create_spatial_index(&self) -> SatFireResult<usize> {
+        const QUERY: &str = include_str!("database/create_fire_db_rtree.sql");
+        const ADD_QUERY: &str = include_str!("database/add_fire_rtree.sql");
+
+        self.conn.execute_batch(QUERY)?;
+        fill_spatial_index(&self.conn, "fires", "fire_id", "fires_rtree", ADD_QUERY)
+    }
+
+    /// Rewrite any pixel BLOBs stored in an older binary format in the current format.
+    ///
+    /// Returns the number of fires that were rewritten.
+    pub fn upgrade_pixel_format(&self) -> SatFireResult<usize> {
+        upgrade_pixel_blobs(&self.conn, "fires", "fire_id")
+    }
+
     /// Get the next id number for a wildfire.
     pub fn next_wildfire_id(&self) -> SatFireResult<u64> {
         const QUERY: &str = "SELECT IFNULL(MAX(fire_id) + 1, 1) FROM fires";
@@ -396,6 +1373,24 @@ impl FiresDatabase {
         Ok(res)
     }
 
+    /// Get the id of the last run started on this database, or 0 if there hasn't been one.
+    pub fn last_run(&self) -> SatFireResult<u64> {
+        const QUERY: &str = "SELECT IFNULL(MAX(run_id), 0) FROM runs";
+
+        let res: u64 = self.conn.query_row(QUERY, [], |row| row.get(0))?;
+
+        Ok(res)
+    }
+
+    /// Record the start of a run that will add fires to the database, and get its id.
+    pub fn start_run(&self) -> SatFireResult<u64> {
+        const QUERY: &str = "INSERT INTO runs (started) VALUES (?)";
+
+        self.conn.execute(QUERY, [Utc::now().timestamp()])?;
+
+        Ok(self.conn.last_insert_rowid() as u64)
+    }
+
     /// Get the most recent start time
     pub fn last_observed(&self, sat: Satellite) -> Option<DateTime<Utc>> {
         self.conn
@@ -456,10 +1451,9 @@ impl FiresDatabase {
 
                 let area = match row.get_ref(6)? {
                     rusqlite::types::ValueRef::Blob(bytes) => {
-                        let mut cursor = std::io::Cursor::new(bytes);
-                        Ok(PixelList::binary_deserialize(&mut cursor))
+                        PixelList::binary_deserialize_slice(bytes)
                     }
-                    _ => Err("Invalid type in pixels column"),
+                    _ => Err("Invalid type in pixels column".into()),
                 }?;
 
                 Ok(Fire::new(
@@ -492,59 +1486,168 @@ impl FiresDatabase {
         info!(target: sat.name(), "Retrieved {} fires from database after filtering out stale fires.",
             fires.len());
 
-        Ok(fires)
+        Ok(fires)
+    }
+
+    /// Get the time series of the whole fire `fire_id` ended up a part of.
+    ///
+    /// This reads the rollup connectfire keeps as it adds fires, so it includes all the fires that
+    /// were merged into the same fire as `fire_id`, and is empty for fires added to the database
+    /// before the rollup existed.
+    pub fn fire_time_series(&self, fire_id: u64) -> SatFireResult<Vec<FireTimeSeriesRow>> {
+        const QUERY: &str = include_str!("database/query_fire_time_series.sql");
+
+        let to_time = |ts: i64| {
+            DateTime::<Utc>::from_utc(NaiveDateTime::from_timestamp_opt(ts, 0).unwrap(), Utc)
+        };
+
+        let mut stmt = self.conn.prepare(QUERY)?;
+        let rows = stmt.query_and_then([fire_id], |row| -> SatFireResult<FireTimeSeriesRow> {
+            let sector = match row.get_ref(1)? {
+                rusqlite::types::ValueRef::Text(txt) => {
+                    let txt = unsafe { std::str::from_utf8_unchecked(txt) };
+                    Sector::string_contains_sector(txt).ok_or("Invalid sector")
+                }
+                _ => Err("sector not text"),
+            }?;
+
+            Ok(FireTimeSeriesRow {
+                root_id: u64::try_from(row.get::<_, i64>(0)?)?,
+                sector,
+                start: to_time(row.get(2)?),
+                end: to_time(row.get(3)?),
+                power: row.get(4)?,
+                area: row.get(5)?,
+                max_temperature: row.get(6)?,
+                num_clusters: row.get(7)?,
+            })
+        })?;
+
+        rows.collect()
+    }
+
+    /// Add fires and associations to clusters to the database.
+    pub fn prepare_to_add_fires(&self) -> SatFireResult<FiresDatabaseAddFire> {
+        const FIRE_QUERY: &str = include_str!("database/add_fire.sql");
+        const ASSOC_QUERY: &str = include_str!("database/add_association.sql");
+
+        const RTREE_QUERY: &str = include_str!("database/add_fire_rtree.sql");
+
+        let fire_stmt = self.conn.prepare(FIRE_QUERY)?;
+        let assoc_stmt = self.conn.prepare(ASSOC_QUERY)?;
+        let rtree_stmt = if table_exists(&self.conn, "fires_rtree")? {
+            Some(self.conn.prepare(RTREE_QUERY)?)
+        } else {
+            None
+        };
+        let associations = HashMap::default();
+
+        Ok(FiresDatabaseAddFire {
+            conn: &self.conn,
+            fire_stmt,
+            assoc_stmt,
+            rtree_stmt,
+            associations,
+        })
+    }
+
+    /// Query fires from the database
+    pub fn query_fires(
+        &self,
+        sat: Option<Satellite>,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+    ) -> SatFireResult<FiresDatabaseQueryFires<'_>> {
+        let use_rtree = !covers_globe(&area) && table_exists(&self.conn, "fires_rtree")?;
+        let columns = "fires.fire_id,
+                 merged_into,
+                 satellite,
+                 first_observed,
+                 last_observed,
+                 max_power,
+                 max_temperature,
+                 pixels";
+
+        let stmt = self.prepare_fires_query(columns, use_rtree, sat, start, end, area)?;
+
+        Ok(FiresDatabaseQueryFires { stmt })
     }
 
-    /// Add fires and associations to clusters to the database.
-    pub fn prepare_to_add_fires(&self) -> SatFireResult<FiresDatabaseAddFire> {
-        const FIRE_QUERY: &str = include_str!("database/add_fire.sql");
-        const ASSOC_QUERY: &str = include_str!("database/add_association.sql");
+    /// Query summaries of fires from the database, without reading their pixels.
+    ///
+    /// This selects the same fires as [FiresDatabase::query_fires], but it is much faster for
+    /// large exports. The bounding boxes of the fires are only available from a database with a
+    /// spatial index.
+    pub fn query_fire_summaries(
+        &self,
+        sat: Option<Satellite>,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+    ) -> SatFireResult<FiresDatabaseQueryFireSummaries<'_>> {
+        let use_rtree = table_exists(&self.conn, "fires_rtree")?;
+        let columns = format!(
+            "fires.fire_id,
+                 merged_into,
+                 satellite,
+                 first_observed,
+                 last_observed,
+                 max_power,
+                 max_temperature,
+                 lat,
+                 lon,
+                 num_pixels,
+                 {}",
+            if use_rtree {
+                "fires_rtree.min_lat, fires_rtree.max_lat, fires_rtree.min_lon, fires_rtree.max_lon"
+            } else {
+                "NULL, NULL, NULL, NULL"
+            }
+        );
 
-        let fire_stmt = self.conn.prepare(FIRE_QUERY)?;
-        let assoc_stmt = self.conn.prepare(ASSOC_QUERY)?;
-        let associations = HashMap::default();
+        let stmt = self.prepare_fires_query(&columns, use_rtree, sat, start, end, area)?;
 
-        Ok(FiresDatabaseAddFire {
-            conn: &self.conn,
-            fire_stmt,
-            assoc_stmt,
-            associations,
-        })
+        Ok(FiresDatabaseQueryFireSummaries { stmt })
     }
 
-    /// Query fires from the database
-    pub fn query_fires(
+    fn prepare_fires_query(
         &self,
+        columns: &str,
+        use_rtree: bool,
         sat: Option<Satellite>,
         start: DateTime<Utc>,
         end: DateTime<Utc>,
         area: BoundingBox,
-    ) -> SatFireResult<FiresDatabaseQueryFires<'_>> {
+    ) -> SatFireResult<rusqlite::Statement<'_>> {
         let sat_select = if let Some(sat) = sat {
             format!("AND satellite = '{}'", sat.name())
         } else {
             String::new()
         };
 
+        let (from, spatial_select) = if use_rtree {
+            (
+                "fires_rtree CROSS JOIN fires ON fires.fire_id = fires_rtree.fire_id",
+                spatial_index_select("fires_rtree", &area),
+            )
+        } else {
+            ("fires", String::new())
+        };
+
         let query = &format!(
-            r#"SELECT
-                 fire_id,
-                 merged_into,
-                 satellite,
-                 first_observed,
-                 last_observed,
-                 max_power,
-                 max_temperature,
-                 pixels
-               FROM fires
+            r#"SELECT {}
+               FROM {}
                WHERE
                  ((first_observed <= {} AND last_observed >= {})
                  OR (first_observed >= {} AND first_observed <= {})
                  OR (last_observed >= {} AND last_observed <= {}))
                  AND
                  lat >= {} AND lat <= {} AND
-                 lon >= {} AND lon <= {} {} 
+                 lon >= {} AND lon <= {} {} {}
                ORDER BY first_observed ASC"#,
+            columns,
+            from,
             start.timestamp(),
             end.timestamp(),
             start.timestamp(),
@@ -555,12 +1658,11 @@ impl FiresDatabase {
             area.ur.lat,
             area.ll.lon,
             area.ur.lon,
+            spatial_select,
             sat_select,
         );
 
-        let stmt = self.conn.prepare(query)?;
-
-        Ok(FiresDatabaseQueryFires { stmt })
+        Ok(self.conn.prepare(query)?)
     }
 }
 
@@ -568,7 +1670,9 @@ pub struct FiresDatabaseAddFire<'a> {
     conn: &'a rusqlite::Connection,
     fire_stmt: rusqlite::Statement<'a>,
     assoc_stmt: rusqlite::Statement<'a>,
-    associations: HashMap<u64, Vec<u64>>,
+    /// Only present if the database has a spatial index.
+    rtree_stmt: Option<rusqlite::Statement<'a>>,
+    associations: HashMap<u64, Vec<FireAssociation>>,
 }
 
 impl<'a> FiresDatabaseAddFire<'a> {
@@ -576,13 +1680,18 @@ impl<'a> FiresDatabaseAddFire<'a> {
     pub fn add_fires(&mut self, fires: &FireList) -> SatFireResult<()> {
         let mut ids = Vec::with_capacity(fires.len());
 
+        // Fires this short are never written, and neither are their associations.
+        for fire in fires.iter().filter(|f| f.duration() <= Duration::hours(1)) {
+            self.associations.remove(&fire.id());
+        }
+
         self.conn.execute("BEGIN TRANSACTION", [])?;
 
         for fire in fires.iter().filter(|f| f.duration() > Duration::hours(1)) {
             ids.push(fire.id());
 
             let Coord { lat, lon } = fire.centroid();
-            let pixels = fire.pixels().binary_serialize();
+            let pixels = fire.try_pixels()?.binary_serialize();
 
             self.fire_stmt.execute([
                 &fire.id() as &dyn ToSql,
@@ -597,13 +1706,50 @@ impl<'a> FiresDatabaseAddFire<'a> {
                 &fire.pixels().len(),
                 &pixels,
             ])?;
+
+            if let Some(ref mut rtree_stmt) = self.rtree_stmt {
+                add_spatial_index_row(rtree_stmt, fire.id() as i64, &fire.bounding_box())?;
+            }
+        }
+
+        // Fires are merged into fires that are still going, so a fire is always added after the
+        // fires merged into it. Its root may not be in the database yet, and may change later.
+        let mut roots = HashMap::default();
+        for fire in fires.iter().filter(|f| f.duration() > Duration::hours(1)) {
+            let root = match fire.merged_into() {
+                0 => fire.id(),
+                merged_into => self.root_of(merged_into)?,
+            };
+
+            self.set_root(fire.id(), root)?;
+            roots.insert(fire.id(), root);
         }
 
+        let mut scans: HashMap<(i64, Sector), (FireAssociation, u32)> = HashMap::default();
         for id in ids {
-            if let Some(cluster_ids) = self.associations.remove(&id) {
-                for cluster_id in cluster_ids {
-                    self.assoc_stmt.execute([id, cluster_id])?;
+            if let Some(associations) = self.associations.remove(&id) {
+                scans.clear();
+
+                for assoc in associations {
+                    // A cluster that was already associated is already in the time series.
+                    if self.assoc_stmt.execute([id, assoc.cluster_id])? == 0 {
+                        continue;
+                    }
+
+                    scans
+                        .entry((assoc.start.timestamp(), assoc.sector))
+                        .and_modify(|(total, count)| {
+                            total.end = total.end.max(assoc.end);
+                            total.power += assoc.power;
+                            total.area += assoc.area;
+                            total.max_temperature =
+                                total.max_temperature.max(assoc.max_temperature);
+                            *count += 1;
+                        })
+                        .or_insert((assoc, 1));
                 }
+
+                self.add_time_series(roots[&id], &scans)?;
             }
         }
         self.conn.execute("COMMIT", [])?;
@@ -612,9 +1758,71 @@ impl<'a> FiresDatabaseAddFire<'a> {
     }
 
     /// Add associations.
-    pub fn add_association(&mut self, fireid: u64, clusterid: u64) {
-        let cluster_ids = self.associations.entry(fireid).or_insert(vec![]);
-        cluster_ids.push(clusterid);
+    pub fn add_association(&mut self, fireid: u64, association: FireAssociation) {
+        let associations = self.associations.entry(fireid).or_insert(vec![]);
+        associations.push(association);
+    }
+
+    /// The root of a fire, the fire itself if it hasn't been added yet.
+    fn root_of(&self, fire_id: u64) -> SatFireResult<u64> {
+        const QUERY: &str = "SELECT root_id FROM fire_roots WHERE fire_id = ?";
+
+        let mut stmt = self.conn.prepare_cached(QUERY)?;
+        let mut rows = stmt.query([fire_id])?;
+
+        Ok(match rows.next()? {
+            Some(row) => u64::try_from(row.get::<_, i64>(0)?)?,
+            None => fire_id,
+        })
+    }
+
+    /// Set the root of a fire, and move everything already gathered under it to the new root.
+    fn set_root(&self, fire_id: u64, root: u64) -> SatFireResult<()> {
+        const SET_QUERY: &str =
+            "INSERT OR REPLACE INTO fire_roots (fire_id, root_id) VALUES (?, ?)";
+        const MERGE_QUERY: &str = include_str!("database/merge_fire_time_series.sql");
+        const DELETE_QUERY: &str = "DELETE FROM fire_time_series WHERE root_id = ?";
+        const MOVE_QUERY: &str = "UPDATE fire_roots SET root_id = ?2 WHERE root_id = ?1";
+
+        self.conn
+            .prepare_cached(SET_QUERY)?
+            .execute([fire_id, root])?;
+
+        if fire_id != root {
+            self.conn
+                .prepare_cached(MERGE_QUERY)?
+                .execute([fire_id, root])?;
+            self.conn.prepare_cached(DELETE_QUERY)?.execute([fire_id])?;
+            self.conn
+                .prepare_cached(MOVE_QUERY)?
+                .execute([fire_id, root])?;
+        }
+
+        Ok(())
+    }
+
+    fn add_time_series(
+        &self,
+        root: u64,
+        scans: &HashMap<(i64, Sector), (FireAssociation, u32)>,
+    ) -> SatFireResult<()> {
+        const QUERY: &str = include_str!("database/add_fire_time_series.sql");
+
+        let mut stmt = self.conn.prepare_cached(QUERY)?;
+        for (total, count) in scans.values() {
+            stmt.execute([
+                &root as &dyn ToSql,
+                &total.sector.name(),
+                &total.start.timestamp(),
+                &total.end.timestamp(),
+                &total.power,
+                &total.area,
+                &total.max_temperature,
+                count,
+            ])?;
+        }
+
+        Ok(())
     }
 }
 
@@ -652,10 +1860,9 @@ impl<'a> FiresDatabaseQueryFires<'a> {
 
             let area = match row.get_ref(7)? {
                 rusqlite::types::ValueRef::Blob(bytes) => {
-                    let mut cursor = std::io::Cursor::new(bytes);
-                    Ok(PixelList::binary_deserialize(&mut cursor))
+                    PixelList::binary_deserialize_slice(bytes)
                 }
-                _ => Err("Invalid type in pixels column"),
+                _ => Err("Invalid type in pixels column".into()),
             }?;
 
             Ok(Fire::new(
@@ -672,8 +1879,93 @@ impl<'a> FiresDatabaseQueryFires<'a> {
     }
 }
 
+pub struct FiresDatabaseQueryFireSummaries<'a> {
+    stmt: rusqlite::Statement<'a>,
+}
+
+impl<'a> FiresDatabaseQueryFireSummaries<'a> {
+    /// Get an iterator over the rows
+    pub fn rows(
+        &mut self,
+    ) -> SatFireResult<impl Iterator<Item = SatFireResult<FiresDatabaseFireSummary>> + '_> {
+        Ok(self
+            .stmt
+            .query_and_then([], |row| -> SatFireResult<FiresDatabaseFireSummary> {
+                let id: u64 = u64::try_from(row.get::<_, i64>(0)?)?;
+                let merged_into: u64 = u64::try_from(row.get::<_, i64>(1)?)?;
+
+                let sat = match row.get_ref(2)? {
+                    rusqlite::types::ValueRef::Text(txt) => {
+                        let txt = unsafe { std::str::from_utf8_unchecked(txt) };
+                        Satellite::string_contains_satellite(txt).ok_or("Invalid sattelite")
+                    }
+                    _ => Err("sattelite not text"),
+                }?;
+
+                let first_observed: DateTime<Utc> = DateTime::from_utc(
+                    chrono::NaiveDateTime::from_timestamp_opt(row.get(3)?, 0).unwrap(),
+                    Utc,
+                );
+                let last_observed: DateTime<Utc> = DateTime::from_utc(
+                    chrono::NaiveDateTime::from_timestamp_opt(row.get(4)?, 0).unwrap(),
+                    Utc,
+                );
+
+                let max_power: f64 = row.get(5)?;
+                let max_temperature: f64 = row.get(6)?;
+                let lat: f64 = row.get(7)?;
+                let lon: f64 = row.get(8)?;
+                let num_pixels: usize = row.get(9)?;
+                let bbox = read_bbox(row, 10)?;
+
+                Ok(FiresDatabaseFireSummary {
+                    id,
+                    merged_into,
+                    sat,
+                    first_observed,
+                    last_observed,
+                    max_power,
+                    max_temperature,
+                    centroid: Coord { lat, lon },
+                    num_pixels,
+                    bbox,
+                })
+            })?)
+    }
+}
+
+/// The data about a fire retrieved from the database, without its pixels.
+#[derive(Debug, Clone)]
+pub struct FiresDatabaseFireSummary {
+    pub id: u64,
+    pub merged_into: u64,
+    pub sat: Satellite,
+    pub first_observed: DateTime<Utc>,
+    pub last_observed: DateTime<Utc>,
+    pub max_power: f64,
+    pub max_temperature: f64,
+    pub centroid: Coord,
+    pub num_pixels: usize,
+    /// The bounding box of the pixels, only available from a database with a spatial index.
+    pub bbox: Option<BoundingBox>,
+}
+
+impl FiresDatabaseFireSummary {
+    /// Get the duration of the fire.
+    pub fn duration(&self) -> Duration {
+        self.last_observed - self.first_observed
+    }
+
+    /// Format the duration in an easy to read way.
+    pub fn format_duration(&self, buffer: &mut String) {
+        crate::fire::format_duration(self.duration(), buffer);
+    }
+}
+
 pub struct JointFiresClusterDatabases {
     conn: Connection,
+    /// Only present if the cluster database is sharded, otherwise it is attached to `conn`.
+    shards: Option<ShardSet>,
 }
 
 impl JointFiresClusterDatabases {
@@ -681,29 +1973,44 @@ impl JointFiresClusterDatabases {
         clusters_db: P1,
         fires_db: P2,
     ) -> SatFireResult<Self> {
+        let clusters_path = clusters_db.as_ref();
         let fires_path = fires_db.as_ref();
-        let attach_clusters = format!(
-            "ATTACH DATABASE \"{}\" AS ff",
-            clusters_db.as_ref().display()
-        );
 
         let conn = FiresDatabase::open_database_to_write(fires_path)?;
-        conn.execute(&attach_clusters, [])?;
 
-        Ok(JointFiresClusterDatabases { conn })
+        // A sharded database could have far more files than SQLite can attach at once, so the
+        // shards are queried separately.
+        let shards = if ShardSet::is_sharded(clusters_path) {
+            Some(ShardSet::new(clusters_path))
+        } else {
+            let attach_clusters = format!("ATTACH DATABASE \"{}\" AS ff", clusters_path.display());
+            conn.execute(&attach_clusters, [])?;
+            None
+        };
+
+        Ok(JointFiresClusterDatabases { conn, shards })
     }
 
     pub fn single_fire_query(&self) -> SatFireResult<JointQuerySingleFire> {
-        let stmt = self.conn.prepare_cached(include_str!(
-            "database/single_fire_clusters_time_series.sql"
-        ))?;
+        let stmt = if self.shards.is_some() {
+            self.conn
+                .prepare_cached(include_str!("database/single_fire_cluster_ids.sql"))?
+        } else {
+            self.conn.prepare_cached(include_str!(
+                "database/single_fire_clusters_time_series.sql"
+            ))?
+        };
 
-        Ok(JointQuerySingleFire { stmt })
+        Ok(JointQuerySingleFire {
+            stmt,
+            shards: self.shards.as_ref(),
+        })
     }
 }
 
 pub struct JointQuerySingleFire<'a> {
     stmt: rusqlite::CachedStatement<'a>,
+    shards: Option<&'a ShardSet>,
 }
 
 impl<'a> JointQuerySingleFire<'a> {
@@ -711,14 +2018,99 @@ impl<'a> JointQuerySingleFire<'a> {
     pub fn run(
         &mut self,
         fire_id: u64,
-    ) -> SatFireResult<impl Iterator<Item = SatFireResult<ClusterDatabaseClusterRow>> + '_> {
-        Ok(self
-            .stmt
-            .query_and_then([fire_id], query_row_to_cluster_row)?)
+    ) -> SatFireResult<Box<dyn Iterator<Item = SatFireResult<ClusterDatabaseClusterRow>> + '_>>
+    {
+        let shards = match self.shards {
+            Some(shards) => shards,
+            None => {
+                return Ok(Box::new(
+                    self.stmt
+                        .query_and_then([fire_id], query_row_to_cluster_row)?,
+                ))
+            }
+        };
+
+        let mut ids_by_shard: HashMap<ShardKey, Vec<i64>> = HashMap::default();
+        for cluster_id in self.stmt.query_map([fire_id], |row| row.get::<_, i64>(0))? {
+            let cluster_id = cluster_id?;
+            ids_by_shard
+                .entry(ShardKey::for_cluster_id(cluster_id))
+                .or_default()
+                .push(cluster_id);
+        }
+
+        let keys: Vec<_> = ids_by_shard.keys().cloned().collect();
+        let ids_by_shard = &ids_by_shard;
+
+        let mut rows: Vec<ClusterDatabaseClusterRow> = shards
+            .for_each(&keys, |key, conn| {
+                let ids: Vec<String> = ids_by_shard[&key].iter().map(|id| id.to_string()).collect();
+                let query = format!(
+                    "SELECT {} FROM clusters WHERE cluster_id IN ({})",
+                    CLUSTER_ROW_COLUMNS,
+                    ids.join(",")
+                );
+
+                let mut stmt = conn.prepare(&query)?;
+                let rows = stmt.query_and_then([], query_row_to_cluster_row)?;
+                rows.collect::<SatFireResult<Vec<_>>>()
+            })?
+            .into_iter()
+            .flatten()
+            .collect();
+
+        rows.sort_by_key(|row| row.start);
+
+        Ok(Box::new(rows.into_iter().map(Ok)))
     }
 }
 
 fn query_row_to_cluster_row(row: &rusqlite::Row) -> SatFireResult<ClusterDatabaseClusterRow> {
+    let ClusterDatabaseClusterSummary {
+        rowid,
+        sat,
+        sector,
+        start,
+        end,
+        power,
+        max_temperature,
+        area,
+        scan_angle,
+        centroid,
+        ..
+    } = read_cluster_summary(row, false)?;
+
+    let pixels = match row.get_ref(11)? {
+        rusqlite::types::ValueRef::Blob(bytes) => PixelList::binary_deserialize_slice(bytes),
+        _ => Err("Invalid type in pixels column".into()),
+    }?;
+
+    Ok(ClusterDatabaseClusterRow {
+        rowid,
+        sat,
+        sector,
+        start,
+        end,
+        power,
+        max_temperature,
+        area,
+        scan_angle,
+        centroid,
+        pixels,
+    })
+}
+
+fn query_row_to_cluster_summary(
+    row: &rusqlite::Row,
+) -> SatFireResult<ClusterDatabaseClusterSummary> {
+    read_cluster_summary(row, true)
+}
+
+/// Read the columns shared by cluster rows and summaries, and the bounding box if `with_bbox`.
+fn read_cluster_summary(
+    row: &rusqlite::Row,
+    with_bbox: bool,
+) -> SatFireResult<ClusterDatabaseClusterSummary> {
     let rowid: u64 = u64::try_from(row.get::<_, i64>(0)?)?;
     let sat = match row.get_ref(1)? {
         rusqlite::types::ValueRef::Text(txt) => {
@@ -752,15 +2144,9 @@ fn query_row_to_cluster_row(row: &rusqlite::Row) -> SatFireResult<ClusterDatabas
     let lon: f64 = row.get(10)?;
     let centroid = Coord { lat, lon };
 
-    let pixels = match row.get_ref(11)? {
-        rusqlite::types::ValueRef::Blob(bytes) => {
-            let mut cursor = std::io::Cursor::new(bytes);
-            Ok(PixelList::binary_deserialize(&mut cursor))
-        }
-        _ => Err("Invalid type in pixels column"),
-    }?;
+    let bbox = if with_bbox { read_bbox(row, 11)? } else { None };
 
-    Ok(ClusterDatabaseClusterRow {
+    Ok(ClusterDatabaseClusterSummary {
         rowid,
         sat,
         sector,
@@ -771,6 +2157,357 @@ fn query_row_to_cluster_row(row: &rusqlite::Row) -> SatFireResult<ClusterDatabas
         area,
         scan_angle,
         centroid,
-        pixels,
+        bbox,
+    })
+}
+
+/// Read a bounding box from the min_lat, max_lat, min_lon, and max_lon columns of a spatial index
+/// starting at column `first`, they are all NULL for rows that aren't in the index.
+fn read_bbox(row: &rusqlite::Row, first: usize) -> SatFireResult<Option<BoundingBox>> {
+    let min_lat: Option<f64> = row.get(first)?;
+    let max_lat: Option<f64> = row.get(first + 1)?;
+    let min_lon: Option<f64> = row.get(first + 2)?;
+    let max_lon: Option<f64> = row.get(first + 3)?;
+
+    Ok(match (min_lat, max_lat, min_lon, max_lon) {
+        (Some(min_lat), Some(max_lat), Some(min_lon), Some(max_lon)) => Some(BoundingBox {
+            ll: Coord {
+                lat: min_lat,
+                lon: min_lon,
+            },
+            ur: Coord {
+                lat: max_lat,
+                lon: max_lon,
+            },
+        }),
+        _ => None,
     })
 }
+
+/// Rewrite the pixels column of a table in the current binary format.
+///
+/// The rows are processed in batches ordered by id, each in its own transaction, so this works on
+/// very large databases without holding everything in memory.
+fn upgrade_pixel_blobs(conn: &Connection, table: &str, id_column: &str) -> SatFireResult<usize> {
+    const BATCH_SIZE: i64 = 10_000;
+
+    let mut select = conn.prepare(&format!(
+        "SELECT {id}, pixels FROM {table} WHERE {id} > ?1 ORDER BY {id} LIMIT ?2",
+        id = id_column,
+        table = table,
+    ))?;
+    let mut update = conn.prepare(&format!(
+        "UPDATE {table} SET pixels = ?1 WHERE {id} = ?2",
+        id = id_column,
+        table = table,
+    ))?;
+
+    let mut last_id: i64 = i64::MIN;
+    let mut num_upgraded: usize = 0;
+
+    loop {
+        let mut batch: Vec<(i64, Vec<u8>)> = Vec::with_capacity(BATCH_SIZE as usize);
+        let mut num_rows = 0;
+
+        let mut rows = select.query([last_id, BATCH_SIZE])?;
+        while let Some(row) = rows.next()? {
+            num_rows += 1;
+            last_id = row.get(0)?;
+
+            if let rusqlite::types::ValueRef::Blob(bytes) = row.get_ref(1)? {
+                if PixelList::binary_version(bytes) != PixelList::BINARY_VERSION {
+                    let pixels = PixelList::binary_deserialize_slice(bytes)?;
+                    batch.push((last_id, pixels.binary_serialize()));
+                }
+            }
+        }
+
+        if num_rows == 0 {
+            break;
+        }
+
+        conn.execute("BEGIN TRANSACTION", [])?;
+        for (id, pixels) in &batch {
+            update.execute([pixels as &dyn ToSql, id])?;
+        }
+        conn.execute("COMMIT", [])?;
+
+        num_upgraded += batch.len();
+        info!(target: table, "upgraded {} rows, last id {}", num_upgraded, last_id);
+    }
+
+    Ok(num_upgraded)
+}
+
+/// Check if a table exists in the database.
+fn table_exists(conn: &Connection, name: &str) -> SatFireResult<bool> {
+    const QUERY: &str = "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = ?";
+
+    let count: i64 = conn.query_row(QUERY, [name], |row| row.get(0))?;
+    Ok(count > 0)
+}
+
+/// Check if an area covers the whole globe, so a spatial index wouldn't filter anything out.
+fn covers_globe(area: &BoundingBox) -> bool {
+    area.ll.lat <= -90.0 && area.ll.lon <= -180.0 && area.ur.lat >= 90.0 && area.ur.lon >= 180.0
+}
+
+/// Create the conditions for selecting rows from a spatial index that overlap an area.
+fn spatial_index_select(rtree_table: &str, area: &BoundingBox) -> String {
+    format!(
+        "AND {rtree}.max_lat >= {} AND {rtree}.min_lat <= {} AND
+             {rtree}.max_lon >= {} AND {rtree}.min_lon <= {}",
+        area.ll.lat,
+        area.ur.lat,
+        area.ll.lon,
+        area.ur.lon,
+        rtree = rtree_table,
+    )
+}
+
+/// Add the bounding box of a row to a spatial index.
+///
+/// Items without any pixels don't have a valid bounding box, they are left out of the index.
+fn add_spatial_index_row(
+    stmt: &mut rusqlite::Statement,
+    id: i64,
+    bbox: &BoundingBox,
+) -> SatFireResult<()> {
+    let BoundingBox { ll, ur } = bbox;
+
+    if [ll.lat, ll.lon, ur.lat, ur.lon]
+        .iter()
+        .all(|v| v.is_finite())
+    {
+        stmt.execute([&id as &dyn ToSql, &ll.lat, &ur.lat, &ll.lon, &ur.lon])?;
+    }
+
+    Ok(())
+}
+
+/// Add every row of a table that isn't in its spatial index yet to the index.
+///
+/// Like [upgrade_pixel_blobs] the rows are processed in batches ordered by id, each in its own
+/// transaction.
+fn fill_spatial_index(
+    conn: &Connection,
+    table: &str,
+    id_column: &str,
+    rtree_table: &str,
+    add_query: &str,
+) -> SatFireResult<usize> {
+    const BATCH_SIZE: i64 = 10_000;
+
+    let mut select = conn.prepare(&format!(
+        "SELECT {id}, pixels FROM {table}
+         WHERE {id} > ?1 AND {id} NOT IN (SELECT {id} FROM {rtree})
+         ORDER BY {id} LIMIT ?2",
+        id = id_column,
+        table = table,
+        rtree = rtree_table,
+    ))?;
+    let mut add = conn.prepare(add_query)?;
+
+    let mut last_id: i64 = i64::MIN;
+    let mut num_added: usize = 0;
+
+    loop {
+        let mut batch: Vec<(i64, BoundingBox)> = Vec::with_capacity(BATCH_SIZE as usize);
+
+        let mut rows = select.query([last_id, BATCH_SIZE])?;
+        while let Some(row) = rows.next()? {
+            last_id = row.get(0)?;
+
+            if let rusqlite::types::ValueRef::Blob(bytes) = row.get_ref(1)? {
+                let pixels = PixelList::binary_deserialize_slice(bytes)?;
+                batch.push((last_id, pixels.bounding_box()));
+            }
+        }
+
+        if batch.is_empty() {
+            break;
+        }
+
+        conn.execute("BEGIN TRANSACTION", [])?;
+        for (id, bbox) in &batch {
+            add_spatial_index_row(&mut add, *id, bbox)?;
+        }
+        conn.execute("COMMIT", [])?;
+
+        num_added += batch.len();
+        info!(target: table, "indexed {} rows, last id {}", num_added, last_id);
+    }
+
+    Ok(num_added)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::{
+        pixel::Pixel,
+        satellite::{DataQualityFlagCode, MaskCode},
+    };
+
+    fn scan(hour: u32, minute: u32) -> (DateTime<Utc>, DateTime<Utc>) {
+        let start = DateTime::<Utc>::from_utc(
+            chrono::NaiveDate::from_ymd_opt(2021, 8, 17)
+                .and_then(|d| d.and_hms_opt(hour, minute, 0))
+                .unwrap(),
+            Utc,
+        );
+
+        (start, start + Duration::minutes(5))
+    }
+
+    #[test]
+    fn processed_files_outside_window() {
+        let (since, _) = scan(20, 0);
+        let mut processed = ClusterDatabaseProcessedFiles {
+            keys: HashSet::default(),
+            windows: [((Satellite::G17, Sector::CONUS), since.timestamp())]
+                .into_iter()
+                .collect(),
+        };
+
+        let (start, end) = scan(20, 1);
+        assert!(processed.covers(Satellite::G17, Sector::CONUS, start, end));
+        assert!(processed.insert(Satellite::G17, Sector::CONUS, start, end));
+        assert!(processed.contains(Satellite::G17, Sector::CONUS, start, end));
+
+        // Older than the window, not being in the set says nothing about it.
+        let (start, end) = scan(19, 56);
+        assert!(!processed.covers(Satellite::G17, Sector::CONUS, start, end));
+        assert!(!processed.contains(Satellite::G17, Sector::CONUS, start, end));
+
+        // No window was loaded for this sector at all.
+        let (start, end) = scan(20, 1);
+        assert!(!processed.covers(Satellite::G17, Sector::FULL, start, end));
+
+        // Too long a scan to fit in a key.
+        let (start, _) = scan(20, 1);
+        let end = start + Duration::days(1);
+        assert!(!processed.covers(Satellite::G17, Sector::CONUS, start, end));
+    }
+
+    fn fire(id: u64, merged_into: u64, start: DateTime<Utc>, hours: i64) -> Fire {
+        let pixel = Pixel {
+            ul: Coord {
+                lat: 45.0,
+                lon: -120.0,
+            },
+            ll: Coord {
+                lat: 44.0,
+                lon: -120.0,
+            },
+            lr: Coord {
+                lat: 44.0,
+                lon: -119.0,
+            },
+            ur: Coord {
+                lat: 45.0,
+                lon: -119.0,
+            },
+            power: 100.0,
+            area: 2.5,
+            temperature: 350.0,
+            scan_angle: 6.0,
+            mask_flag: MaskCode(10),
+            data_quality_flag: DataQualityFlagCode(0),
+        };
+
+        let mut area = PixelList::new();
+        area.push(pixel);
+
+        let end = start + Duration::hours(hours);
+        Fire::new(
+            start,
+            end,
+            100.0,
+            350.0,
+            id,
+            area,
+            Satellite::G17,
+            merged_into,
+        )
+    }
+
+    fn association(cluster_id: u64, start: DateTime<Utc>, power: f64) -> FireAssociation {
+        FireAssociation {
+            cluster_id,
+            sector: Sector::CONUS,
+            start,
+            end: start + Duration::minutes(5),
+            power,
+            area: 1.0,
+            max_temperature: power,
+        }
+    }
+
+    #[test]
+    fn fire_time_series_merge_chain() {
+        let path =
+            std::env::temp_dir().join(format!("satfire-fires-{}.sqlite", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        let db = FiresDatabase::connect(&path).unwrap();
+        let mut add = db.prepare_to_add_fires().unwrap();
+
+        let (t0, _) = scan(20, 1);
+        let t1 = t0 + Duration::minutes(5);
+
+        // Fire 1 is merged into 2, which is merged into 3. Each is added after those merged into
+        // it, like connectfire does.
+        add.add_association(1, association(10, t0, 10.0));
+        add.add_association(2, association(20, t0, 5.0));
+        add.add_association(2, association(21, t1, 7.0));
+        add.add_association(3, association(30, t1, 1.0));
+        add.add_association(4, association(40, t1, 1.0));
+
+        let mut fires = FireList::new();
+        fires.add_fire(fire(1, 2, t0, 2));
+        // Too short to be written.
+        fires.add_fire(fire(4, 0, t0, 1));
+        add.add_fires(&fires).unwrap();
+
+        assert!(!add.associations.contains_key(&4));
+        assert_eq!(add.root_of(1).unwrap(), 2);
+
+        let mut fires = FireList::new();
+        fires.add_fire(fire(2, 3, t0, 2));
+        add.add_fires(&fires).unwrap();
+
+        let mut fires = FireList::new();
+        fires.add_fire(fire(3, 0, t0, 2));
+        add.add_fires(&fires).unwrap();
+
+        assert!(add.associations.is_empty());
+        for id in 1..=3 {
+            assert_eq!(add.root_of(id).unwrap(), 3);
+        }
+        drop(add);
+
+        let series = db.fire_time_series(1).unwrap();
+        assert_eq!(series.len(), 2);
+        assert!(series.iter().all(|row| row.root_id == 3));
+
+        assert_eq!(series[0].start, t0);
+        assert_eq!(series[0].power, 15.0);
+        assert_eq!(series[0].max_temperature, 10.0);
+        assert_eq!(series[0].num_clusters, 2);
+
+        assert_eq!(series[1].start, t1);
+        assert_eq!(series[1].power, 8.0);
+        assert_eq!(series[1].num_clusters, 2);
+
+        assert_eq!(db.fire_time_series(3).unwrap().len(), 2);
+        assert!(db
+            .fire_time_series(2)
+            .unwrap()
+            .iter()
+            .all(|row| row.root_id == 3));
+
+        drop(db);
+        std::fs::remove_file(&path).unwrap();
+    }
+}
@@ -1,2 +1 @@
-INSERT OR REPLACE INTO associations (fire_id, cluster_id) VALUES (?, ?)
-
+INSERT OR IGNORE INTO associations (fire_id, cluster_id) VALUES (?, ?)
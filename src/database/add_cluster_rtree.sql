@@ -0,0 +1,7 @@
+INSERT OR REPLACE INTO clusters_rtree (
+  cluster_id,
+  min_lat,
+  max_lat,
+  min_lon,
+  max_lon)
+VALUES (?, ?, ?, ?, ?)
@@ -0,0 +1,16 @@
+INSERT INTO fire_time_series (
+    root_id,
+    sector,
+    start_time,
+    end_time,
+    power,
+    area,
+    max_temperature,
+    num_clusters)
+VALUES (?, ?, ?, ?, ?, ?, ?, ?)
+ON CONFLICT (root_id, start_time, sector) DO UPDATE SET
+    end_time = MAX(end_time, excluded.end_time),
+    power = power + excluded.power,
+    area = area + excluded.area,
+    max_temperature = MAX(max_temperature, excluded.max_temperature),
+    num_clusters = num_clusters + excluded.num_clusters
@@ -12,14 +12,6 @@ CREATE TABLE IF NOT EXISTS clusters (
   max_scan_angle  REAL    NOT NULL,  -- degrees
   pixels          BLOB    NOT NULL);
 
-CREATE UNIQUE INDEX IF NOT EXISTS no_cluster_dups
-  ON clusters (satellite, sector, start_time,
-               end_time, lat, lon);
-
-CREATE INDEX IF NOT EXISTS file_processed
-  ON clusters (satellite, sector, start_time,
-               end_time);
-
 -- This table records files that have been processed, but 
 -- did not contain any clusters.
 CREATE TABLE IF NOT EXISTS no_clusters (
@@ -0,0 +1,7 @@
+CREATE UNIQUE INDEX IF NOT EXISTS no_cluster_dups
+  ON clusters (satellite, sector, start_time,
+               end_time, lat, lon);
+
+CREATE INDEX IF NOT EXISTS file_processed
+  ON clusters (satellite, sector, start_time,
+               end_time);
@@ -0,0 +1,13 @@
+-- An optional spatial index of the bounding boxes of all the pixels in each cluster. When this
+-- table exists, it is kept up to date as clusters are added and used for queries over an area.
+CREATE VIRTUAL TABLE IF NOT EXISTS clusters_rtree USING rtree(
+  cluster_id,
+  min_lat, max_lat,
+  min_lon, max_lon);
+
+-- Replacing a cluster deletes the old row, this only fires for that with recursive_triggers on.
+CREATE TRIGGER IF NOT EXISTS clusters_rtree_delete
+  AFTER DELETE ON clusters
+BEGIN
+  DELETE FROM clusters_rtree WHERE cluster_id = OLD.cluster_id;
+END;
@@ -17,3 +17,29 @@ CREATE TABLE IF NOT EXISTS associations (
   cluster_id INTEGER NOT NULL,
   UNIQUE(fire_id, cluster_id));
 
+
+-- The fire each fire was eventually merged into, fires that weren't merged are their own root.
+-- Kept up to date by connectfire, every fire points straight at its root.
+CREATE TABLE IF NOT EXISTS fire_roots (
+  fire_id INTEGER PRIMARY KEY,
+  root_id INTEGER NOT NULL);
+
+CREATE INDEX IF NOT EXISTS fire_roots_root ON fire_roots (root_id);
+
+-- The totals of the clusters from each scan of each root fire, including the fires merged into it.
+CREATE TABLE IF NOT EXISTS fire_time_series (
+  root_id         INTEGER NOT NULL,
+  sector          TEXT    NOT NULL,
+  start_time      INTEGER NOT NULL,  --unix timestamp
+  end_time        INTEGER NOT NULL,  --unix timestamp
+  power           REAL    NOT NULL,
+  area            REAL    NOT NULL,
+  max_temperature REAL    NOT NULL,
+  num_clusters    INTEGER NOT NULL,
+  PRIMARY KEY (root_id, start_time, sector)) WITHOUT ROWID;
+
+-- Every run of connectfire, so a run can tell if any other run changed the database since it saved
+-- its state.
+CREATE TABLE IF NOT EXISTS runs (
+  run_id  INTEGER PRIMARY KEY AUTOINCREMENT,
+  started INTEGER NOT NULL);  --unix timestamp
@@ -0,0 +1,13 @@
+-- An optional spatial index of the bounding boxes of all the pixels in each fire. When this
+-- table exists, it is kept up to date as fires are added and used for queries over an area.
+CREATE VIRTUAL TABLE IF NOT EXISTS fires_rtree USING rtree(
+  fire_id,
+  min_lat, max_lat,
+  min_lon, max_lon);
+
+-- Replacing a fire deletes the old row, this only fires for that with recursive_triggers on.
+CREATE TRIGGER IF NOT EXISTS fires_rtree_delete
+  AFTER DELETE ON fires
+BEGIN
+  DELETE FROM fires_rtree WHERE fire_id = OLD.fire_id;
+END;
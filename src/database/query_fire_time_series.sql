@@ -0,0 +1,12 @@
+SELECT
+    root_id,
+    sector,
+    start_time,
+    end_time,
+    power,
+    area,
+    max_temperature,
+    num_clusters
+FROM fire_time_series
+WHERE root_id = IFNULL((SELECT root_id FROM fire_roots WHERE fire_id = ?1), ?1)
+ORDER BY start_time ASC
@@ -0,0 +1,2 @@
+SELECT start_time, end_time FROM no_clusters
+WHERE satellite = ?1 AND sector = ?2 AND start_time >= ?3
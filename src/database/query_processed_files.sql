@@ -0,0 +1,5 @@
+SELECT start_time, end_time FROM clusters
+WHERE satellite = ?1 AND sector = ?2 AND start_time >= ?3
+UNION
+SELECT start_time, end_time FROM no_clusters
+WHERE satellite = ?1 AND sector = ?2 AND start_time >= ?3
@@ -0,0 +1,7 @@
+-- Without the no_cluster_dups index, INSERT OR REPLACE can't find older copies of a cluster, so
+-- remove them here keeping the most recently inserted copy.
+DELETE FROM clusters
+WHERE cluster_id NOT IN (
+  SELECT MAX(cluster_id)
+  FROM clusters
+  GROUP BY satellite, sector, start_time, end_time, lat, lon);
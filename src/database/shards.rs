@@ -0,0 +1,476 @@
+//! Store clusters in one database file per satellite per month.
+//!
+//! A cluster database path that is a directory holds a set of shards named like
+//! `G17_2021-08.sqlite`. Each shard is a complete cluster database with the clusters whose scan
+//! started in that month, so queries only open the months they need and ingest only writes to the
+//! month it is currently loading. Old months can be vacuumed, backed up, or archived on their own.
+//!
+//! Cluster ids have to stay unique across all the shards because the fires database refers to
+//! them. Each shard starts numbering its clusters at an offset made from its month and satellite,
+//! so the shard a cluster is stored in can also be found from its id.
+
+use super::{table_exists, ClusterDatabase, ClusterQueryRow};
+use crate::{satellite::Satellite, SatFireResult};
+use chrono::{DateTime, Datelike, NaiveDate, Utc};
+use crossbeam_channel::{bounded, Receiver};
+use rusqlite::Connection;
+use std::{
+    collections::VecDeque,
+    path::{Path, PathBuf},
+};
+use strum::IntoEnumIterator;
+
+/// The number of bits of a cluster id available for numbering the clusters within a shard.
+const CLUSTER_ID_SHIFT: u32 = 40;
+
+/// The number of slots for satellites in the shard part of a cluster id.
+const SATELLITE_SLOTS: i64 = 16;
+
+/// The name of the file that marks a bulk load with deferred indexes in progress.
+const BULK_LOAD_MARKER: &str = "bulk_load_in_progress";
+
+/// The number of rows each shard reader can get ahead of the merge.
+const ROWS_IN_FLIGHT_PER_SHARD: usize = 64;
+
+/// Identifies a single shard, a month of data from one satellite.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub(super) struct ShardKey {
+    /// Months since the start of year 0, so keys sort by time first.
+    month: i32,
+    /// The position of the satellite in `Satellite::iter()`.
+    sat: u8,
+}
+
+impl ShardKey {
+    /// Get the shard that data from this satellite with a scan start at time `t` goes in.
+    pub(super) fn for_time(sat: Satellite, t: DateTime<Utc>) -> Self {
+        let sat = Satellite::iter().position(|s| s == sat).unwrap() as u8;
+        let month = t.year() * 12 + t.month0() as i32;
+
+        ShardKey { month, sat }
+    }
+
+    /// Get the shard a cluster is stored in from its id.
+    pub(super) fn for_cluster_id(cluster_id: i64) -> Self {
+        let shard = cluster_id >> CLUSTER_ID_SHIFT;
+        let month = (shard / SATELLITE_SLOTS) as i32;
+        let sat = (shard % SATELLITE_SLOTS) as u8;
+
+        ShardKey { month, sat }
+    }
+
+    /// The cluster ids in this shard are all greater than this.
+    fn cluster_id_base(&self) -> i64 {
+        (self.month as i64 * SATELLITE_SLOTS + self.sat as i64) << CLUSTER_ID_SHIFT
+    }
+
+    pub(super) fn satellite(&self) -> Option<Satellite> {
+        Satellite::iter().nth(self.sat as usize)
+    }
+
+    /// The start of the month this shard covers.
+    pub(super) fn start(&self) -> DateTime<Utc> {
+        Self::month_start(self.month)
+    }
+
+    /// The start of the month after the one this shard covers.
+    pub(super) fn end(&self) -> DateTime<Utc> {
+        Self::month_start(self.month + 1)
+    }
+
+    fn month_start(month: i32) -> DateTime<Utc> {
+        let (year, month0) = (month.div_euclid(12), month.rem_euclid(12) as u32);
+
+        DateTime::from_utc(
+            NaiveDate::from_ymd_opt(year, month0 + 1, 1)
+                .and_then(|d| d.and_hms_opt(0, 0, 0))
+                .unwrap(),
+            Utc,
+        )
+    }
+
+    pub(super) fn file_name(&self) -> Option<String> {
+        let sat = self.satellite()?;
+        let (year, month0) = (self.month.div_euclid(12), self.month.rem_euclid(12));
+
+        Some(format!(
+            "{}_{:04}-{:02}.sqlite",
+            sat.name(),
+            year,
+            month0 + 1
+        ))
+    }
+
+    fn from_file_name(fname: &str) -> Option<Self> {
+        let (sat, year_month) = fname.strip_suffix(".sqlite")?.split_once('_')?;
+        let (year, month) = year_month.split_once('-')?;
+
+        let sat = Satellite::iter().position(|s| s.name() == sat)? as u8;
+        let year: i32 = year.parse().ok()?;
+        let month: i32 = month.parse().ok()?;
+
+        if !(1..=12).contains(&month) {
+            return None;
+        }
+
+        Some(ShardKey {
+            month: year * 12 + month - 1,
+            sat,
+        })
+    }
+}
+
+/// The directory of a sharded cluster database.
+#[derive(Debug, Clone)]
+pub(super) struct ShardSet {
+    dir: PathBuf,
+}
+
+impl ShardSet {
+    /// Check if a cluster database path is for a sharded database.
+    pub(super) fn is_sharded(path: &Path) -> bool {
+        path.is_dir()
+    }
+
+    pub(super) fn new(dir: &Path) -> Self {
+        ShardSet {
+            dir: dir.to_owned(),
+        }
+    }
+
+    /// Get all the shards in the database, sorted by time and then satellite.
+    pub(super) fn keys(&self) -> SatFireResult<Vec<ShardKey>> {
+        let mut keys = Vec::new();
+
+        for entry in std::fs::read_dir(&self.dir)? {
+            if let Some(key) = ShardKey::from_file_name(&entry?.file_name().to_string_lossy()) {
+                keys.push(key);
+            }
+        }
+
+        keys.sort_unstable();
+        Ok(keys)
+    }
+
+    /// Get the shards that could have data for this satellite with a scan start in the time range.
+    pub(super) fn keys_for(
+        &self,
+        sat: Option<Satellite>,
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+    ) -> SatFireResult<Vec<ShardKey>> {
+        Ok(self
+            .keys()?
+            .into_iter()
+            .filter(|key| sat.is_none() || key.satellite() == sat)
+            .filter(|key| key.end() > start && key.start() <= end)
+            .collect())
+    }
+
+    fn path(&self, key: ShardKey) -> SatFireResult<PathBuf> {
+        let fname = key.file_name().ok_or("Invalid shard")?;
+        Ok(self.dir.join(fname))
+    }
+
+    /// Open a shard to add data, creating it if needed.
+    pub(super) fn connect(&self, key: ShardKey) -> SatFireResult<Connection> {
+        let conn = ClusterDatabase::open_database_to_write(&self.path(key)?)?;
+
+        // The first id AUTOINCREMENT hands out is one more than the sequence value.
+        conn.execute(
+            "INSERT INTO sqlite_sequence (name, seq)
+             SELECT 'clusters', ?1
+             WHERE NOT EXISTS (SELECT 1 FROM sqlite_sequence WHERE name = 'clusters')",
+            [key.cluster_id_base()],
+        )?;
+
+        if self.bulk_load_in_progress() && !ClusterDatabase::indexes_deferred(&conn)? {
+            conn.execute_batch(super::DEFER_INDEXES_QUERY)?;
+        }
+
+        Ok(conn)
+    }
+
+    /// Open a shard if it exists.
+    pub(super) fn open_existing(&self, key: ShardKey) -> SatFireResult<Option<Connection>> {
+        let path = self.path(key)?;
+
+        if path.is_file() {
+            Ok(Some(ClusterDatabase::open_database_to_write(&path)?))
+        } else {
+            Ok(None)
+        }
+    }
+
+    fn bulk_load_marker(&self) -> PathBuf {
+        self.dir.join(BULK_LOAD_MARKER)
+    }
+
+    /// Check if indexes are deferred for a bulk load, so new shards should defer them too.
+    pub(super) fn bulk_load_in_progress(&self) -> bool {
+        self.bulk_load_marker().exists()
+    }
+
+    pub(super) fn start_bulk_load(&self) -> SatFireResult<()> {
+        std::fs::write(self.bulk_load_marker(), [])?;
+        Ok(())
+    }
+
+    pub(super) fn finish_bulk_load(&self) -> SatFireResult<()> {
+        match std::fs::remove_file(self.bulk_load_marker()) {
+            Ok(()) => Ok(()),
+            Err(err) if err.kind() == std::io::ErrorKind::NotFound => Ok(()),
+            Err(err) => Err(err.into()),
+        }
+    }
+
+    /// Run `f` on each existing shard in parallel and collect the results in the same order as
+    /// `keys`.
+    pub(super) fn for_each<T, F>(&self, keys: &[ShardKey], f: F) -> SatFireResult<Vec<T>>
+    where
+        T: Send,
+        F: Fn(ShardKey, &Connection) -> SatFireResult<T> + Sync,
+    {
+        let num_threads = num_cpus::get().min(keys.len()).max(1);
+        let chunk_size = (keys.len() + num_threads - 1) / num_threads;
+        let f = &f;
+
+        std::thread::scope(|scope| {
+            let handles: Vec<_> = keys
+                .chunks(chunk_size.max(1))
+                .map(|chunk| {
+                    scope.spawn(move || -> SatFireResult<Vec<T>> {
+                        let mut results = Vec::with_capacity(chunk.len());
+                        for &key in chunk {
+                            if let Some(conn) = self.open_existing(key)? {
+                                results.push(f(key, &conn)?);
+                            }
+                        }
+                        Ok(results)
+                    })
+                })
+                .collect();
+
+            let mut results = Vec::with_capacity(keys.len());
+            for handle in handles {
+                results.extend(handle.join().map_err(|_| "shard thread panicked")??);
+            }
+            Ok(results)
+        })
+    }
+
+    /// Run a cluster query on several shards and merge the results in order of scan start.
+    ///
+    /// The queries must return cluster rows ordered by `start_time`, `indexed_query` is used
+    /// instead of `query` on shards with a spatial index. Each shard is read on its own thread, a
+    /// few shards ahead of the one being consumed.
+    pub(super) fn merged_rows<T: ClusterQueryRow>(
+        &self,
+        keys: Vec<ShardKey>,
+        query: String,
+        indexed_query: Option<String>,
+    ) -> MergedClusterRows<T> {
+        let mut months: VecDeque<Vec<ShardKey>> = VecDeque::new();
+        for key in keys {
+            match months.back_mut() {
+                Some(month) if month[0].month == key.month => month.push(key),
+                _ => months.push_back(vec![key]),
+            }
+        }
+
+        let mut rows = MergedClusterRows {
+            shards: self.clone(),
+            query,
+            indexed_query,
+            waiting: months,
+            started: VecDeque::new(),
+            current: Vec::new(),
+            error: None,
+            max_readers: num_cpus::get().max(1),
+        };
+        rows.start_readers();
+
+        rows
+    }
+}
+
+/// A channel of rows from a thread reading a single shard.
+type ShardRows<T> = Receiver<Result<T, String>>;
+
+/// An iterator over cluster rows from several shards, see [ShardSet::merged_rows].
+pub(super) struct MergedClusterRows<T> {
+    shards: ShardSet,
+    query: String,
+    indexed_query: Option<String>,
+    /// Months that haven't been started yet.
+    waiting: VecDeque<Vec<ShardKey>>,
+    /// Months with reader threads running, but that aren't being merged yet.
+    started: VecDeque<Vec<ShardRows<T>>>,
+    /// The shards in the month being merged now, with the next row from each.
+    current: Vec<(ShardRows<T>, Option<T>)>,
+    /// An error from a reader that hasn't been returned yet.
+    error: Option<String>,
+    max_readers: usize,
+}
+
+impl<T: ClusterQueryRow> MergedClusterRows<T> {
+    /// Start reader threads for as many months as the limit allows, but always at least one.
+    fn start_readers(&mut self) {
+        let mut num_readers: usize = self.started.iter().map(|month| month.len()).sum();
+
+        while num_readers == 0 || num_readers < self.max_readers {
+            let month = match self.waiting.pop_front() {
+                Some(month) => month,
+                None => break,
+            };
+
+            num_readers += month.len();
+            let readers = month
+                .into_iter()
+                .map(|key| self.spawn_reader(key))
+                .collect();
+            self.started.push_back(readers);
+        }
+    }
+
+    fn spawn_reader(&self, key: ShardKey) -> ShardRows<T> {
+        let (to_merge, from_reader) = bounded(ROWS_IN_FLIGHT_PER_SHARD);
+        let shards = self.shards.clone();
+        let query = self.query.clone();
+        let indexed_query = self.indexed_query.clone();
+
+        std::thread::spawn(move || {
+            let read = || -> SatFireResult<()> {
+                let conn = match shards.open_existing(key)? {
+                    Some(conn) => conn,
+                    None => return Ok(()),
+                };
+                let query = match indexed_query {
+                    Some(ref indexed_query) if table_exists(&conn, "clusters_rtree")? => {
+                        indexed_query
+                    }
+                    _ => &query,
+                };
+                let mut stmt = conn.prepare(query)?;
+
+                for row in stmt.query_and_then([], T::from_query_row)? {
+                    // An error means the iterator was dropped, so stop reading.
+                    if to_merge.send(row.map_err(|err| err.to_string())).is_err() {
+                        break;
+                    }
+                }
+
+                Ok(())
+            };
+
+            if let Err(err) = read() {
+                let _ = to_merge.send(Err(err.to_string()));
+            }
+        });
+
+        from_reader
+    }
+
+    /// Move on to the next month, returns false if there are no more.
+    fn next_month(&mut self) -> bool {
+        self.start_readers();
+
+        match self.started.pop_front() {
+            Some(month) => {
+                self.current = month.into_iter().map(|rows| (rows, None)).collect();
+                for i in 0..self.current.len() {
+                    self.recv(i);
+                }
+
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// Get the next row from shard `i` in the current month.
+    fn recv(&mut self, i: usize) {
+        let (rows, next) = &mut self.current[i];
+
+        match rows.recv() {
+            Ok(Ok(row)) => *next = Some(row),
+            Ok(Err(err)) => self.error = Some(err),
+            // The reader is done with this shard.
+            Err(_) => {}
+        }
+    }
+}
+
+impl<T: ClusterQueryRow> Iterator for MergedClusterRows<T> {
+    type Item = SatFireResult<T>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        loop {
+            if let Some(err) = self.error.take() {
+                return Some(Err(err.into()));
+            }
+
+            let earliest = self
+                .current
+                .iter()
+                .enumerate()
+                .filter_map(|(i, (_, next))| next.as_ref().map(|row| (i, row.scan_start())))
+                .min_by_key(|&(_, start)| start)
+                .map(|(i, _)| i);
+
+            match earliest {
+                Some(i) => {
+                    let row = self.current[i].1.take();
+                    self.recv(i);
+                    return row.map(Ok);
+                }
+                None => {
+                    if !self.next_month() {
+                        return None;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn shard_key_file_names() {
+        let t = DateTime::<Utc>::from_utc(
+            NaiveDate::from_ymd_opt(2021, 8, 17)
+                .and_then(|d| d.and_hms_opt(20, 1, 0))
+                .unwrap(),
+            Utc,
+        );
+
+        let key = ShardKey::for_time(Satellite::G17, t);
+        assert_eq!(key.file_name().unwrap(), "G17_2021-08.sqlite");
+        assert_eq!(ShardKey::from_file_name("G17_2021-08.sqlite"), Some(key));
+        assert!(key.start() <= t && t < key.end());
+        assert_eq!(key.end().month(), 9);
+
+        assert_eq!(ShardKey::from_file_name("G17_2021-13.sqlite"), None);
+        assert_eq!(ShardKey::from_file_name("G19_2021-08.sqlite"), None);
+        assert_eq!(ShardKey::from_file_name("bulk_load_in_progress"), None);
+    }
+
+    #[test]
+    fn shard_key_cluster_ids() {
+        for sat in Satellite::iter() {
+            let t = sat.operational();
+            let key = ShardKey::for_time(sat, t);
+
+            let first_id = key.cluster_id_base() + 1;
+            assert_eq!(ShardKey::for_cluster_id(first_id), key);
+            assert_eq!(ShardKey::for_cluster_id(first_id + 1_000_000), key);
+            assert!(first_id > 0);
+
+            let next_month = ShardKey::for_time(sat, key.end());
+            assert!(next_month.cluster_id_base() > first_id + 1_000_000);
+        }
+    }
+}
@@ -0,0 +1,12 @@
+SELECT associations.cluster_id
+FROM associations
+WHERE associations.fire_id in (
+     WITH RECURSIVE
+          find_mergers(x) AS (
+	           VALUES(?)
+		       UNION ALL
+		       SELECT fire_id FROM fires, find_mergers WHERE merged_into = find_mergers.x
+          )
+	      SELECT fire_id FROM fires
+	     WHERE fire_id IN find_mergers
+)
@@ -1,20 +1,41 @@
 use crate::{
+    cluster::DisjointSet,
     database::ClusterDatabaseClusterRow,
-    geo::{BoundingBox, Coord, Geo, Hilbert2DRTreeView},
+    geo::{BoundingBox, Coord, Geo, Hilbert2DRTree},
     pixel::PixelList,
     satellite::Satellite,
     KmlWriter, KmzFile, SatFireResult,
 };
-use chrono::{DateTime, Duration, Utc};
+use chrono::{DateTime, Duration, NaiveDateTime, Utc};
+use once_cell::unsync::OnceCell;
+use rustc_hash::FxHashMap as HashMap;
 use std::{
     cell::Cell,
     fmt::{self, Display, Write},
-    ops::ControlFlow,
+    io::Read,
     path::Path,
+    sync::Arc,
 };
+use strum::IntoEnumIterator;
+
+mod paging;
+use paging::PagedPixels;
+pub use paging::PixelScratchFile;
 
 const OVERLAP_FUDGE_FACTOR: f64 = 1.0e-2;
 
+/// The domain of the spatial index for a [FireList].
+const FULL_DOMAIN: BoundingBox = BoundingBox {
+    ll: Coord {
+        lat: -90.0,
+        lon: -180.0,
+    },
+    ur: Coord {
+        lat: 90.0,
+        lon: 180.0,
+    },
+};
+
 /**
  * The aggregate properties of a temporally connected group of [Cluster](crate::Cluster) objects.
  *
@@ -51,12 +72,20 @@ pub struct Fire {
     /// area during the fire. Since all the data for each satellite is projected to a common grid
     /// before being published online, throughout the life of the fire the Pixels will perfectly
     /// overlap. This is kind of a composite of the properties of the fire over it's lifetime.
-    area: PixelList,
+    ///
+    /// This is empty while the pixels are paged out, it is filled back in from `paged_out` the
+    /// next time they are needed. Use [Fire::pixels] instead of accessing this directly.
+    area: OnceCell<PixelList>,
+    /// A copy of the pixels in a scratch file, if they have been paged out and not changed since.
+    paged_out: Option<Arc<PagedPixels>>,
     /// The satellite the Clusters that were a part of this fire were observed with.
     sat: Satellite,
     /// If this fire was merged into another, what was the identity of that fire. The value 0
     /// implies it has not yet been merged into another fire.
     merged_into: u64,
+    /// Set when this fire has grown, or joined a list, since the last time [FireList::merge_fires]
+    /// checked it against the other fires in its list.
+    dirty: bool,
 
     /// Make a cache for items expensive to calculate.
     cache_up_to_date: Cell<bool>,
@@ -92,7 +121,7 @@ impl Display for Fire {
         writeln!(f, "    Last Observed: {}", self.last_observed)?;
         writeln!(f, "         Duration: {}", duration_buf)?;
         writeln!(f, "         Centroid: {:.6},{:.6}", centroid.lat, centroid.lon)?;
-        writeln!(f, "Pixel List Length: {}", self.area.len())?;
+        writeln!(f, "Pixel List Length: {}", self.num_pixels())?;
         writeln!(f, "        Max Power: {:.0} MW", self.max_power)?;
         writeln!(f, "  Max Temperature: {:.0}K", self.max_temperature)
     }
@@ -116,9 +145,11 @@ impl Fire {
             max_power,
             max_temperature,
             id,
-            area,
+            area: OnceCell::from(area),
+            paged_out: None,
             sat,
             merged_into,
+            dirty: true,
             cache_up_to_date: Cell::new(false),
             centroid: Cell::new(Coord { lat: 0.0, lon: 0.0 }),
             bbox: Cell::new(BoundingBox::default()),
@@ -175,8 +206,63 @@ impl Fire {
     }
 
     /// Get access to the pixels in the wildfire.
+    ///
+    /// If the pixels were paged out by [FireList::page_out_cold_fires] they are read back in.
+    ///
+    /// # Panics
+    /// If the pixels were paged out and can't be read back in from the scratch file, use
+    /// [Fire::try_pixels] wherever that can happen.
     pub fn pixels(&self) -> &PixelList {
-        &self.area
+        self.try_pixels()
+            .expect("Error reading paged out pixels from the scratch file")
+    }
+
+    /// Get access to the pixels in the wildfire, or the error reading them back in if they were
+    /// paged out by [FireList::page_out_cold_fires].
+    pub fn try_pixels(&self) -> SatFireResult<&PixelList> {
+        self.area.get_or_try_init(|| match self.paged_out {
+            Some(ref paged) => paged.page_in(),
+            None => Err("Fire has no pixels".into()),
+        })
+    }
+
+    /// Get the number of pixels in the wildfire without reading them in if they are paged out.
+    pub fn num_pixels(&self) -> usize {
+        match self.area.get() {
+            Some(area) => area.len(),
+            None => self.paged_out.as_ref().map_or(0, |paged| paged.len()),
+        }
+    }
+
+    /// Check if the pixels are only in the scratch file right now.
+    fn is_paged_out(&self) -> bool {
+        self.area.get().is_none()
+    }
+
+    /// Get the pixels to modify them, the paged out copy is out of date after this.
+    fn area_mut(&mut self) -> SatFireResult<&mut PixelList> {
+        self.try_pixels()?;
+        self.paged_out = None;
+        Ok(self.area.get_mut().expect("Fire has no pixels"))
+    }
+
+    /// Write the pixels out to `scratch` and drop them from memory.
+    ///
+    /// The bounding box and centroid are kept, so the fire can still be found in a spatial index.
+    fn page_out(&mut self, scratch: &Arc<PixelScratchFile>) -> SatFireResult<()> {
+        if self.is_paged_out() {
+            return Ok(());
+        }
+
+        self.update_cache();
+
+        // Pixels that were paged in, but not modified, are still in the scratch file.
+        if self.paged_out.is_none() {
+            self.paged_out = Some(Arc::new(scratch.page_out(self.pixels())?));
+        }
+
+        self.area.take();
+        Ok(())
     }
 
     /// Get the satellite this fire was observed from.
@@ -185,19 +271,25 @@ impl Fire {
     }
 
     /// Update a wildfire by adding the information in this ClusterDatabaseClusterRow to it.
-    pub fn update(&mut self, row: &ClusterDatabaseClusterRow) {
+    ///
+    /// This fails if the pixels were paged out and can't be read back in, the fire is left as it
+    /// was.
+    pub fn update(&mut self, row: &ClusterDatabaseClusterRow) -> SatFireResult<()> {
         debug_assert!(row.sat == self.sat);
 
-        self.last_observed = row.end;
+        self.area_mut()?.max_merge(&row.pixels);
+
+        self.last_observed = self.last_observed.max(row.end);
         self.max_power = self.max_power.max(row.power);
         self.max_temperature = self.max_temperature.max(row.max_temperature);
 
+        self.dirty = true;
         self.invalidate_cache();
-        self.area.max_merge(&row.pixels);
+        Ok(())
     }
 
     /// Merge two wildfires.
-    fn merge_with(&mut self, right: &mut Self) {
+    fn merge_with(&mut self, right: &mut Self) -> SatFireResult<()> {
         debug_assert_eq!(self.sat, right.sat);
 
         // The fire with the lower value for the id was created first, so prefer to keep it
@@ -206,6 +298,8 @@ impl Fire {
             std::mem::swap(self, right);
         }
 
+        self.area_mut()?.max_merge(right.try_pixels()?);
+
         if right.first_observed < self.first_observed {
             self.first_observed = right.first_observed;
         }
@@ -214,37 +308,25 @@ impl Fire {
             self.last_observed = right.last_observed;
         }
 
+        self.dirty = true;
         self.invalidate_cache();
-        self.area.max_merge(&right.area);
 
         self.max_power = self.max_power.max(right.max_power);
         self.max_temperature = self.max_temperature.max(right.max_temperature);
 
         right.merged_into = self.id;
+        Ok(())
     }
 
     /// Format the duration in an easy to read way.
     pub fn format_duration(&self, buffer: &mut String) {
-        buffer.clear();
-        let duration = self.duration();
-        let weeks = duration.num_weeks();
-        if weeks > 0 {
-            let _ = write!(buffer as &mut dyn std::fmt::Write, "{} weeks ", weeks);
-        }
-
-        let days = duration.num_days() % 7;
-        if days > 0 {
-            let _ = write!(buffer as &mut dyn std::fmt::Write, "{} days ", days);
-        }
-
-        let hours = duration.num_hours() % 24;
-        let _ = write!(buffer as &mut dyn std::fmt::Write, "{} hours", hours);
+        format_duration(self.duration(), buffer);
     }
 
     fn update_cache(&self) {
         if !self.cache_up_to_date.get() {
-            self.bbox.set(self.area.bounding_box());
-            self.centroid.set(self.area.centroid());
+            self.bbox.set(self.pixels().bounding_box());
+            self.centroid.set(self.pixels().centroid());
             self.cache_up_to_date.set(true);
         }
     }
@@ -254,6 +336,23 @@ impl Fire {
     }
 }
 
+/// Format a duration in an easy to read way.
+pub(crate) fn format_duration(duration: Duration, buffer: &mut String) {
+    buffer.clear();
+    let weeks = duration.num_weeks();
+    if weeks > 0 {
+        let _ = write!(buffer as &mut dyn std::fmt::Write, "{} weeks ", weeks);
+    }
+
+    let days = duration.num_days() % 7;
+    if days > 0 {
+        let _ = write!(buffer as &mut dyn std::fmt::Write, "{} days ", days);
+    }
+
+    let hours = duration.num_hours() % 24;
+    let _ = write!(buffer as &mut dyn std::fmt::Write, "{} hours", hours);
+}
+
 impl Geo for Fire {
     fn centroid(&self) -> Coord {
         self.update_cache();
@@ -267,7 +366,15 @@ impl Geo for Fire {
 }
 
 /// A list of [Fire] objects.
-pub struct FireList(Vec<Fire>);
+///
+/// The first time the list is searched a spatial index is built for it, and after that the index
+/// is kept up to date as fires are added, removed, and updated. So a list that is searched over
+/// and over again, like the list of ongoing fires in connectfire, only pays for building the
+/// index once in a while.
+pub struct FireList {
+    fires: Vec<Fire>,
+    index: Option<Hilbert2DRTree>,
+}
 
 #[derive(Debug, Clone)]
 pub enum FireListUpdateResult {
@@ -282,25 +389,30 @@ impl Default for FireList {
 }
 
 impl From<Vec<Fire>> for FireList {
-    fn from(src: Vec<Fire>) -> Self {
-        FireList(src)
+    fn from(mut fires: Vec<Fire>) -> Self {
+        fires.iter_mut().for_each(|fire| fire.dirty = true);
+        FireList { fires, index: None }
     }
 }
 
 impl FireList {
     /// Create a new, empty list.
     pub fn new() -> Self {
-        FireList(vec![])
+        Self::from(vec![])
     }
 
     /// Get a vector of fires
     pub fn into_vec(self) -> Vec<Fire> {
-        self.0
+        self.fires
     }
 
     /// Add a fire to the list.
-    pub fn add_fire(&mut self, fire: Fire) {
-        self.0.push(fire)
+    pub fn add_fire(&mut self, mut fire: Fire) {
+        fire.dirty = true;
+        if let Some(index) = self.index.as_mut() {
+            index.push(fire.bounding_box());
+        }
+        self.fires.push(fire)
     }
 
     /// Create a new fire and add it to the list.
@@ -315,21 +427,29 @@ impl FireList {
     /// # Returns
     ///
     /// `Some(clust)` if `clust` was not matched to a fire and used to update it. If the
-    /// `clust` was consumed, then it returns `None`.
-    pub fn update(&mut self, row: ClusterDatabaseClusterRow) -> FireListUpdateResult {
+    /// `clust` was consumed, then it returns `None`. It is an error if the pixels of a paged out
+    /// fire can't be read back in.
+    pub fn update(
+        &mut self,
+        row: ClusterDatabaseClusterRow,
+    ) -> SatFireResult<FireListUpdateResult> {
         let cluster_pixels: &PixelList = &row.pixels;
         let cluster_bbox = cluster_pixels.bounding_box();
 
-        for fire in self.0.iter_mut() {
+        for (fire_idx, fire) in self.fires.iter_mut().enumerate() {
             if cluster_bbox.overlap(&fire.bounding_box(), OVERLAP_FUDGE_FACTOR) {
-                if cluster_pixels.adjacent_to_or_overlaps(&fire.area, OVERLAP_FUDGE_FACTOR) {
-                    fire.update(&row);
-                    return FireListUpdateResult::Match(fire.id);
+                if cluster_pixels.adjacent_to_or_overlaps(fire.try_pixels()?, OVERLAP_FUDGE_FACTOR)
+                {
+                    fire.update(&row)?;
+                    if let Some(index) = self.index.as_mut() {
+                        index.grow(fire_idx, fire.bounding_box());
+                    }
+                    return Ok(FireListUpdateResult::Match(fire.id));
                 }
             }
         }
 
-        FireListUpdateResult::NoMatch(row)
+        Ok(FireListUpdateResult::NoMatch(row))
     }
 
     /// Extend a fire list using another fire list, the `src` list is left empty.
@@ -337,100 +457,147 @@ impl FireList {
     /// Returns the number of items added to this list.
     pub fn extend(&mut self, src: &mut Self) -> usize {
         let src_sz = src.len();
-        self.0.append(&mut src.0);
+        for fire in &mut src.fires {
+            fire.dirty = true;
+            if let Some(index) = self.index.as_mut() {
+                index.push(fire.bounding_box());
+            }
+        }
+        self.fires.append(&mut src.fires);
+        src.index = None;
         src_sz
     }
 
+    /// Remove a fire the same way `Vec::swap_remove` does, keeping the spatial index current.
+    fn swap_remove(&mut self, fire_idx: usize) -> Fire {
+        if let Some(index) = self.index.as_mut() {
+            index.swap_remove(fire_idx);
+        }
+        self.fires.swap_remove(fire_idx)
+    }
+
+    /// Get the spatial index for the list, building or rebuilding it if needed.
+    ///
+    /// This takes the fields separately so the fires can still be modified while the index is
+    /// borrowed. Returns `None` if the list is empty.
+    fn spatial_index<'a>(
+        fires: &[Fire],
+        index: &'a mut Option<Hilbert2DRTree>,
+    ) -> Option<&'a mut Hilbert2DRTree> {
+        if index.as_ref().map_or(true, Hilbert2DRTree::needs_rebuild) {
+            *index = Hilbert2DRTree::build_for(fires, Some(FULL_DOMAIN));
+        }
+
+        index.as_mut()
+    }
+
     /// Detect overlaps in the fires in the list and merge them together into a single fire.
     ///
+    /// Only fires that have grown or joined the list since the last call are checked against the
+    /// others, two fires that have not changed were already found not to overlap. Fires that
+    /// overlap, directly or through a chain of other fires, are merged into the oldest one of
+    /// them in a single pass, so this is cheap enough to call after every scan.
+    ///
     /// # Arguments
     /// merged_away - is a list to move the smaller of two merged fires into.
     ///
     /// # Returns
-    /// The number of mergers that occurred.
-    pub fn merge_fires(&mut self, merged_away: &mut Self) -> usize {
-        const FULL_DOMAIN: BoundingBox = BoundingBox {
-            ll: Coord {
-                lat: -90.0,
-                lon: -180.0,
-            },
-            ur: Coord {
-                lat: 90.0,
-                lon: 180.0,
-            },
+    /// The number of mergers that occurred, or the error reading the pixels of a paged out fire
+    /// back in. Nothing is merged if there is an error.
+    pub fn merge_fires(&mut self, merged_away: &mut Self) -> SatFireResult<usize> {
+        let index = match Self::spatial_index(&self.fires, &mut self.index) {
+            Some(index) => index,
+            None => return Ok(0),
         };
 
-        let starting_size = self.0.len();
-        let mut to_delete = std::collections::HashSet::<usize>::new();
+        let mut sets = DisjointSet::new(self.fires.len());
+        let mut any_overlaps = false;
+        let mut candidates = vec![];
 
-        let mut size_change = usize::MAX;
+        for (fire_idx, fire) in self.fires.iter().enumerate() {
+            if !fire.dirty {
+                continue;
+            }
 
-        // Repeat until we stop finding mergers.
-        while size_change > 0 {
-            let iteration_size = self.0.len();
+            index.indexes_overlapping(&fire.bounding_box(), &mut candidates);
 
-            // Safety: Doing this so I can have 2 mutable pointers at the same time to an element
-            // within the slice. I never modify it, which is checked for by comparing the fire id's in
-            // the closure.
-            unsafe {
-                let secret_slice =
-                    std::slice::from_raw_parts_mut(self.0.as_mut_ptr(), self.0.len());
+            for &candidate_idx in &candidates {
+                // If both are dirty only check the pair once.
+                let candidate = &self.fires[candidate_idx];
+                if candidate_idx == fire_idx || (candidate.dirty && candidate_idx < fire_idx) {
+                    continue;
+                }
 
-                if let Some(mut view) =
-                    Hilbert2DRTreeView::build_for(secret_slice, Some(FULL_DOMAIN))
+                if sets.find(fire_idx) != sets.find(candidate_idx)
+                    && fire
+                        .try_pixels()?
+                        .adjacent_to_or_overlaps(candidate.try_pixels()?, OVERLAP_FUDGE_FACTOR)
                 {
-                    let potential_overlaps = view.indexes_of_potential_overlap();
-
-                    for index in potential_overlaps {
-                        // Safe because index is in range as defined by iteration_size.
-                        let fire = &mut *(self.0.get_unchecked_mut(index) as *mut Fire);
-
-                        let region = fire.bounding_box();
-                        (to_delete, _) = view.foreach(
-                            region,
-                            (to_delete, fire),
-                            |candidate_fire, candidate_index, (mut to_del_set, fire)| {
-                                if fire.id() == candidate_fire.id()
-                                    || to_del_set.contains(&index)
-                                    || to_del_set.contains(&candidate_index)
-                                    || !fire.area.adjacent_to_or_overlaps(
-                                        &candidate_fire.area,
-                                        OVERLAP_FUDGE_FACTOR,
-                                    )
-                                {
-                                    (false, ControlFlow::Continue((to_del_set, fire)))
-                                } else {
-                                    fire.merge_with(candidate_fire);
-                                    to_del_set.insert(candidate_index);
-                                    (true, ControlFlow::Continue((to_del_set, fire)))
-                                }
-                            },
-                        );
-                    }
+                    sets.union(fire_idx, candidate_idx);
+                    any_overlaps = true;
                 }
             }
+        }
 
-            let mut to_delete_vec: Vec<_> = to_delete.drain().collect();
-            to_delete_vec.sort_unstable_by_key(|v| std::cmp::Reverse(*v));
+        let mut to_delete = vec![];
+        if any_overlaps {
+            let mut groups: HashMap<usize, Vec<usize>> = HashMap::default();
+            for fire_idx in 0..self.fires.len() {
+                groups
+                    .entry(sets.find(fire_idx))
+                    .or_default()
+                    .push(fire_idx);
+            }
 
-            for idx in to_delete_vec {
-                let temp = self.0.swap_remove(idx);
-                merged_away.0.push(temp);
+            let groups: Vec<_> = groups
+                .into_values()
+                .filter(|group| group.len() > 1)
+                .collect();
+
+            // Read in the pixels of every fire being merged before changing any of them, so a
+            // paged out fire that can't be read back in leaves the list as it was.
+            for &fire_idx in groups.iter().flatten() {
+                self.fires[fire_idx].try_pixels()?;
             }
-            size_change = iteration_size - self.0.len();
+
+            for mut group in groups {
+                // Merge everything into the oldest fire, so they all get merged_into set to the
+                // fire that survives.
+                group.sort_unstable_by_key(|&fire_idx| self.fires[fire_idx].id);
+
+                let keep_idx = group[0];
+                for &merge_idx in &group[1..] {
+                    let (keep, merge) = get_pair_mut(&mut self.fires, keep_idx, merge_idx);
+                    // The pixels are all in memory, so this can't fail.
+                    keep.merge_with(merge)?;
+                }
+
+                index.grow(keep_idx, self.fires[keep_idx].bounding_box());
+                to_delete.extend_from_slice(&group[1..]);
+            }
+        }
+
+        for fire in &mut self.fires {
+            fire.dirty = false;
+        }
+
+        to_delete.sort_unstable_by_key(|v| std::cmp::Reverse(*v));
+        for &idx in &to_delete {
+            let temp = self.swap_remove(idx);
+            merged_away.add_fire(temp);
         }
 
-        starting_size - self.0.len()
+        Ok(to_delete.len())
     }
 
     /// Get the number of fires in the list.
     pub fn len(&self) -> usize {
-        self.0.len()
+        self.fires.len()
     }
 
     /// Check if this list is empty.
     pub fn is_empty(&self) -> bool {
-        self.0.is_empty()
+        self.fires.is_empty()
     }
 
     /// Remove fires from the list that are likely no longer burning.
@@ -443,25 +610,126 @@ impl FireList {
     /// The number of items moved to the `removed` list.
     pub fn drain_stale_fires(&mut self, removed: &mut Self, current_time: DateTime<Utc>) -> usize {
         let mut i = 0;
-        let mut len = self.0.len();
-        let starting_size = self.0.len();
+        let mut len = self.fires.len();
+        let starting_size = self.fires.len();
         while i < len {
-            let f = unsafe { self.0.get_unchecked(i) };
+            let f = unsafe { self.fires.get_unchecked(i) };
             if wildfire_is_stale(f, current_time) {
-                let temp = self.0.swap_remove(i);
+                let temp = self.swap_remove(i);
                 len -= 1;
-                removed.0.push(temp);
+                removed.add_fire(temp);
             } else {
                 i += 1;
             }
         }
 
-        starting_size - self.0.len()
+        starting_size - self.fires.len()
+    }
+
+    /// Page out the pixels of fires that have not been observed since `cold_before`.
+    ///
+    /// Only the bounding box and centroid of those fires stay in memory. The pixels are read back
+    /// in from `scratch` when a search of the spatial index needs them to check for an exact
+    /// overlap, or when they are accessed with [Fire::pixels].
+    ///
+    /// # Returns
+    /// The number of fires that were paged out.
+    pub fn page_out_cold_fires(
+        &mut self,
+        scratch: &Arc<PixelScratchFile>,
+        cold_before: DateTime<Utc>,
+    ) -> SatFireResult<usize> {
+        let mut num_paged_out = 0;
+        for fire in self.fires.iter_mut() {
+            if fire.last_observed < cold_before && !fire.is_paged_out() {
+                fire.page_out(scratch)?;
+                num_paged_out += 1;
+            }
+        }
+
+        Ok(num_paged_out)
     }
 
     /// Get an iterator over the fires.
     pub fn iter(&self) -> impl Iterator<Item = &Fire> {
-        self.0.iter()
+        self.fires.iter()
+    }
+
+    /// Encode the list into a binary format, for instance to save it between runs of a program.
+    ///
+    /// The spatial index is not saved, it is rebuilt the first time the list is searched. Paged
+    /// out pixels are read back in, which can fail.
+    pub fn binary_serialize(&self) -> SatFireResult<Vec<u8>> {
+        let mut output = Vec::new();
+
+        output.extend_from_slice(&(self.fires.len() as u64).to_le_bytes());
+
+        for fire in &self.fires {
+            let sat_idx = Satellite::iter().position(|s| s == fire.sat).unwrap() as u8;
+            let pixels = fire.try_pixels()?.binary_serialize();
+
+            output.push(sat_idx);
+            output.extend_from_slice(&fire.id.to_le_bytes());
+            output.extend_from_slice(&fire.merged_into.to_le_bytes());
+            output.extend_from_slice(&fire.first_observed.timestamp().to_le_bytes());
+            output.extend_from_slice(&fire.last_observed.timestamp().to_le_bytes());
+            output.extend_from_slice(&fire.max_power.to_le_bytes());
+            output.extend_from_slice(&fire.max_temperature.to_le_bytes());
+            output.extend_from_slice(&(pixels.len() as u64).to_le_bytes());
+            output.extend_from_slice(&pixels);
+        }
+
+        Ok(output)
+    }
+
+    /// Deserialize an array of bytes created by [FireList::binary_serialize].
+    pub fn binary_deserialize<R: Read>(r: &mut R) -> SatFireResult<Self> {
+        let mut buf: [u8; 8] = [0; 8];
+        let mut read_u64 = |r: &mut R| -> SatFireResult<u64> {
+            r.read_exact(&mut buf)?;
+            Ok(u64::from_le_bytes(buf))
+        };
+
+        let read_time = |bits: u64| -> SatFireResult<DateTime<Utc>> {
+            let naive = NaiveDateTime::from_timestamp_opt(bits as i64, 0)
+                .ok_or_else(|| "Invalid time stamp".to_string())?;
+            Ok(DateTime::<Utc>::from_utc(naive, Utc))
+        };
+
+        let num_fires = read_u64(r)? as usize;
+        let mut fires = Vec::with_capacity(num_fires);
+
+        for _ in 0..num_fires {
+            let mut sat_idx: [u8; 1] = [0];
+            r.read_exact(&mut sat_idx)?;
+            let sat = Satellite::iter()
+                .nth(sat_idx[0] as usize)
+                .ok_or_else(|| "Invalid satellite".to_string())?;
+
+            let id = read_u64(r)?;
+            let merged_into = read_u64(r)?;
+            let first_observed = read_time(read_u64(r)?)?;
+            let last_observed = read_time(read_u64(r)?)?;
+            let max_power = f64::from_bits(read_u64(r)?);
+            let max_temperature = f64::from_bits(read_u64(r)?);
+
+            let mut pixels = vec![0; read_u64(r)? as usize];
+            r.read_exact(&mut pixels)?;
+            let area = PixelList::binary_deserialize_slice(&pixels)?;
+
+            fires.push(Fire::new(
+                first_observed,
+                last_observed,
+                max_power,
+                max_temperature,
+                id,
+                area,
+                sat,
+                merged_into,
+            ));
+        }
+
+        Ok(Self::from(fires))
     }
 
     /// Save this list in a KML file.
@@ -514,7 +782,7 @@ impl FireList {
             kmz.create_point(centroid.lat, centroid.lon, 0.0)?;
             kmz.finish_placemark()?;
 
-            fire.pixels().kml_write(&mut kmz);
+            fire.try_pixels()?.kml_write(&mut kmz);
             kmz.finish_folder()?;
         }
 
@@ -523,26 +791,19 @@ impl FireList {
 }
 
 pub struct FireListView<'a> {
-    view: Hilbert2DRTreeView<'a, Fire>,
+    fires: &'a mut [Fire],
+    index: &'a mut Hilbert2DRTree,
 }
 
 impl<'a> FireListView<'a> {
     /// Create a new view of a FireList.
     pub fn new(fire_list: &'a mut FireList) -> Option<Self> {
-        const FULL_DOMAIN: BoundingBox = BoundingBox {
-            ll: Coord {
-                lat: -90.0,
-                lon: -180.0,
-            },
-            ur: Coord {
-                lat: 90.0,
-                lon: 180.0,
-            },
-        };
-
-        let view_opt = Hilbert2DRTreeView::build_for(&mut fire_list.0, Some(FULL_DOMAIN));
+        let index = FireList::spatial_index(&fire_list.fires, &mut fire_list.index)?;
 
-        view_opt.map(|view| Self { view })
+        Some(Self {
+            fires: &mut fire_list.fires,
+            index,
+        })
     }
 
     /// Update the underlying list with the provided cluster.
@@ -552,34 +813,154 @@ impl<'a> FireListView<'a> {
     /// # Returns
     ///
     /// `Some(clust)` if `clust` was not matched to a fire and used to update it. If the
-    /// `clust` was consumed, then it returns `None`.
-    pub fn update(&mut self, row: ClusterDatabaseClusterRow) -> FireListUpdateResult {
-        let bbox = row.pixels.bounding_box();
-
-        self.view.foreach(
-            bbox,
-            FireListUpdateResult::NoMatch(row),
-            |fire, _fire_idx, matched| match matched {
-                FireListUpdateResult::NoMatch(row) => {
-                    if row
-                        .pixels
-                        .adjacent_to_or_overlaps(&fire.area, OVERLAP_FUDGE_FACTOR)
-                    {
-                        fire.update(&row);
-                        (
-                            true,
-                            ControlFlow::Break(FireListUpdateResult::Match(fire.id())),
-                        )
-                    } else {
-                        (
-                            false,
-                            ControlFlow::Continue(FireListUpdateResult::NoMatch(row)),
-                        )
-                    }
+    /// `clust` was consumed, then it returns `None`. It is an error if the pixels of a paged out
+    /// fire can't be read back in.
+    pub fn update(
+        &mut self,
+        row: ClusterDatabaseClusterRow,
+    ) -> SatFireResult<FireListUpdateResult> {
+        let mut candidates = vec![];
+        self.index
+            .indexes_overlapping(&row.pixels.bounding_box(), &mut candidates);
+
+        for fire_idx in candidates {
+            let fire_pixels = self.fires[fire_idx].try_pixels()?;
+            if row
+                .pixels
+                .adjacent_to_or_overlaps(fire_pixels, OVERLAP_FUDGE_FACTOR)
+            {
+                return self.apply_match(row, fire_idx);
+            }
+        }
+
+        Ok(FireListUpdateResult::NoMatch(row))
+    }
+
+    /// Update the underlying list with all the clusters from a single scan time.
+    ///
+    /// This is similar to calling [FireListView::update] for each row, except the search for a
+    /// matching fire is run on up to `num_threads` threads. Every search is done against the fires
+    /// as they were before any of the rows were applied, then the updates are applied in the order
+    /// of `rows`. So the results do not depend on the number of threads. They can differ from
+    /// calling [FireListView::update] one row at a time when a cluster only touches a fire after
+    /// another cluster from the same scan time expanded it, [FireList::merge_fires] will join
+    /// those fires later.
+    ///
+    /// # Returns
+    ///
+    /// The result for each row, in the same order as `rows`. It is an error if the pixels of a
+    /// paged out fire can't be read back in.
+    pub fn update_all(
+        &mut self,
+        rows: Vec<ClusterDatabaseClusterRow>,
+        num_threads: usize,
+    ) -> SatFireResult<Vec<FireListUpdateResult>> {
+        let matches = self.find_matches(&rows, num_threads)?;
+
+        rows.into_iter()
+            .zip(matches)
+            .map(|(row, fire_idx)| match fire_idx {
+                Some(fire_idx) => self.apply_match(row, fire_idx),
+                None => Ok(FireListUpdateResult::NoMatch(row)),
+            })
+            .collect()
+    }
+
+    /// Find the index of the first fire each row overlaps, without modifying anything.
+    fn find_matches(
+        &self,
+        rows: &[ClusterDatabaseClusterRow],
+        num_threads: usize,
+    ) -> SatFireResult<Vec<Option<usize>>> {
+        // Spawning threads for a handful of clusters costs more than it saves.
+        const MIN_ROWS_PER_THREAD: usize = 16;
+
+        let index: &Hilbert2DRTree = self.index;
+
+        // Paged out fires can only be read back in on this thread, so do it for every fire the
+        // rows might match before starting.
+        if self.fires.iter().any(Fire::is_paged_out) {
+            let mut candidates = vec![];
+            for row in rows {
+                index.indexes_overlapping(&row.pixels.bounding_box(), &mut candidates);
+                for &fire_idx in &candidates {
+                    self.fires[fire_idx].try_pixels()?;
                 }
-                found @ FireListUpdateResult::Match(..) => (false, ControlFlow::Break(found)),
-            },
-        )
+            }
+        }
+
+        // Fire isn't Sync because of its cache, but the pixels are all that's needed here. Any
+        // fire still paged out isn't a candidate for any of the rows.
+        let areas: Vec<Option<&PixelList>> =
+            self.fires.iter().map(|fire| fire.area.get()).collect();
+        let areas = &areas;
+
+        let find_match = move |row: &ClusterDatabaseClusterRow, candidates: &mut Vec<usize>| {
+            index.indexes_overlapping(&row.pixels.bounding_box(), candidates);
+            candidates.iter().copied().find(|&fire_idx| {
+                areas[fire_idx].map_or(false, |area| {
+                    row.pixels
+                        .adjacent_to_or_overlaps(area, OVERLAP_FUDGE_FACTOR)
+                })
+            })
+        };
+
+        let num_threads = num_threads.max(1);
+        let chunk_size = ((rows.len() + num_threads - 1) / num_threads).max(MIN_ROWS_PER_THREAD);
+
+        if rows.len() <= chunk_size {
+            let mut candidates = vec![];
+            return Ok(rows
+                .iter()
+                .map(|row| find_match(row, &mut candidates))
+                .collect());
+        }
+
+        Ok(std::thread::scope(|s| {
+            let handles: Vec<_> = rows
+                .chunks(chunk_size)
+                .map(|chunk| {
+                    s.spawn(move || {
+                        let mut candidates = vec![];
+                        chunk
+                            .iter()
+                            .map(|row| find_match(row, &mut candidates))
+                            .collect::<Vec<_>>()
+                    })
+                })
+                .collect();
+
+            handles
+                .into_iter()
+                .flat_map(|jh| jh.join().expect("Error joining a matching thread."))
+                .collect()
+        }))
+    }
+
+    /// Update the fire at `fire_idx` with `row`, keeping the spatial index current.
+    fn apply_match(
+        &mut self,
+        row: ClusterDatabaseClusterRow,
+        fire_idx: usize,
+    ) -> SatFireResult<FireListUpdateResult> {
+        let fire = &mut self.fires[fire_idx];
+        fire.update(&row)?;
+        self.index.grow(fire_idx, fire.bounding_box());
+
+        Ok(FireListUpdateResult::Match(fire.id()))
+    }
+}
+
+/// Get mutable references to two different elements of a slice.
+fn get_pair_mut<T>(slice: &mut [T], first: usize, second: usize) -> (&mut T, &mut T) {
+    assert_ne!(first, second);
+
+    if first < second {
+        let (left, right) = slice.split_at_mut(second);
+        (&mut left[first], &mut right[0])
+    } else {
+        let (left, right) = slice.split_at_mut(first);
+        (&mut right[0], &mut left[second])
     }
 }
 
@@ -587,7 +968,7 @@ fn wildfire_is_stale(fire: &Fire, current_time: DateTime<Utc>) -> bool {
     let duration_since_last_observed = current_time - fire.last_observed;
 
     // If it got this big, it can't be real. It must be a "noise fire"
-    if fire.pixels().len() >= 1_000 {
+    if fire.num_pixels() >= 1_000 {
         return true;
     }
 
@@ -605,3 +986,168 @@ fn wildfire_is_stale(fire: &Fire, current_time: DateTime<Utc>) -> bool {
     let wildfire_duration = fire.duration();
     wildfire_duration < duration_since_last_observed
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::{
+        pixel::Pixel,
+        satellite::{DataQualityFlagCode, MaskCode},
+    };
+
+    #[test]
+    fn test_fire_list_binary_round_trip() {
+        let pixel = Pixel {
+            ul: Coord {
+                lat: 45.0,
+                lon: -120.0,
+            },
+            ll: Coord {
+                lat: 44.0,
+                lon: -120.0,
+            },
+            lr: Coord {
+                lat: 44.0,
+                lon: -119.0,
+            },
+            ur: Coord {
+                lat: 45.0,
+                lon: -119.0,
+            },
+            power: 100.0,
+            area: 2.5,
+            temperature: 350.0,
+            scan_angle: 6.0,
+            mask_flag: MaskCode(10),
+            data_quality_flag: DataQualityFlagCode(0),
+        };
+
+        let first = DateTime::<Utc>::from_utc(
+            NaiveDateTime::from_timestamp_opt(1_600_000_000, 0).unwrap(),
+            Utc,
+        );
+        let last = first + Duration::hours(5);
+
+        let mut fires = FireList::new();
+        for (id, sat) in Satellite::iter().enumerate() {
+            let mut area = PixelList::new();
+            for _ in 0..=id {
+                area.push(pixel);
+            }
+            fires.add_fire(Fire::new(
+                first,
+                last,
+                100.0,
+                350.0,
+                7 + id as u64,
+                area,
+                sat,
+                3,
+            ));
+        }
+
+        let bytes = fires.binary_serialize().unwrap();
+        let copy = FireList::binary_deserialize(&mut bytes.as_slice()).unwrap();
+
+        assert_eq!(copy.len(), fires.len());
+        for (a, b) in fires.iter().zip(copy.iter()) {
+            assert_eq!(a.id(), b.id());
+            assert_eq!(a.merged_into(), b.merged_into());
+            assert_eq!(a.satellite(), b.satellite());
+            assert_eq!(a.first_observed(), b.first_observed());
+            assert_eq!(a.last_observed(), b.last_observed());
+            assert_eq!(a.max_power(), b.max_power());
+            assert_eq!(a.max_temperature(), b.max_temperature());
+            assert_eq!(a.pixels().len(), b.pixels().len());
+        }
+
+        assert!(FireList::binary_deserialize(&mut &bytes[..bytes.len() - 1]).is_err());
+    }
+
+    fn fire_at(id: u64, lon: f64) -> Fire {
+        let pixel = Pixel {
+            ul: Coord { lat: 45.0, lon },
+            ll: Coord { lat: 44.0, lon },
+            lr: Coord {
+                lat: 44.0,
+                lon: lon + 1.0,
+            },
+            ur: Coord {
+                lat: 45.0,
+                lon: lon + 1.0,
+            },
+            power: 100.0,
+            area: 2.5,
+            temperature: 350.0,
+            scan_angle: 6.0,
+            mask_flag: MaskCode(10),
+            data_quality_flag: DataQualityFlagCode(0),
+        };
+
+        let mut area = PixelList::new();
+        area.push(pixel);
+
+        let start = DateTime::<Utc>::from_utc(
+            NaiveDateTime::from_timestamp_opt(1_600_000_000, 0).unwrap(),
+            Utc,
+        );
+
+        Fire::new(start, start, 100.0, 350.0, id, area, Satellite::G17, 0)
+    }
+
+    #[test]
+    fn test_merge_fires_chain() {
+        // The outside fires only touch through the one in the middle.
+        let mut fires = FireList::new();
+        fires.add_fire(fire_at(5, -120.0));
+        fires.add_fire(fire_at(2, -119.0));
+        fires.add_fire(fire_at(9, -118.0));
+        fires.add_fire(fire_at(4, -100.0));
+
+        let mut merged_away = FireList::new();
+        assert_eq!(fires.merge_fires(&mut merged_away).unwrap(), 2);
+        assert_eq!(fires.len(), 2);
+        assert!(fires.iter().any(|f| f.id() == 2 && f.pixels().len() == 3));
+        assert!(fires.iter().any(|f| f.id() == 4));
+
+        assert_eq!(merged_away.len(), 2);
+        assert!(merged_away.iter().all(|f| f.merged_into() == 2));
+
+        // Nothing changed, so nothing new to merge.
+        assert_eq!(fires.merge_fires(&mut merged_away).unwrap(), 0);
+
+        // A fire joining the list gets checked against the ones already in it.
+        fires.add_fire(fire_at(11, -101.0));
+        assert_eq!(fires.merge_fires(&mut merged_away).unwrap(), 1);
+        assert!(fires.iter().any(|f| f.id() == 4 && f.pixels().len() == 2));
+        assert_eq!(merged_away.len(), 3);
+    }
+
+    #[test]
+    fn test_page_out_cold_fires() {
+        let scratch = PixelScratchFile::create_in(&std::env::temp_dir()).unwrap();
+
+        let mut fires = FireList::new();
+        fires.add_fire(fire_at(1, -120.0));
+        fires.add_fire(fire_at(2, -100.0));
+
+        let mut merged_away = FireList::new();
+        assert_eq!(fires.merge_fires(&mut merged_away).unwrap(), 0);
+
+        let cold_before = fires.iter().next().unwrap().last_observed() + Duration::hours(1);
+        assert_eq!(fires.page_out_cold_fires(&scratch, cold_before).unwrap(), 2);
+        assert!(fires
+            .iter()
+            .all(|f| f.is_paged_out() && f.num_pixels() == 1));
+
+        // Only the fire near the new one is read back in to check for an overlap.
+        fires.add_fire(fire_at(3, -119.0));
+        assert_eq!(fires.merge_fires(&mut merged_away).unwrap(), 1);
+        assert!(fires.iter().any(|f| f.id() == 1 && f.pixels().len() == 2));
+        assert!(fires.iter().any(|f| f.id() == 2 && f.is_paged_out()));
+
+        let far_fire = fires.iter().find(|f| f.id() == 2).unwrap();
+        assert_eq!(far_fire.pixels().len(), 1);
+        assert!(!far_fire.is_paged_out());
+    }
+}
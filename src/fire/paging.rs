@@ -0,0 +1,148 @@
+//! Keep the pixels of fires that have not changed in a while on disk instead of in memory.
+use crate::{pixel::PixelList, SatFireResult};
+use std::{
+    fmt::{self, Debug},
+    fs::{File, OpenOptions},
+    os::unix::fs::FileExt,
+    path::Path,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
+};
+
+/// The smallest slot handed out is 2^MIN_SIZE_CLASS bytes.
+const MIN_SIZE_CLASS: usize = 8;
+
+/// A scratch file to hold the pixels of fires that are not likely to change soon.
+///
+/// The file is removed from the directory as soon as it is created, so the space is given back
+/// when the last fire using it is dropped, even if the program does not exit cleanly. Space in the
+/// file is handed out in power of two sized slots, and the slots are reused when the fires in them
+/// are updated or dropped, so the file only grows as large as the most pixels ever paged out at
+/// one time.
+///
+/// Reading a fire back in is a positioned read, so recently used parts of the file are served
+/// from the operating system's page cache the same way they would be with a memory map.
+pub struct PixelScratchFile {
+    file: File,
+    space: Mutex<ScratchSpace>,
+}
+
+/// Bookkeeping for the space in a [PixelScratchFile].
+#[derive(Debug, Default)]
+struct ScratchSpace {
+    /// The end of the used part of the file.
+    len: u64,
+    /// The offsets of free slots, by size class.
+    free: Vec<Vec<u64>>,
+}
+
+impl Debug for PixelScratchFile {
+    fn fmt(&self, f: &mut fmt::Formatter) -> Result<(), fmt::Error> {
+        f.debug_struct("PixelScratchFile")
+            .field("space", &self.space)
+            .finish()
+    }
+}
+
+impl PixelScratchFile {
+    /// Create a new scratch file in the directory `dir`.
+    pub fn create_in(dir: &Path) -> SatFireResult<Arc<Self>> {
+        static COUNT: AtomicUsize = AtomicUsize::new(0);
+
+        let path = dir.join(format!(
+            "satfire-{}-{}.pixels",
+            std::process::id(),
+            COUNT.fetch_add(1, Ordering::SeqCst)
+        ));
+
+        let file = OpenOptions::new()
+            .read(true)
+            .write(true)
+            .create_new(true)
+            .open(&path)?;
+        std::fs::remove_file(&path)?;
+
+        Ok(Arc::new(PixelScratchFile {
+            file,
+            space: Mutex::new(ScratchSpace::default()),
+        }))
+    }
+
+    /// Write out a list of pixels.
+    pub(crate) fn page_out(self: &Arc<Self>, pixels: &PixelList) -> SatFireResult<PagedPixels> {
+        let bytes = pixels.binary_serialize();
+        let size_class = size_class(bytes.len());
+        let offset = self.allocate(size_class);
+
+        if let Err(err) = self.file.write_all_at(&bytes, offset) {
+            self.release(size_class, offset);
+            return Err(err.into());
+        }
+
+        Ok(PagedPixels {
+            scratch: Arc::clone(self),
+            offset,
+            len: bytes.len(),
+            size_class,
+            num_pixels: pixels.len(),
+        })
+    }
+
+    fn allocate(&self, size_class: usize) -> u64 {
+        let mut space = self.space.lock().expect("Error locking scratch file space");
+
+        if let Some(offset) = space.free.get_mut(size_class).and_then(Vec::pop) {
+            return offset;
+        }
+
+        let offset = space.len;
+        space.len += 1 << size_class;
+        offset
+    }
+
+    fn release(&self, size_class: usize, offset: u64) {
+        let mut space = self.space.lock().expect("Error locking scratch file space");
+
+        if space.free.len() <= size_class {
+            space.free.resize_with(size_class + 1, Vec::new);
+        }
+        space.free[size_class].push(offset);
+    }
+}
+
+/// A list of pixels stored in a [PixelScratchFile], the slot is released when this is dropped.
+#[derive(Debug)]
+pub(crate) struct PagedPixels {
+    scratch: Arc<PixelScratchFile>,
+    offset: u64,
+    len: usize,
+    size_class: usize,
+    num_pixels: usize,
+}
+
+impl PagedPixels {
+    /// Read the pixels back in.
+    pub(crate) fn page_in(&self) -> SatFireResult<PixelList> {
+        let mut bytes = vec![0; self.len];
+        self.scratch.file.read_exact_at(&mut bytes, self.offset)?;
+        PixelList::binary_deserialize_slice(&bytes)
+    }
+
+    /// The number of pixels in the list.
+    pub(crate) fn len(&self) -> usize {
+        self.num_pixels
+    }
+}
+
+impl Drop for PagedPixels {
+    fn drop(&mut self) {
+        self.scratch.release(self.size_class, self.offset);
+    }
+}
+
+/// The size class of the smallest slot that will hold `len` bytes.
+fn size_class(len: usize) -> usize {
+    (len.next_power_of_two().trailing_zeros() as usize).max(MIN_SIZE_CLASS)
+}
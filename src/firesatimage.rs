@@ -1,34 +1,40 @@
 use crate::{
     geo::Coord,
     pixel::Pixel,
-    satellite::{DataQualityFlagCode, MaskCode},
+    satellite::{DataQualityFlagCode, MaskCode, Satellite, Sector},
     SatFireResult,
 };
 use libc::{c_char, c_double, c_int, c_short, c_void, size_t};
 use once_cell::sync::OnceCell;
+use rustc_hash::FxHashMap as HashMap;
 use std::{
     ffi::{CStr, CString},
-    io::Read,
     path::Path,
     sync::Mutex,
 };
 
+mod geolocation;
+pub use geolocation::set_geolocation_cache_directory;
+
+mod zipped;
+use zipped::ZippedNetCdf;
+
 static_assertions::assert_eq_size!(c_short, i16);
 static_assertions::assert_eq_size!(c_double, f64);
 
 /**
  * Handle to a dataset for the Fire Detection Characteristics and some metadata.
  */
-#[derive(Debug, Clone)]
-pub(crate) struct SatFireImage {
+#[derive(Debug)]
+pub struct SatFireImage {
     /// Image width in pixels
     xlen: usize,
     /// Image height in pixels
     ylen: usize,
     /// All the information needed for transforming from row and column numbers to coordinates.
     tran: CoordTransform,
-    /// In memory buffer if this is from a zip file
-    buffer: Option<Vec<u8>>,
+    /// The memory holding the NetCDF file if this is from a zip file
+    buffer: Option<ZippedNetCdf>,
     /// Handle to the NetCDF file
     nc_file_id: c_int,
     /// Orignial file name the dataset was loaded from.
@@ -46,7 +52,7 @@ macro_rules! check_error {
 
 impl SatFireImage {
     /// Open a file containing GOES-R/S Fire Detection Characteristics.
-    pub(crate) fn open<P: AsRef<Path>>(path: P) -> SatFireResult<Self> {
+    pub fn open<P: AsRef<Path>>(path: P) -> SatFireResult<Self> {
         let p: &Path = path.as_ref();
         // FIXME change option into error
         let fname: String = p
@@ -71,13 +77,7 @@ impl SatFireImage {
     fn open_zip(p: &Path, fname: String) -> SatFireResult<Self> {
         let path_str = CString::new(p.to_string_lossy().as_bytes())?;
 
-        let file = std::fs::File::open(p)?;
-        let mut zip = zip::ZipArchive::new(file)?;
-        assert_eq!(zip.len(), 1);
-
-        let mut nc_file = zip.by_index(0)?;
-        let mut buf: Vec<u8> = Vec::with_capacity(nc_file.size() as usize + 10);
-        let _size_read = nc_file.read_to_end(&mut buf)?;
+        let mut buf = ZippedNetCdf::load(p)?;
 
         let lock = get_netcdf_lock()
             .lock()
@@ -88,7 +88,7 @@ impl SatFireImage {
                 path_str.as_ptr(),
                 NC_NOWRITE,
                 buf.len(),
-                buf.as_mut_ptr() as *mut c_void,
+                buf.as_mut_ptr(),
                 &mut file_id as *mut c_int,
             );
             if status != NC_NOERR {
@@ -130,7 +130,7 @@ impl SatFireImage {
     fn initialize_with_nc_file_handle(
         fname: String,
         handle: c_int,
-        in_memory_buffer: Option<Vec<u8>>,
+        in_memory_buffer: Option<ZippedNetCdf>,
     ) -> SatFireResult<Self> {
         let mut xlen: usize = 0;
         let mut ylen: usize = 0;
@@ -228,74 +228,143 @@ impl SatFireImage {
         })
     }
 
-    pub(crate) fn extract_fire_points(&self) -> SatFireResult<Vec<FirePoint>> {
-        let mut points: Vec<FirePoint> = Vec::new();
+    /// Get all the fire points with a good data quality flag.
+    ///
+    /// The satellite and sector are used to look up (or build) a cached table of the pixel corner
+    /// locations for this fixed grid so the projection math is only done once per run.
+    ///
+    /// Only a tiny fraction of the pixels in an image are good quality fire detections, so the
+    /// data quality flags are loaded first and then only the chunks of the other variables that
+    /// contain a candidate pixel are read.
+    pub fn extract_fire_points(
+        &self,
+        sat: Satellite,
+        sector: Sector,
+    ) -> SatFireResult<Vec<FirePoint>> {
+        let mut buffers = FirePointBuffers::default();
+        self.extract_fire_points_into(sat, sector, &mut buffers)?;
+        Ok(buffers.points)
+    }
+
+    /// The same as [SatFireImage::extract_fire_points], but the points and all the working space
+    /// are kept in `buffers` so they can be reused for the next image.
+    pub(crate) fn extract_fire_points_into(
+        &self,
+        sat: Satellite,
+        sector: Sector,
+        buffers: &mut FirePointBuffers,
+    ) -> SatFireResult<()> {
+        let FirePointBuffers {
+            dqfs,
+            candidates,
+            powers,
+            areas,
+            temperatures,
+            masks,
+            chunk_doubles,
+            chunk_shorts,
+            points,
+        } = buffers;
+
+        points.clear();
+
+        let grid = geolocation::grid_for(sat, sector, self.xlen, self.ylen, &self.tran);
 
         let lock = get_netcdf_lock()
             .lock()
             .expect("Error locking global mutex for netCDF");
 
-        let powers = self.extract_variable_double(b"Power\0".as_ptr() as *const c_char)?;
-        let areas = self.extract_variable_double(b"Area\0".as_ptr() as *const c_char)?;
-        let temperatures = self.extract_variable_double(b"Temp\0".as_ptr() as *const c_char)?;
-        let masks = self.extract_variable_short(b"Mask\0".as_ptr() as *const c_char)?;
-        let dqfs = self.extract_variable_short(b"DQF\0".as_ptr() as *const c_char)?;
+        self.extract_variable_short(b"DQF\0".as_ptr() as *const c_char, dqfs)?;
 
-        drop(lock);
+        // 0 for a data quality flag indicates a good quality fire detection
+        candidates.clear();
+        candidates.extend(
+            dqfs.iter()
+                .enumerate()
+                .filter(|(_, dqf)| **dqf == 0)
+                .map(|(index, _)| (index % self.xlen, index / self.xlen)),
+        );
 
-        for j in 0..self.ylen {
-            for i in 0..self.xlen {
-                let index = i + j * self.xlen;
-
-                let power_mw;
-                let area;
-                let temperature;
-                let mask;
-                let dqf;
-
-                unsafe {
-                    power_mw = *powers.get_unchecked(index);
-                    area = *areas.get_unchecked(index);
-                    temperature = *temperatures.get_unchecked(index);
-                    mask = *masks.get_unchecked(index);
-                    dqf = *dqfs.get_unchecked(index);
-                }
+        if candidates.is_empty() {
+            return Ok(());
+        }
 
-                // 0 for a data quality flag indicates a good quality fire detection
-                if dqf == 0 {
-                    let ii = i as f64;
-                    let jj = j as f64;
-
-                    let ips: [f64; 5] = [ii - 0.5, ii - 0.5, ii + 0.5, ii + 0.5, ii];
-                    let jps: [f64; 5] = [jj - 0.5, jj + 0.5, jj + 0.5, jj - 0.5, jj];
-
-                    let (scan_angle, coords) = self.tran.convert_row_cols_to_latlon(&jps, &ips);
-
-                    points.push(FirePoint {
-                        x: i as isize,
-                        y: j as isize,
-                        pixel: Pixel {
-                            ul: coords[0],
-                            ll: coords[1],
-                            lr: coords[2],
-                            ur: coords[3],
-                            power: power_mw,
-                            area,
-                            temperature,
-                            mask_flag: MaskCode(mask),
-                            data_quality_flag: DataQualityFlagCode(dqf),
-                            scan_angle,
-                        },
-                    });
-                }
-            }
+        self.gather_variable_double(
+            b"Power\0".as_ptr() as *const c_char,
+            candidates,
+            powers,
+            chunk_doubles,
+        )?;
+        self.gather_variable_double(
+            b"Area\0".as_ptr() as *const c_char,
+            candidates,
+            areas,
+            chunk_doubles,
+        )?;
+        self.gather_variable_double(
+            b"Temp\0".as_ptr() as *const c_char,
+            candidates,
+            temperatures,
+            chunk_doubles,
+        )?;
+        self.gather_variable_short(
+            b"Mask\0".as_ptr() as *const c_char,
+            candidates,
+            masks,
+            chunk_shorts,
+        )?;
+
+        drop(lock);
+
+        // Grids that aren't cached still share the corners between neighboring pixels.
+        let sparse_grid = match grid {
+            Some(_) => geolocation::SparseGeoGrid::default(),
+            None => geolocation::SparseGeoGrid::for_pixels(&self.tran, candidates),
+        };
+
+        points.reserve(candidates.len());
+        for (k, &(i, j)) in candidates.iter().enumerate() {
+            let scan_angle = self.tran.scan_angle(j as f64, i as f64);
+
+            let [ul, ll, lr, ur] = match grid {
+                Some(ref grid) => grid.pixel_corners(i, j),
+                None => sparse_grid.pixel_corners(i, j),
+            };
+
+            points.push(FirePoint {
+                x: i as isize,
+                y: j as isize,
+                pixel: Pixel {
+                    ul,
+                    ll,
+                    lr,
+                    ur,
+                    power: powers[k],
+                    area: areas[k],
+                    temperature: temperatures[k],
+                    mask_flag: MaskCode(masks[k]),
+                    data_quality_flag: DataQualityFlagCode(dqfs[i + j * self.xlen]),
+                    scan_angle,
+                },
+            });
         }
 
-        Ok(points)
+        Ok(())
     }
 
-    fn extract_variable_double(&self, vname: *const c_char) -> SatFireResult<Vec<f64>> {
-        let mut vals = Vec::with_capacity(self.xlen * self.ylen);
+    /// Load the values of a variable at the candidate (column, row) locations.
+    ///
+    /// The returned values are in the same order as the candidates. The scale factor, offset, and
+    /// fill value are only applied to the gathered values.
+    fn gather_variable_double(
+        &self,
+        vname: *const c_char,
+        candidates: &[(usize, usize)],
+        vals: &mut Vec<f64>,
+        chunk_buffer: &mut Vec<f64>,
+    ) -> SatFireResult<()> {
+        vals.clear();
+        vals.resize(candidates.len(), 0.0);
 
         let mut skip_transform;
         let mut scale_factor: f64 = 1.0;
@@ -308,13 +377,25 @@ impl SatFireImage {
             let mut status = nc_inq_varid(fid, vname, &mut varid as *mut c_int);
             check_error!(status)?;
 
-            let start: [size_t; 2] = [0, 0];
-            let counts: [size_t; 2] = [self.ylen, self.xlen];
-            let (start, counts) = (start.as_ptr(), counts.as_ptr());
-            status = nc_get_vara_double(fid, varid, start, counts, vals.as_mut_ptr());
-            check_error!(status)?;
-
-            vals.set_len(self.ylen * self.xlen);
+            for group in self.chunk_groups(varid, candidates)? {
+                let [_, ncols] = group.counts;
+                chunk_buffer.resize(group.len(), 0.0);
+
+                status = nc_get_vara_double(
+                    fid,
+                    varid,
+                    group.start.as_ptr(),
+                    group.counts.as_ptr(),
+                    chunk_buffer.as_mut_ptr(),
+                );
+                check_error!(status)?;
+
+                for &k in &group.members {
+                    let (i, j) = candidates[k];
+                    let idx = (j - group.start[0]) * ncols + (i - group.start[1]);
+                    vals[k] = chunk_buffer[idx];
+                }
+            }
 
             let scale_str = b"scale_factor\0".as_ptr() as *const c_char;
             let offset_str = b"add_offset\0".as_ptr() as *const c_char;
@@ -345,11 +426,111 @@ impl SatFireImage {
             }
         }
 
-        Ok(vals)
+        Ok(())
     }
 
-    fn extract_variable_short(&self, vname: *const c_char) -> SatFireResult<Vec<i16>> {
-        let mut vals = Vec::with_capacity(self.xlen * self.ylen);
+    /// Load the values of a variable at the candidate (column, row) locations.
+    ///
+    /// The returned values are in the same order as the candidates.
+    fn gather_variable_short(
+        &self,
+        vname: *const c_char,
+        candidates: &[(usize, usize)],
+        vals: &mut Vec<i16>,
+        chunk_buffer: &mut Vec<i16>,
+    ) -> SatFireResult<()> {
+        vals.clear();
+        vals.resize(candidates.len(), 0);
+
+        unsafe {
+            let mut varid: c_int = -1;
+            let mut status = nc_inq_varid(self.nc_file_id, vname, &mut varid as *mut c_int);
+            check_error!(status)?;
+
+            for group in self.chunk_groups(varid, candidates)? {
+                let [_, ncols] = group.counts;
+                chunk_buffer.resize(group.len(), 0);
+
+                status = nc_get_vara_short(
+                    self.nc_file_id,
+                    varid,
+                    group.start.as_ptr(),
+                    group.counts.as_ptr(),
+                    chunk_buffer.as_mut_ptr(),
+                );
+                check_error!(status)?;
+
+                for &k in &group.members {
+                    let (i, j) = candidates[k];
+                    let idx = (j - group.start[0]) * ncols + (i - group.start[1]);
+                    vals[k] = chunk_buffer[idx];
+                }
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Group the candidate (column, row) locations by the storage chunk of the variable they are
+    /// in, so each chunk that holds a candidate is read (and decompressed) exactly once.
+    ///
+    /// If the variable isn't chunked, each row is treated as a chunk.
+    fn chunk_groups(
+        &self,
+        varid: c_int,
+        candidates: &[(usize, usize)],
+    ) -> SatFireResult<Vec<ChunkGroup>> {
+        let mut storage: c_int = -1;
+        let mut chunk_sizes: [size_t; 2] = [0, 0];
+
+        unsafe {
+            let status = nc_inq_var_chunking(
+                self.nc_file_id,
+                varid,
+                &mut storage as *mut c_int,
+                chunk_sizes.as_mut_ptr(),
+            );
+            check_error!(status)?;
+        }
+
+        if storage != NC_CHUNKED || chunk_sizes[0] == 0 || chunk_sizes[1] == 0 {
+            chunk_sizes = [1, self.xlen];
+        }
+        let [chunk_rows, chunk_cols] = chunk_sizes;
+
+        let mut groups: HashMap<(usize, usize), ChunkGroup> = HashMap::default();
+        for (k, &(i, j)) in candidates.iter().enumerate() {
+            let (chunk_j, chunk_i) = (j / chunk_rows, i / chunk_cols);
+
+            groups
+                .entry((chunk_j, chunk_i))
+                .or_insert_with(|| {
+                    let start = [chunk_j * chunk_rows, chunk_i * chunk_cols];
+                    let counts = [
+                        chunk_rows.min(self.ylen - start[0]),
+                        chunk_cols.min(self.xlen - start[1]),
+                    ];
+
+                    ChunkGroup {
+                        start,
+                        counts,
+                        members: vec![],
+                    }
+                })
+                .members
+                .push(k);
+        }
+
+        Ok(groups.into_values().collect())
+    }
+
+    fn extract_variable_short(
+        &self,
+        vname: *const c_char,
+        vals: &mut Vec<i16>,
+    ) -> SatFireResult<()> {
+        vals.clear();
+        vals.reserve(self.xlen * self.ylen);
 
         unsafe {
             let mut varid: c_int = -1;
@@ -371,7 +552,43 @@ impl SatFireImage {
             vals.set_len(self.ylen * self.xlen);
         }
 
-        Ok(vals)
+        Ok(())
+    }
+}
+
+/// The fire points found in an image, and the space used to find them.
+///
+/// The full size data quality flag grid is the biggest of these, keeping them between images
+/// saves allocating (and zeroing) several megabytes for each file.
+#[derive(Debug, Default)]
+pub(crate) struct FirePointBuffers {
+    dqfs: Vec<i16>,
+    /// The (column, row) of each good quality fire detection.
+    candidates: Vec<(usize, usize)>,
+    powers: Vec<f64>,
+    areas: Vec<f64>,
+    temperatures: Vec<f64>,
+    masks: Vec<i16>,
+    chunk_doubles: Vec<f64>,
+    chunk_shorts: Vec<i16>,
+    /// The fire points from the last image.
+    pub(crate) points: Vec<FirePoint>,
+}
+
+/// A hyperslab of a variable covering one storage chunk, and the candidates that lie in it.
+#[derive(Debug)]
+struct ChunkGroup {
+    /// The (row, column) of the upper left corner of the chunk.
+    start: [size_t; 2],
+    /// The number of (rows, columns) in the chunk, clipped to the edges of the grid.
+    counts: [size_t; 2],
+    /// Indexes into the candidate list of the candidates in this chunk.
+    members: Vec<usize>,
+}
+
+impl ChunkGroup {
+    fn len(&self) -> usize {
+        self.counts[0] * self.counts[1]
     }
 }
 
@@ -394,7 +611,7 @@ impl Drop for SatFireImage {
  * a fire.
  */
 #[derive(Debug, Clone, Copy)]
-pub(crate) struct FirePoint {
+pub struct FirePoint {
     /// The polygon describing the scanned area.
     pub pixel: Pixel,
     /// The x-coordinate (column number, often indexed as 'i') in the grid.
@@ -426,47 +643,108 @@ struct CoordTransform {
 }
 
 impl CoordTransform {
+    /// Calculate the scan angle, in degrees, of a point in the grid.
+    fn scan_angle(&self, row: f64, col: f64) -> f64 {
+        let x = self.xscale * col + self.xoffset;
+        let y = self.yscale * row + self.yoffset;
+
+        x.hypot(y).to_degrees()
+    }
+
+    /// Calculate the corners of the pixel at column `i` and row `j`.
+    ///
+    /// The corners are returned in the order upper left, lower left, lower right, upper right.
+    /// This is the direct calculation that the tables in [geolocation] are checked against.
+    #[cfg(test)]
+    fn pixel_corners(&self, i: usize, j: usize) -> [Coord; 4] {
+        let ii = i as f64;
+        let jj = j as f64;
+
+        [
+            self.convert_row_col_to_latlon(jj - 0.5, ii - 0.5),
+            self.convert_row_col_to_latlon(jj + 0.5, ii - 0.5),
+            self.convert_row_col_to_latlon(jj + 0.5, ii + 0.5),
+            self.convert_row_col_to_latlon(jj - 0.5, ii + 0.5),
+        ]
+    }
+
+    /// Convert a (possibly fractional) row and column number in the grid into a coordinate.
+    ///
+    /// This is the original calculation, with all the trigonometry done for each point, kept to
+    /// check that sharing it by row and column with [CoordTransform::convert_trig_to_latlon]
+    /// gives exactly the same results.
+    #[cfg(test)]
     #[allow(non_snake_case)]
-    fn convert_row_cols_to_latlon(&self, rows: &[f64; 5], cols: &[f64; 5]) -> (f64, [Coord; 5]) {
-        let mut coords = [Coord { lat: 0.0, lon: 0.0 }; 5];
-
-        let x = self.xscale * cols[4] + self.xoffset;
-        let y = self.yscale * rows[4] + self.yoffset;
-        let scan_angle = x.hypot(y).to_degrees();
-
-        for i in 0..5 {
-            let x = self.xscale * cols[i] + self.xoffset;
-            let y = self.yscale * rows[i] + self.yoffset;
-
-            let sinx = x.sin();
-            let cosx = x.cos();
-            let siny = y.sin();
-            let cosy = y.cos();
-            let req = self.req;
-            let rpol = self.rpol;
-            let H = self.H;
-            let lon0 = self.lon0;
-
-            let a =
-                sinx * sinx + cosx * cosx * (cosy * cosy + req * req / (rpol * rpol) * siny * siny);
-            let b = -2.0 * H * cosx * cosy;
-            let c = H * H - req * req;
-
-            let rs = (-b - (b * b - 4.0 * a * c).sqrt()) / (2.0 * a);
-
-            let sx = rs * cosx * cosy;
-            let sy = -rs * sinx;
-            let sz = rs * cosx * siny;
-
-            let lat = (req * req * sz)
-                .atan2(rpol * rpol * ((H - sx) * (H - sx) + sy * sy).sqrt())
-                .to_degrees();
-            let lon = lon0 - (sy.atan2(H - sx)).to_degrees();
-
-            coords[i] = Coord { lat, lon };
-        }
+    fn convert_row_col_to_latlon(&self, row: f64, col: f64) -> Coord {
+        let x = self.xscale * col + self.xoffset;
+        let y = self.yscale * row + self.yoffset;
+
+        let sinx = x.sin();
+        let cosx = x.cos();
+        let siny = y.sin();
+        let cosy = y.cos();
+        let req = self.req;
+        let rpol = self.rpol;
+        let H = self.H;
+        let lon0 = self.lon0;
+
+        let a = sinx * sinx + cosx * cosx * (cosy * cosy + req * req / (rpol * rpol) * siny * siny);
+        let b = -2.0 * H * cosx * cosy;
+        let c = H * H - req * req;
+
+        let rs = (-b - (b * b - 4.0 * a * c).sqrt()) / (2.0 * a);
+
+        let sx = rs * cosx * cosy;
+        let sy = -rs * sinx;
+        let sz = rs * cosx * siny;
+
+        let lat = (req * req * sz)
+            .atan2(rpol * rpol * ((H - sx) * (H - sx) + sy * sy).sqrt())
+            .to_degrees();
+        let lon = lon0 - (sy.atan2(H - sx)).to_degrees();
+
+        Coord { lat, lon }
+    }
+
+    /// The sine and cosine of the scan angle in the x direction for a (possibly fractional) column.
+    fn column_trig(&self, col: f64) -> (f64, f64) {
+        (self.xscale * col + self.xoffset).sin_cos()
+    }
+
+    /// The sine and cosine of the scan angle in the y direction for a (possibly fractional) row.
+    fn row_trig(&self, row: f64) -> (f64, f64) {
+        (self.yscale * row + self.yoffset).sin_cos()
+    }
 
-        (scan_angle, coords)
+    /// Convert the sines and cosines of the scan angles of a point into a coordinate.
+    ///
+    /// The x scan angle only depends on the column and the y scan angle only depends on the row,
+    /// so when converting many points in a grid the trigonometry can be done once per row and
+    /// column with [CoordTransform::row_trig] and [CoordTransform::column_trig] instead of once
+    /// per point.
+    #[allow(non_snake_case)]
+    fn convert_trig_to_latlon(&self, (siny, cosy): (f64, f64), (sinx, cosx): (f64, f64)) -> Coord {
+        let req = self.req;
+        let rpol = self.rpol;
+        let H = self.H;
+        let lon0 = self.lon0;
+
+        let a = sinx * sinx + cosx * cosx * (cosy * cosy + req * req / (rpol * rpol) * siny * siny);
+        let b = -2.0 * H * cosx * cosy;
+        let c = H * H - req * req;
+
+        let rs = (-b - (b * b - 4.0 * a * c).sqrt()) / (2.0 * a);
+
+        let sx = rs * cosx * cosy;
+        let sy = -rs * sinx;
+        let sz = rs * cosx * siny;
+
+        let lat = (req * req * sz)
+            .atan2(rpol * rpol * ((H - sx) * (H - sx) + sy * sy).sqrt())
+            .to_degrees();
+        let lon = lon0 - (sy.atan2(H - sx)).to_degrees();
+
+        Coord { lat, lon }
     }
 }
 
@@ -479,6 +757,7 @@ fn get_netcdf_lock() -> &'static Mutex<()> {
 const NC_NOWRITE: c_int = 0x0000;
 const NC_NOERR: c_int = 0;
 const NC_ENOTATT: c_int = -43;
+const NC_CHUNKED: c_int = 0;
 
 fn check_netcdf_error(status_code: c_int, file: &'static str, line: u32) -> SatFireResult<()> {
     unsafe {
@@ -546,6 +825,12 @@ extern "C" {
         counts: *const size_t,
         vals: *mut c_short,
     ) -> c_int;
+    fn nc_inq_var_chunking(
+        handle: c_int,
+        varid: c_int,
+        storage: *mut c_int,
+        chunk_sizes: *mut size_t,
+    ) -> c_int;
     fn nc_get_vara_double(
         handle: c_int,
         varid: c_int,
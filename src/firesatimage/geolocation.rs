@@ -0,0 +1,629 @@
+//! A cache of the pixel corner locations for the fixed grids used by the GOES satellites.
+//!
+//! For a given satellite, sector, and resolution the data is always projected onto the exact same
+//! grid. So instead of doing all the trigonometry to convert every pixel to latitude and longitude
+//! for every file, the locations of the grid vertices are calculated once and then looked up.
+//!
+//! Neighboring pixels share corners, so the table stores the (xlen + 1) x (ylen + 1) vertices of
+//! the grid instead of 4 corners per pixel. Without a cache directory the rows of the table are
+//! calculated lazily the first time they are needed. With a cache directory the whole table is
+//! calculated once, saved to a file, and then memory mapped on later runs.
+//!
+//! Meso-sectors move around, so their grids are never cached. Instead [SparseGeoGrid] calculates
+//! just the vertices of the pixels in a file that are needed, still only once each.
+//!
+//! The x scan angle of a vertex only depends on its column and the y scan angle only on its row,
+//! so all the sines and cosines are calculated once per column and row of vertices and shared.
+
+use super::CoordTransform;
+use crate::{
+    geo::Coord,
+    satellite::{Satellite, Sector},
+    SatFireResult,
+};
+use libc::c_void;
+use log::{info, warn};
+use once_cell::sync::OnceCell;
+use rustc_hash::FxHashMap as HashMap;
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    mem::size_of,
+    os::unix::io::AsRawFd,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex},
+};
+
+static_assertions::assert_eq_size!(Coord, [f64; 2]);
+
+/// Set a directory to store the geolocation tables in.
+///
+/// If this is set, the tables are saved to files in this directory and memory mapped so they can
+/// be reused by later runs. If it is never set, the tables are only kept in memory for the life of
+/// the program. The directory can only be set once, before any files are processed.
+pub fn set_geolocation_cache_directory<P: AsRef<Path>>(dir: P) -> SatFireResult<()> {
+    let dir = dir.as_ref();
+    if !dir.is_dir() {
+        return Err(format!(
+            "Geolocation cache directory does not exist: {}",
+            dir.display()
+        )
+        .into());
+    }
+
+    GEO_GRID_CACHE_DIR
+        .set(dir.to_path_buf())
+        .map_err(|_| "Geolocation cache directory already set.".into())
+}
+
+/// Get the geolocation table for a grid, building it if necessary.
+///
+/// Returns `None` if this grid should not be cached, in which case the caller should calculate
+/// the coordinates directly.
+pub(super) fn grid_for(
+    sat: Satellite,
+    sector: Sector,
+    xlen: usize,
+    ylen: usize,
+    tran: &CoordTransform,
+) -> Option<Arc<GeoGrid>> {
+    if matches!(sector, Sector::MESO1 | Sector::MESO2) {
+        return None;
+    }
+
+    let key = GeoGridKey::new(sat, sector, xlen, ylen, tran);
+
+    // Building a grid can take a while, so only hold the lock long enough to find its slot. Other
+    // threads wanting the same grid wait on the slot, not the whole cache.
+    let slot = {
+        let mut cache = GEO_GRID_CACHE
+            .get_or_init(|| Mutex::new(HashMap::default()))
+            .lock()
+            .expect("Error locking geolocation cache mutex");
+
+        Arc::clone(cache.entry(key).or_default())
+    };
+
+    let grid = slot.get_or_init(|| Arc::new(GeoGrid::new(&key, *tran)));
+
+    Some(Arc::clone(grid))
+}
+
+type GeoGridSlot = Arc<OnceCell<Arc<GeoGrid>>>;
+
+static GEO_GRID_CACHE: OnceCell<Mutex<HashMap<GeoGridKey, GeoGridSlot>>> = OnceCell::new();
+static GEO_GRID_CACHE_DIR: OnceCell<PathBuf> = OnceCell::new();
+
+/// Everything needed to uniquely identify a fixed grid.
+///
+/// The floating point values are stored as their bit patterns so the key can be hashed.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct GeoGridKey {
+    sat: Satellite,
+    sector: Sector,
+    xlen: usize,
+    ylen: usize,
+    xscale: u64,
+    xoffset: u64,
+    yscale: u64,
+    yoffset: u64,
+    lon0: u64,
+}
+
+impl GeoGridKey {
+    fn new(
+        sat: Satellite,
+        sector: Sector,
+        xlen: usize,
+        ylen: usize,
+        tran: &CoordTransform,
+    ) -> Self {
+        GeoGridKey {
+            sat,
+            sector,
+            xlen,
+            ylen,
+            xscale: tran.xscale.to_bits(),
+            xoffset: tran.xoffset.to_bits(),
+            yscale: tran.yscale.to_bits(),
+            yoffset: tran.yoffset.to_bits(),
+            lon0: tran.lon0.to_bits(),
+        }
+    }
+
+    /// The name of the cache file for this grid.
+    ///
+    /// Grids of the same size can have different transforms, so a hash of the transform is part of
+    /// the name. It is a plain FNV-1a hash so the name is the same in every run.
+    fn file_name(&self) -> String {
+        let hash = [
+            self.xscale,
+            self.xoffset,
+            self.yscale,
+            self.yoffset,
+            self.lon0,
+        ]
+        .iter()
+        .flat_map(|bits| bits.to_le_bytes())
+        .fold(0xcbf2_9ce4_8422_2325_u64, |hash, byte| {
+            (hash ^ byte as u64).wrapping_mul(0x0100_0000_01b3)
+        });
+
+        format!(
+            "{}_{}_{}x{}_{:016x}.geogrid",
+            self.sat.name(),
+            self.sector.name(),
+            self.xlen,
+            self.ylen,
+            hash
+        )
+    }
+}
+
+/// A table of the coordinates of the vertices of a fixed grid.
+#[derive(Debug)]
+pub(super) struct GeoGrid {
+    /// Image width in pixels, there is one more vertex than this in each row.
+    xlen: usize,
+    /// Image height in pixels, there is one more row of vertices than this.
+    ylen: usize,
+    /// The transform used to fill in lazily calculated rows.
+    tran: CoordTransform,
+    /// The sine and cosine of the x scan angle for each column of vertices, for lazy rows.
+    column_trig: Box<[(f64, f64)]>,
+    /// Where the vertices live.
+    storage: GeoGridStorage,
+}
+
+#[derive(Debug)]
+enum GeoGridStorage {
+    /// Each row of vertices is calculated the first time it is needed.
+    Lazy(Vec<OnceCell<Box<[Coord]>>>),
+    /// The whole table is memory mapped from a file.
+    Mapped(MappedVertices),
+}
+
+impl GeoGrid {
+    fn new(key: &GeoGridKey, tran: CoordTransform) -> Self {
+        let (xlen, ylen) = (key.xlen, key.ylen);
+
+        if let Some(dir) = GEO_GRID_CACHE_DIR.get() {
+            let path = dir.join(key.file_name());
+
+            match Self::load_or_create_mapped(&path, xlen, ylen, &tran) {
+                Ok(mapped) => {
+                    return GeoGrid {
+                        xlen,
+                        ylen,
+                        tran,
+                        column_trig: Box::new([]),
+                        storage: GeoGridStorage::Mapped(mapped),
+                    };
+                }
+                Err(err) => {
+                    warn!(target: "geolocation", "Unable to use cache file {} - {}",
+                        path.display(), err);
+                }
+            }
+        }
+
+        Self::new_lazy(xlen, ylen, tran)
+    }
+
+    fn new_lazy(xlen: usize, ylen: usize, tran: CoordTransform) -> Self {
+        let rows = (0..=ylen).map(|_| OnceCell::new()).collect();
+
+        GeoGrid {
+            xlen,
+            ylen,
+            tran,
+            column_trig: column_trig(&tran, xlen + 1),
+            storage: GeoGridStorage::Lazy(rows),
+        }
+    }
+
+    /// Get the corners of the pixel at column `i` and row `j`.
+    ///
+    /// The corners are returned in the order upper left, lower left, lower right, upper right.
+    pub(super) fn pixel_corners(&self, i: usize, j: usize) -> [Coord; 4] {
+        debug_assert!(i < self.xlen && j < self.ylen);
+
+        let upper = self.vertex_row(j);
+        let lower = self.vertex_row(j + 1);
+
+        [upper[i], lower[i], lower[i + 1], upper[i + 1]]
+    }
+
+    fn vertex_row(&self, row: usize) -> &[Coord] {
+        let row_len = self.xlen + 1;
+
+        match self.storage {
+            GeoGridStorage::Lazy(ref rows) => {
+                rows[row].get_or_init(|| calculate_vertex_row(&self.tran, &self.column_trig, row))
+            }
+            GeoGridStorage::Mapped(ref mapped) => {
+                let start = row * row_len;
+                &mapped.vertices()[start..(start + row_len)]
+            }
+        }
+    }
+
+    fn load_or_create_mapped(
+        path: &Path,
+        xlen: usize,
+        ylen: usize,
+        tran: &CoordTransform,
+    ) -> SatFireResult<MappedVertices> {
+        let header = GeoGridFileHeader::new(xlen, ylen, tran);
+
+        if path.exists() {
+            match MappedVertices::open(path, &header) {
+                Ok(mapped) => return Ok(mapped),
+                Err(err) => {
+                    warn!(target: "geolocation", "Rebuilding cache file {} - {}",
+                        path.display(), err);
+                }
+            }
+        }
+
+        info!(target: "geolocation", "Building cache file {}", path.display());
+
+        // Write to a temporary file and then move it into place so a partially written file is
+        // never visible to another process. Several worker processes may be racing to build the
+        // same file, so the temporary file name is unique to this process.
+        let tmp_path = path.with_extension(format!("geogrid.{}.tmp", std::process::id()));
+        {
+            let mut f = BufWriter::new(File::create(&tmp_path)?);
+            header.write(&mut f)?;
+
+            let column_trig = column_trig(tran, xlen + 1);
+            for row in 0..=ylen {
+                for coord in calculate_vertex_row(tran, &column_trig, row).iter() {
+                    f.write_all(&coord.lat.to_ne_bytes())?;
+                    f.write_all(&coord.lon.to_ne_bytes())?;
+                }
+            }
+
+            f.flush()?;
+        }
+        std::fs::rename(&tmp_path, path)?;
+
+        MappedVertices::open(path, &header)
+    }
+}
+
+/// The sine and cosine of the x scan angle for each of the first `row_len` columns of vertices.
+fn column_trig(tran: &CoordTransform, row_len: usize) -> Box<[(f64, f64)]> {
+    (0..row_len)
+        .map(|col| tran.column_trig(col as f64 - 0.5))
+        .collect()
+}
+
+fn calculate_vertex_row(
+    tran: &CoordTransform,
+    column_trig: &[(f64, f64)],
+    row: usize,
+) -> Box<[Coord]> {
+    let row_trig = tran.row_trig(row as f64 - 0.5);
+
+    column_trig
+        .iter()
+        .map(|&col_trig| tran.convert_trig_to_latlon(row_trig, col_trig))
+        .collect()
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                       Sparse Grids
+ *-----------------------------------------------------------------------------------------------*/
+
+/// The vertices around a scattered set of pixels in a grid that is not worth a full table.
+///
+/// Each vertex is only calculated once, no matter how many of the pixels share it.
+#[derive(Debug, Default)]
+pub(super) struct SparseGeoGrid {
+    /// Vertices by column and row.
+    vertices: HashMap<(usize, usize), Coord>,
+}
+
+impl SparseGeoGrid {
+    /// Calculate the vertices around the pixels at the given (column, row) locations.
+    pub(super) fn for_pixels(tran: &CoordTransform, pixels: &[(usize, usize)]) -> Self {
+        let mut row_trig: HashMap<usize, (f64, f64)> = HashMap::default();
+        let mut column_trig: HashMap<usize, (f64, f64)> = HashMap::default();
+        let mut vertices: HashMap<(usize, usize), Coord> = HashMap::default();
+        vertices.reserve(pixels.len() * 2);
+
+        for &(i, j) in pixels {
+            for vertex in [(i, j), (i, j + 1), (i + 1, j + 1), (i + 1, j)] {
+                vertices.entry(vertex).or_insert_with(|| {
+                    let (col, row) = vertex;
+                    let col_trig = *column_trig
+                        .entry(col)
+                        .or_insert_with(|| tran.column_trig(col as f64 - 0.5));
+                    let row_trig = *row_trig
+                        .entry(row)
+                        .or_insert_with(|| tran.row_trig(row as f64 - 0.5));
+
+                    tran.convert_trig_to_latlon(row_trig, col_trig)
+                });
+            }
+        }
+
+        SparseGeoGrid { vertices }
+    }
+
+    /// Get the corners of the pixel at column `i` and row `j`, which must be one of the pixels
+    /// this was created for.
+    ///
+    /// The corners are returned in the order upper left, lower left, lower right, upper right.
+    pub(super) fn pixel_corners(&self, i: usize, j: usize) -> [Coord; 4] {
+        [
+            self.vertices[&(i, j)],
+            self.vertices[&(i, j + 1)],
+            self.vertices[&(i + 1, j + 1)],
+            self.vertices[&(i + 1, j)],
+        ]
+    }
+}
+
+/*-------------------------------------------------------------------------------------------------
+ *                                        Cache Files
+ *-----------------------------------------------------------------------------------------------*/
+
+/// The header of a geolocation cache file.
+///
+/// The vertices follow the header as native endian (lat, lon) pairs of f64 in row major order.
+/// The header is padded out to `HEADER_SIZE` so the vertices are aligned in the mapped memory.
+#[derive(Debug, Clone, Copy, PartialEq)]
+struct GeoGridFileHeader {
+    xlen: u64,
+    ylen: u64,
+    params: [f64; 8],
+}
+
+const HEADER_MAGIC: &[u8; 8] = b"SFGEOGRD";
+const HEADER_VERSION: u32 = 1;
+const HEADER_SIZE: usize = 128;
+
+impl GeoGridFileHeader {
+    fn new(xlen: usize, ylen: usize, tran: &CoordTransform) -> Self {
+        GeoGridFileHeader {
+            xlen: xlen as u64,
+            ylen: ylen as u64,
+            params: [
+                tran.xscale,
+                tran.xoffset,
+                tran.yscale,
+                tran.yoffset,
+                tran.req,
+                tran.rpol,
+                tran.H,
+                tran.lon0,
+            ],
+        }
+    }
+
+    fn num_vertices(&self) -> usize {
+        (self.xlen as usize + 1) * (self.ylen as usize + 1)
+    }
+
+    fn write<W: Write>(&self, w: &mut W) -> std::io::Result<()> {
+        let mut buf = [0u8; HEADER_SIZE];
+        let mut cursor = std::io::Cursor::new(&mut buf[..]);
+
+        cursor.write_all(HEADER_MAGIC)?;
+        cursor.write_all(&HEADER_VERSION.to_ne_bytes())?;
+        cursor.write_all(&0u32.to_ne_bytes())?;
+        cursor.write_all(&self.xlen.to_ne_bytes())?;
+        cursor.write_all(&self.ylen.to_ne_bytes())?;
+        for param in self.params {
+            cursor.write_all(&param.to_ne_bytes())?;
+        }
+
+        w.write_all(&buf)
+    }
+
+    fn read(bytes: &[u8]) -> SatFireResult<Self> {
+        if bytes.len() < HEADER_SIZE || &bytes[..8] != HEADER_MAGIC {
+            return Err("Not a geolocation cache file".into());
+        }
+
+        let u64_at = |offset: usize| {
+            let mut buf = [0u8; 8];
+            buf.copy_from_slice(&bytes[offset..(offset + 8)]);
+            u64::from_ne_bytes(buf)
+        };
+
+        let mut version = [0u8; 4];
+        version.copy_from_slice(&bytes[8..12]);
+        if u32::from_ne_bytes(version) != HEADER_VERSION {
+            return Err("Unsupported geolocation cache file version".into());
+        }
+
+        let xlen = u64_at(16);
+        let ylen = u64_at(24);
+
+        let mut params = [0.0; 8];
+        for (i, param) in params.iter_mut().enumerate() {
+            *param = f64::from_bits(u64_at(32 + i * 8));
+        }
+
+        Ok(GeoGridFileHeader { xlen, ylen, params })
+    }
+}
+
+/// A read only memory map of a geolocation cache file.
+#[derive(Debug)]
+struct MappedVertices {
+    ptr: *mut c_void,
+    len: usize,
+    num_vertices: usize,
+}
+
+// Safety: The mapping is read only and never modified after it is created.
+unsafe impl Send for MappedVertices {}
+unsafe impl Sync for MappedVertices {}
+
+impl MappedVertices {
+    fn open(path: &Path, expected: &GeoGridFileHeader) -> SatFireResult<Self> {
+        let f = File::open(path)?;
+        let len = f.metadata()?.len() as usize;
+
+        let num_vertices = expected.num_vertices();
+        if len != HEADER_SIZE + num_vertices * size_of::<Coord>() {
+            return Err("Geolocation cache file is the wrong size".into());
+        }
+
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                f.as_raw_fd(),
+                0,
+            )
+        };
+
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        // Create this first so the memory is unmapped if the header doesn't check out.
+        let mapped = MappedVertices {
+            ptr,
+            len,
+            num_vertices,
+        };
+
+        let header_bytes = unsafe { std::slice::from_raw_parts(ptr as *const u8, HEADER_SIZE) };
+        if GeoGridFileHeader::read(header_bytes)? != *expected {
+            return Err("Geolocation cache file is for a different grid".into());
+        }
+
+        Ok(mapped)
+    }
+
+    fn vertices(&self) -> &[Coord] {
+        // Safety: The size was checked when the file was mapped and the mapping is page aligned,
+        // so with the header padding the vertices are properly aligned for Coord.
+        unsafe {
+            let start = (self.ptr as *const u8).add(HEADER_SIZE) as *const Coord;
+            std::slice::from_raw_parts(start, self.num_vertices)
+        }
+    }
+}
+
+impl Drop for MappedVertices {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr, self.len);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    // Projection information for the GOES-16 CONUS sector, trimmed down to a small grid.
+    fn test_transform() -> CoordTransform {
+        CoordTransform {
+            xscale: 5.6e-05,
+            xoffset: -0.101332,
+            yscale: -5.6e-05,
+            yoffset: 0.128212,
+            req: 6378137.0,
+            rpol: 6356752.31414,
+            H: 35786023.0 + 6378137.0,
+            lon0: -75.0,
+        }
+    }
+
+    fn assert_corners_match(grid: &GeoGrid, tran: &CoordTransform, xlen: usize, ylen: usize) {
+        for j in 0..ylen {
+            for i in 0..xlen {
+                let from_grid = grid.pixel_corners(i, j);
+                let direct = tran.pixel_corners(i, j);
+
+                for (g, d) in from_grid.iter().zip(direct.iter()) {
+                    assert_eq!(g.lat.to_bits(), d.lat.to_bits());
+                    assert_eq!(g.lon.to_bits(), d.lon.to_bits());
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_lazy_grid_matches_direct_calculation() {
+        let tran = test_transform();
+        let (xlen, ylen) = (25, 15);
+
+        let grid = GeoGrid::new_lazy(xlen, ylen, tran);
+        assert_corners_match(&grid, &tran, xlen, ylen);
+    }
+
+    #[test]
+    fn test_mapped_grid_round_trip() {
+        let tran = test_transform();
+        let (xlen, ylen) = (25, 15);
+
+        let mut path = std::env::temp_dir();
+        path.push(format!("satfire_test_{}.geogrid", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        // First time builds the file, second time maps the existing file.
+        for _ in 0..2 {
+            let mapped = GeoGrid::load_or_create_mapped(&path, xlen, ylen, &tran).unwrap();
+            let grid = GeoGrid {
+                xlen,
+                ylen,
+                tran,
+                column_trig: Box::new([]),
+                storage: GeoGridStorage::Mapped(mapped),
+            };
+            assert_corners_match(&grid, &tran, xlen, ylen);
+        }
+
+        // A different grid should not be able to use this file.
+        let header = GeoGridFileHeader::new(xlen, ylen + 1, &tran);
+        assert!(MappedVertices::open(&path, &header).is_err());
+
+        let _ = std::fs::remove_file(&path);
+    }
+
+    #[test]
+    fn test_cache_file_names_differ_by_transform() {
+        let tran = test_transform();
+        let mut shifted = tran;
+        shifted.xoffset += tran.xscale;
+
+        let name = |tran: &CoordTransform| {
+            GeoGridKey::new(Satellite::G16, Sector::CONUS, 25, 15, tran).file_name()
+        };
+
+        assert_eq!(name(&tran), name(&test_transform()));
+        assert_ne!(name(&tran), name(&shifted));
+        assert!(name(&tran).starts_with("G16_FDCC_25x15_"));
+    }
+
+    #[test]
+    fn test_sparse_grid_matches_direct_calculation() {
+        let tran = test_transform();
+
+        // A block of neighbors that share corners and a couple of scattered pixels.
+        let pixels = [(3, 4), (4, 4), (3, 5), (4, 5), (10, 2), (20, 14)];
+        let grid = SparseGeoGrid::for_pixels(&tran, &pixels);
+        assert_eq!(grid.vertices.len(), 9 + 4 + 4);
+
+        for &(i, j) in &pixels {
+            let from_grid = grid.pixel_corners(i, j);
+            let direct = tran.pixel_corners(i, j);
+
+            for (g, d) in from_grid.iter().zip(direct.iter()) {
+                assert_eq!(g.lat.to_bits(), d.lat.to_bits());
+                assert_eq!(g.lon.to_bits(), d.lon.to_bits());
+            }
+        }
+    }
+}
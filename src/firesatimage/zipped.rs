@@ -0,0 +1,201 @@
+//! Memory for NetCDF files opened from inside zip archives.
+//!
+//! Compressed members are decompressed into buffers that are returned to a pool when the file is
+//! closed, so loading one file after another on the same threads reuses the same few large
+//! allocations. Stored (uncompressed) members are handed to NetCDF straight from a memory map of
+//! the archive without being copied at all.
+
+use crate::SatFireResult;
+use libc::c_void;
+use once_cell::sync::OnceCell;
+use std::{
+    fmt::{self, Debug},
+    fs::File,
+    io::Read,
+    os::unix::io::AsRawFd,
+    path::Path,
+    sync::Mutex,
+};
+use zip::CompressionMethod;
+
+/// The most memory kept in the pool, buffers that don't fit are freed when they are returned.
+///
+/// The whole pool is limited, not the number of buffers, because each buffer holds a whole
+/// decompressed file and a full disk file is much larger than a CONUS one.
+const MAX_POOLED_BYTES: usize = 256 * 1024 * 1024;
+
+static BUFFER_POOL: OnceCell<Mutex<Vec<Vec<u8>>>> = OnceCell::new();
+
+/// The contents of the NetCDF file in a zip archive, which must outlive the NetCDF handle.
+pub(super) enum ZippedNetCdf {
+    /// A compressed member decompressed into a buffer from the pool.
+    Buffer(Vec<u8>),
+    /// A stored member inside a private, copy on write, memory map of the whole archive.
+    Mapped {
+        ptr: *mut c_void,
+        map_len: usize,
+        offset: usize,
+        len: usize,
+    },
+}
+
+// Safety: The mapping is only accessed through the NetCDF handle that owns it.
+unsafe impl Send for ZippedNetCdf {}
+
+impl Debug for ZippedNetCdf {
+    fn fmt(&self, f: &mut fmt::Formatter) -> Result<(), fmt::Error> {
+        match self {
+            ZippedNetCdf::Buffer(buf) => write!(f, "Buffer({} bytes)", buf.len()),
+            ZippedNetCdf::Mapped { len, .. } => write!(f, "Mapped({} bytes)", len),
+        }
+    }
+}
+
+impl ZippedNetCdf {
+    /// Load the only member of the zip archive at `path`.
+    pub(super) fn load(path: &Path) -> SatFireResult<Self> {
+        let file = File::open(path)?;
+        let mut zip = zip::ZipArchive::new(&file)?;
+        assert_eq!(zip.len(), 1);
+
+        let mut nc_file = zip.by_index(0)?;
+
+        if nc_file.compression() == CompressionMethod::Stored {
+            let offset = nc_file.data_start() as usize;
+            let len = nc_file.size() as usize;
+            drop(nc_file);
+
+            return Self::map_member(&file, offset, len);
+        }
+
+        let mut buf = take_buffer();
+        buf.reserve(nc_file.size() as usize + 10);
+        match nc_file.read_to_end(&mut buf) {
+            Ok(_) => Ok(ZippedNetCdf::Buffer(buf)),
+            Err(err) => {
+                return_buffer(buf);
+                Err(err.into())
+            }
+        }
+    }
+
+    fn map_member(file: &File, offset: usize, len: usize) -> SatFireResult<Self> {
+        let map_len = file.metadata()?.len() as usize;
+        if len == 0 || offset + len > map_len {
+            return Err("Invalid stored member in zip archive".into());
+        }
+
+        // NetCDF is only given read access, but it takes a mutable pointer. A private writable
+        // mapping means a stray write could never reach the archive on disk.
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                map_len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        Ok(ZippedNetCdf::Mapped {
+            ptr,
+            map_len,
+            offset,
+            len,
+        })
+    }
+
+    /// Get a pointer to the start of the NetCDF file.
+    pub(super) fn as_mut_ptr(&mut self) -> *mut c_void {
+        match self {
+            ZippedNetCdf::Buffer(buf) => buf.as_mut_ptr() as *mut c_void,
+            ZippedNetCdf::Mapped { ptr, offset, .. } => unsafe {
+                (*ptr as *mut u8).add(*offset) as *mut c_void
+            },
+        }
+    }
+
+    /// Get the size of the NetCDF file in bytes.
+    pub(super) fn len(&self) -> usize {
+        match self {
+            ZippedNetCdf::Buffer(buf) => buf.len(),
+            ZippedNetCdf::Mapped { len, .. } => *len,
+        }
+    }
+}
+
+impl Drop for ZippedNetCdf {
+    fn drop(&mut self) {
+        match self {
+            ZippedNetCdf::Buffer(buf) => return_buffer(std::mem::take(buf)),
+            ZippedNetCdf::Mapped { ptr, map_len, .. } => unsafe {
+                libc::munmap(*ptr, *map_len);
+            },
+        }
+    }
+}
+
+fn take_buffer() -> Vec<u8> {
+    BUFFER_POOL
+        .get_or_init(|| Mutex::new(vec![]))
+        .lock()
+        .expect("Error locking buffer pool")
+        .pop()
+        .unwrap_or_default()
+}
+
+fn return_buffer(mut buf: Vec<u8>) {
+    if buf.capacity() == 0 {
+        return;
+    }
+
+    buf.clear();
+
+    let mut pool = BUFFER_POOL
+        .get_or_init(|| Mutex::new(vec![]))
+        .lock()
+        .expect("Error locking buffer pool");
+
+    let pooled: usize = pool.iter().map(|b| b.capacity()).sum();
+    if pooled + buf.capacity() <= MAX_POOLED_BYTES {
+        pool.push(buf);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_buffers_are_reused() {
+        let mut buf = take_buffer();
+        buf.extend_from_slice(&[1, 2, 3]);
+        buf.reserve(1_000_000);
+        let capacity = buf.capacity();
+        let ptr = buf.as_ptr();
+
+        drop(ZippedNetCdf::Buffer(buf));
+
+        let buf = take_buffer();
+        assert!(buf.is_empty());
+        assert_eq!(buf.capacity(), capacity);
+        assert_eq!(buf.as_ptr(), ptr);
+    }
+
+    #[test]
+    fn test_pool_is_limited_by_bytes() {
+        let too_big: Vec<u8> = Vec::with_capacity(MAX_POOLED_BYTES + 1);
+        let ptr = too_big.as_ptr();
+
+        return_buffer(too_big);
+
+        let pool = BUFFER_POOL.get().unwrap().lock().unwrap();
+        assert!(pool.iter().all(|b| b.as_ptr() != ptr));
+        assert!(pool.iter().map(|b| b.capacity()).sum::<usize>() <= MAX_POOLED_BYTES);
+    }
+}
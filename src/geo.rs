@@ -295,7 +295,7 @@ pub(crate) struct IntersectResult {
 }
 
 mod hilbert_rtree;
-pub(crate) use hilbert_rtree::Hilbert2DRTreeView;
+pub use hilbert_rtree::Hilbert2DRTree;
 
 #[cfg(test)]
 mod test {
@@ -1,322 +1,240 @@
 use super::*;
-use std::ops::ControlFlow;
 
 const RTREE_CHILDREN_PER_NODE: usize = 4;
 const OVERLAP_FUDGE_FACTOR: f64 = 1.0e-2;
 
-#[derive(Debug)]
-enum RTreeNode {
-    Node {
-        bbox: BoundingBox,
-        children_overlap: bool,
-        children: Vec<RTreeNode>,
-    },
-    Leaf {
-        bbox: BoundingBox,
-        hilbert_num: u64,
-        index: usize,
-    },
+/// Marks a leaf whose item has been removed from the tree.
+const REMOVED: usize = usize::MAX;
+
+/// Items are added to an unsorted buffer and removed items leave holes in the tree. Once the
+/// buffer plus the holes are more than this fraction of the tree, it's time to rebuild.
+const REBUILD_FRACTION: usize = 4;
+
+/// Don't bother rebuilding small trees, the unsorted buffer is fast enough for a few items.
+const MIN_CHANGES_BEFORE_REBUILD: usize = 64;
+
+/// Where an item is stored in a [Hilbert2DRTree].
+#[derive(Debug, Clone, Copy)]
+enum Location {
+    /// The index of a leaf in the tree.
+    Leaf(usize),
+    /// The index in the buffer of items added since the tree was built.
+    Added(usize),
 }
 
-impl RTreeNode {
-    fn bounding_box(&self) -> BoundingBox {
-        match self {
-            Self::Node { bbox, .. } => *bbox,
-            Self::Leaf { bbox, .. } => *bbox,
-        }
-    }
+/// A packed Hilbert R-tree that can be kept up to date as the indexed items change.
+///
+/// The tree doesn't hold the items, it holds indexes into a slice owned by someone else. Whoever
+/// owns that slice must tell the tree when items are added ([Hilbert2DRTree::push]), removed
+/// ([Hilbert2DRTree::swap_remove]), or expanded ([Hilbert2DRTree::grow]), using the same indexes
+/// as a `Vec` would.
+///
+/// New items go into an unsorted buffer that is searched linearly, and removed items are only
+/// marked as removed. Those changes slowly make queries more expensive, so the owner should check
+/// [Hilbert2DRTree::needs_rebuild] and rebuild the tree with [Hilbert2DRTree::build_for] when it
+/// returns `true`.
+#[derive(Debug, Clone)]
+pub struct Hilbert2DRTree {
+    /// The bounding boxes of the nodes at each level of the tree. Level 0 are the leaves sorted by
+    /// Hilbert number and the last level is the root. The children of node `i` are the nodes
+    /// `i * RTREE_CHILDREN_PER_NODE` up to `(i + 1) * RTREE_CHILDREN_PER_NODE` on the level below.
+    levels: Vec<Vec<BoundingBox>>,
+    /// The index of the item stored at each leaf, or `REMOVED`.
+    leaf_items: Vec<usize>,
+    /// The number of leaves marked as `REMOVED`.
+    num_removed: usize,
+    /// Items added since the tree was built, with their bounding boxes.
+    added: Vec<(usize, BoundingBox)>,
+    /// Where each item is stored.
+    locations: Vec<Location>,
+}
 
-    fn max_hilbert_num(&self) -> u64 {
-        match self {
-            Self::Leaf { hilbert_num, .. } => *hilbert_num,
-            Self::Node { children, .. } => children
-                .iter()
-                .map(|node| node.max_hilbert_num())
-                .max()
-                .unwrap_or(0),
+impl Hilbert2DRTree {
+    /// Build a tree for the provided items.
+    pub fn build_for<T: Geo>(data: &[T], precomputed_domain: Option<BoundingBox>) -> Option<Self> {
+        if data.is_empty() {
+            return None;
         }
-    }
 
-    fn new_nodes(children: Vec<Self>) -> Self {
-        let mut bbox = BoundingBox {
-            ll: Coord {
-                lat: f64::INFINITY,
-                lon: f64::INFINITY,
-            },
-            ur: Coord {
-                lat: -f64::INFINITY,
-                lon: -f64::INFINITY,
-            },
-        };
+        let data_domain = precomputed_domain.unwrap_or_else(|| Self::build_domain(data));
 
-        let mut children_overlap = false;
-        for (i, child_box) in children.iter().map(|c| c.bounding_box()).enumerate() {
-            bbox.ll.lat = bbox.ll.lat.min(child_box.ll.lat);
-            bbox.ll.lon = bbox.ll.lon.min(child_box.ll.lon);
-            bbox.ur.lat = bbox.ur.lat.max(child_box.ur.lat);
-            bbox.ur.lon = bbox.ur.lon.max(child_box.ur.lon);
-
-            // Only check if we haven't already found an overlap.
-            if !children_overlap {
-                for other_child_box in children
-                    .iter()
-                    .enumerate()
-                    .filter(|(j, _)| *j != i) // Don't check a box for overlap against itself!
-                    .map(|(_, c)| c.bounding_box())
-                {
-                    if child_box.overlap(&other_child_box, OVERLAP_FUDGE_FACTOR) {
-                        children_overlap = true;
-                        break;
-                    }
-                }
-            }
+        let hc = HilbertCurve::new(16, data_domain);
+
+        // Sort the items by Hilbert number. This is how we get locality for the parent nodes. The
+        // index breaks ties so the tree is the same every time it is built from the same data.
+        let mut leaves: Vec<(u64, usize, BoundingBox)> = data
+            .iter()
+            .enumerate()
+            .map(|(index, item)| {
+                let hilbert_num = hc.translate_to_curve_distance(item.centroid());
+                (hilbert_num, index, item.bounding_box())
+            })
+            .collect();
+        leaves.sort_unstable_by_key(|&(hilbert_num, index, _)| (hilbert_num, index));
+
+        let mut locations = vec![Location::Leaf(0); data.len()];
+        for (leaf, &(_, index, _)) in leaves.iter().enumerate() {
+            locations[index] = Location::Leaf(leaf);
         }
 
-        Self::Node {
-            bbox,
-            children,
-            children_overlap,
+        let leaf_items = leaves.iter().map(|&(_, index, _)| index).collect();
+
+        let mut levels = vec![leaves
+            .into_iter()
+            .map(|(_, _, bbox)| bbox)
+            .collect::<Vec<_>>()];
+        while levels[levels.len() - 1].len() > 1 {
+            let level = levels[levels.len() - 1]
+                .chunks(RTREE_CHILDREN_PER_NODE)
+                .map(|children| {
+                    children
+                        .iter()
+                        .fold(Self::empty_box(), |bbox, child| Self::union(&bbox, child))
+                })
+                .collect();
+
+            levels.push(level);
         }
+
+        Some(Hilbert2DRTree {
+            levels,
+            leaf_items,
+            num_removed: 0,
+            added: vec![],
+            locations,
+        })
     }
 
-    fn num_children(&self) -> usize {
-        match self {
-            Self::Node { children, .. } => children.len(),
-            Self::Leaf { .. } => 1,
-        }
+    /// The number of items in the tree.
+    pub fn len(&self) -> usize {
+        self.locations.len()
     }
 
-    /// Recursively apply `update` to objects in `data` that have bounding boxes that overlap
-    /// `region`.
-    ///
-    /// ## Parameters
-    ///
-    /// data - is managed by the parent Hilbert2DRTreeView object. Indexes of `Self::Leaf{..}`
-    /// nodes index into this slice.
-    ///
-    /// region - is the region of interest.
-    ///
-    /// update - is a `Fn` to apply to any items that overlap `region`. If it returns `Break(..)`,
-    /// then further iteration should stop. If it returns `Continue(..)`, then iteration should
-    /// carry on. If the `bool` in the return value is `true`, then something was updated and the
-    /// bounding boxes need to be checked for expansion. The arguments to this function are a
-    /// mutable reference to an item stored in the underlying array whose bounding box overlaps
-    /// `region`, the index of that item in the underlying array, and the `user_data` passed in
-    /// below.
-    ///
-    /// user_data - will be passed from call to call of `update` in case you want to accumulate
-    /// some data while iterating. This behaves similar to the accumulator on the fold method of
-    /// iterators.
-    ///
-    /// ## Returns
-    ///
-    /// The first element of the returned tuple indicates if anything was updated. The second is
-    /// any value you may want to return from the iteration.
-    fn foreach<T, V, F>(
-        &mut self,
-        data: &mut [T],
-        region: &BoundingBox,
-        mut update: F,
-        user_data: V,
-    ) -> (bool, ControlFlow<V, V>)
-    where
-        T: Geo,
-        F: FnMut(&mut T, usize, V) -> (bool, ControlFlow<V, V>) + Copy,
-    {
-        if !self.bounding_box().overlap(region, OVERLAP_FUDGE_FACTOR) {
-            return (false, ControlFlow::Continue(user_data));
-        }
-
-        match self {
-            Self::Leaf { index, bbox, .. } => {
-                let (updated, rv) = update(&mut data[*index], *index, user_data);
-
-                if updated {
-                    *bbox = data[*index].bounding_box();
-                }
-                (updated, rv)
-            }
-            Self::Node {
-                children,
-                children_overlap,
-                bbox,
-            } => {
-                let mut user_data = user_data;
-                let mut updated = false;
-                let mut keep_going = true;
-                for child in children.iter_mut() {
-                    let (local_updated, rv) = child.foreach(data, region, update, user_data);
-
-                    if local_updated {
-                        let child_box = child.bounding_box();
-
-                        bbox.ll.lat = bbox.ll.lat.min(child_box.ll.lat);
-                        bbox.ll.lon = bbox.ll.lon.min(child_box.ll.lon);
-                        bbox.ur.lat = bbox.ur.lat.max(child_box.ur.lat);
-                        bbox.ur.lon = bbox.ur.lon.max(child_box.ur.lon);
-
-                        updated = true;
-                    }
-
-                    match rv {
-                        ControlFlow::Continue(value) => user_data = value,
-                        ControlFlow::Break(value) => {
-                            user_data = value;
-                            keep_going = false;
-                            break;
-                        }
-                    }
-                }
+    /// Check if the tree is empty.
+    pub fn is_empty(&self) -> bool {
+        self.locations.is_empty()
+    }
 
-                // Check to see if expanding has caused any children to overlap.
-                if !*children_overlap && updated {
-                    for (i, child_box) in children.iter().map(|c| c.bounding_box()).enumerate() {
-                        for other_child_box in children
-                            .iter()
-                            .enumerate()
-                            .filter(|(j, _)| i != *j)
-                            .map(|(_, c)| c.bounding_box())
-                        {
-                            if child_box.overlap(&other_child_box, OVERLAP_FUDGE_FACTOR) {
-                                *children_overlap = true;
-                                break;
-                            }
-                        }
-
-                        if *children_overlap {
-                            break;
-                        }
-                    }
-                }
+    /// Check if enough has changed since the tree was built that it should be rebuilt.
+    pub fn needs_rebuild(&self) -> bool {
+        let num_changes = self.added.len() + self.num_removed;
 
-                let user_data = if keep_going {
-                    ControlFlow::Continue(user_data)
-                } else {
-                    ControlFlow::Break(user_data)
-                };
+        num_changes > MIN_CHANGES_BEFORE_REBUILD
+            && num_changes > self.leaf_items.len() / REBUILD_FRACTION
+    }
 
-                (updated, user_data)
-            }
-        }
+    /// Add an item to the end, the same as `Vec::push`.
+    pub fn push(&mut self, bbox: BoundingBox) {
+        let index = self.locations.len();
+        self.locations.push(Location::Added(self.added.len()));
+        self.added.push((index, bbox));
     }
 
-    fn get_indexes_of_potential_overlap(&self, buffer: &mut Vec<usize>) {
-        match self {
-            Self::Leaf { index, .. } => buffer.push(*index),
-            Self::Node {
-                children,
-                children_overlap,
-                ..
-            } => {
-                if *children_overlap {
-                    for child in children {
-                        child.get_indexes_of_potential_overlap(buffer);
-                    }
+    /// Remove the item at `index` and move the last item into its place, the same as
+    /// `Vec::swap_remove`.
+    pub fn swap_remove(&mut self, index: usize) {
+        match self.locations[index] {
+            Location::Leaf(leaf) => {
+                self.leaf_items[leaf] = REMOVED;
+                self.num_removed += 1;
+            }
+            Location::Added(pos) => {
+                self.added.swap_remove(pos);
+                if let Some(&(moved, _)) = self.added.get(pos) {
+                    self.locations[moved] = Location::Added(pos);
                 }
             }
         }
-    }
-}
-
-#[derive(Debug)]
-pub struct Hilbert2DRTreeView<'a, T> {
-    root: RTreeNode,
-    hc: HilbertCurve,
-    data: &'a mut [T],
-}
 
-impl<'a, T: Geo> Hilbert2DRTreeView<'a, T> {
-    /// Build a view into the provided list.
-    pub fn build_for(data: &'a mut [T], precomputed_domain: Option<BoundingBox>) -> Option<Self> {
-        if data.is_empty() {
-            return None;
+        let last = self.locations.len() - 1;
+        if index != last {
+            let location = self.locations[last];
+            match location {
+                Location::Leaf(leaf) => self.leaf_items[leaf] = index,
+                Location::Added(pos) => self.added[pos].0 = index,
+            }
+            self.locations[index] = location;
         }
+        self.locations.pop();
+    }
 
-        let data_domain = precomputed_domain.unwrap_or_else(|| Self::build_domain(data));
-
-        let hc = HilbertCurve::new(16, data_domain);
-
-        // Build the leaf nodes - level 0
-        let mut leaves = Vec::with_capacity(data.len());
-        for item in data.iter_mut().enumerate() {
-            let (index, item) = item;
-            let bbox = item.bounding_box();
-            let hilbert_num = hc.translate_to_curve_distance(item.centroid());
-            leaves.push(RTreeNode::Leaf {
-                bbox,
-                hilbert_num,
-                index,
-            });
-        }
-
-        // Sort the leaf nodes by Hilbert number. This is how we get locality for the parent nodes.
-        leaves.sort_unstable_by_key(RTreeNode::max_hilbert_num);
-
-        let mut num_level_nodes = leaves.len();
-        let mut level_nodes = leaves;
-        while num_level_nodes > 1 {
-            let child_nodes = level_nodes;
-            level_nodes = Vec::with_capacity(child_nodes.len() / RTREE_CHILDREN_PER_NODE + 1);
-
-            let mut children = Vec::with_capacity(RTREE_CHILDREN_PER_NODE);
-            for child_node in child_nodes.into_iter() {
-                children.push(child_node);
-
-                if children.len() == RTREE_CHILDREN_PER_NODE {
-                    let node = RTreeNode::new_nodes(children);
-                    level_nodes.push(node);
-                    children = Vec::with_capacity(RTREE_CHILDREN_PER_NODE);
+    /// Expand the bounding box of the item at `index` to include `bbox`.
+    pub fn grow(&mut self, index: usize, bbox: BoundingBox) {
+        match self.locations[index] {
+            Location::Leaf(leaf) => {
+                let mut node = leaf;
+                for level in self.levels.iter_mut() {
+                    level[node] = Self::union(&level[node], &bbox);
+                    node /= RTREE_CHILDREN_PER_NODE;
                 }
             }
-
-            if !children.is_empty() {
-                let node = RTreeNode::new_nodes(children);
-                level_nodes.push(node);
+            Location::Added(pos) => {
+                let item_box = &mut self.added[pos].1;
+                *item_box = Self::union(item_box, &bbox);
             }
-
-            num_level_nodes = level_nodes.len();
         }
+    }
+
+    /// Get the indexes of items whose bounding boxes overlap `region`.
+    ///
+    /// The `buffer` is cleared first. The order of the indexes only depends on the order the items
+    /// were added in and the changes made since, so it is the same every time for the same data.
+    pub fn indexes_overlapping(&self, region: &BoundingBox, buffer: &mut Vec<usize>) {
+        buffer.clear();
 
-        debug_assert_eq!(level_nodes.len(), 1);
-        let root = level_nodes.into_iter().next().unwrap();
+        if let Some(root_level) = self.levels.len().checked_sub(1) {
+            self.get_indexes_overlapping(root_level, 0, region, buffer);
+        }
 
-        Some(Hilbert2DRTreeView { root, hc, data })
+        buffer.extend(
+            self.added
+                .iter()
+                .filter(|(_, bbox)| bbox.overlap(region, OVERLAP_FUDGE_FACTOR))
+                .map(|&(index, _)| index),
+        );
     }
 
-    /// Apply a function to all elements with boundaries that overlap.
-    ///
-    /// If the closure returns `true`, then an element was updated and we need to update the upper
-    /// levels of the bounding boxes.
-    ///
-    /// Returns `true` if `update` EVER returns `true`, that is if anything was ever updated.
-    pub fn foreach<V, F>(&mut self, region: BoundingBox, user_data: V, update: F) -> V
-    where
-        F: FnMut(&mut T, usize, V) -> (bool, ControlFlow<V, V>) + Copy,
-    {
-        if self.root.num_children() > 0 {
-            let (_, rv) = self.root.foreach(self.data, &region, update, user_data);
-            match rv {
-                ControlFlow::Break(value) => value,
-                ControlFlow::Continue(value) => value,
+    fn get_indexes_overlapping(
+        &self,
+        level: usize,
+        node: usize,
+        region: &BoundingBox,
+        buffer: &mut Vec<usize>,
+    ) {
+        if !self.levels[level][node].overlap(region, OVERLAP_FUDGE_FACTOR) {
+            return;
+        }
+
+        if level == 0 {
+            let index = self.leaf_items[node];
+            if index != REMOVED {
+                buffer.push(index);
             }
         } else {
-            user_data
+            let first_child = node * RTREE_CHILDREN_PER_NODE;
+            let last_child =
+                (first_child + RTREE_CHILDREN_PER_NODE).min(self.levels[level - 1].len());
+            for child in first_child..last_child {
+                self.get_indexes_overlapping(level - 1, child, region, buffer);
+            }
         }
     }
 
-    /// Get the indexes of items which potentially overlap other items.
-    pub fn indexes_of_potential_overlap(&self) -> Vec<usize> {
-        let mut buffer = Vec::with_capacity(self.data.len() / 100);
-
-        if self.root.num_children() > 0 {
-            self.root.get_indexes_of_potential_overlap(&mut buffer);
+    fn union(left: &BoundingBox, right: &BoundingBox) -> BoundingBox {
+        BoundingBox {
+            ll: Coord {
+                lat: left.ll.lat.min(right.ll.lat),
+                lon: left.ll.lon.min(right.ll.lon),
+            },
+            ur: Coord {
+                lat: left.ur.lat.max(right.ur.lat),
+                lon: left.ur.lon.max(right.ur.lon),
+            },
         }
-
-        buffer
     }
 
-    fn build_domain(data: &[T]) -> BoundingBox {
-        let mut mbr = BoundingBox {
+    fn empty_box() -> BoundingBox {
+        BoundingBox {
             ll: Coord {
                 lat: f64::INFINITY,
                 lon: f64::INFINITY,
@@ -325,18 +243,13 @@ impl<'a, T: Geo> Hilbert2DRTreeView<'a, T> {
                 lat: -f64::INFINITY,
                 lon: -f64::INFINITY,
             },
-        };
-
-        for item in data {
-            let item_rect = item.bounding_box();
-
-            mbr.ll.lat = mbr.ll.lat.min(item_rect.ll.lat);
-            mbr.ll.lon = mbr.ll.lon.min(item_rect.ll.lon);
-            mbr.ur.lat = mbr.ur.lat.max(item_rect.ur.lat);
-            mbr.ur.lon = mbr.ur.lon.max(item_rect.ur.lon);
         }
+    }
 
-        mbr
+    fn build_domain<T: Geo>(data: &[T]) -> BoundingBox {
+        data.iter().fold(Self::empty_box(), |mbr, item| {
+            Self::union(&mbr, &item.bounding_box())
+        })
     }
 }
 
@@ -738,38 +651,39 @@ mod test {
         rects
     }
 
-    fn test_bb_for_hits(mut rectangles: &mut [LabeledBB], bbox: BoundingBox, num_hits: usize) {
+    fn test_bb_for_hits(rectangles: &[LabeledBB], bbox: BoundingBox, num_hits: usize) {
         println!("Target Area: {} Expected Hits: {}", bbox, num_hits);
 
-        // Create the view.
-        let mut view = Hilbert2DRTreeView::build_for(&mut rectangles, None).unwrap();
+        // Create the tree.
+        let tree = Hilbert2DRTree::build_for(rectangles, None).unwrap();
 
         // Count the hits.
-        let hits = view.foreach(bbox, 0, |labeled_rect, _rect_idx, hits_so_far| {
-            println!("{:?} overlaps {:?}", bbox, labeled_rect);
-            (false, ControlFlow::Continue(hits_so_far + 1))
-        });
+        let mut hits = vec![];
+        tree.indexes_overlapping(&bbox, &mut hits);
+        for &idx in &hits {
+            println!("{:?} overlaps {:?}", bbox, rectangles[idx]);
+        }
 
-        assert_eq!(hits, num_hits);
+        assert_eq!(hits.len(), num_hits);
     }
 
     #[test]
     #[rustfmt::skip]
     fn rtree_test_query_whole_domain() {
-        let mut rectangles = create_rectangles_for_rtree_view_test();
+        let rectangles = create_rectangles_for_rtree_view_test();
 
         // Check the whole domain
         let whole_domain = 
             BoundingBox {ll: Coord { lat: 0.0, lon: 0.0 }, ur: Coord {lat: 20.0, lon: 20.0}};
 
         let len = rectangles.len();
-        test_bb_for_hits(&mut rectangles, whole_domain, len);
+        test_bb_for_hits(&rectangles, whole_domain, len);
     }
 
     #[test]
     #[rustfmt::skip]
     fn rtree_test_query() {
-        let mut rectangles = create_rectangles_for_rtree_view_test();
+        let rectangles = create_rectangles_for_rtree_view_test();
 
         for rec in &rectangles {
             println!("{:?}", rec);
@@ -792,7 +706,64 @@ mod test {
         ];
 
         for (bb, num_hit) in test_pairs{
-            test_bb_for_hits(&mut rectangles, bb, num_hit);
+            test_bb_for_hits(&rectangles, bb, num_hit);
+        }
+    }
+
+    #[test]
+    fn rtree_test_incremental_updates() {
+        let mut rectangles = create_rectangles_for_rtree_view_test();
+        let mut tree = Hilbert2DRTree::build_for(&rectangles, None).unwrap();
+
+        fn brute_force(rectangles: &[LabeledBB], region: &BoundingBox) -> Vec<usize> {
+            (0..rectangles.len())
+                .filter(|&i| rectangles[i].rect.overlap(region, OVERLAP_FUDGE_FACTOR))
+                .collect()
+        }
+
+        fn check(tree: &Hilbert2DRTree, rectangles: &[LabeledBB]) {
+            assert_eq!(tree.len(), rectangles.len());
+
+            let mut hits = vec![];
+            for x in 0..16 {
+                for y in 0..10 {
+                    let region = LabeledBB::new(x, y).rect;
+                    tree.indexes_overlapping(&region, &mut hits);
+                    hits.sort_unstable();
+                    assert_eq!(hits, brute_force(rectangles, &region));
+                }
+            }
+        }
+
+        // Add some new items.
+        for (x, y) in [(2, 2), (4, 8), (12, 0)] {
+            let item = LabeledBB::new(x, y);
+            tree.push(item.rect);
+            rectangles.push(item);
+        }
+        check(&tree, &rectangles);
+
+        // Remove items from the tree and the added buffer.
+        for idx in [3, rectangles.len() - 2, 0, 10] {
+            tree.swap_remove(idx);
+            rectangles.swap_remove(idx);
+        }
+        check(&tree, &rectangles);
+
+        // Grow an item from the tree and one from the added buffer.
+        for idx in [5, rectangles.len() - 1] {
+            rectangles[idx].rect.ur.lon += 2.0;
+            rectangles[idx].rect.ur.lat += 1.0;
+            tree.grow(idx, rectangles[idx].rect);
+        }
+        check(&tree, &rectangles);
+
+        // Remove everything.
+        while !rectangles.is_empty() {
+            tree.swap_remove(0);
+            rectangles.swap_remove(0);
+            check(&tree, &rectangles);
         }
+        assert!(tree.is_empty());
     }
 }
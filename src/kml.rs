@@ -7,16 +7,32 @@
 //! for this implementation I'm only implementing the parts I need with a focus on a more streaming
 //! type API. That means the user is responsible for closing all tags.
 
-use crate::SatFireResult;
-use chrono::{DateTime, Utc};
+use crate::{BoundingBox, Coord, SatFireError, SatFireResult};
+use chrono::{DateTime, Duration, Utc};
+use crossbeam_channel::{bounded, Receiver, Sender};
+use log::error;
 use std::{
     fs::File,
-    io::{BufWriter, Write},
+    io::{BufWriter, Cursor, Write},
     path::Path,
+    str::FromStr,
+    sync::atomic::{AtomicUsize, Ordering},
+    thread::{self, JoinHandle},
 };
-use zip::ZipWriter;
+use zip::{write::FileOptions, ZipArchive, ZipWriter};
 
-pub struct KmzFile(ZipWriter<BufWriter<File>>);
+/// The size of the blocks of KML handed to the thread that compresses a KMZ file.
+const KMZ_CHUNK_SIZE: usize = 1 << 20;
+
+/// The number of blocks that can be waiting to be compressed. Together with [KMZ_CHUNK_SIZE] this
+/// bounds the memory used by a [KmzFile] no matter how large the document is.
+const KMZ_CHUNKS_IN_FLIGHT: usize = 4;
+
+/// A KMZ file.
+///
+/// The KML is gathered into large blocks that are compressed and written on a background thread,
+/// so creating the KML and compressing it happen at the same time.
+pub struct KmzFile(KmzOutput);
 
 impl KmzFile {
     pub fn new<P: AsRef<Path>>(pth: P) -> SatFireResult<Self> {
@@ -24,9 +40,9 @@ impl KmzFile {
 
         let f = std::fs::File::create(p)?;
         let mut kmz = ZipWriter::new(BufWriter::new(f));
-        let kmz_opts = zip::write::FileOptions::default().compression_level(Some(9));
+        let kmz_opts = zip::write::FileOptions::default();
         kmz.start_file("doc.kml", kmz_opts)?;
-        let mut new = KmzFile(kmz);
+        let mut new = KmzFile(KmzOutput::new(kmz));
         new.start_document()?;
         Ok(new)
     }
@@ -41,6 +57,91 @@ impl KmlWriter for KmzFile {
 impl Drop for KmzFile {
     fn drop(&mut self) {
         self.finish_document();
+
+        if let Err(err) = self.0.finish() {
+            error!(target: "kmz", "Error finishing KMZ file: {}", err);
+        }
+    }
+}
+
+/// Sends blocks of KML to a thread that compresses them into the zip file.
+struct KmzOutput {
+    chunk: Vec<u8>,
+    to_zip: Option<Sender<Vec<u8>>>,
+    spare_chunks: Receiver<Vec<u8>>,
+    zip_thread: Option<JoinHandle<SatFireResult<()>>>,
+}
+
+impl KmzOutput {
+    fn new(mut zip: ZipWriter<BufWriter<File>>) -> Self {
+        let (to_zip, chunks) = bounded::<Vec<u8>>(KMZ_CHUNKS_IN_FLIGHT);
+        let (return_chunk, spare_chunks) = bounded(KMZ_CHUNKS_IN_FLIGHT + 1);
+
+        let zip_thread = thread::spawn(move || {
+            for mut chunk in chunks {
+                zip.write_all(&chunk)?;
+
+                chunk.clear();
+                let _ = return_chunk.try_send(chunk);
+            }
+
+            zip.finish()?;
+            Ok(())
+        });
+
+        KmzOutput {
+            chunk: Vec::with_capacity(KMZ_CHUNK_SIZE),
+            to_zip: Some(to_zip),
+            spare_chunks,
+            zip_thread: Some(zip_thread),
+        }
+    }
+
+    fn send_chunk(&mut self) -> std::io::Result<()> {
+        let next = self
+            .spare_chunks
+            .try_recv()
+            .unwrap_or_else(|_| Vec::with_capacity(KMZ_CHUNK_SIZE));
+        let full = std::mem::replace(&mut self.chunk, next);
+
+        let quit = || std::io::Error::new(std::io::ErrorKind::BrokenPipe, "KMZ thread quit");
+        self.to_zip
+            .as_ref()
+            .ok_or_else(quit)?
+            .send(full)
+            .map_err(|_| quit())
+    }
+
+    /// Send the last block and wait for the zip file to be finished.
+    fn finish(&mut self) -> SatFireResult<()> {
+        if !self.chunk.is_empty() {
+            self.send_chunk()?;
+        }
+
+        drop(self.to_zip.take());
+
+        match self.zip_thread.take() {
+            Some(jh) => jh.join().expect("Error joining KMZ thread"),
+            None => Ok(()),
+        }
+    }
+}
+
+impl Write for KmzOutput {
+    fn write(&mut self, buf: &[u8]) -> std::io::Result<usize> {
+        if !self.chunk.is_empty() && self.chunk.len() + buf.len() > KMZ_CHUNK_SIZE {
+            self.send_chunk()?;
+        }
+
+        self.chunk.extend_from_slice(buf);
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> std::io::Result<()> {
+        if !self.chunk.is_empty() {
+            self.send_chunk()?;
+        }
+        Ok(())
     }
 }
 
@@ -69,6 +170,394 @@ impl Drop for KmlFile {
     }
 }
 
+/// Format KML into memory, mainly for use with [write_kml_in_parallel].
+impl KmlWriter for Vec<u8> {
+    fn output(&mut self) -> &mut dyn Write {
+        self
+    }
+}
+
+/// The number of items each thread formats at a time in [write_kml_in_parallel].
+const ITEMS_PER_THREAD: usize = 64;
+
+/// Format a sequence of items as KML on several threads and write them out in order.
+///
+/// `format` writes the KML for a single item into an empty buffer. Items are taken from `items` a
+/// batch at a time, and while one batch is formatted the batch before it is written to `kml`. The
+/// buffers are reused from one batch to the next, so memory use depends on the number of threads
+/// and not on the number of items.
+pub fn write_kml_in_parallel<K, T, I, F>(kml: &mut K, items: I, format: F) -> SatFireResult<()>
+where
+    K: KmlWriter + ?Sized,
+    T: Sync,
+    I: IntoIterator<Item = T>,
+    F: Fn(&T, &mut Vec<u8>) -> SatFireResult<()> + Sync,
+{
+    let num_threads = num_cpus::get().max(1);
+    let batch_size = num_threads * ITEMS_PER_THREAD;
+    let format = &format;
+
+    let mut items = items.into_iter();
+    let mut ready: Vec<Vec<u8>> = vec![];
+    let mut spare: Vec<Vec<u8>> = vec![];
+
+    loop {
+        let batch: Vec<T> = items.by_ref().take(batch_size).collect();
+        if batch.is_empty() && ready.is_empty() {
+            break;
+        }
+
+        let mut buffers: Vec<Vec<u8>> = batch
+            .iter()
+            .map(|_| spare.pop().unwrap_or_default())
+            .collect();
+        let chunk_size = ((batch.len() + num_threads - 1) / num_threads).max(1);
+
+        thread::scope(|s| -> SatFireResult<()> {
+            let handles: Vec<_> = batch
+                .chunks(chunk_size)
+                .zip(buffers.chunks_mut(chunk_size))
+                .map(|(items, buffers)| {
+                    s.spawn(move || -> SatFireResult<()> {
+                        for (item, buffer) in items.iter().zip(buffers.iter_mut()) {
+                            format(item, buffer)?;
+                        }
+                        Ok(())
+                    })
+                })
+                .collect();
+
+            let mut written = Ok(());
+            for mut buffer in ready.drain(..) {
+                if written.is_ok() {
+                    written = kml.output().write_all(&buffer);
+                }
+                buffer.clear();
+                spare.push(buffer);
+            }
+
+            for jh in handles {
+                jh.join().expect("Error joining a KML formatting thread.")?;
+            }
+
+            Ok(written?)
+        })?;
+
+        ready = buffers;
+    }
+
+    Ok(())
+}
+
+/// How much of each cluster or fire to put in a KML file.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum KmlDetail {
+    /// Every pixel as a polygon, this is the most detail and the largest files.
+    Pixels,
+    /// The bounding box of the pixels, or the centroid when the bounding box isn't known.
+    Outlines,
+    /// A single point at the centroid.
+    Centroids,
+}
+
+impl KmlDetail {
+    pub fn name(&self) -> &'static str {
+        match self {
+            KmlDetail::Pixels => "pixels",
+            KmlDetail::Outlines => "outlines",
+            KmlDetail::Centroids => "centroids",
+        }
+    }
+}
+
+impl FromStr for KmlDetail {
+    type Err = SatFireError;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s.to_ascii_lowercase().as_str() {
+            "pixels" => Ok(KmlDetail::Pixels),
+            "outlines" => Ok(KmlDetail::Outlines),
+            "centroids" => Ok(KmlDetail::Centroids),
+            _ => Err(format!(
+                "Invalid level of detail, expected pixels, outlines, or centroids: {}",
+                s
+            )
+            .into()),
+        }
+    }
+}
+
+/// A document in a KMZ file written by [write_chunked_kmz].
+#[derive(Debug, Clone)]
+pub struct KmlChunk<T> {
+    /// The name of the link to this chunk in the root document.
+    pub name: String,
+    /// The start of the time covered by the chunk.
+    pub start: DateTime<Utc>,
+    /// The end of the time covered by the chunk.
+    pub end: DateTime<Utc>,
+    /// The area covered by the chunk, it is only loaded when this area is in view.
+    pub region: Option<BoundingBox>,
+    /// Anything else needed to create the chunk.
+    pub contents: T,
+}
+
+impl KmlChunk<()> {
+    /// Split a time range and area into chunks of at most `hours` hours and `degrees` degrees of
+    /// latitude and longitude.
+    pub fn split(
+        start: DateTime<Utc>,
+        end: DateTime<Utc>,
+        area: BoundingBox,
+        hours: Option<i64>,
+        degrees: Option<f64>,
+    ) -> Vec<Self> {
+        let mut times = vec![start];
+        if let Some(hours) = hours.filter(|&h| h > 0) {
+            let mut t = start + Duration::hours(hours);
+            while t < end {
+                times.push(t);
+                t = t + Duration::hours(hours);
+            }
+        }
+        times.push(end);
+
+        let steps = |min: f64, max: f64| -> Vec<f64> {
+            let mut steps = vec![min];
+            if let Some(degrees) = degrees.filter(|&d| d > 0.0) {
+                let num = ((max - min) / degrees).ceil().max(1.0) as usize;
+                steps.extend((1..num).map(|i| min + i as f64 * degrees));
+            }
+            steps.push(max);
+            steps
+        };
+        let lats = steps(area.ll.lat, area.ur.lat);
+        let lons = steps(area.ll.lon, area.ur.lon);
+        let tiled = lats.len() > 2 || lons.len() > 2;
+
+        let mut chunks = vec![];
+        for time in times.windows(2) {
+            for lat in lats.windows(2) {
+                for lon in lons.windows(2) {
+                    let region = BoundingBox {
+                        ll: Coord {
+                            lat: lat[0],
+                            lon: lon[0],
+                        },
+                        ur: Coord {
+                            lat: lat[1],
+                            lon: lon[1],
+                        },
+                    };
+
+                    let mut name = time[0].format("%Y-%m-%d %H:%MZ").to_string();
+                    if tiled {
+                        name += &format!(" ({:.2}, {:.2})", lat[0], lon[0]);
+                    }
+
+                    chunks.push(KmlChunk {
+                        name,
+                        start: time[0],
+                        end: time[1],
+                        region: Some(region),
+                        contents: (),
+                    });
+                }
+            }
+        }
+
+        chunks
+    }
+}
+
+/// The size a chunk's region must take up on the screen, in pixels, before it is loaded.
+const CHUNK_MIN_LOD_PIXELS: u32 = 128;
+
+/// Write a KMZ file with each chunk in its own document, linked from the root document.
+///
+/// `format` writes the contents of the document for a chunk, including any styles it uses,
+/// between the header and footer. The chunks are formatted and compressed on several threads at
+/// once, and Google Earth only loads each one when it is in view and in the time range shown, so
+/// this works for exports far too large to open as a single document.
+pub fn write_chunked_kmz<P, T, F>(path: P, chunks: &[KmlChunk<T>], format: F) -> SatFireResult<()>
+where
+    P: AsRef<Path>,
+    T: Sync,
+    F: Fn(&KmlChunk<T>, &mut Vec<u8>) -> SatFireResult<()> + Sync,
+{
+    let f = File::create(path.as_ref())?;
+    let mut kmz = ZipWriter::new(BufWriter::new(f));
+
+    // The root document goes first, it is the one Google Earth opens.
+    let mut root: Vec<u8> = vec![];
+    root.start_document()?;
+    for (i, chunk) in chunks.iter().enumerate() {
+        root.start_network_link(Some(&chunk.name))?;
+        root.timespan(chunk.start, chunk.end)?;
+        if let Some(ref region) = chunk.region {
+            root.region(region, CHUNK_MIN_LOD_PIXELS)?;
+        }
+        root.finish_network_link(&chunk_file_name(i))?;
+    }
+    root.finish_document();
+
+    kmz.start_file("doc.kml", FileOptions::default())?;
+    kmz.write_all(&root)?;
+    drop(root);
+
+    let num_threads = num_cpus::get().min(chunks.len()).max(1);
+    let next_chunk = &AtomicUsize::new(0);
+    let format = &format;
+    let (to_kmz, compressed) = bounded::<SatFireResult<Vec<u8>>>(num_threads);
+
+    thread::scope(|s| -> SatFireResult<()> {
+        for _ in 0..num_threads {
+            let to_kmz = to_kmz.clone();
+            s.spawn(move || {
+                let mut kml: Vec<u8> = vec![];
+                loop {
+                    let i = next_chunk.fetch_add(1, Ordering::Relaxed);
+                    if i >= chunks.len() {
+                        break;
+                    }
+
+                    let member = compress_chunk(i, &chunks[i], &mut kml, format);
+                    let failed = member.is_err();
+
+                    // An error sending means the KMZ file failed, so stop.
+                    if to_kmz.send(member).is_err() || failed {
+                        break;
+                    }
+                }
+            });
+        }
+        drop(to_kmz);
+
+        // The chunks are added in the order they are finished, it doesn't matter because they
+        // are found by name.
+        for member in compressed {
+            let mut member = ZipArchive::new(Cursor::new(member?))?;
+            kmz.raw_copy_file(member.by_index_raw(0)?)?;
+        }
+
+        Ok(())
+    })?;
+
+    kmz.finish()?;
+
+    Ok(())
+}
+
+/// The name of the document for a chunk in a KMZ file written by [write_chunked_kmz].
+fn chunk_file_name(index: usize) -> String {
+    format!("chunks/{:05}.kml", index)
+}
+
+/// Format a chunk into `kml` and compress it into a zip archive of its own, so it can be copied
+/// into the KMZ file without compressing it again.
+fn compress_chunk<T, F>(
+    index: usize,
+    chunk: &KmlChunk<T>,
+    kml: &mut Vec<u8>,
+    format: &F,
+) -> SatFireResult<Vec<u8>>
+where
+    F: Fn(&KmlChunk<T>, &mut Vec<u8>) -> SatFireResult<()>,
+{
+    kml.clear();
+    kml.start_document()?;
+    format(chunk, kml)?;
+    kml.finish_document();
+
+    let mut zip = ZipWriter::new(Cursor::new(Vec::with_capacity(kml.len() / 4)));
+    zip.start_file(chunk_file_name(index), FileOptions::default())?;
+    zip.write_all(kml)?;
+
+    Ok(zip.finish()?.into_inner())
+}
+
+/// The number of decimal places used for coordinates, about 10 cm.
+const COORD_DECIMALS: u32 = 6;
+const COORD_SCALE: u64 = 10u64.pow(COORD_DECIMALS);
+
+/// Format a value with [COORD_DECIMALS] decimal places, with any trailing zeros trimmed.
+///
+/// This is several times faster than the shortest round trip formatting used by `{}`, which is
+/// most of the work in writing out large KML files. Returns `None` for values too large for this
+/// method, they should be written with `{}` instead.
+fn format_fixed(value: f64, buf: &mut [u8; 24]) -> Option<&[u8]> {
+    let scaled = (value * COORD_SCALE as f64).round();
+    if !(scaled.abs() < 1.0e15) {
+        return None;
+    }
+
+    let scaled = scaled as i64;
+    let mut int_part = scaled.unsigned_abs() / COORD_SCALE;
+    let mut frac_part = scaled.unsigned_abs() % COORD_SCALE;
+
+    let mut frac_digits = COORD_DECIMALS;
+    while frac_digits > 0 && frac_part % 10 == 0 {
+        frac_part /= 10;
+        frac_digits -= 1;
+    }
+
+    let mut pos = buf.len();
+    for _ in 0..frac_digits {
+        pos -= 1;
+        buf[pos] = b'0' + (frac_part % 10) as u8;
+        frac_part /= 10;
+    }
+
+    if frac_digits > 0 {
+        pos -= 1;
+        buf[pos] = b'.';
+    }
+
+    loop {
+        pos -= 1;
+        buf[pos] = b'0' + (int_part % 10) as u8;
+        int_part /= 10;
+        if int_part == 0 {
+            break;
+        }
+    }
+
+    if scaled < 0 {
+        pos -= 1;
+        buf[pos] = b'-';
+    }
+
+    Some(&buf[pos..])
+}
+
+/// Write a longitude, latitude, altitude triple for a coordinates element.
+fn write_lon_lat_z(out: &mut dyn Write, lat: f64, lon: f64, z: f64) -> std::io::Result<()> {
+    let mut line = [0u8; 80];
+    let mut len = 0;
+
+    for (i, value) in [lon, lat, z].into_iter().enumerate() {
+        if i > 0 {
+            line[len] = b',';
+            len += 1;
+        }
+
+        let mut buf = [0u8; 24];
+        match format_fixed(value, &mut buf) {
+            Some(digits) => {
+                line[len..(len + digits.len())].copy_from_slice(digits);
+                len += digits.len();
+            }
+            None => {
+                out.write_all(&line[..len])?;
+                len = 0;
+                write!(out, "{}", value)?;
+            }
+        }
+    }
+
+    out.write_all(&line[..len])
+}
+
 pub trait KmlWriter {
     fn output(&mut self) -> &mut dyn Write;
 
@@ -334,19 +823,166 @@ pub trait KmlWriter {
     ///
     /// Must be used inside a linear ring element.
     fn linear_ring_add_vertex(&mut self, lat: f64, lon: f64, z: f64) -> SatFireResult<()> {
-        writeln!(self.output(), "{},{},{}", lon, lat, z)?;
+        write_lon_lat_z(self.output(), lat, lon, z)?;
+        self.output().write_all(b"\n")?;
         Ok(())
     }
 
     /// Write out a KML Point element
     fn create_point(&mut self, lat: f64, lon: f64, z: f64) -> SatFireResult<()> {
+        self.output().write_all(b"<Point>\n<coordinates>")?;
+        write_lon_lat_z(self.output(), lat, lon, z)?;
+        self.output().write_all(b"</coordinates>\n</Point>\n")?;
+        Ok(())
+    }
+
+    /// Write out a Polygon element for a bounding box.
+    fn create_outline(&mut self, bbox: &BoundingBox) -> SatFireResult<()> {
+        let BoundingBox { ll, ur } = bbox;
+
+        self.start_polygon(false, true, Some("clampToGround"))?;
+        self.polygon_start_outer_ring()?;
+        self.start_linear_ring()?;
+        self.linear_ring_add_vertex(ur.lat, ll.lon, 0.0)?;
+        self.linear_ring_add_vertex(ll.lat, ll.lon, 0.0)?;
+        self.linear_ring_add_vertex(ll.lat, ur.lon, 0.0)?;
+        self.linear_ring_add_vertex(ur.lat, ur.lon, 0.0)?;
+        self.linear_ring_add_vertex(ur.lat, ll.lon, 0.0)?;
+        self.finish_linear_ring()?;
+        self.polygon_finish_outer_ring()?;
+        self.finish_polygon()
+    }
+
+    /// Write out a Region element, so the feature it is in is only shown when that area is in
+    /// view and takes up at least `min_lod_pixels` pixels on the screen.
+    fn region(&mut self, bbox: &BoundingBox, min_lod_pixels: u32) -> SatFireResult<()> {
+        writeln!(
+            self.output(),
+            concat!(
+                "<Region>\n<LatLonAltBox>\n",
+                "<north>{}</north>\n<south>{}</south>\n<east>{}</east>\n<west>{}</west>\n",
+                "</LatLonAltBox>\n",
+                "<Lod><minLodPixels>{}</minLodPixels></Lod>\n",
+                "</Region>"
+            ),
+            bbox.ur.lat,
+            bbox.ll.lat,
+            bbox.ur.lon,
+            bbox.ll.lon,
+            min_lod_pixels
+        )?;
+        Ok(())
+    }
+
+    /// Start a NetworkLink element.
+    fn start_network_link(&mut self, name: Option<&str>) -> SatFireResult<()> {
+        writeln!(self.output(), "<NetworkLink>")?;
+
+        if let Some(name) = name {
+            writeln!(self.output(), "<name>{}</name>", name)?;
+        }
+
+        Ok(())
+    }
+
+    /// Close out a NetworkLink element with the link to `href`, which is loaded when its region
+    /// comes into view.
+    fn finish_network_link(&mut self, href: &str) -> SatFireResult<()> {
         writeln!(
             self.output(),
-            "<Point>\n<coordinates>{},{},{}</coordinates>\n</Point>",
-            lon,
-            lat,
-            z
+            concat!(
+                "<Link>\n<href>{}</href>\n",
+                "<viewRefreshMode>onRegion</viewRefreshMode>\n",
+                "</Link>\n</NetworkLink>"
+            ),
+            href
         )?;
         Ok(())
     }
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_format_fixed() {
+        let mut buf = [0u8; 24];
+        let mut fmt = |value: f64| format_fixed(value, &mut buf).map(|b| b.to_vec());
+
+        assert_eq!(fmt(0.0).unwrap(), b"0");
+        assert_eq!(fmt(-0.0000001).unwrap(), b"0");
+        assert_eq!(fmt(45.5).unwrap(), b"45.5");
+        assert_eq!(fmt(-120.123456789).unwrap(), b"-120.123457");
+        assert_eq!(fmt(-0.25).unwrap(), b"-0.25");
+        assert_eq!(fmt(179.9999999).unwrap(), b"180");
+        assert_eq!(fmt(0.000001).unwrap(), b"0.000001");
+        assert!(fmt(f64::NAN).is_none());
+        assert!(fmt(1.0e300).is_none());
+
+        let mut out: Vec<u8> = vec![];
+        write_lon_lat_z(&mut out, 44.5, -120.0, f64::INFINITY).unwrap();
+        assert_eq!(out, b"-120,44.5,inf");
+    }
+
+    #[test]
+    fn test_split_chunks() {
+        use chrono::NaiveDateTime;
+
+        let start = DateTime::<Utc>::from_utc(
+            NaiveDateTime::from_timestamp_opt(1_629_000_000, 0).unwrap(),
+            Utc,
+        );
+        let end = start + Duration::hours(30);
+        let area = BoundingBox {
+            ll: Coord {
+                lat: 40.0,
+                lon: -120.0,
+            },
+            ur: Coord {
+                lat: 45.0,
+                lon: -110.0,
+            },
+        };
+
+        let chunks = KmlChunk::split(start, end, area, None, None);
+        assert_eq!(chunks.len(), 1);
+        assert_eq!((chunks[0].start, chunks[0].end), (start, end));
+
+        let chunks = KmlChunk::split(start, end, area, Some(12), Some(4.0));
+        assert_eq!(chunks.len(), 3 * 2 * 3);
+        assert_eq!(chunks.last().unwrap().end, end);
+        assert_eq!(chunks[3].start, start);
+        assert_eq!(chunks[6].start, start + Duration::hours(12));
+
+        let first = chunks[0].region.unwrap();
+        assert_eq!((first.ll.lat, first.ur.lat), (40.0, 44.0));
+        assert_eq!((first.ll.lon, first.ur.lon), (-120.0, -116.0));
+
+        let last = chunks[5].region.unwrap();
+        assert_eq!((last.ll.lat, last.ur.lat), (44.0, 45.0));
+        assert_eq!((last.ll.lon, last.ur.lon), (-112.0, -110.0));
+    }
+
+    #[test]
+    fn test_write_kml_in_parallel_keeps_order() {
+        let mut out: Vec<u8> = vec![];
+        let items: Vec<usize> = (0..10_000).collect();
+
+        write_kml_in_parallel(&mut out, items.iter().copied(), |item, buf| {
+            buf.start_folder(Some(&item.to_string()), None, false)?;
+            buf.finish_folder()
+        })
+        .unwrap();
+
+        let mut expected: Vec<u8> = vec![];
+        for item in items {
+            expected
+                .start_folder(Some(&item.to_string()), None, false)
+                .unwrap();
+            expected.finish_folder().unwrap();
+        }
+
+        assert_eq!(out, expected);
+    }
+}
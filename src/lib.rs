@@ -2,19 +2,30 @@
 #![allow(dead_code)]
 
 // Public API
-pub use cluster::{Cluster, ClusterList};
+pub use cluster::{
+    run_cluster_list_worker, Cluster, ClusterList, ClusterListBuffers, ClusterListWorker,
+};
+pub use columns::{ClusterColumns, FireColumns};
 pub use database::{
     ClusterDatabase, ClusterDatabaseAddCluster, ClusterDatabaseClusterRow,
-    ClusterDatabaseQueryClusterPresent, ClusterDatabaseQueryClusters, FiresDatabase,
-    FiresDatabaseAddFire, JointFiresClusterDatabases, JointQuerySingleFire,
+    ClusterDatabaseClusterSummary, ClusterDatabaseProcessedFiles,
+    ClusterDatabaseQueryClusterPresent, ClusterDatabaseQueryClusters, FireAssociation,
+    FireTimeSeriesRow, FiresDatabase, FiresDatabaseAddFire, FiresDatabaseFireSummary,
+    FiresDatabaseQueryFireSummaries, JointFiresClusterDatabases, JointQuerySingleFire,
 };
-pub use fire::{Fire, FireList, FireListUpdateResult, FireListView};
+pub use fire::{Fire, FireList, FireListUpdateResult, FireListView, PixelScratchFile};
+pub use firesatimage::set_geolocation_cache_directory;
 pub use geo::{BoundingBox, Coord, Geo};
-pub use kml::{KmlFile, KmlWriter, KmzFile};
+pub use kml::{
+    write_chunked_kmz, write_kml_in_parallel, KmlChunk, KmlDetail, KmlFile, KmlWriter, KmzFile,
+};
+pub use metrics::{MetricsReporter, PipelineMetrics, StageMetrics};
 pub use pixel::{Pixel, PixelList};
+pub use prefetch::{PrefetchBudget, PrefetchedFile};
 pub use satellite::{
     parse_satellite_description_from_file_name, DataQualityFlagCode, MaskCode, Satellite, Sector,
 };
+pub use watch::{DirectoryWatcher, WatchEvent};
 
 /// A generic error type.
 pub type SatFireError = Box<dyn Error + Send + Sync>;
@@ -52,15 +63,28 @@ pub fn end_time_from_file_name(fname: &str) -> Option<DateTime<Utc>> {
         .map(|naive| DateTime::<Utc>::from_utc(naive, Utc))
 }
 
+/// Crate internals used by the benchmarks in `benches/`, these are not a stable API.
+#[cfg(feature = "bench-internals")]
+#[doc(hidden)]
+pub mod bench_internals {
+    pub use crate::cluster::clusters_from_fire_points;
+    pub use crate::firesatimage::{FirePoint, SatFireImage};
+    pub use crate::geo::Hilbert2DRTree;
+}
+
 // Private API
 mod cluster;
+mod columns;
 mod database;
 mod fire;
 mod firesatimage;
 mod geo;
 mod kml;
+mod metrics;
 mod pixel;
+mod prefetch;
 mod satellite;
+mod watch;
 
 use chrono::{DateTime, NaiveDateTime, Utc};
 use std::error::Error;
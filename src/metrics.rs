@@ -0,0 +1,419 @@
+//! Counters and timing histograms for the stages of the processing pipelines.
+//!
+//! Every stage of a pipeline, like decoding files or matching clusters to fires, gets a
+//! [StageMetrics] from a shared [PipelineMetrics]. Recording is a few atomic additions, so it is
+//! always on. A [MetricsReporter] periodically logs a line per stage, and optionally writes all
+//! the metrics to a file in the Prometheus text format for the node exporter textfile collector.
+use crate::SatFireResult;
+use crossbeam_channel::{bounded, RecvTimeoutError, Sender};
+use log::info;
+use std::{
+    fmt::Write as _,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex,
+    },
+    thread::JoinHandle,
+    time::{Duration, Instant},
+};
+
+/// The number of histogram buckets, bucket `i` counts times under 2^i microseconds and the last
+/// bucket counts everything longer, a bit over two minutes.
+const NUM_BUCKETS: usize = 28;
+
+/// The metrics for all the stages of a pipeline.
+#[derive(Debug)]
+pub struct PipelineMetrics {
+    program: &'static str,
+    stages: Mutex<Vec<Arc<StageMetrics>>>,
+}
+
+impl PipelineMetrics {
+    /// Create a new, empty, set of metrics for a program.
+    pub fn new(program: &'static str) -> Arc<Self> {
+        Arc::new(PipelineMetrics {
+            program,
+            stages: Mutex::new(vec![]),
+        })
+    }
+
+    /// Get the metrics for a stage, they are created the first time a stage is asked for.
+    pub fn stage(&self, name: &str) -> Arc<StageMetrics> {
+        let mut stages = self.stages.lock().expect("Error locking metrics");
+
+        if let Some(stage) = stages.iter().find(|stage| stage.name == name) {
+            return Arc::clone(stage);
+        }
+
+        let stage = Arc::new(StageMetrics::new(name));
+        stages.push(Arc::clone(&stage));
+        stage
+    }
+
+    /// Start a thread that reports the metrics every `interval` until the reporter is dropped.
+    ///
+    /// The report is logged, and if `prometheus_file` is given the metrics are also written to
+    /// that file in the Prometheus text format. The file is replaced atomically so a collector
+    /// never sees a partial file.
+    pub fn start_reporting(
+        self: &Arc<Self>,
+        interval: Duration,
+        prometheus_file: Option<PathBuf>,
+    ) -> SatFireResult<MetricsReporter> {
+        let (stop, stopped) = bounded::<()>(0);
+        let metrics = Arc::clone(self);
+
+        let jh = std::thread::Builder::new()
+            .name(format!("{}-metrics", self.program))
+            .spawn(move || {
+                let mut previous = metrics.snapshots();
+                let mut last_report = Instant::now();
+
+                loop {
+                    let done = match stopped.recv_timeout(interval) {
+                        Err(RecvTimeoutError::Timeout) => false,
+                        _ => true,
+                    };
+
+                    let current = metrics.snapshots();
+                    let elapsed = last_report.elapsed();
+                    metrics.log_report(&current, &previous, elapsed);
+
+                    if let Some(ref path) = prometheus_file {
+                        if let Err(err) = metrics.write_prometheus(path) {
+                            log::warn!(target: "metrics", "Error writing {}: {}", path.display(), err);
+                        }
+                    }
+
+                    if done {
+                        break;
+                    }
+
+                    previous = current;
+                    last_report = Instant::now();
+                }
+            })?;
+
+        Ok(MetricsReporter {
+            stop: Some(stop),
+            jh: Some(jh),
+        })
+    }
+
+    /// Format all the metrics in the Prometheus text exposition format.
+    pub fn prometheus_text(&self) -> String {
+        let snapshots = self.snapshots();
+        let mut text = String::new();
+
+        let _ = writeln!(
+            text,
+            "# HELP satfire_stage_items_total Items produced by a stage."
+        );
+        let _ = writeln!(text, "# TYPE satfire_stage_items_total counter");
+        for s in &snapshots {
+            let _ = writeln!(
+                text,
+                "satfire_stage_items_total{{{}}} {}",
+                self.labels(&s.name),
+                s.items
+            );
+        }
+
+        let _ = writeln!(
+            text,
+            "# HELP satfire_stage_seconds Time spent on each operation."
+        );
+        let _ = writeln!(text, "# TYPE satfire_stage_seconds histogram");
+        for s in snapshots.iter().filter(|s| s.ops > 0) {
+            let labels = self.labels(&s.name);
+
+            let mut cumulative = 0;
+            for (i, count) in s.buckets.iter().enumerate().take(NUM_BUCKETS - 1) {
+                cumulative += count;
+                let le = bucket_upper_bound_us(i) as f64 / 1.0e6;
+                let _ = writeln!(
+                    text,
+                    "satfire_stage_seconds_bucket{{{},le=\"{}\"}} {}",
+                    labels, le, cumulative
+                );
+            }
+            let _ = writeln!(
+                text,
+                "satfire_stage_seconds_bucket{{{},le=\"+Inf\"}} {}",
+                labels, s.ops
+            );
+            let _ = writeln!(
+                text,
+                "satfire_stage_seconds_sum{{{}}} {}",
+                labels,
+                s.busy_us as f64 / 1.0e6
+            );
+            let _ = writeln!(text, "satfire_stage_seconds_count{{{}}} {}", labels, s.ops);
+        }
+
+        let _ = writeln!(
+            text,
+            "# HELP satfire_stage_queue_depth Items waiting in the output channel of a stage."
+        );
+        let _ = writeln!(text, "# TYPE satfire_stage_queue_depth gauge");
+        for s in snapshots.iter().filter(|s| s.has_queue) {
+            let _ = writeln!(
+                text,
+                "satfire_stage_queue_depth{{{}}} {}",
+                self.labels(&s.name),
+                s.queue_depth
+            );
+        }
+
+        text
+    }
+
+    /// Write the metrics to a file in the Prometheus text format.
+    pub fn write_prometheus(&self, path: &Path) -> SatFireResult<()> {
+        let mut tmp = path.as_os_str().to_owned();
+        tmp.push(".tmp");
+
+        std::fs::write(&tmp, self.prometheus_text())?;
+        std::fs::rename(&tmp, path)?;
+
+        Ok(())
+    }
+
+    fn labels(&self, stage: &str) -> String {
+        format!("program=\"{}\",stage=\"{}\"", self.program, stage)
+    }
+
+    fn snapshots(&self) -> Vec<StageSnapshot> {
+        self.stages
+            .lock()
+            .expect("Error locking metrics")
+            .iter()
+            .map(|stage| stage.snapshot())
+            .collect()
+    }
+
+    fn log_report(&self, current: &[StageSnapshot], previous: &[StageSnapshot], elapsed: Duration) {
+        let secs = elapsed.as_secs_f64().max(1.0e-3);
+
+        for s in current {
+            let prev = previous.iter().find(|p| p.name == s.name);
+            let (prev_ops, prev_items) = prev.map(|p| (p.ops, p.items)).unwrap_or((0, 0));
+
+            let mut line = format!(
+                "{:>12}: {:>8} items {:>9.1}/s",
+                s.name,
+                s.items,
+                (s.items - prev_items) as f64 / secs
+            );
+
+            if s.ops > 0 {
+                let _ = write!(
+                    line,
+                    ", {:>8} ops {:>7.1}/s, mean {:>8.2} ms, p50 {:>8.2} ms, p99 {:>8.2} ms, max {:>8.2} ms",
+                    s.ops,
+                    (s.ops - prev_ops) as f64 / secs,
+                    s.busy_us as f64 / s.ops as f64 / 1.0e3,
+                    s.quantile_us(0.50) as f64 / 1.0e3,
+                    s.quantile_us(0.99) as f64 / 1.0e3,
+                    s.max_us as f64 / 1.0e3,
+                );
+            }
+
+            if s.has_queue {
+                let _ = write!(
+                    line,
+                    ", queue {} (max {})",
+                    s.queue_depth, s.max_queue_depth
+                );
+            }
+
+            info!(target: "metrics", "{}", line);
+        }
+    }
+}
+
+/// Counters and timings for a single stage of a pipeline.
+///
+/// A stage produces items, like files or clusters, and spends time on operations, like decoding
+/// a file or committing a transaction, and it may feed a channel whose depth is sampled.
+#[derive(Debug)]
+pub struct StageMetrics {
+    name: String,
+    items: AtomicU64,
+    ops: AtomicU64,
+    busy_us: AtomicU64,
+    max_us: AtomicU64,
+    buckets: [AtomicU64; NUM_BUCKETS],
+    /// The queue depth plus one, zero means the stage never recorded one.
+    queue_depth: AtomicU64,
+    max_queue_depth: AtomicU64,
+}
+
+impl StageMetrics {
+    fn new(name: &str) -> Self {
+        StageMetrics {
+            name: name.to_owned(),
+            items: AtomicU64::new(0),
+            ops: AtomicU64::new(0),
+            busy_us: AtomicU64::new(0),
+            max_us: AtomicU64::new(0),
+            buckets: std::array::from_fn(|_| AtomicU64::new(0)),
+            queue_depth: AtomicU64::new(0),
+            max_queue_depth: AtomicU64::new(0),
+        }
+    }
+
+    /// Count items produced by this stage.
+    pub fn add_items(&self, count: usize) {
+        self.items.fetch_add(count as u64, Ordering::Relaxed);
+    }
+
+    /// Record how long a single operation took.
+    pub fn record(&self, elapsed: Duration) {
+        let us = elapsed.as_micros().min(u64::MAX as u128) as u64;
+
+        self.ops.fetch_add(1, Ordering::Relaxed);
+        self.busy_us.fetch_add(us, Ordering::Relaxed);
+        self.max_us.fetch_max(us, Ordering::Relaxed);
+        self.buckets[bucket_for(us)].fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Time an operation and record how long it took.
+    pub fn time<T, F: FnOnce() -> T>(&self, operation: F) -> T {
+        let now = Instant::now();
+        let result = operation();
+        self.record(now.elapsed());
+        result
+    }
+
+    /// Sample the number of items waiting in the channel this stage sends to.
+    pub fn queue_depth(&self, depth: usize) {
+        self.queue_depth.store(depth as u64 + 1, Ordering::Relaxed);
+        self.max_queue_depth
+            .fetch_max(depth as u64, Ordering::Relaxed);
+    }
+
+    fn snapshot(&self) -> StageSnapshot {
+        let queue_depth = self.queue_depth.load(Ordering::Relaxed);
+
+        StageSnapshot {
+            name: self.name.clone(),
+            items: self.items.load(Ordering::Relaxed),
+            ops: self.ops.load(Ordering::Relaxed),
+            busy_us: self.busy_us.load(Ordering::Relaxed),
+            max_us: self.max_us.load(Ordering::Relaxed),
+            buckets: std::array::from_fn(|i| self.buckets[i].load(Ordering::Relaxed)),
+            has_queue: queue_depth > 0,
+            queue_depth: queue_depth.saturating_sub(1),
+            max_queue_depth: self.max_queue_depth.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// The values of a [StageMetrics] at one time.
+#[derive(Debug, Clone)]
+struct StageSnapshot {
+    name: String,
+    items: u64,
+    ops: u64,
+    busy_us: u64,
+    max_us: u64,
+    buckets: [u64; NUM_BUCKETS],
+    has_queue: bool,
+    queue_depth: u64,
+    max_queue_depth: u64,
+}
+
+impl StageSnapshot {
+    /// Estimate a quantile from the histogram, it is the upper bound of the bucket it falls in.
+    fn quantile_us(&self, q: f64) -> u64 {
+        let target = ((self.ops as f64 * q).ceil() as u64).max(1);
+
+        let mut cumulative = 0;
+        for (i, count) in self.buckets.iter().enumerate() {
+            cumulative += count;
+            if cumulative >= target {
+                return bucket_upper_bound_us(i).min(self.max_us);
+            }
+        }
+
+        self.max_us
+    }
+}
+
+/// Reports metrics on a background thread, the final report is made when this is dropped.
+#[derive(Debug)]
+pub struct MetricsReporter {
+    stop: Option<Sender<()>>,
+    jh: Option<JoinHandle<()>>,
+}
+
+impl Drop for MetricsReporter {
+    fn drop(&mut self) {
+        // Disconnecting the channel wakes the reporter up for its last report.
+        drop(self.stop.take());
+
+        if let Some(jh) = self.jh.take() {
+            let _ = jh.join();
+        }
+    }
+}
+
+fn bucket_for(us: u64) -> usize {
+    ((u64::BITS - us.leading_zeros()) as usize).min(NUM_BUCKETS - 1)
+}
+
+fn bucket_upper_bound_us(bucket: usize) -> u64 {
+    1 << bucket
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_stage_histogram() {
+        let metrics = PipelineMetrics::new("test");
+        let stage = metrics.stage("decode");
+
+        for ms in 1..=100 {
+            stage.record(Duration::from_millis(ms));
+        }
+        stage.add_items(250);
+        stage.queue_depth(7);
+        stage.queue_depth(3);
+
+        let snapshot = metrics.stage("decode").snapshot();
+        assert_eq!(snapshot.ops, 100);
+        assert_eq!(snapshot.items, 250);
+        assert_eq!(snapshot.max_us, 100_000);
+        assert_eq!(snapshot.queue_depth, 3);
+        assert_eq!(snapshot.max_queue_depth, 7);
+
+        // Power of two buckets, so the estimate is at most double the real value.
+        let p50 = snapshot.quantile_us(0.5);
+        assert!((50_000..=100_000).contains(&p50), "p50 = {}", p50);
+        assert_eq!(snapshot.quantile_us(0.99), 100_000);
+    }
+
+    #[test]
+    fn test_prometheus_text() {
+        let metrics = PipelineMetrics::new("findfire");
+        metrics.stage("walk").add_items(3);
+        metrics.stage("decode").record(Duration::from_micros(3));
+
+        let text = metrics.prometheus_text();
+        assert!(text.contains("satfire_stage_items_total{program=\"findfire\",stage=\"walk\"} 3"));
+        assert!(text.contains(
+            "satfire_stage_seconds_bucket{program=\"findfire\",stage=\"decode\",le=\"0.000002\"} 0"
+        ));
+        assert!(text.contains(
+            "satfire_stage_seconds_bucket{program=\"findfire\",stage=\"decode\",le=\"0.000004\"} 1"
+        ));
+        assert!(
+            text.contains("satfire_stage_seconds_count{program=\"findfire\",stage=\"decode\"} 1")
+        );
+        assert!(!text.contains("satfire_stage_seconds_count{program=\"findfire\",stage=\"walk\"}"));
+    }
+}
@@ -2,12 +2,20 @@ use crate::{
     geo::{BoundingBox, Coord, Geo},
     kml::KmlWriter,
     satellite::{DataQualityFlagCode, MaskCode},
+    SatFireResult,
 };
+use once_cell::sync::OnceCell;
 use std::{
     io::{Read, Write},
     mem::size_of,
 };
 
+mod boxes;
+use boxes::PixelBoxes;
+
+mod grid;
+use grid::PixelGrid;
+
 const OVERLAP_FUDGE_FACTOR: f64 = 1.0e-2;
 
 /// The coordinates describing the area of a pixel viewed from a GOES satellite.
@@ -65,6 +73,10 @@ impl Pixel {
         };
     }
 
+    /// Write a pixel in the version 1 binary format.
+    ///
+    /// Only used to create version 1 data for testing backward compatibility.
+    #[cfg(test)]
     fn write_bytes<W: Write>(&self, w: &mut W) -> Result<(), std::io::Error> {
         let mut write_coord = |coord: &Coord| -> Result<(), std::io::Error> {
             w.write_all(&coord.lat.to_le_bytes())?;
@@ -87,6 +99,7 @@ impl Pixel {
         Ok(())
     }
 
+    /// Read a pixel in the version 1 binary format.
     fn read_bytes<R: Read>(r: &mut R) -> Self {
         let mut buf: [u8; 8] = [0; 8];
 
@@ -436,20 +449,31 @@ impl Pixel {
 }
 
 /// A pixel list stores a list of Pixel objects.
+///
+/// Large lists, like the area of a long lived fire, build a spatial grid of their pixels the first
+/// time they are compared to another list. The grid is kept up to date by [PixelList::max_merge]
+/// so comparisons only have to look at nearby pixels.
+///
+/// The bounding boxes of the pixels are also kept in separate arrays the first time they are
+/// needed, so the exact geometry is only checked for pairs of pixels whose boxes overlap.
 #[derive(Debug, Clone)]
-pub struct PixelList(Vec<Pixel>);
+pub struct PixelList {
+    pixels: Vec<Pixel>,
+    grid: OnceCell<PixelGrid>,
+    boxes: OnceCell<PixelBoxes>,
+}
 
 impl Geo for PixelList {
     fn centroid(&self) -> Coord {
         let mut centroid = Coord { lat: 0.0, lon: 0.0 };
-        for pixel in &self.0 {
+        for pixel in &self.pixels {
             let coord = pixel.centroid();
             centroid.lat += coord.lat;
             centroid.lon += coord.lon;
         }
 
-        centroid.lat /= self.0.len() as f64;
-        centroid.lon /= self.0.len() as f64;
+        centroid.lat /= self.pixels.len() as f64;
+        centroid.lon /= self.pixels.len() as f64;
 
         centroid
     }
@@ -461,7 +485,7 @@ impl Geo for PixelList {
         let mut min_lon = std::f64::INFINITY;
         let mut max_lon = -std::f64::INFINITY;
 
-        for pixel in &self.0 {
+        for pixel in &self.pixels {
             min_lat = min_lat.min(pixel.ll.lat).min(pixel.lr.lat);
             max_lat = max_lat.max(pixel.ul.lat).max(pixel.ur.lat);
             min_lon = min_lon.min(pixel.ll.lon).min(pixel.lr.lon);
@@ -481,37 +505,67 @@ impl Default for PixelList {
 impl PixelList {
     /// Create a new PixelList
     pub fn new() -> Self {
-        PixelList(vec![])
+        PixelList::from_pixels(vec![])
     }
 
     /// Create a new PixelList with a given capacity.
     pub fn with_capacity(capacity: usize) -> Self {
-        PixelList(Vec::with_capacity(capacity))
+        PixelList::from_pixels(Vec::with_capacity(capacity))
+    }
+
+    fn from_pixels(pixels: Vec<Pixel>) -> Self {
+        PixelList {
+            pixels,
+            grid: OnceCell::new(),
+            boxes: OnceCell::new(),
+        }
     }
 
     /// Get the number of pixels in this list.
     pub fn len(&self) -> usize {
-        self.0.len()
+        self.pixels.len()
     }
 
     /// Check if this PixelList is empty
     pub fn is_empty(&self) -> bool {
-        self.0.is_empty()
+        self.pixels.is_empty()
     }
 
     /// Append a [Pixel] to the end of the list.
     pub fn push(&mut self, pixel: Pixel) {
-        self.0.push(pixel)
+        if let Some(grid) = self.grid.get_mut() {
+            grid.insert(self.pixels.len(), &pixel);
+        }
+        if let Some(boxes) = self.boxes.get_mut() {
+            boxes.push(&pixel);
+        }
+        self.pixels.push(pixel)
     }
 
     /// Empty the list, but keep it intact for reuse.
     pub fn clear(&mut self) {
-        self.0.clear()
+        self.grid = OnceCell::new();
+        self.boxes = OnceCell::new();
+        self.pixels.clear()
+    }
+
+    /// Get the spatial grid for this list, if it is large enough to be worth having one.
+    fn grid(&self) -> Option<&PixelGrid> {
+        if self.pixels.len() >= PixelGrid::MIN_PIXELS {
+            Some(self.grid.get_or_init(|| PixelGrid::build(&self.pixels)))
+        } else {
+            None
+        }
+    }
+
+    /// Get the bounding boxes of the pixels in this list.
+    fn boxes(&self) -> &PixelBoxes {
+        self.boxes.get_or_init(|| PixelBoxes::build(&self.pixels))
     }
 
     /// Calculate the total power in a PixelList, megawatts.
     pub fn total_power(&self) -> f64 {
-        self.0
+        self.pixels
             .iter()
             .filter(|p| !p.power.is_infinite() && !p.power.is_nan())
             .map(|p| p.power)
@@ -520,7 +574,7 @@ impl PixelList {
 
     /// Calculate the total fire area in a PixelList, square meters.
     pub fn total_are(&self) -> f64 {
-        self.0
+        self.pixels
             .iter()
             .filter(|p| !p.area.is_infinite() && !p.area.is_nan())
             .map(|p| p.area)
@@ -529,7 +583,7 @@ impl PixelList {
 
     /// Calculate the maximum fire temperature in a PixelList, kelvin.
     pub fn maximum_temperature(&self) -> f64 {
-        self.0
+        self.pixels
             .iter()
             .filter(|p| !p.temperature.is_infinite() && !p.temperature.is_nan())
             .map(|p| p.temperature)
@@ -538,7 +592,7 @@ impl PixelList {
 
     /// Calculate the maximum scan angle in a PixelList, degrees.
     pub fn maximum_scan_angle(&self) -> f64 {
-        self.0
+        self.pixels
             .iter()
             .filter(|p| !p.scan_angle.is_infinite() && !p.scan_angle.is_nan())
             .map(|p| p.scan_angle)
@@ -551,35 +605,80 @@ impl PixelList {
             return false;
         }
 
-        for s_pixel in &self.0 {
-            for o_pixel in &other.0 {
-                if s_pixel.is_adjacent_to_or_overlaps(o_pixel, eps) {
-                    return true;
-                }
+        // Search the grid of the larger list with each pixel from the smaller one.
+        if self.len() >= other.len() {
+            if let Some(grid) = self.grid() {
+                let boxes = self.boxes();
+                return other.pixels.iter().any(|o_pixel| {
+                    let o_bbox = o_pixel.bounding_box();
+                    grid.any_near(&o_bbox, eps, |idx| {
+                        boxes.overlaps(idx, &o_bbox, eps)
+                            && self.pixels[idx].is_adjacent_to_or_overlaps(o_pixel, eps)
+                    })
+                });
             }
+        } else if let Some(grid) = other.grid() {
+            let boxes = other.boxes();
+            return self.pixels.iter().any(|s_pixel| {
+                let s_bbox = s_pixel.bounding_box();
+                grid.any_near(&s_bbox, eps, |idx| {
+                    boxes.overlaps(idx, &s_bbox, eps)
+                        && s_pixel.is_adjacent_to_or_overlaps(&other.pixels[idx], eps)
+                })
+            });
         }
 
-        false
+        let boxes = other.boxes();
+        self.pixels.iter().any(|s_pixel| {
+            boxes.any_overlapping(&s_pixel.bounding_box(), eps, |idx| {
+                s_pixel.is_adjacent_to_or_overlaps(&other.pixels[idx], eps)
+            })
+        })
     }
 
     pub fn pixels(&self) -> &[Pixel] {
-        &self.0
+        &self.pixels
     }
 
     pub fn max_merge(&mut self, other: &PixelList) {
-        for other_pixel in other.0.iter() {
-            let mut is_new = true;
-
-            for pixel in self.0.iter_mut() {
-                if pixel.approx_equal(other_pixel, OVERLAP_FUDGE_FACTOR) {
-                    pixel.max_merge(other_pixel);
-                    is_new = false;
-                    break;
+        for other_pixel in other.pixels.iter() {
+            let matching = match self.grid() {
+                Some(grid) => {
+                    // The grid doesn't return the pixels in order, so find the first one.
+                    let mut first: Option<usize> = None;
+                    grid.any_near(&other_pixel.bounding_box(), OVERLAP_FUDGE_FACTOR, |idx| {
+                        if first.map_or(true, |first| idx < first)
+                            && self.pixels[idx].approx_equal(other_pixel, OVERLAP_FUDGE_FACTOR)
+                        {
+                            first = Some(idx);
+                        }
+                        false
+                    });
+                    first
                 }
-            }
+                None => {
+                    // Pixels that are approximately equal have overlapping boxes, and the boxes
+                    // are visited in order so this is the first match.
+                    let mut first: Option<usize> = None;
+                    self.boxes().any_overlapping(
+                        &other_pixel.bounding_box(),
+                        OVERLAP_FUDGE_FACTOR,
+                        |idx| {
+                            let matches =
+                                self.pixels[idx].approx_equal(other_pixel, OVERLAP_FUDGE_FACTOR);
+                            if matches {
+                                first = Some(idx);
+                            }
+                            matches
+                        },
+                    );
+                    first
+                }
+            };
 
-            if is_new {
-                self.0.push(*other_pixel);
+            match matching {
+                Some(idx) => self.pixels[idx].max_merge(other_pixel),
+                None => self.push(*other_pixel),
             }
         }
     }
@@ -588,27 +687,82 @@ impl PixelList {
 /*-------------------------------------------------------------------------------------------------
  *                                         Binary Format
  *-----------------------------------------------------------------------------------------------*/
+/* Version 1 of the binary format was a native usize (little endian) count of the pixels followed
+ * by each pixel written field by field with f64 for all the floating point values, 100 bytes per
+ * pixel.
+ *
+ * Version 2 starts with a 16 byte header, a magic number followed by the number of pixels and the
+ * size of each pixel record as little endian u32. The pixels follow as fixed width records of
+ * little endian f32 values for corners (lat, lon for ul, ll, lr, ur), power, area, temperature,
+ * and scan angle, then the mask and data quality flags as i16. With the header size all of the
+ * fields in a record are aligned when the BLOB is.
+ *
+ * Read as a version 1 length the magic number is an absurdly large number of pixels, so the two
+ * formats can't be confused.
+ */
+const BINARY_V2_MAGIC: [u8; 8] = *b"SFPXL2\0\xff";
+const BINARY_V2_HEADER_SIZE: usize = 16;
+const BINARY_V2_RECORD_SIZE: usize = 12 * size_of::<f32>() + 2 * size_of::<i16>();
+const BINARY_V1_RECORD_SIZE: usize = 12 * size_of::<f64>() + 2 * size_of::<i16>();
+
 impl PixelList {
+    /// The version of the binary format written by [PixelList::binary_serialize].
+    pub const BINARY_VERSION: u32 = 2;
+
     /// Encode the PixelList into a binary format suitable for storing in a database.
     pub fn binary_serialize(&self) -> Vec<u8> {
-        // Ignore write errors since we're writing to a Vec<u8>
+        let mut output = Vec::new();
+        self.binary_serialize_into(&mut output);
+        output
+    }
 
-        let mut output = Vec::with_capacity(size_of::<usize>() + size_of::<Pixel>() * self.0.len());
+    /// Append the binary format from [PixelList::binary_serialize] to a buffer.
+    ///
+    /// This is for reusing one buffer to serialize a lot of lists.
+    pub fn binary_serialize_into(&self, output: &mut Vec<u8>) {
+        output.reserve(BINARY_V2_HEADER_SIZE + BINARY_V2_RECORD_SIZE * self.pixels.len());
+
+        output.extend_from_slice(&BINARY_V2_MAGIC);
+        output.extend_from_slice(&(self.pixels.len() as u32).to_le_bytes());
+        output.extend_from_slice(&(BINARY_V2_RECORD_SIZE as u32).to_le_bytes());
+
+        for pixel in &self.pixels {
+            for coord in [pixel.ul, pixel.ll, pixel.lr, pixel.ur] {
+                output.extend_from_slice(&(coord.lat as f32).to_le_bytes());
+                output.extend_from_slice(&(coord.lon as f32).to_le_bytes());
+            }
 
-        let _ = output.write_all(&self.0.len().to_le_bytes());
-        for pixel in &self.0 {
-            let _ = pixel.write_bytes(&mut output);
+            output.extend_from_slice(&(pixel.power as f32).to_le_bytes());
+            output.extend_from_slice(&(pixel.area as f32).to_le_bytes());
+            output.extend_from_slice(&(pixel.temperature as f32).to_le_bytes());
+            output.extend_from_slice(&(pixel.scan_angle as f32).to_le_bytes());
+            output.extend_from_slice(&pixel.mask_flag.0.to_le_bytes());
+            output.extend_from_slice(&pixel.data_quality_flag.0.to_le_bytes());
         }
-
-        output
     }
 
     /// Deserialize an array of bytes into a PixelList.
     ///
+    /// This handles all versions of the binary format. Any errors reading the data are ignored,
+    /// use [PixelList::binary_deserialize_slice] to check the data.
     pub fn binary_deserialize<R: Read>(r: &mut R) -> Self {
         let mut buf: [u8; size_of::<usize>()] = [0; size_of::<usize>()];
 
         let _ = r.read_exact(&mut buf);
+
+        if buf[..] == BINARY_V2_MAGIC[..] {
+            let mut header = [0u8; BINARY_V2_HEADER_SIZE - BINARY_V2_MAGIC.len()];
+            let _ = r.read_exact(&mut header);
+            let len = u32::from_le_bytes(header[..4].try_into().unwrap()) as usize;
+
+            let mut records = Vec::with_capacity(len * BINARY_V2_RECORD_SIZE);
+            let _ = r
+                .take((len * BINARY_V2_RECORD_SIZE) as u64)
+                .read_to_end(&mut records);
+
+            return Self::from_v2_records(&records);
+        }
+
         let len = usize::from_le_bytes(buf);
 
         let mut data: Vec<Pixel> = Vec::with_capacity(len);
@@ -617,7 +771,89 @@ impl PixelList {
             data.push(Pixel::read_bytes(r));
         }
 
-        PixelList(data)
+        PixelList::from_pixels(data)
+    }
+
+    /// Deserialize a BLOB straight from the database into a PixelList.
+    ///
+    /// This handles all versions of the binary format and checks that the data is the right size.
+    /// Version 2 BLOBs are decoded directly from the borrowed slice without any intermediate
+    /// buffers.
+    pub fn binary_deserialize_slice(bytes: &[u8]) -> SatFireResult<Self> {
+        match Self::binary_version(bytes) {
+            2 => {
+                if bytes.len() < BINARY_V2_HEADER_SIZE {
+                    return Err("Pixel BLOB too short for header".into());
+                }
+
+                let len = u32::from_le_bytes(bytes[8..12].try_into().unwrap()) as usize;
+                let record_size = u32::from_le_bytes(bytes[12..16].try_into().unwrap()) as usize;
+                let records = &bytes[BINARY_V2_HEADER_SIZE..];
+
+                if record_size != BINARY_V2_RECORD_SIZE
+                    || records.len() != len * BINARY_V2_RECORD_SIZE
+                {
+                    return Err("Invalid pixel BLOB size".into());
+                }
+
+                Ok(Self::from_v2_records(records))
+            }
+            _ => {
+                if bytes.len() < size_of::<usize>() {
+                    return Err("Pixel BLOB too short for header".into());
+                }
+
+                let len = usize::from_le_bytes(bytes[..size_of::<usize>()].try_into().unwrap());
+                if bytes.len() != size_of::<usize>() + len * BINARY_V1_RECORD_SIZE {
+                    return Err("Invalid pixel BLOB size".into());
+                }
+
+                let mut cursor = std::io::Cursor::new(bytes);
+                Ok(Self::binary_deserialize(&mut cursor))
+            }
+        }
+    }
+
+    /// Get the version of the binary format used for these bytes.
+    pub fn binary_version(bytes: &[u8]) -> u32 {
+        if bytes.starts_with(&BINARY_V2_MAGIC) {
+            2
+        } else {
+            1
+        }
+    }
+
+    fn from_v2_records(records: &[u8]) -> Self {
+        let data = records
+            .chunks_exact(BINARY_V2_RECORD_SIZE)
+            .map(|rec| {
+                let f = |i: usize| -> f64 {
+                    f32::from_le_bytes(rec[(4 * i)..(4 * i + 4)].try_into().unwrap()) as f64
+                };
+                let coord = |i: usize| Coord {
+                    lat: f(i),
+                    lon: f(i + 1),
+                };
+                let flag = |offset: usize| -> i16 {
+                    i16::from_le_bytes(rec[offset..(offset + 2)].try_into().unwrap())
+                };
+
+                Pixel {
+                    ul: coord(0),
+                    ll: coord(2),
+                    lr: coord(4),
+                    ur: coord(6),
+                    power: f(8),
+                    area: f(9),
+                    temperature: f(10),
+                    scan_angle: f(11),
+                    mask_flag: MaskCode(flag(48)),
+                    data_quality_flag: DataQualityFlagCode(flag(50)),
+                }
+            })
+            .collect();
+
+        PixelList::from_pixels(data)
     }
 }
 
@@ -675,7 +911,7 @@ impl PixelList {
     /// document.
     ///
     pub fn kml_write<K: KmlWriter>(&self, kml: &mut K) {
-        for pixel in &self.0 {
+        for pixel in &self.pixels {
             let mut desc: [u8; 256] = [0; 256];
             let mut cursor = std::io::Cursor::new(&mut desc[..]);
 
@@ -1438,15 +1674,218 @@ mod test {
     #[test]
     fn satfire_pixel_list_test_binary_round_trip() {
         let plist = pixel_list_test_setup();
-        assert_eq!(plist.0.len(), 9);
+        assert_eq!(plist.pixels.len(), 9);
 
         let buf = plist.binary_serialize();
         let mut cursor = std::io::Cursor::new(buf);
 
         let plist2 = PixelList::binary_deserialize(&mut cursor);
+        let plist3 = PixelList::binary_deserialize_slice(&cursor.into_inner()).unwrap();
+
+        assert_eq!(plist2.len(), 9);
+        assert_eq!(plist3.len(), 9);
+
+        for ((p1, p2), p3) in plist
+            .pixels
+            .into_iter()
+            .zip(plist2.pixels.into_iter())
+            .zip(plist3.pixels.into_iter())
+        {
+            assert!(p1.approx_equal(&p2, 1.0e-5));
+            assert!(p1.approx_equal(&p3, 1.0e-5));
+        }
+    }
+
+    #[test]
+    fn satfire_pixel_list_test_binary_v1_compatibility() {
+        let plist = pixel_list_test_setup();
 
-        for (p1, p2) in plist.0.into_iter().zip(plist2.0.into_iter()) {
-            assert!(p1.approx_equal(&p2, f64::MIN));
+        let mut buf: Vec<u8> = vec![];
+        buf.extend_from_slice(&plist.pixels.len().to_le_bytes());
+        for pixel in &plist.pixels {
+            pixel.write_bytes(&mut buf).unwrap();
         }
+
+        assert_eq!(PixelList::binary_version(&buf), 1);
+        assert_eq!(PixelList::binary_version(&plist.binary_serialize()), 2);
+
+        let plist2 = PixelList::binary_deserialize(&mut std::io::Cursor::new(&buf));
+        let plist3 = PixelList::binary_deserialize_slice(&buf).unwrap();
+
+        assert_eq!(plist2.len(), 9);
+        assert_eq!(plist3.len(), 9);
+
+        for ((p1, p2), p3) in plist
+            .pixels
+            .into_iter()
+            .zip(plist2.pixels.into_iter())
+            .zip(plist3.pixels.into_iter())
+        {
+            assert!(p1.approx_equal(&p2, 0.0));
+            assert!(p1.approx_equal(&p3, 0.0));
+        }
+
+        assert!(PixelList::binary_deserialize_slice(&buf[..(buf.len() - 1)]).is_err());
+    }
+
+    #[test]
+    fn satfire_pixel_list_test_boxes_match_bounding_box_overlap() {
+        let square = |lat: f64, lon: f64, size: f64| Pixel {
+            ul: Coord {
+                lat: lat + size,
+                lon,
+            },
+            ll: Coord { lat, lon },
+            lr: Coord {
+                lat,
+                lon: lon + size,
+            },
+            ur: Coord {
+                lat: lat + size,
+                lon: lon + size,
+            },
+            power: 1.0,
+            area: 0.0,
+            temperature: 0.0,
+            scan_angle: 0.0,
+            mask_flag: MaskCode(0),
+            data_quality_flag: DataQualityFlagCode(0),
+        };
+
+        // Not a multiple of the number of lanes, with some boxes that can't overlap anything.
+        let mut pixels: Vec<Pixel> = (0..21)
+            .map(|i| {
+                square(
+                    40.0 + (i % 5) as f64 * 0.5,
+                    -120.0 + (i / 5) as f64 * 0.5,
+                    0.5,
+                )
+            })
+            .collect();
+        pixels[3].ul.lat = f64::NAN;
+        pixels[17].lr.lon = f64::INFINITY;
+
+        let boxes = PixelBoxes::build(&pixels);
+
+        // The box test is the eps arithmetic of BoundingBox::overlap without its check for
+        // edges that aren't finite, the exact tests reject those boxes later.
+        let edges_overlap = |a: &BoundingBox, b: &BoundingBox| {
+            a.ll.lon - b.ur.lon <= OVERLAP_FUDGE_FACTOR
+                && b.ll.lon - a.ur.lon <= OVERLAP_FUDGE_FACTOR
+                && a.ll.lat - b.ur.lat <= OVERLAP_FUDGE_FACTOR
+                && b.ll.lat - a.ur.lat <= OVERLAP_FUDGE_FACTOR
+        };
+
+        let mut infinite_hits = 0;
+        for i in -2..8 {
+            for j in -2..8 {
+                let bbox =
+                    square(40.0 + i as f64 * 0.5, -120.0 + j as f64 * 0.5, 0.25).bounding_box();
+
+                let expected: Vec<usize> = (0..pixels.len())
+                    .filter(|&idx| edges_overlap(&pixels[idx].bounding_box(), &bbox))
+                    .collect();
+
+                let mut found = vec![];
+                assert!(!boxes.any_overlapping(&bbox, OVERLAP_FUDGE_FACTOR, |idx| {
+                    found.push(idx);
+                    false
+                }));
+                assert_eq!(found, expected);
+                if found.contains(&17) {
+                    infinite_hits += 1;
+                }
+
+                // Nothing the bounding box check at the start of the exact tests passes is skipped.
+                for idx in 0..pixels.len() {
+                    let exact = pixels[idx]
+                        .bounding_box()
+                        .overlap(&bbox, OVERLAP_FUDGE_FACTOR);
+                    assert!(!exact || found.contains(&idx));
+                    assert_eq!(
+                        boxes.overlaps(idx, &bbox, OVERLAP_FUDGE_FACTOR),
+                        expected.contains(&idx)
+                    );
+                }
+            }
+        }
+        assert!(infinite_hits > 0);
+
+        // Small lists compare every pair that passes the box test.
+        let mut small = PixelList::new();
+        small.push(square(41.0, -119.0, 0.5));
+        let mut other = PixelList::new();
+        other.push(square(45.0, -115.0, 0.5));
+        assert!(!small.adjacent_to_or_overlaps(&other, OVERLAP_FUDGE_FACTOR));
+        other.push(square(41.5, -119.0, 0.5));
+        assert!(small.adjacent_to_or_overlaps(&other, OVERLAP_FUDGE_FACTOR));
+    }
+
+    #[test]
+    fn satfire_pixel_list_test_grid_matches_brute_force() {
+        let square = |lat: f64, lon: f64, size: f64, power: f64| Pixel {
+            ul: Coord {
+                lat: lat + size,
+                lon,
+            },
+            ll: Coord { lat, lon },
+            lr: Coord {
+                lat,
+                lon: lon + size,
+            },
+            ur: Coord {
+                lat: lat + size,
+                lon: lon + size,
+            },
+            power,
+            area: 0.0,
+            temperature: 0.0,
+            scan_angle: 0.0,
+            mask_flag: MaskCode(0),
+            data_quality_flag: DataQualityFlagCode(0),
+        };
+
+        // A checkerboard, so some single pixels touch it and some don't.
+        let mut big = PixelList::new();
+        for i in 0..10 {
+            for j in 0..10 {
+                if (i + j) % 2 == 0 && (i, j) != (4, 4) {
+                    big.push(square(40.0 + i as f64, -120.0 + j as f64, 1.0, 1.0));
+                }
+            }
+        }
+        assert!(big.len() >= PixelGrid::MIN_PIXELS);
+
+        for i in -2..12 {
+            for j in -2..12 {
+                let mut small = PixelList::new();
+                small.push(square(40.0 + i as f64, -120.0 + j as f64, 1.0, 2.0));
+
+                let brute_force = big.pixels.iter().any(|b_pixel| {
+                    small.pixels[0].is_adjacent_to_or_overlaps(b_pixel, OVERLAP_FUDGE_FACTOR)
+                });
+
+                assert_eq!(
+                    small.adjacent_to_or_overlaps(&big, OVERLAP_FUDGE_FACTOR),
+                    brute_force
+                );
+                assert_eq!(
+                    big.adjacent_to_or_overlaps(&small, OVERLAP_FUDGE_FACTOR),
+                    brute_force
+                );
+            }
+        }
+
+        // Merging the same pixels again only updates them, new pixels are added.
+        let num_pixels = big.len();
+        let mut update = PixelList::new();
+        update.push(square(40.0, -120.0, 1.0, 5.0));
+        update.push(square(44.0, -116.0, 1.0, 5.0));
+        big.max_merge(&update);
+
+        assert_eq!(big.len(), num_pixels + 1);
+        assert_eq!(big.pixels[0].power, 5.0);
+        assert_eq!(big.pixels[num_pixels].power, 5.0);
+        assert!(update.adjacent_to_or_overlaps(&big, OVERLAP_FUDGE_FACTOR));
     }
 }
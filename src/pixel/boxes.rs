@@ -0,0 +1,102 @@
+use super::Pixel;
+use crate::geo::{BoundingBox, Geo};
+
+/// The bounding boxes of the pixels in a [PixelList](super::PixelList), with each edge in its own
+/// array so a box can be tested against several pixels at once.
+///
+/// Only the pixels whose boxes pass this test need the exact (and much slower) geometry. The test
+/// is the same `eps` arithmetic as [BoundingBox::overlap] on the raw edges, so it never skips a
+/// pair that would have passed the bounding box check at the start of the exact tests.
+///
+/// Edges that aren't finite are kept as they are. A NaN edge fails every comparison, so that box
+/// never overlaps anything. An infinite edge may pass, and the exact tests reject it later.
+#[derive(Debug, Clone, Default)]
+pub(super) struct PixelBoxes {
+    min_lat: Vec<f64>,
+    min_lon: Vec<f64>,
+    max_lat: Vec<f64>,
+    max_lon: Vec<f64>,
+}
+
+impl PixelBoxes {
+    /// The number of boxes tested together, enough to fill the widest vector registers.
+    const LANES: usize = 8;
+
+    /// Build the boxes for a list of pixels.
+    pub(super) fn build(pixels: &[Pixel]) -> Self {
+        let mut boxes = PixelBoxes {
+            min_lat: Vec::with_capacity(pixels.len()),
+            min_lon: Vec::with_capacity(pixels.len()),
+            max_lat: Vec::with_capacity(pixels.len()),
+            max_lon: Vec::with_capacity(pixels.len()),
+        };
+
+        for pixel in pixels {
+            boxes.push(pixel);
+        }
+
+        boxes
+    }
+
+    /// Add the box for a pixel to the end.
+    pub(super) fn push(&mut self, pixel: &Pixel) {
+        let bbox = pixel.bounding_box();
+
+        self.min_lat.push(bbox.ll.lat);
+        self.min_lon.push(bbox.ll.lon);
+        self.max_lat.push(bbox.ur.lat);
+        self.max_lon.push(bbox.ur.lon);
+    }
+
+    /// Check if the box at `index` overlaps `bbox`, within `eps`.
+    pub(super) fn overlaps(&self, index: usize, bbox: &BoundingBox, eps: f64) -> bool {
+        self.min_lon[index] - bbox.ur.lon <= eps
+            && bbox.ll.lon - self.max_lon[index] <= eps
+            && self.min_lat[index] - bbox.ur.lat <= eps
+            && bbox.ll.lat - self.max_lat[index] <= eps
+    }
+
+    /// Call `visit` with the index of every box that overlaps `bbox` within `eps`, in order.
+    ///
+    /// Iteration stops early and returns `true` as soon as `visit` does.
+    pub(super) fn any_overlapping<F>(&self, bbox: &BoundingBox, eps: f64, mut visit: F) -> bool
+    where
+        F: FnMut(usize) -> bool,
+    {
+        let (b_min_lat, b_min_lon) = (bbox.ll.lat, bbox.ll.lon);
+        let (b_max_lat, b_max_lon) = (bbox.ur.lat, bbox.ur.lon);
+
+        let len = self.min_lat.len();
+        let (min_lat, min_lon) = (&self.min_lat[..len], &self.min_lon[..len]);
+        let (max_lat, max_lon) = (&self.max_lat[..len], &self.max_lon[..len]);
+
+        let mut start = 0;
+        while start < len {
+            let lanes = Self::LANES.min(len - start);
+
+            // No branches in here, so the compiler can test all the lanes with vector
+            // instructions, then only the hits are visited.
+            let mut hits: u32 = 0;
+            for lane in 0..lanes {
+                let i = start + lane;
+                let hit = (min_lon[i] - b_max_lon <= eps)
+                    & (b_min_lon - max_lon[i] <= eps)
+                    & (min_lat[i] - b_max_lat <= eps)
+                    & (b_min_lat - max_lat[i] <= eps);
+                hits |= (hit as u32) << lane;
+            }
+
+            while hits != 0 {
+                let lane = hits.trailing_zeros() as usize;
+                if visit(start + lane) {
+                    return true;
+                }
+                hits &= hits - 1;
+            }
+
+            start += lanes;
+        }
+
+        false
+    }
+}
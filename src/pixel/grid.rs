@@ -0,0 +1,119 @@
+use super::Pixel;
+use crate::geo::{BoundingBox, Geo};
+use rustc_hash::FxHashMap;
+
+/// A uniform grid over the pixels of a [PixelList](super::PixelList) for finding the pixels near
+/// a location without checking every pixel in the list.
+///
+/// Each pixel is stored in the cell that holds the lower left corner of its bounding box. So the
+/// pixels that could touch a bounding box are all in the cells covering that box, extended down
+/// and to the left by the size of the largest pixel in the grid.
+///
+/// Pixels with coordinates that aren't finite are left out of the grid, they can't be adjacent to
+/// or overlap anything anyway.
+#[derive(Debug, Clone)]
+pub(super) struct PixelGrid {
+    /// The width and height of the cells in degrees.
+    cell_size: f64,
+    /// The largest width or height of a pixel in the grid, in degrees.
+    max_extent: f64,
+    /// The indexes of the pixels with the lower left corner of their bounding box in each cell.
+    cells: FxHashMap<(i32, i32), Vec<u32>>,
+}
+
+impl PixelGrid {
+    /// Don't bother with a grid for lists smaller than this, checking every pixel is faster.
+    pub(super) const MIN_PIXELS: usize = 16;
+
+    /// Build a grid for a list of pixels.
+    pub(super) fn build(pixels: &[Pixel]) -> Self {
+        let max_extent = pixels
+            .iter()
+            .map(|pixel| Self::extent(&pixel.bounding_box()))
+            .filter(|extent| extent.is_finite())
+            .fold(0.0, f64::max);
+
+        // Any size works, but cells about the size of a pixel keep the number of cells to check
+        // and the number of pixels in each cell small.
+        let cell_size = max_extent.max(1.0e-3);
+
+        let mut grid = PixelGrid {
+            cell_size,
+            max_extent,
+            cells: FxHashMap::default(),
+        };
+
+        for (index, pixel) in pixels.iter().enumerate() {
+            grid.insert(index, pixel);
+        }
+
+        grid
+    }
+
+    /// Add a pixel to the grid.
+    pub(super) fn insert(&mut self, index: usize, pixel: &Pixel) {
+        let bbox = pixel.bounding_box();
+        let extent = Self::extent(&bbox);
+
+        if !(extent.is_finite() && bbox.ll.lat.is_finite() && bbox.ll.lon.is_finite()) {
+            return;
+        }
+
+        self.max_extent = self.max_extent.max(extent);
+
+        let key = (self.cell_of(bbox.ll.lat), self.cell_of(bbox.ll.lon));
+        self.cells.entry(key).or_default().push(index as u32);
+    }
+
+    /// Call `visit` with the index of every pixel that could be within `eps` of `bbox`.
+    ///
+    /// Iteration stops early and returns `true` as soon as `visit` does.
+    pub(super) fn any_near<F>(&self, bbox: &BoundingBox, eps: f64, mut visit: F) -> bool
+    where
+        F: FnMut(usize) -> bool,
+    {
+        let coords = [bbox.ll.lat, bbox.ll.lon, bbox.ur.lat, bbox.ur.lon];
+        if coords.iter().any(|coord| !coord.is_finite()) {
+            return false;
+        }
+
+        let min_lat = self.cell_of(bbox.ll.lat - self.max_extent - eps);
+        let max_lat = self.cell_of(bbox.ur.lat + eps);
+        let min_lon = self.cell_of(bbox.ll.lon - self.max_extent - eps);
+        let max_lon = self.cell_of(bbox.ur.lon + eps);
+
+        let num_cells = (i64::from(max_lat) - i64::from(min_lat) + 1)
+            * (i64::from(max_lon) - i64::from(min_lon) + 1);
+
+        // For a box that covers a lot of cells, it's quicker to just check all of them.
+        if num_cells > self.cells.len() as i64 {
+            return self
+                .cells
+                .iter()
+                .filter(|((lat_cell, lon_cell), _)| {
+                    (min_lat..=max_lat).contains(lat_cell) && (min_lon..=max_lon).contains(lon_cell)
+                })
+                .any(|(_, indexes)| indexes.iter().any(|&index| visit(index as usize)));
+        }
+
+        for lat_cell in min_lat..=max_lat {
+            for lon_cell in min_lon..=max_lon {
+                if let Some(indexes) = self.cells.get(&(lat_cell, lon_cell)) {
+                    if indexes.iter().any(|&index| visit(index as usize)) {
+                        return true;
+                    }
+                }
+            }
+        }
+
+        false
+    }
+
+    fn cell_of(&self, degrees: f64) -> i32 {
+        (degrees / self.cell_size).floor() as i32
+    }
+
+    fn extent(bbox: &BoundingBox) -> f64 {
+        (bbox.ur.lat - bbox.ll.lat).max(bbox.ur.lon - bbox.ll.lon)
+    }
+}
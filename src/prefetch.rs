@@ -0,0 +1,179 @@
+//! Read files into the page cache ahead of the threads that decode them.
+//!
+//! On network storage most of the time spent loading a file is waiting on the server. The loaders
+//! and decode worker processes open files by path, so the files are read ahead of them and the
+//! kernel keeps the bytes in the page cache until a loader gets to them. A budget limits how many
+//! bytes are read ahead, so files aren't pushed back out of the cache before they are used.
+use std::{
+    fs::File,
+    io::{ErrorKind, Read},
+    os::unix::io::AsRawFd,
+    path::{Path, PathBuf},
+    sync::{Arc, Condvar, Mutex},
+};
+
+/// The number of bytes of files that have been read ahead and not used yet.
+#[derive(Debug)]
+pub struct PrefetchBudget {
+    max_bytes: u64,
+    in_flight: Mutex<u64>,
+    freed: Condvar,
+}
+
+impl PrefetchBudget {
+    /// Create a budget that lets up to `max_bytes` be read ahead.
+    pub fn new(max_bytes: u64) -> Arc<Self> {
+        Arc::new(PrefetchBudget {
+            max_bytes,
+            in_flight: Mutex::new(0),
+            freed: Condvar::new(),
+        })
+    }
+
+    /// Get the number of bytes read ahead and not used yet.
+    pub fn in_flight(&self) -> u64 {
+        *self.in_flight.lock().unwrap()
+    }
+
+    /// Wait until there is room for `bytes` more, a file larger than the whole budget only has to
+    /// wait for everything else to be used.
+    fn acquire(&self, bytes: u64) {
+        let mut in_flight = self.in_flight.lock().unwrap();
+        while *in_flight > 0 && *in_flight + bytes > self.max_bytes {
+            in_flight = self.freed.wait(in_flight).unwrap();
+        }
+        *in_flight += bytes;
+    }
+
+    fn release(&self, bytes: u64) {
+        let mut in_flight = self.in_flight.lock().unwrap();
+        *in_flight -= bytes;
+        self.freed.notify_all();
+    }
+}
+
+/// A file that has been read into the page cache.
+///
+/// Its bytes count against the [PrefetchBudget] until this is dropped, so drop it once the file
+/// has been loaded.
+#[derive(Debug)]
+pub struct PrefetchedFile {
+    path: PathBuf,
+    bytes: u64,
+    budget: Arc<PrefetchBudget>,
+}
+
+impl PrefetchedFile {
+    /// The size of the reads used to pull a file into the page cache.
+    const READ_SIZE: usize = 1024 * 1024;
+
+    /// Read a file into the page cache, after waiting for room in the budget.
+    ///
+    /// `buffer` is only scratch space for the reads, keep one for each thread. Errors aren't
+    /// reported here, the file is passed on as it is and loading it will report the problem.
+    pub fn read_ahead(path: PathBuf, budget: &Arc<PrefetchBudget>, buffer: &mut Vec<u8>) -> Self {
+        let mut file = match File::open(&path) {
+            Ok(file) => file,
+            Err(_) => return Self::not_read(path, budget),
+        };
+
+        let bytes = file.metadata().map(|md| md.len()).unwrap_or(0);
+        budget.acquire(bytes);
+
+        let prefetched = PrefetchedFile {
+            path,
+            bytes,
+            budget: Arc::clone(budget),
+        };
+
+        // Ask for the whole file at once so the kernel can send all the requests to the server
+        // together, then read it to be sure it's all there.
+        unsafe {
+            libc::posix_fadvise(file.as_raw_fd(), 0, 0, libc::POSIX_FADV_WILLNEED);
+        }
+
+        buffer.resize(Self::READ_SIZE, 0);
+        loop {
+            match file.read(buffer) {
+                Ok(0) => break,
+                Ok(_) => {}
+                Err(err) if err.kind() == ErrorKind::Interrupted => {}
+                Err(_) => break,
+            }
+        }
+
+        prefetched
+    }
+
+    /// Pass a file on without reading it ahead.
+    pub fn not_read(path: PathBuf, budget: &Arc<PrefetchBudget>) -> Self {
+        PrefetchedFile {
+            path,
+            bytes: 0,
+            budget: Arc::clone(budget),
+        }
+    }
+
+    /// Get the path to the file.
+    pub fn path(&self) -> &Path {
+        &self.path
+    }
+
+    /// Get the number of bytes read ahead.
+    pub fn len(&self) -> u64 {
+        self.bytes
+    }
+
+    /// Check if nothing was read ahead.
+    pub fn is_empty(&self) -> bool {
+        self.bytes == 0
+    }
+}
+
+impl Drop for PrefetchedFile {
+    fn drop(&mut self) {
+        self.budget.release(self.bytes);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_prefetch_budget() {
+        let dir = std::env::temp_dir().join(format!("satfire-prefetch-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir(&dir).unwrap();
+
+        let path = dir.join("file.nc");
+        std::fs::write(&path, vec![7u8; 3000]).unwrap();
+
+        let budget = PrefetchBudget::new(4000);
+        let mut buffer = vec![];
+
+        let first = PrefetchedFile::read_ahead(path.clone(), &budget, &mut buffer);
+        assert_eq!(first.len(), 3000);
+        assert_eq!(first.path(), path);
+        assert_eq!(budget.in_flight(), 3000);
+
+        let missing = PrefetchedFile::read_ahead(dir.join("missing.nc"), &budget, &mut buffer);
+        assert!(missing.is_empty());
+
+        // The second copy doesn't fit until the first one is used.
+        let handle = {
+            let budget = Arc::clone(&budget);
+            let path = path.clone();
+            std::thread::spawn(move || PrefetchedFile::read_ahead(path, &budget, &mut vec![]).len())
+        };
+
+        std::thread::sleep(std::time::Duration::from_millis(50));
+        assert_eq!(budget.in_flight(), 3000);
+
+        drop(first);
+        assert_eq!(handle.join().unwrap(), 3000);
+        assert_eq!(budget.in_flight(), 0);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
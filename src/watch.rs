@@ -0,0 +1,327 @@
+//! Watch for new files with inotify, or take their paths from a pipe.
+use crate::SatFireResult;
+use rustc_hash::FxHashMap as HashMap;
+use std::{
+    ffi::{CString, OsStr},
+    fs::{File, OpenOptions},
+    io::{ErrorKind, Read},
+    mem::size_of,
+    os::unix::{
+        ffi::OsStrExt,
+        fs::FileTypeExt,
+        io::{AsRawFd, FromRawFd},
+    },
+    path::{Path, PathBuf},
+    time::Duration,
+};
+
+/// Something that happened in a watched directory or pipe.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum WatchEvent {
+    /// A file was finished being written or was moved into a watched directory, or its path was
+    /// read from the pipe.
+    File(PathBuf),
+    /// A directory was created or moved into a watched directory. It is not watched yet, and
+    /// files may have landed in it before it is.
+    Directory(PathBuf),
+    /// The kernel dropped events because they weren't read fast enough, anything could have been
+    /// missed.
+    Overflow,
+}
+
+/// Watches directories for new files.
+///
+/// Directories are not watched recursively, each one has to be added with
+/// [DirectoryWatcher::watch], including the new ones reported by [WatchEvent::Directory].
+#[derive(Debug)]
+pub struct DirectoryWatcher {
+    inotify: File,
+    /// The directory for each watch descriptor.
+    dirs: HashMap<i32, PathBuf>,
+    buffer: Vec<u8>,
+    /// A pipe to read newline separated paths from, and any partial line read from it.
+    pipe: Option<(File, Vec<u8>)>,
+}
+
+impl DirectoryWatcher {
+    /// The size of the buffer for reading events, enough for hundreds of events.
+    const BUFFER_SIZE: usize = 64 * 1024;
+
+    /// Create a watcher that isn't watching anything yet.
+    pub fn new() -> SatFireResult<Self> {
+        let fd = unsafe { libc::inotify_init1(libc::IN_NONBLOCK | libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(std::io::Error::last_os_error().into());
+        }
+
+        Ok(DirectoryWatcher {
+            inotify: unsafe { File::from_raw_fd(fd) },
+            dirs: HashMap::default(),
+            buffer: vec![0; Self::BUFFER_SIZE],
+            pipe: None,
+        })
+    }
+
+    /// Start watching a directory for new files and directories.
+    pub fn watch(&mut self, dir: &Path) -> SatFireResult<()> {
+        const MASK: u32 =
+            libc::IN_CLOSE_WRITE | libc::IN_MOVED_TO | libc::IN_CREATE | libc::IN_ONLYDIR;
+
+        let c_path = CString::new(dir.as_os_str().as_bytes())?;
+        let wd =
+            unsafe { libc::inotify_add_watch(self.inotify.as_raw_fd(), c_path.as_ptr(), MASK) };
+        if wd < 0 {
+            return Err(format!(
+                "Unable to watch {}: {}",
+                dir.display(),
+                std::io::Error::last_os_error()
+            )
+            .into());
+        }
+
+        self.dirs.insert(wd, dir.to_path_buf());
+
+        Ok(())
+    }
+
+    /// Stop watching the directories `keep` returns `false` for, returns how many were removed.
+    pub fn retain<F: FnMut(&Path) -> bool>(&mut self, mut keep: F) -> SatFireResult<usize> {
+        let removed: Vec<i32> = self
+            .dirs
+            .iter()
+            .filter(|(_, dir)| !keep(dir))
+            .map(|(&wd, _)| wd)
+            .collect();
+
+        for &wd in &removed {
+            // The directory may already be gone, and its IN_IGNORED event not read yet.
+            if unsafe { libc::inotify_rm_watch(self.inotify.as_raw_fd(), wd) } < 0 {
+                let err = std::io::Error::last_os_error();
+                if err.raw_os_error() != Some(libc::EINVAL) {
+                    return Err(err.into());
+                }
+            }
+
+            self.dirs.remove(&wd);
+        }
+
+        Ok(removed.len())
+    }
+
+    /// Also read newline separated paths from a pipe.
+    ///
+    /// A named pipe is held open for writing too, so it keeps going when the programs writing to
+    /// it come and go. Anything else is read until the end of the file.
+    pub fn read_paths_from(&mut self, pipe: &Path) -> SatFireResult<()> {
+        let is_fifo = std::fs::metadata(pipe)?.file_type().is_fifo();
+
+        let file = OpenOptions::new().read(true).write(is_fifo).open(pipe)?;
+        self.pipe = Some((file, vec![]));
+
+        Ok(())
+    }
+
+    /// The number of directories being watched.
+    pub fn len(&self) -> usize {
+        self.dirs.len()
+    }
+
+    /// Check if no directories are being watched.
+    pub fn is_empty(&self) -> bool {
+        self.dirs.is_empty()
+    }
+
+    /// Wait up to `timeout` for something to happen and add what happened to `events`.
+    ///
+    /// This returns early if interrupted by a signal, so a signal handler can stop a loop that
+    /// calls this.
+    pub fn wait(&mut self, timeout: Duration, events: &mut Vec<WatchEvent>) -> SatFireResult<()> {
+        let mut fds = [
+            libc::pollfd {
+                fd: self.inotify.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd {
+                // Negative file descriptors are ignored.
+                fd: self.pipe.as_ref().map(|(f, _)| f.as_raw_fd()).unwrap_or(-1),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+        ];
+
+        let timeout = timeout.as_millis().min(libc::c_int::MAX as u128) as libc::c_int;
+        if unsafe { libc::poll(fds.as_mut_ptr(), fds.len() as libc::nfds_t, timeout) } < 0 {
+            let err = std::io::Error::last_os_error();
+            if err.kind() == ErrorKind::Interrupted {
+                return Ok(());
+            }
+            return Err(err.into());
+        }
+
+        if fds[0].revents != 0 {
+            self.read_events(events)?;
+        }
+
+        if fds[1].revents != 0 {
+            self.read_pipe(events)?;
+        }
+
+        Ok(())
+    }
+
+    fn read_events(&mut self, events: &mut Vec<WatchEvent>) -> SatFireResult<()> {
+        const HEADER_SIZE: usize = size_of::<libc::inotify_event>();
+
+        loop {
+            let num_read = match self.inotify.read(&mut self.buffer) {
+                Ok(num_read) => num_read,
+                Err(err) if err.kind() == ErrorKind::WouldBlock => return Ok(()),
+                Err(err) if err.kind() == ErrorKind::Interrupted => continue,
+                Err(err) => return Err(err.into()),
+            };
+
+            let mut offset = 0;
+            while offset + HEADER_SIZE <= num_read {
+                let field = |i: usize| -> [u8; 4] {
+                    let start = offset + 4 * i;
+                    self.buffer[start..(start + 4)].try_into().unwrap()
+                };
+
+                let wd = i32::from_ne_bytes(field(0));
+                let mask = u32::from_ne_bytes(field(1));
+                let name_len = u32::from_ne_bytes(field(3)) as usize;
+
+                // The name is padded with nul bytes.
+                let name = &self.buffer[(offset + HEADER_SIZE)..(offset + HEADER_SIZE + name_len)];
+                let name = &name[..name.iter().position(|&b| b == 0).unwrap_or(name.len())];
+
+                offset += HEADER_SIZE + name_len;
+
+                if mask & libc::IN_Q_OVERFLOW != 0 {
+                    events.push(WatchEvent::Overflow);
+                    continue;
+                }
+
+                if mask & libc::IN_IGNORED != 0 {
+                    // The directory was removed, or unmounted.
+                    self.dirs.remove(&wd);
+                    continue;
+                }
+
+                let path = match self.dirs.get(&wd) {
+                    Some(dir) if !name.is_empty() => dir.join(OsStr::from_bytes(name)),
+                    _ => continue,
+                };
+
+                if mask & libc::IN_ISDIR != 0 {
+                    if mask & (libc::IN_CREATE | libc::IN_MOVED_TO) != 0 {
+                        events.push(WatchEvent::Directory(path));
+                    }
+                } else if mask & (libc::IN_CLOSE_WRITE | libc::IN_MOVED_TO) != 0 {
+                    events.push(WatchEvent::File(path));
+                }
+            }
+        }
+    }
+
+    fn read_pipe(&mut self, events: &mut Vec<WatchEvent>) -> SatFireResult<()> {
+        let (pipe, partial) = match self.pipe {
+            Some(ref mut pipe) => pipe,
+            None => return Ok(()),
+        };
+
+        let mut buf = [0u8; 4096];
+        let num_read = match pipe.read(&mut buf) {
+            Ok(num_read) => num_read,
+            Err(err) if err.kind() == ErrorKind::Interrupted => return Ok(()),
+            Err(err) => return Err(err.into()),
+        };
+
+        if num_read == 0 {
+            // The end of the file, the last line may not have a newline.
+            partial.push(b'\n');
+        } else {
+            partial.extend_from_slice(&buf[..num_read]);
+        }
+
+        let complete = partial
+            .iter()
+            .rposition(|&b| b == b'\n')
+            .map(|i| i + 1)
+            .unwrap_or(0);
+
+        for line in partial[..complete].split(|&b| b == b'\n') {
+            let is_text = |b: &u8| !b.is_ascii_whitespace();
+            if let (Some(first), Some(last)) = (
+                line.iter().position(is_text),
+                line.iter().rposition(is_text),
+            ) {
+                let path = OsStr::from_bytes(&line[first..=last]);
+                events.push(WatchEvent::File(PathBuf::from(path)));
+            }
+        }
+        partial.drain(..complete);
+
+        if num_read == 0 {
+            self.pipe = None;
+        }
+
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_watch_new_files_and_directories() {
+        let dir = std::env::temp_dir().join(format!("satfire-watch-{}", std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        std::fs::create_dir(&dir).unwrap();
+
+        let mut watcher = DirectoryWatcher::new().unwrap();
+        watcher.watch(&dir).unwrap();
+
+        let mut f = File::create(dir.join("partial.nc")).unwrap();
+        std::fs::write(dir.join("written.nc"), b"data").unwrap();
+        std::fs::create_dir(dir.join("sub")).unwrap();
+        std::fs::write(dir.join("tmp"), b"data").unwrap();
+        std::fs::rename(dir.join("tmp"), dir.join("moved.zip")).unwrap();
+
+        let mut events = vec![];
+        watcher.wait(Duration::from_secs(5), &mut events).unwrap();
+
+        assert_eq!(
+            events,
+            vec![
+                WatchEvent::File(dir.join("written.nc")),
+                WatchEvent::Directory(dir.join("sub")),
+                WatchEvent::File(dir.join("tmp")),
+                WatchEvent::File(dir.join("moved.zip")),
+            ]
+        );
+
+        // Still open for writing, so it isn't reported until it is closed.
+        f.write_all(b"data").unwrap();
+        drop(f);
+
+        events.clear();
+        watcher.wait(Duration::from_secs(5), &mut events).unwrap();
+        assert_eq!(events, vec![WatchEvent::File(dir.join("partial.nc"))]);
+
+        assert_eq!(watcher.retain(|d| d != dir).unwrap(), 1);
+        assert!(watcher.is_empty());
+
+        std::fs::write(dir.join("unwatched.nc"), b"data").unwrap();
+        events.clear();
+        watcher
+            .wait(Duration::from_millis(50), &mut events)
+            .unwrap();
+        assert!(events.is_empty());
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}